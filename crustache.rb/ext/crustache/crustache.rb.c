@@ -38,6 +38,8 @@ static VALUE rb_eRender;
 static int
 rb_crustache__setvar(crustache_var *variable, VALUE rb_obj)
 {
+	/* Ruby objects are owned by the GC */
+	variable->flags = CRUSTACHE_VAR_BORROWED;
 
 	switch (TYPE(rb_obj)) {
 	case T_ARRAY:
@@ -57,6 +59,20 @@ rb_crustache__setvar(crustache_var *variable, VALUE rb_obj)
 		variable->size = RSTRING_LEN(rb_obj);
 		break;
 
+	case T_FIXNUM:
+		variable->type = CRUSTACHE_VAR_INT64;
+		variable->value.integer = (int64_t)FIX2LONG(rb_obj);
+		break;
+
+	case T_FLOAT:
+		variable->type = CRUSTACHE_VAR_DOUBLE;
+		variable->value.number = RFLOAT_VALUE(rb_obj);
+		break;
+
+	case T_TRUE:
+		variable->type = CRUSTACHE_VAR_TRUE;
+		break;
+
 	case T_NIL:
 	case T_FALSE:
 		variable->type = CRUSTACHE_VAR_FALSE;
@@ -130,6 +146,51 @@ rb_crustache__list_get(
 	return rb_crustache__setvar(var, rb_ary_entry(rb_array, (long)i));
 }
 
+struct rb_crustache__iterator {
+	VALUE rb_array;
+	long pos;
+};
+
+static int
+rb_crustache__list_begin(void **iterator, void *list)
+{
+	struct rb_crustache__iterator *iter;
+	VALUE rb_array = (VALUE)list;
+
+	Check_Type(rb_array, T_ARRAY);
+
+	iter = ALLOC(struct rb_crustache__iterator);
+	iter->rb_array = rb_array;
+	iter->pos = 0;
+
+	*iterator = iter;
+	return 0;
+}
+
+static int
+rb_crustache__list_next_batch(
+	crustache_var *vars,
+	size_t max,
+	size_t *count,
+	void *iterator)
+{
+	struct rb_crustache__iterator *iter = iterator;
+	long len = RARRAY_LEN(iter->rb_array);
+	size_t i;
+
+	for (i = 0; i < max && iter->pos < len; ++i, ++iter->pos)
+		rb_crustache__setvar(&vars[i], RARRAY_PTR(iter->rb_array)[iter->pos]);
+
+	*count = i;
+	return 0;
+}
+
+static void
+rb_crustache__list_end(void *iterator)
+{
+	xfree(iterator);
+}
+
 static int
 rb_crustache__lambda(
 	crustache_var *var,
@@ -192,6 +253,10 @@ rb_template_new(VALUE klass, VALUE rb_raw_template)
 		0
 	};
 
+	default_api.list_begin = rb_crustache__list_begin;
+	default_api.list_next_batch = rb_crustache__list_next_batch;
+	default_api.list_end = rb_crustache__list_end;
+
 	error = crustache_new(&template,
 		&default_api,
 		RSTRING_PTR(rb_raw_template),
@@ -227,6 +292,36 @@ rb_template_render(VALUE self, VALUE rb_context)
 	return result;
 }
 
+static VALUE
+rb_template_render_layers(int argc, VALUE *argv, VALUE self)
+{
+	crustache_template *template;
+	crustache_var *layers;
+	struct buf *output_buf;
+
+	int i, error;
+	VALUE result;
+
+	Data_Get_Struct(self, crustache_template, template);
+
+	layers = ALLOCA_N(crustache_var, argc);
+	for (i = 0; i < argc; ++i)
+		rb_crustache__setvar(&layers[i], argv[i]);
+
+	output_buf = bufnew(128);
+
+	error = crustache_render_layers(output_buf, template, layers, (size_t)argc);
+	if (error < 0) {
+		bufrelease(output_buf);
+		rb_template__render_error(template, error);
+	}
+
+	result = rb_str_new(output_buf->data, output_buf->size);
+	bufrelease(output_buf);
+
+	return result;
+}
+
 void Init_crustache()
 {
 	rb_mCrustache = rb_define_module("Crustache");
@@ -237,5 +332,6 @@ void Init_crustache()
 	rb_cTemplate = rb_define_class_under(rb_mCrustache, "Template", rb_cObject);
 	rb_define_singleton_method(rb_cTemplate, "new", rb_template_new, 1);
 	rb_define_method(rb_cTemplate, "render", rb_template_render, 1);
+	rb_define_method(rb_cTemplate, "render_layers", rb_template_render_layers, -1);
 }
 
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK 1024
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+struct crustache_arena {
+	struct arena_chunk *first;
+	struct arena_chunk *current;
+	size_t chunk_size;
+};
+
+/* the chunk header is padded so allocations start aligned */
+#define CHUNK_HEADER \
+	((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static struct arena_chunk *
+chunk_new(size_t size)
+{
+	struct arena_chunk *chunk = malloc(CHUNK_HEADER + size);
+	if (chunk == NULL)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+crustache_arena *
+crustache_arena_new(size_t chunk_size)
+{
+	crustache_arena *arena;
+
+	if (chunk_size < ARENA_MIN_CHUNK)
+		chunk_size = ARENA_MIN_CHUNK;
+
+	arena = malloc(sizeof(crustache_arena));
+	if (arena == NULL)
+		return NULL;
+
+	arena->chunk_size = chunk_size;
+	arena->first = arena->current = chunk_new(chunk_size);
+
+	if (arena->first == NULL) {
+		free(arena);
+		return NULL;
+	}
+
+	return arena;
+}
+
+void *
+crustache_arena_alloc(crustache_arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->current;
+	size_t offset;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (chunk->size - chunk->used < size) {
+		struct arena_chunk *next = chunk->next;
+
+		/* reuse the chunks left over from the last render, unless
+		 * the next one is too small for this allocation */
+		if (next == NULL || next->size < size) {
+			next = chunk_new(size > arena->chunk_size ? size : arena->chunk_size);
+			if (next == NULL)
+				return NULL;
+
+			next->next = chunk->next;
+			chunk->next = next;
+		}
+
+		next->used = 0;
+		arena->current = chunk = next;
+	}
+
+	offset = chunk->used;
+	chunk->used += size;
+	return (char *)chunk + CHUNK_HEADER + offset;
+}
+
+void
+arena_mark(crustache_arena *arena, struct arena_mark *mark)
+{
+	mark->chunk = arena->current;
+	mark->used = arena->current->used;
+}
+
+void
+arena_rewind(crustache_arena *arena, const struct arena_mark *mark)
+{
+	arena->current = mark->chunk;
+	arena->current->used = mark->used;
+}
+
+void
+crustache_arena_reset(crustache_arena *arena)
+{
+	if (!arena)
+		return;
+
+	arena->current = arena->first;
+	arena->current->used = 0;
+}
+
+void
+crustache_arena_free(crustache_arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if (!arena)
+		return;
+
+	chunk = arena->first;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	free(arena);
+}
@@ -0,0 +1,22 @@
+#ifndef __CR_ARENA_H__
+#define __CR_ARENA_H__
+
+#include "crustache.h"
+
+struct arena_chunk;
+
+/* A position in the arena, to go back to once a render is done */
+struct arena_mark {
+	struct arena_chunk *chunk;
+	size_t used;
+};
+
+extern void
+arena_mark(crustache_arena *arena, struct arena_mark *mark);
+
+/* Release everything allocated since `mark` in O(1). The chunks are
+ * kept around for the next render */
+extern void
+arena_rewind(crustache_arena *arena, const struct arena_mark *mark);
+
+#endif
@@ -0,0 +1,709 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "crustache.h"
+
+/**
+ * Binary contexts are laid out so they can be read in place, straight
+ * from an mmap'ed file or a shared memory segment. All the integers are
+ * in native byte order.
+ *
+ * - A 16 byte header: the magic "CRB1", then the offset of the root
+ * node from the start of the blob and the total size of the blob, both
+ * as uint32_t, then 4 bytes of padding.
+ *
+ * - Nodes start at multiples of 8 from the start of the blob, with a
+ * `struct blob_node` header. Children are always written before their
+ * parents, and parents point at them with the (positive) distance from
+ * the start of the parent back to the start of the child, so a node can
+ * be read without knowing where the blob starts.
+ *
+ * - Strings are followed by their bytes and a NUL; integers and doubles
+ * by their 8 bytes. Arrays are followed by `size` uint32_t distances to
+ * their items. Maps are followed by `size` `struct blob_entry`, sorted
+ * by the length of the key and then bytewise, so lookups are a binary
+ * search. Keys are raw bytes written anywhere before the map.
+ */
+
+#define BLOB_MAGIC "CRB1"
+#define BLOB_HEADER 16
+#define BLOB_ALIGN 8
+#define BLOB_MAX_DEPTH 512
+
+enum {
+	BLOB_FALSE = 0,
+	BLOB_TRUE = 1,
+	BLOB_INT64 = 2,
+	BLOB_DOUBLE = 3,
+	BLOB_STR = 4,
+	BLOB_SAFE_STR = 5,
+	BLOB_ARRAY = 6,
+	BLOB_MAP = 7,
+};
+
+struct blob_node {
+	uint32_t type;
+	uint32_t size;
+};
+
+struct blob_entry {
+	uint32_t key;
+	uint32_t key_size;
+	uint32_t value;
+};
+
+/* Entries and items of the open containers, as offsets from the
+ * start of the blob */
+struct blob_pending {
+	size_t key;
+	size_t key_size;
+	size_t value;
+};
+
+struct blob_level {
+	int map;
+	size_t first;
+	int has_key;
+	size_t key;
+	size_t key_size;
+};
+
+struct crustache_blob_writer {
+	struct buf *ob;
+	size_t start;
+
+	struct blob_level *levels;
+	size_t level_count, level_capacity;
+
+	struct blob_pending *pending;
+	size_t pending_count, pending_capacity;
+
+	size_t root;
+	int has_root;
+	int error;
+};
+
+static int
+key_cmp(const char *a, size_t a_size, const char *b, size_t b_size)
+{
+	if (a_size != b_size)
+		return a_size < b_size ? -1 : 1;
+
+	return memcmp(a, b, a_size);
+}
+
+/*
+ * Writer
+ */
+
+static size_t
+blob_offset(crustache_blob_writer *w)
+{
+	return w->ob->size - w->start;
+}
+
+static int
+blob_put(crustache_blob_writer *w, const void *data, size_t size)
+{
+	if (blob_offset(w) + size > UINT32_MAX)
+		return (w->error = CR_EBLOB);
+
+	if (bufgrow(w->ob, w->ob->size + size) < 0)
+		return (w->error = CR_ENOMEM);
+
+	bufput(w->ob, data, size);
+	return 0;
+}
+
+static int
+blob_pad(crustache_blob_writer *w)
+{
+	static const char ZEROES[BLOB_ALIGN] = {0};
+	size_t misaligned = blob_offset(w) % BLOB_ALIGN;
+
+	if (misaligned == 0)
+		return 0;
+
+	return blob_put(w, ZEROES, BLOB_ALIGN - misaligned);
+}
+
+/* Start a new node; returns its offset, or 0 on error. No node can
+ * sit at 0, as that's where the header is */
+static size_t
+blob_put_node(crustache_blob_writer *w, uint32_t type, uint32_t size)
+{
+	struct blob_node node;
+	size_t offset;
+
+	if (blob_pad(w) < 0)
+		return 0;
+
+	node.type = type;
+	node.size = size;
+	offset = blob_offset(w);
+
+	return blob_put(w, &node, sizeof(node)) < 0 ? 0 : offset;
+}
+
+/* Check that a value can be written at this point */
+static int
+blob_check_slot(crustache_blob_writer *w)
+{
+	if (w->error < 0)
+		return w->error;
+
+	if (w->level_count == 0) {
+		if (w->has_root)
+			return (w->error = CR_EBLOB);
+	} else {
+		struct blob_level *level = &w->levels[w->level_count - 1];
+
+		if (level->map && !level->has_key)
+			return (w->error = CR_EBLOB);
+	}
+
+	return 0;
+}
+
+/* Hand a finished node to its container, or make it the root. An
+ * offset of 0 means writing the node failed */
+static int
+blob_add_value(crustache_blob_writer *w, size_t offset)
+{
+	struct blob_level *level;
+	struct blob_pending *entry;
+
+	if (offset == 0)
+		return w->error;
+
+	if (w->level_count == 0) {
+		w->root = offset;
+		w->has_root = 1;
+		return 0;
+	}
+
+	if (w->pending_count == w->pending_capacity) {
+		size_t capacity = w->pending_capacity ? w->pending_capacity * 2 : 16;
+		void *pending = realloc(w->pending, capacity * sizeof(struct blob_pending));
+
+		if (pending == NULL)
+			return (w->error = CR_ENOMEM);
+
+		w->pending = pending;
+		w->pending_capacity = capacity;
+	}
+
+	level = &w->levels[w->level_count - 1];
+	entry = &w->pending[w->pending_count++];
+
+	entry->key = level->key;
+	entry->key_size = level->key_size;
+	entry->value = offset;
+	level->has_key = 0;
+	return 0;
+}
+
+static int
+blob_put_scalar(crustache_blob_writer *w, uint32_t type, const void *data, size_t size)
+{
+	size_t offset;
+
+	if (blob_check_slot(w) < 0)
+		return w->error;
+
+	offset = blob_put_node(w, type, type == BLOB_STR || type == BLOB_SAFE_STR ? (uint32_t)size : 0);
+
+	if (offset != 0 && size > 0 && blob_put(w, data, size) < 0)
+		return w->error;
+
+	if (offset != 0 && (type == BLOB_STR || type == BLOB_SAFE_STR) && blob_put(w, "", 1) < 0)
+		return w->error;
+
+	return blob_add_value(w, offset);
+}
+
+crustache_blob_writer *
+crustache_blob_writer_new(struct buf *ob)
+{
+	char header[BLOB_HEADER];
+	crustache_blob_writer *w = malloc(sizeof(crustache_blob_writer));
+
+	if (w == NULL)
+		return NULL;
+
+	memset(w, 0x0, sizeof(crustache_blob_writer));
+	w->ob = ob;
+	w->start = ob->size;
+
+	/* the root and the size are filled in by crustache_blob_finish */
+	memset(header, 0x0, sizeof(header));
+	memcpy(header, BLOB_MAGIC, 4);
+	blob_put(w, header, sizeof(header));
+
+	return w;
+}
+
+void
+crustache_blob_writer_free(crustache_blob_writer *w)
+{
+	if (w == NULL)
+		return;
+
+	free(w->levels);
+	free(w->pending);
+	free(w);
+}
+
+int
+crustache_blob_put_str(crustache_blob_writer *w, const char *str, size_t size)
+{
+	return blob_put_scalar(w, BLOB_STR, str, size);
+}
+
+int
+crustache_blob_put_safe_str(crustache_blob_writer *w, const char *str, size_t size)
+{
+	return blob_put_scalar(w, BLOB_SAFE_STR, str, size);
+}
+
+int
+crustache_blob_put_int(crustache_blob_writer *w, int64_t integer)
+{
+	return blob_put_scalar(w, BLOB_INT64, &integer, sizeof(integer));
+}
+
+int
+crustache_blob_put_double(crustache_blob_writer *w, double number)
+{
+	return blob_put_scalar(w, BLOB_DOUBLE, &number, sizeof(number));
+}
+
+int
+crustache_blob_put_bool(crustache_blob_writer *w, int boolean)
+{
+	return blob_put_scalar(w, boolean ? BLOB_TRUE : BLOB_FALSE, NULL, 0);
+}
+
+static int
+blob_begin(crustache_blob_writer *w, int map)
+{
+	struct blob_level *level;
+
+	if (blob_check_slot(w) < 0)
+		return w->error;
+
+	if (w->level_count == w->level_capacity) {
+		size_t capacity = w->level_capacity ? w->level_capacity * 2 : 8;
+		void *levels = realloc(w->levels, capacity * sizeof(struct blob_level));
+
+		if (levels == NULL)
+			return (w->error = CR_ENOMEM);
+
+		w->levels = levels;
+		w->level_capacity = capacity;
+	}
+
+	level = &w->levels[w->level_count++];
+	memset(level, 0x0, sizeof(struct blob_level));
+	level->map = map;
+	level->first = w->pending_count;
+	return 0;
+}
+
+int
+crustache_blob_begin_array(crustache_blob_writer *w)
+{
+	return blob_begin(w, 0);
+}
+
+int
+crustache_blob_begin_map(crustache_blob_writer *w)
+{
+	return blob_begin(w, 1);
+}
+
+int
+crustache_blob_put_key(crustache_blob_writer *w, const char *key, size_t key_size)
+{
+	struct blob_level *level;
+	size_t offset;
+
+	if (w->error < 0)
+		return w->error;
+
+	if (w->level_count == 0 || !w->levels[w->level_count - 1].map ||
+		w->levels[w->level_count - 1].has_key)
+		return (w->error = CR_EBLOB);
+
+	offset = blob_offset(w);
+
+	if (blob_put(w, key, key_size) < 0)
+		return w->error;
+
+	level = &w->levels[w->level_count - 1];
+	level->has_key = 1;
+	level->key = offset;
+	level->key_size = key_size;
+	return 0;
+}
+
+/* A stable merge sort, so the last of several equal keys can win */
+static void
+sort_entries(const char *base, struct blob_pending *entries, struct blob_pending *tmp, size_t count)
+{
+	size_t mid = count / 2, i = 0, j = mid, n = 0;
+
+	if (count < 2)
+		return;
+
+	sort_entries(base, entries, tmp, mid);
+	sort_entries(base, entries + mid, tmp, count - mid);
+
+	while (i < mid && j < count) {
+		if (key_cmp(base + entries[j].key, entries[j].key_size,
+			base + entries[i].key, entries[i].key_size) < 0)
+			tmp[n++] = entries[j++];
+		else
+			tmp[n++] = entries[i++];
+	}
+
+	while (i < mid)
+		tmp[n++] = entries[i++];
+
+	memcpy(entries, tmp, n * sizeof(struct blob_pending));
+}
+
+static size_t
+blob_end_map(crustache_blob_writer *w, struct blob_pending *entries, size_t count)
+{
+	const char *base = w->ob->data + w->start;
+	struct blob_pending *tmp;
+	size_t i, unique = 0, offset;
+
+	if (count > 1) {
+		tmp = malloc(count * sizeof(struct blob_pending));
+		if (tmp == NULL) {
+			w->error = CR_ENOMEM;
+			return 0;
+		}
+
+		sort_entries(base, entries, tmp, count);
+		free(tmp);
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (i + 1 < count && key_cmp(
+			base + entries[i].key, entries[i].key_size,
+			base + entries[i + 1].key, entries[i + 1].key_size) == 0)
+			continue;
+
+		entries[unique++] = entries[i];
+	}
+
+	offset = blob_put_node(w, BLOB_MAP, (uint32_t)unique);
+
+	for (i = 0; offset != 0 && i < unique; ++i) {
+		struct blob_entry entry;
+
+		entry.key = (uint32_t)(offset - entries[i].key);
+		entry.key_size = (uint32_t)entries[i].key_size;
+		entry.value = (uint32_t)(offset - entries[i].value);
+
+		if (blob_put(w, &entry, sizeof(entry)) < 0)
+			return 0;
+	}
+
+	return offset;
+}
+
+static size_t
+blob_end_array(crustache_blob_writer *w, struct blob_pending *items, size_t count)
+{
+	size_t i, offset = blob_put_node(w, BLOB_ARRAY, (uint32_t)count);
+
+	for (i = 0; offset != 0 && i < count; ++i) {
+		uint32_t back = (uint32_t)(offset - items[i].value);
+
+		if (blob_put(w, &back, sizeof(back)) < 0)
+			return 0;
+	}
+
+	return offset;
+}
+
+int
+crustache_blob_end(crustache_blob_writer *w)
+{
+	struct blob_level *level;
+	size_t offset;
+
+	if (w->error < 0)
+		return w->error;
+
+	if (w->level_count == 0 || w->levels[w->level_count - 1].has_key)
+		return (w->error = CR_EBLOB);
+
+	level = &w->levels[w->level_count - 1];
+
+	if (level->map)
+		offset = blob_end_map(w, w->pending + level->first, w->pending_count - level->first);
+	else
+		offset = blob_end_array(w, w->pending + level->first, w->pending_count - level->first);
+
+	w->pending_count = level->first;
+	w->level_count--;
+
+	return blob_add_value(w, offset);
+}
+
+int
+crustache_blob_finish(crustache_blob_writer *w)
+{
+	uint32_t header[2];
+
+	if (w->error < 0)
+		return w->error;
+
+	if (w->level_count > 0 || !w->has_root)
+		return (w->error = CR_EBLOB);
+
+	if (blob_pad(w) < 0)
+		return w->error;
+
+	header[0] = (uint32_t)w->root;
+	header[1] = (uint32_t)blob_offset(w);
+	memcpy(w->ob->data + w->start + 4, header, sizeof(header));
+	return 0;
+}
+
+/*
+ * Reader
+ */
+
+static const struct blob_node *
+blob_child(const struct blob_node *node, uint32_t back)
+{
+	return (const struct blob_node *)((const char *)node - back);
+}
+
+static void
+blob_node_var(crustache_var *var, const struct blob_node *node)
+{
+	memset(var, 0x0, sizeof(crustache_var));
+
+	/* the blob owns everything */
+	var->flags = CRUSTACHE_VAR_BORROWED;
+
+	switch (node->type) {
+	case BLOB_TRUE:
+		var->type = CRUSTACHE_VAR_TRUE;
+		break;
+
+	case BLOB_INT64:
+		var->type = CRUSTACHE_VAR_INT64;
+		memcpy(&var->value.integer, node + 1, sizeof(int64_t));
+		break;
+
+	case BLOB_DOUBLE:
+		var->type = CRUSTACHE_VAR_DOUBLE;
+		memcpy(&var->value.number, node + 1, sizeof(double));
+		break;
+
+	case BLOB_STR:
+	case BLOB_SAFE_STR:
+		var->type = (node->type == BLOB_STR) ? CRUSTACHE_VAR_STR : CRUSTACHE_VAR_SAFE_STR;
+		var->data = (void *)(node + 1);
+		var->size = node->size;
+		break;
+
+	case BLOB_ARRAY:
+		var->type = CRUSTACHE_VAR_LIST;
+		var->data = (void *)node;
+		var->size = node->size;
+		break;
+
+	case BLOB_MAP:
+		var->type = CRUSTACHE_VAR_CONTEXT;
+		var->data = (void *)node;
+		break;
+
+	default:
+		var->type = CRUSTACHE_VAR_FALSE;
+		break;
+	}
+}
+
+static int
+blob_context_find(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	const struct blob_node *map = context;
+	const struct blob_entry *entries = (const struct blob_entry *)(map + 1);
+	size_t lo = 0, hi = map->size;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *entry_key = (const char *)map - entries[mid].key;
+		int cmp = key_cmp(key, key_size, entry_key, entries[mid].key_size);
+
+		if (cmp == 0) {
+			blob_node_var(var, blob_child(map, entries[mid].value));
+			return 0;
+		}
+
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+static int
+blob_list_get(crustache_var *var, void *list, size_t i)
+{
+	const struct blob_node *array = list;
+	const uint32_t *items = (const uint32_t *)(array + 1);
+
+	if (i >= array->size)
+		return -1;
+
+	blob_node_var(var, blob_child(array, items[i]));
+	return 0;
+}
+
+static int
+blob_lambda(crustache_var *var, void *lambda, const char *raw_template, size_t raw_size)
+{
+	(void)var;
+	(void)lambda;
+	(void)raw_template;
+	(void)raw_size;
+
+	/* there are no lambdas in a blob */
+	return -1;
+}
+
+void
+crustache_blob_api(crustache_api *api)
+{
+	memset(api, 0x0, sizeof(crustache_api));
+
+	api->context_find = &blob_context_find;
+	api->list_get = &blob_list_get;
+	api->lambda = &blob_lambda;
+}
+
+static int
+blob_header(const char *blob, size_t size, uint32_t *root)
+{
+	uint32_t header[2];
+
+	if (size < BLOB_HEADER || ((uintptr_t)blob % BLOB_ALIGN) != 0 ||
+		memcmp(blob, BLOB_MAGIC, 4) != 0)
+		return CR_EBLOB;
+
+	memcpy(header, blob + 4, sizeof(header));
+
+	if (header[1] > size || header[0] < BLOB_HEADER || header[0] % BLOB_ALIGN != 0 ||
+		(size_t)header[0] + sizeof(struct blob_node) > header[1])
+		return CR_EBLOB;
+
+	*root = header[0];
+	return 0;
+}
+
+int
+crustache_blob_var(crustache_var *var, const void *blob, size_t size)
+{
+	uint32_t root;
+
+	if (blob_header(blob, size, &root) < 0)
+		return CR_EBLOB;
+
+	blob_node_var(var, (const struct blob_node *)((const char *)blob + root));
+	return 0;
+}
+
+/* Check that a node and everything below it lies inside the blob.
+ * Children must come strictly before their parents, so there can't be
+ * any cycles; `budget` guards against nodes shared over and over. */
+static int
+blob_check_node(const char *blob, size_t offset, size_t size, size_t *budget, int depth)
+{
+	const struct blob_node *node;
+	size_t i, payload;
+
+	if (depth > BLOB_MAX_DEPTH || (*budget)-- == 0 ||
+		offset < BLOB_HEADER || offset % BLOB_ALIGN != 0 ||
+		offset + sizeof(struct blob_node) > size)
+		return -1;
+
+	node = (const struct blob_node *)(blob + offset);
+	payload = size - offset - sizeof(struct blob_node);
+
+	switch (node->type) {
+	case BLOB_FALSE:
+	case BLOB_TRUE:
+		return 0;
+
+	case BLOB_INT64:
+	case BLOB_DOUBLE:
+		return payload >= 8 ? 0 : -1;
+
+	case BLOB_STR:
+	case BLOB_SAFE_STR:
+		return payload > node->size ? 0 : -1;
+
+	case BLOB_ARRAY: {
+		const uint32_t *items = (const uint32_t *)(node + 1);
+
+		if (payload / sizeof(uint32_t) < node->size)
+			return -1;
+
+		for (i = 0; i < node->size; ++i) {
+			if (items[i] == 0 || items[i] > offset ||
+				blob_check_node(blob, offset - items[i], offset, budget, depth + 1) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	case BLOB_MAP: {
+		const struct blob_entry *entries = (const struct blob_entry *)(node + 1);
+
+		if (payload / sizeof(struct blob_entry) < node->size)
+			return -1;
+
+		for (i = 0; i < node->size; ++i) {
+			const struct blob_entry *entry = &entries[i];
+
+			if (entry->key > offset - BLOB_HEADER || entry->key_size > entry->key ||
+				entry->value == 0 || entry->value > offset ||
+				blob_check_node(blob, offset - entry->value, offset, budget, depth + 1) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	default:
+		return -1;
+	}
+}
+
+int
+crustache_blob_check(const void *blob, size_t size)
+{
+	uint32_t root;
+	size_t budget;
+
+	if (blob_header(blob, size, &root) < 0)
+		return CR_EBLOB;
+
+	budget = size / sizeof(struct blob_node);
+
+	if (blob_check_node(blob, root, ((const uint32_t *)blob)[2], &budget, 0) < 0)
+		return CR_EBLOB;
+
+	return 0;
+}
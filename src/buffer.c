@@ -231,6 +231,662 @@ bufputc(struct buf *buf, char c)
 	buf->size += 1;
 }
 
+/*
+ * Unsigned big integers for bufputd, in 32-bit words with the least
+ * significant first. 40 words hold anything the digit generation of a
+ * double gets to (subnormals scaled by 10^324 take ~1130 bits).
+ */
+#define BIGNUM_WORDS 40
+
+struct bignum {
+	uint32_t w[BIGNUM_WORDS];
+	int n;
+};
+
+static void
+big_set(struct bignum *b, uint64_t v)
+{
+	b->w[0] = (uint32_t)v;
+	b->w[1] = (uint32_t)(v >> 32);
+	b->n = (v >> 32) ? 2 : (v ? 1 : 0);
+}
+
+static void
+big_mul(struct bignum *b, uint32_t m)
+{
+	uint64_t carry = 0;
+	int i;
+
+	for (i = 0; i < b->n; ++i) {
+		carry += (uint64_t)b->w[i] * m;
+		b->w[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+
+	if (carry)
+		b->w[b->n++] = (uint32_t)carry;
+}
+
+static void
+big_pow10(struct bignum *b, int k)
+{
+	static const uint32_t POW10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+	};
+
+	for (; k >= 9; k -= 9)
+		big_mul(b, POW10[9]);
+
+	if (k > 0)
+		big_mul(b, POW10[k]);
+}
+
+static void
+big_shl(struct bignum *b, int bits)
+{
+	int words = bits / 32, i;
+
+	bits %= 32;
+
+	if (b->n == 0)
+		return;
+
+	if (bits) {
+		uint32_t top = b->w[b->n - 1] >> (32 - bits);
+
+		for (i = b->n - 1; i > 0; --i)
+			b->w[i] = (b->w[i] << bits) | (b->w[i - 1] >> (32 - bits));
+		b->w[0] <<= bits;
+
+		if (top)
+			b->w[b->n++] = top;
+	}
+
+	if (words) {
+		memmove(b->w + words, b->w, b->n * sizeof(uint32_t));
+		memset(b->w, 0x0, words * sizeof(uint32_t));
+		b->n += words;
+	}
+}
+
+static int
+big_cmp(const struct bignum *a, const struct bignum *b)
+{
+	int i;
+
+	if (a->n != b->n)
+		return a->n < b->n ? -1 : 1;
+
+	for (i = a->n - 1; i >= 0; --i) {
+		if (a->w[i] != b->w[i])
+			return a->w[i] < b->w[i] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* out = a + b */
+static void
+big_add(struct bignum *out, const struct bignum *a, const struct bignum *b)
+{
+	uint64_t carry = 0;
+	int i, n = a->n > b->n ? a->n : b->n;
+
+	for (i = 0; i < n; ++i) {
+		carry += (uint64_t)(i < a->n ? a->w[i] : 0) + (i < b->n ? b->w[i] : 0);
+		out->w[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+
+	if (carry)
+		out->w[n++] = (uint32_t)carry;
+
+	out->n = n;
+}
+
+/* a -= b, for a >= b */
+static void
+big_sub(struct bignum *a, const struct bignum *b)
+{
+	int64_t borrow = 0;
+	int i;
+
+	for (i = 0; i < a->n; ++i) {
+		borrow += (int64_t)a->w[i] - (i < b->n ? b->w[i] : 0);
+		a->w[i] = (uint32_t)borrow;
+		borrow = borrow < 0 ? -1 : 0;
+	}
+
+	while (a->n > 0 && a->w[a->n - 1] == 0)
+		a->n--;
+}
+
+/*
+ * Next digit of `r / s`, for r < 10 * s, leaving the remainder in `r`.
+ * The top word of `s` must be in [2^27, 2^28): the estimate from the
+ * top words is then never more than one too low.
+ */
+static int
+big_digit(struct bignum *r, const struct bignum *s)
+{
+	uint64_t top = r->w[s->n - 1], borrow = 0, carry = 0;
+	uint32_t q;
+	int i;
+
+	if (r->n < s->n)
+		return 0;
+
+	if (r->n > s->n)
+		top |= (uint64_t)r->w[s->n] << 32;
+
+	q = (uint32_t)(top / ((uint64_t)s->w[s->n - 1] + 1));
+
+	if (q > 0) {
+		/* r -= q * s */
+		for (i = 0; i < r->n; ++i) {
+			uint64_t sub;
+
+			carry += (uint64_t)(i < s->n ? s->w[i] : 0) * q;
+			sub = (uint64_t)(uint32_t)carry + borrow;
+			carry >>= 32;
+
+			borrow = sub > r->w[i];
+			r->w[i] = (uint32_t)(r->w[i] - sub);
+		}
+
+		while (r->n > 0 && r->w[r->n - 1] == 0)
+			r->n--;
+	}
+
+	while (big_cmp(r, s) >= 0) {
+		big_sub(r, s);
+		q++;
+	}
+
+	return (int)q;
+}
+
+/*
+ * Shortest digits which read back into `d` (finite, > 0), using the
+ * free-format algorithm of Steele & White as refined by Burger & Dybvig:
+ * `r / s` is the value being printed, and `m+ / s`, `m- / s` the
+ * distance to the halfway points with its neighbours. Digits are
+ * generated until the number printed so far is inside that interval,
+ * and the last one is rounded to the closest. Everything is exact, so
+ * the result is always the shortest and, among those, the closest.
+ *
+ * The digits are written into `digits` (17 at most) and `d` is
+ * 0.DIGITS * 10^exp10. Returns the amount of digits.
+ */
+static int
+shortest_digits(char *digits, int *exp10, double d)
+{
+	struct bignum r, s, m_plus, m_minus_buf, t, *m_minus = &m_plus;
+	uint64_t bits, f;
+	uint32_t top;
+	int e, k, n = 0, even, unequal, p, shift;
+
+	memcpy(&bits, &d, sizeof(bits));
+	f = bits & ((UINT64_C(1) << 52) - 1);
+	e = (int)((bits >> 52) & 0x7FF);
+
+	/* the gap below a power of two is half the one above it */
+	unequal = (f == 0 && e > 1);
+
+	if (e == 0) {
+		e = -1074;
+	} else {
+		f |= UINT64_C(1) << 52;
+		e -= 1075;
+	}
+
+	/* the halfway points round to even mantissas */
+	even = (f & 1) == 0;
+
+	big_set(&r, f);
+	big_shl(&r, 1 + unequal);
+
+	if (e >= 0) {
+		big_shl(&r, e);
+		big_set(&s, 2 << unequal);
+		big_set(&m_plus, 1);
+		big_shl(&m_plus, e + unequal);
+	} else {
+		big_set(&s, 1);
+		big_shl(&s, 1 - e + unequal);
+		big_set(&m_plus, 1 << unequal);
+	}
+
+	if (unequal) {
+		m_minus = &m_minus_buf;
+		big_set(m_minus, 1);
+		if (e > 0)
+			big_shl(m_minus, e);
+	}
+
+	/*
+	 * Estimate k = ceil(log10(d)) from the binary exponent: d is in
+	 * [2^p, 2^(p+1)), so this is either right or one too low.
+	 * 78913 / 2^18 is log10(2), exact enough for doubles.
+	 */
+	for (p = e + 52; f < (UINT64_C(1) << 52); f <<= 1)
+		p--;
+
+	k = (p == 0) ? 0 : (p > 0 ? (p * 78913 >> 18) + 1 : -((-p * 78913) >> 18));
+
+	if (k >= 0) {
+		big_pow10(&s, k);
+	} else {
+		big_pow10(&r, -k);
+		big_pow10(&m_plus, -k);
+		if (unequal)
+			big_pow10(m_minus, -k);
+	}
+
+	big_add(&t, &r, &m_plus);
+	if (even ? big_cmp(&t, &s) >= 0 : big_cmp(&t, &s) > 0) {
+		k++;
+	} else {
+		big_mul(&r, 10);
+		big_mul(&m_plus, 10);
+		if (unequal)
+			big_mul(m_minus, 10);
+	}
+
+	/* scale everything so big_digit() can estimate the quotients */
+	top = s.w[s.n - 1];
+	for (shift = 0; top < (UINT32_C(1) << 31); top <<= 1)
+		shift++;
+
+	shift = (shift + 28) % 32;
+	big_shl(&r, shift);
+	big_shl(&s, shift);
+	big_shl(&m_plus, shift);
+	if (unequal)
+		big_shl(m_minus, shift);
+
+	for (;;) {
+		int digit = big_digit(&r, &s), low, high;
+
+		big_add(&t, &r, &m_plus);
+		low = even ? big_cmp(&r, m_minus) <= 0 : big_cmp(&r, m_minus) < 0;
+		high = even ? big_cmp(&t, &s) >= 0 : big_cmp(&t, &s) > 0;
+
+		if (!low && !high) {
+			digits[n++] = (char)('0' + digit);
+			big_mul(&r, 10);
+			big_mul(&m_plus, 10);
+			if (unequal)
+				big_mul(m_minus, 10);
+			continue;
+		}
+
+		if (low && high) {
+			/* both fit, take the closest */
+			big_add(&t, &r, &r);
+			high = big_cmp(&t, &s) >= 0;
+		}
+
+		digits[n++] = (char)('0' + digit + high);
+		break;
+	}
+
+	*exp10 = k;
+	return n;
+}
+
+/*
+ * Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", 2010): the same digits, worked out with
+ * 64-bit integers and a cached power of ten instead of bignums. The
+ * imprecision of the cached power is tracked, and whenever it could
+ * change the result (about 0.5% of doubles) Grisu gives up and
+ * shortest_digits() does the work instead.
+ */
+struct diy_fp {
+	uint64_t f;
+	int e;
+};
+
+/* 10^k ~= f * 2^e, for k from -348 to 340 in steps of 8 */
+static const struct {
+	uint64_t f;
+	int e, k;
+} CACHED_POWERS[] = {
+	{UINT64_C(0xfa8fd5a0081c0288), -1220, -348}, {UINT64_C(0xbaaee17fa23ebf76), -1193, -340},
+	{UINT64_C(0x8b16fb203055ac76), -1166, -332}, {UINT64_C(0xcf42894a5dce35ea), -1140, -324},
+	{UINT64_C(0x9a6bb0aa55653b2d), -1113, -316}, {UINT64_C(0xe61acf033d1a45df), -1087, -308},
+	{UINT64_C(0xab70fe17c79ac6ca), -1060, -300}, {UINT64_C(0xff77b1fcbebcdc4f), -1034, -292},
+	{UINT64_C(0xbe5691ef416bd60c), -1007, -284}, {UINT64_C(0x8dd01fad907ffc3c), -980, -276},
+	{UINT64_C(0xd3515c2831559a83), -954, -268}, {UINT64_C(0x9d71ac8fada6c9b5), -927, -260},
+	{UINT64_C(0xea9c227723ee8bcb), -901, -252}, {UINT64_C(0xaecc49914078536d), -874, -244},
+	{UINT64_C(0x823c12795db6ce57), -847, -236}, {UINT64_C(0xc21094364dfb5637), -821, -228},
+	{UINT64_C(0x9096ea6f3848984f), -794, -220}, {UINT64_C(0xd77485cb25823ac7), -768, -212},
+	{UINT64_C(0xa086cfcd97bf97f4), -741, -204}, {UINT64_C(0xef340a98172aace5), -715, -196},
+	{UINT64_C(0xb23867fb2a35b28e), -688, -188}, {UINT64_C(0x84c8d4dfd2c63f3b), -661, -180},
+	{UINT64_C(0xc5dd44271ad3cdba), -635, -172}, {UINT64_C(0x936b9fcebb25c996), -608, -164},
+	{UINT64_C(0xdbac6c247d62a584), -582, -156}, {UINT64_C(0xa3ab66580d5fdaf6), -555, -148},
+	{UINT64_C(0xf3e2f893dec3f126), -529, -140}, {UINT64_C(0xb5b5ada8aaff80b8), -502, -132},
+	{UINT64_C(0x87625f056c7c4a8b), -475, -124}, {UINT64_C(0xc9bcff6034c13053), -449, -116},
+	{UINT64_C(0x964e858c91ba2655), -422, -108}, {UINT64_C(0xdff9772470297ebd), -396, -100},
+	{UINT64_C(0xa6dfbd9fb8e5b88f), -369, -92}, {UINT64_C(0xf8a95fcf88747d94), -343, -84},
+	{UINT64_C(0xb94470938fa89bcf), -316, -76}, {UINT64_C(0x8a08f0f8bf0f156b), -289, -68},
+	{UINT64_C(0xcdb02555653131b6), -263, -60}, {UINT64_C(0x993fe2c6d07b7fac), -236, -52},
+	{UINT64_C(0xe45c10c42a2b3b06), -210, -44}, {UINT64_C(0xaa242499697392d3), -183, -36},
+	{UINT64_C(0xfd87b5f28300ca0e), -157, -28}, {UINT64_C(0xbce5086492111aeb), -130, -20},
+	{UINT64_C(0x8cbccc096f5088cc), -103, -12}, {UINT64_C(0xd1b71758e219652c), -77, -4},
+	{UINT64_C(0x9c40000000000000), -50, 4}, {UINT64_C(0xe8d4a51000000000), -24, 12},
+	{UINT64_C(0xad78ebc5ac620000), 3, 20}, {UINT64_C(0x813f3978f8940984), 30, 28},
+	{UINT64_C(0xc097ce7bc90715b3), 56, 36}, {UINT64_C(0x8f7e32ce7bea5c70), 83, 44},
+	{UINT64_C(0xd5d238a4abe98068), 109, 52}, {UINT64_C(0x9f4f2726179a2245), 136, 60},
+	{UINT64_C(0xed63a231d4c4fb27), 162, 68}, {UINT64_C(0xb0de65388cc8ada8), 189, 76},
+	{UINT64_C(0x83c7088e1aab65db), 216, 84}, {UINT64_C(0xc45d1df942711d9a), 242, 92},
+	{UINT64_C(0x924d692ca61be758), 269, 100}, {UINT64_C(0xda01ee641a708dea), 295, 108},
+	{UINT64_C(0xa26da3999aef774a), 322, 116}, {UINT64_C(0xf209787bb47d6b85), 348, 124},
+	{UINT64_C(0xb454e4a179dd1877), 375, 132}, {UINT64_C(0x865b86925b9bc5c2), 402, 140},
+	{UINT64_C(0xc83553c5c8965d3d), 428, 148}, {UINT64_C(0x952ab45cfa97a0b3), 455, 156},
+	{UINT64_C(0xde469fbd99a05fe3), 481, 164}, {UINT64_C(0xa59bc234db398c25), 508, 172},
+	{UINT64_C(0xf6c69a72a3989f5c), 534, 180}, {UINT64_C(0xb7dcbf5354e9bece), 561, 188},
+	{UINT64_C(0x88fcf317f22241e2), 588, 196}, {UINT64_C(0xcc20ce9bd35c78a5), 614, 204},
+	{UINT64_C(0x98165af37b2153df), 641, 212}, {UINT64_C(0xe2a0b5dc971f303a), 667, 220},
+	{UINT64_C(0xa8d9d1535ce3b396), 694, 228}, {UINT64_C(0xfb9b7cd9a4a7443c), 720, 236},
+	{UINT64_C(0xbb764c4ca7a44410), 747, 244}, {UINT64_C(0x8bab8eefb6409c1a), 774, 252},
+	{UINT64_C(0xd01fef10a657842c), 800, 260}, {UINT64_C(0x9b10a4e5e9913129), 827, 268},
+	{UINT64_C(0xe7109bfba19c0c9d), 853, 276}, {UINT64_C(0xac2820d9623bf429), 880, 284},
+	{UINT64_C(0x80444b5e7aa7cf85), 907, 292}, {UINT64_C(0xbf21e44003acdd2d), 933, 300},
+	{UINT64_C(0x8e679c2f5e44ff8f), 960, 308}, {UINT64_C(0xd433179d9c8cb841), 986, 316},
+	{UINT64_C(0x9e19db92b4e31ba9), 1013, 324}, {UINT64_C(0xeb96bf6ebadf77d9), 1039, 332},
+	{UINT64_C(0xaf87023b9bf0ee6b), 1066, 340},
+};
+
+static struct diy_fp
+diy_mul(struct diy_fp x, struct diy_fp y)
+{
+	uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFF;
+	uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFF;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d, mid;
+	struct diy_fp r;
+
+	mid = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF);
+	mid += UINT64_C(1) << 31;
+
+	r.f = ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+static struct diy_fp
+diy_normalize(struct diy_fp x)
+{
+	while (!(x.f & (UINT64_C(1) << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+
+	return x;
+}
+
+/*
+ * Move the last digit down while the number stays inside the safe
+ * interval and gets closer to `d`. Returns 0 if it can't be known to be
+ * the closest one, or to be inside the interval at all.
+ */
+static int
+grisu_round(char *digits, int n, uint64_t distance, uint64_t delta,
+	uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+	uint64_t small = distance - unit, big = distance + unit;
+
+	while (rest < small && delta - rest >= ten_kappa &&
+		(rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+		digits[n - 1]--;
+		rest += ten_kappa;
+	}
+
+	if (rest < big && delta - rest >= ten_kappa &&
+		(rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+		return 0;
+
+	return 2 * unit <= rest && rest <= delta - 4 * unit;
+}
+
+/*
+ * Shortest digits of `d` (finite, > 0) as shortest_digits() would give
+ * them, or 0 if Grisu can't be sure of them.
+ */
+static int
+grisu_digits(char *digits, int *exp10, double d)
+{
+	static const uint32_t POW10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+	};
+
+	struct diy_fp v, w, high, low, c, too_high, too_low, one;
+	uint64_t bits, unit = 1, delta, p2, rest;
+	uint32_t p1, div;
+	double estimate;
+	int kappa, i, n = 0;
+
+	memcpy(&bits, &d, sizeof(bits));
+	v.f = bits & ((UINT64_C(1) << 52) - 1);
+	v.e = (int)((bits >> 52) & 0x7FF);
+
+	if (v.e == 0) {
+		v.e = -1074;
+	} else {
+		v.f |= UINT64_C(1) << 52;
+		v.e -= 1075;
+	}
+
+	/* the halfway points with the neighbours, on the same scale */
+	w = diy_normalize(v);
+	high.f = (v.f << 1) + 1;
+	high.e = v.e - 1;
+	high = diy_normalize(high);
+
+	if (v.f == (UINT64_C(1) << 52) && v.e > -1074) {
+		low.f = (v.f << 2) - 1;
+		low.e = v.e - 2;
+	} else {
+		low.f = (v.f << 1) - 1;
+		low.e = v.e - 1;
+	}
+
+	low.f <<= low.e - high.e;
+	low.e = high.e;
+
+	/* a cached power bringing the exponents into [-60, -32] */
+	estimate = (-61 - w.e) * 0.30102999566398114;
+	kappa = (int)estimate;
+	if (kappa < estimate)
+		kappa++;
+
+	i = (kappa + 348 - 1) / 8 + 1;
+	c.f = CACHED_POWERS[i].f;
+	c.e = CACHED_POWERS[i].e;
+
+	w = diy_mul(w, c);
+	high = diy_mul(high, c);
+	low = diy_mul(low, c);
+
+	assert(w.e >= -60 && w.e <= -32);
+
+	/* be pessimistic about the error of the products */
+	too_low.f = low.f - unit;
+	too_high.f = high.f + unit;
+	delta = too_high.f - too_low.f;
+
+	one.e = w.e;
+	one.f = UINT64_C(1) << -one.e;
+
+	p1 = (uint32_t)(too_high.f >> -one.e);
+	p2 = too_high.f & (one.f - 1);
+
+	for (kappa = 10; kappa > 1 && p1 < POW10[kappa - 1]; --kappa)
+		;
+
+	/* the integer part of the scaled number, one digit at a time */
+	while (kappa > 0) {
+		div = POW10[kappa - 1];
+		digits[n++] = (char)('0' + p1 / div);
+		p1 %= div;
+		kappa--;
+
+		rest = ((uint64_t)p1 << -one.e) + p2;
+		if (rest < delta) {
+			*exp10 = n + kappa - CACHED_POWERS[i].k;
+			return grisu_round(digits, n, too_high.f - w.f, delta, rest,
+				(uint64_t)div << -one.e, unit) ? n : 0;
+		}
+	}
+
+	/* then the fraction; the error grows with each digit */
+	for (;;) {
+		p2 *= 10;
+		unit *= 10;
+		delta *= 10;
+
+		digits[n++] = (char)('0' + (p2 >> -one.e));
+		p2 &= one.f - 1;
+		kappa--;
+
+		if (p2 < delta) {
+			*exp10 = n + kappa - CACHED_POWERS[i].k;
+			return grisu_round(digits, n, (too_high.f - w.f) * unit, delta, p2,
+				one.f, unit) ? n : 0;
+		}
+	}
+}
+
+/*
+ * bufputd: appends the shortest representation of a double that
+ * round-trips. Like "%.17g", exponents from -5 down or from 17 up are
+ * printed in scientific notation.
+ */
+void
+bufputd(struct buf *buf, double d)
+{
+	char digits[24], *out;
+	int n, k, exp10, i;
+
+	if (!buf)
+		return;
+
+	if (d != d) {
+		bufput(buf, "nan", 3);
+		return;
+	}
+
+	if (d < 0 || (d == 0 && 1 / d < 0)) {
+		bufputc(buf, '-');
+		d = -d;
+	}
+
+	if (d == 0) {
+		bufputc(buf, '0');
+		return;
+	}
+
+	if (d > 1.7976931348623157e308) {
+		bufput(buf, "inf", 3);
+		return;
+	}
+
+	/* integers are exact and print as they are */
+	if (d < 9007199254740992.0 && d == (double)(int64_t)d) {
+		bufputi64(buf, (int64_t)d);
+		return;
+	}
+
+	if (buf->size + 32 > buf->asize && bufgrow(buf, buf->size + 32) < 0)
+		return;
+
+	n = grisu_digits(digits, &k, d);
+	if (n == 0)
+		n = shortest_digits(digits, &k, d);
+	exp10 = k - 1;
+	out = buf->data + buf->size;
+
+	if (exp10 < -4 || exp10 >= 17) {
+		*out++ = digits[0];
+		if (n > 1) {
+			*out++ = '.';
+			memcpy(out, digits + 1, n - 1);
+			out += n - 1;
+		}
+
+		*out++ = 'e';
+		*out++ = exp10 < 0 ? '-' : '+';
+		if (exp10 < 0)
+			exp10 = -exp10;
+
+		if (exp10 >= 100)
+			*out++ = (char)('0' + exp10 / 100);
+		*out++ = (char)('0' + exp10 / 10 % 10);
+		*out++ = (char)('0' + exp10 % 10);
+	} else if (k <= 0) {
+		*out++ = '0';
+		*out++ = '.';
+		for (i = 0; i < -k; ++i)
+			*out++ = '0';
+		memcpy(out, digits, n);
+		out += n;
+	} else if (k >= n) {
+		memcpy(out, digits, n);
+		out += n;
+		for (i = n; i < k; ++i)
+			*out++ = '0';
+	} else {
+		memcpy(out, digits, k);
+		out += k;
+		*out++ = '.';
+		memcpy(out, digits + k, n - k);
+		out += n - k;
+	}
+
+	buf->size = out - buf->data;
+}
+
+/* bufputi64: appends the decimal representation of an integer */
+void
+bufputi64(struct buf *buf, int64_t i)
+{
+	static const char DIGITS[] =
+		"00010203040506070809"
+		"10111213141516171819"
+		"20212223242526272829"
+		"30313233343536373839"
+		"40414243444546474849"
+		"50515253545556575859"
+		"60616263646566676869"
+		"70717273747576777879"
+		"80818283848586878889"
+		"90919293949596979899";
+
+	char tmp[20], *p = tmp + sizeof(tmp);
+	uint64_t u = (i < 0) ? (uint64_t)0 - (uint64_t)i : (uint64_t)i;
+
+	while (u >= 100) {
+		unsigned int d = (unsigned int)(u % 100) * 2;
+		u /= 100;
+		*--p = DIGITS[d + 1];
+		*--p = DIGITS[d];
+	}
+
+	if (u >= 10) {
+		unsigned int d = (unsigned int)u * 2;
+		*--p = DIGITS[d + 1];
+		*--p = DIGITS[d];
+	} else {
+		*--p = (char)('0' + u);
+	}
+
+	if (i < 0)
+		bufputc(buf, '-');
+
+	bufput(buf, p, tmp + sizeof(tmp) - p);
+}
+
 /* bufrelease: decrease the reference count and free the buffer if needed */
 void
 bufrelease(struct buf *buf)
@@ -291,12 +947,16 @@ bufslurp(struct buf *buf, size_t len)
 void
 vbufprintf(struct buf *buf, const char *fmt, va_list ap)
 {
+	va_list ap_copy;
 	int n;
 
 	if (buf == 0 || (buf->size >= buf->asize && bufgrow(buf, buf->size + 1)) < 0)
 		return;
 
-	n = _buf_vsnprintf(buf->data + buf->size, buf->asize - buf->size, fmt, ap);
+	/* `ap` is used up by the first try, keep it for the second one */
+	va_copy(ap_copy, ap);
+	n = _buf_vsnprintf(buf->data + buf->size, buf->asize - buf->size, fmt, ap_copy);
+	va_end(ap_copy);
 
 	if (n < 0) {
 #ifdef _MSC_VER
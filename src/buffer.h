@@ -20,6 +20,7 @@
 
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #if defined(_MSC_VER)
 #define __attribute__(x)
@@ -85,6 +86,12 @@ void bufputs(struct buf *, const char*);
 /* bufputc: appends a single char to a buffer */
 void bufputc(struct buf *, char);
 
+/* bufputd: appends the shortest representation of a double that round-trips */
+void bufputd(struct buf *, double);
+
+/* bufputi64: appends the decimal representation of an integer */
+void bufputi64(struct buf *, int64_t);
+
 /* bufrelease: decrease the reference count and free the buffer if needed */
 void bufrelease(struct buf *);
 
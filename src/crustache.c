@@ -2,12 +2,31 @@
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <ctype.h>
 
 #include "crustache.h"
 #include "houdini.h"
+#include "escape_cache.h"
+#include "filters.h"
+#include "minify.h"
+#include "arena.h"
+#include "fragment_cache.h"
+#include "lock.h"
 
 #define MAX_RENDER_RECURSION 16
+#define MAX_FILTER_ARGS 8
+#define LIST_BATCH_SIZE 32
 #define DEFAULT_STACK_SIZE 4 /* max two reallocs */
+#define COLUMN_UNBOUND (-2)
+#define COLUMN_BINDING_SIZE 64
+#define LOCAL_LAYERS 4
+#define FRAME_LOCAL_KEYS 8
+#define LAMBDA_CACHE_SIZE 16
+
+/* A copy the renderer made of a variable it already holds (or of a
+ * table cell): it never belonged to the host, so releasing it is not a
+ * saved `var_free` call */
+#define VAR_ALIAS (CRUSTACHE_VAR_BORROWED | (1u << 31))
 
 typedef enum {
 	CRUSTACHE_NODE_MULTIROOT,
@@ -18,6 +37,14 @@ typedef enum {
 	CRUSTACHE_NODE_PARTIAL,
 } node_t;
 
+typedef enum {
+	FETCH_NAME,
+	FETCH_IMPLICIT, /* {{.}} */
+	FETCH_INDEX, /* {{@index}} */
+	FETCH_FIRST, /* {{@first}} */
+	FETCH_LAST, /* {{@last}} */
+} fetch_t;
+
 typedef enum {
 	CRUSTACHE_TAG_ESCAPE,
 	CRUSTACHE_TAG_RAW,
@@ -42,25 +69,81 @@ struct node_static {
 struct node_fetch {
 	struct node base;
 	struct node_str var;
+	fetch_t kind;
+
+	/* for dotted names, `head` is the first segment and
+	 * `path` holds the rest of them. Their hashes are worked
+	 * out here, so hosts can look them up right away */
+	struct node_str head;
+	size_t head_hash;
+	crustache_key *path;
+	size_t path_len;
+
+	size_t slot;
+};
+
+/* A partial loaded through the `partial` callback, shared by all the
+ * partial tags with the same name. The name is copied right after the
+ * entry, as it may come from a partial which is freed before us */
+struct partial_entry {
+	struct node_str name;
+	crustache_template *template;
+
+	/* in the entries of a partial we own: the entry of the root
+	 * template which actually holds the partial */
+	struct partial_entry *shared;
+
+	struct partial_entry *next;
 };
 
 struct node_partial {
 	struct node base;
 	struct node_str partial_name;
+	struct partial_entry *entry;
+};
+
+struct node_filter {
+	struct node_str name;
+	crustache_filter_fn filter;
+	crustache_var *args;
+	size_t arg_count;
+	struct node_filter *next;
 };
 
 struct node_tag {
 	struct node base;
 	struct node *tag_value;
+	struct node_filter *filters;
 	tag_mode_t print_mode;
 };
 
+/* The variable names fetched anywhere inside a section (or the whole
+ * template), bound when the section is compiled */
+struct scope {
+	size_t *slots;
+	size_t slot_count;
+
+	/* the distinct keys to resolve with `context_find_many`, and the
+	 * index in `keys` for each name slot in the template (or -1) */
+	crustache_key *keys;
+	size_t key_count;
+	int *position;
+};
+
 struct node_section {
 	struct node base;
 	struct node *section_key;
 	struct node *content;
 	struct node_str raw_content;
 	int inverted;
+	struct scope scope;
+
+	/* the delimiters in effect at the section tag, to compile
+	 * the output of lambdas with */
+	struct node_str delim_open, delim_close;
+
+	/* tells apart fragments of different sections with the same name */
+	size_t content_hash;
 };
 
 struct mustache {
@@ -69,6 +152,15 @@ struct mustache {
 	size_t size;
 };
 
+/* A template compiled from the output of a lambda */
+struct lambda_cache_entry {
+	size_t hash;
+	struct node_str delim_open, delim_close;
+	crustache_template *template;
+	unsigned long last_used;
+	int in_use;
+};
+
 struct crustache_template {
 	struct {
 		const char *chars;
@@ -87,8 +179,155 @@ struct crustache_template {
 	size_t error_pos;
 	struct node *error_node;
 	int fail_on_not_found;
+
+	struct buf *static_content;
+
+	/* the first fetch node for each distinct variable name */
+	struct node_fetch **names;
+	size_t name_count;
+	struct scope root_scope;
+
+	/* threads rendering the template share the cache, under the lock */
+	struct lambda_cache_entry lambda_cache[LAMBDA_CACHE_SIZE];
+	unsigned long lambda_clock;
+	cr_lock_t lambda_lock;
+
+	/* the context a specialized template was folded with, for the
+	 * nodes which still read it; not owned by the template */
+	crustache_var static_context;
+	int has_static_context;
+
+	/* code generated by crustache-aot, and the nodes it refers to */
+	const crustache_compiled *compiled;
+	struct node **compiled_nodes;
+
+	/* the partials this template has loaded; if it's a partial
+	 * owned by another template, it uses the cache of `partial_root`.
+	 * Rendering threads fill it in under the lock of the root */
+	struct partial_entry *partials;
+	crustache_template *partial_root;
+	cr_lock_t partial_lock;
+
+	/* the text of the partials inlined by crustache_link_partials */
+	struct linked_text *linked;
+
+	/* our own part of the keys in the fragment cache */
+	unsigned long fragment_id;
+};
+
+/* A top-level node of the template and where its output went */
+struct result_segment {
+	struct node *node;
+	size_t start;
+	size_t size;
+
+	/* ran a lambda, which may read anything */
+	int any_key;
+};
+
+struct crustache_result {
+	crustache_template *template;
+	crustache_var context;
+	struct buf *output;
+
+	struct result_segment *segments;
+	size_t segment_count;
+
+	crustache_change *changes;
+	size_t change_count;
+};
+
+/* What a `lambda_section` callback gets to render its section with */
+struct crustache_section {
+	crustache_template *template;
+	struct node_section *node;
+	struct stack *context;
+	int depth;
+	int error;
+};
+
+/* What the code generated by crustache-aot gets to render with */
+struct aot_section;
+
+struct crustache_aot {
+	crustache_template *template;
+	struct stack *context;
+	int depth;
+
+	/* the sections the generated code is looping through */
+	struct aot_section *open;
+	size_t open_count;
+};
+
+/* An entry in the context stack */
+/* What a single render writes to as it goes. It belongs to the render
+ * call and not to the template, so a template can be rendered by many
+ * threads at once */
+struct render_state {
+	/* filters write their output here; two, so a filter never
+	 * writes over its own input */
+	struct buf *filter_scratch[2];
+
+	/* tells tracked renders which parts ran a lambda */
+	unsigned long lambda_calls;
+};
+
+struct frame {
+	crustache_var *var;
+
+	/* set if the frame is an element of a list or a table */
+	int loop;
+	size_t index;
+	int last;
+
+	/* set if the frame is a row of a CRUSTACHE_VAR_COLUMNS table */
+	const crustache_columns *columns;
+
+	/* the template whose name slots `binding` and `scope` refer to */
+	const crustache_template *template;
+
+	/* column index for each name slot */
+	int *binding;
+
+	/* the keys of `scope` which were found in a CRUSTACHE_VAR_CONTEXT
+	 * frame with a single `context_find_many` call */
+	const struct scope *scope;
+	crustache_var *resolved;
+	int *found;
+
+	crustache_var local_resolved[FRAME_LOCAL_KEYS];
+	int local_found[FRAME_LOCAL_KEYS];
+
+	/* set on the bottom frame of a render where missing names
+	 * are errors, as when specializing a template */
+	int strict;
+
+	/* set on the bottom frame of every render */
+	struct render_state *render;
 };
 
+/* 32-bit FNV-1a, so the hashes written into code generated by
+ * crustache-aot are the same on every platform */
+static size_t
+hash_str(const char *str, size_t size)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+size_t
+crustache_key_hash(const char *key, size_t size)
+{
+	return hash_str(key, size);
+}
+
 static void
 print_indent(int depth)
 {
@@ -120,8 +359,15 @@ print_tree(struct node *node, int depth)
 
 			case CRUSTACHE_NODE_TAG: {
 				struct node_tag *tag = (struct node_tag *)node;
+				struct node_filter *filter;
+
 				printf("tag [%d] =>\n", tag->print_mode);
 				print_tree(tag->tag_value, depth + 1);
+
+				for (filter = tag->filters; filter != NULL; filter = filter->next) {
+					print_indent(depth + 1);
+					printf("filter [%.*s]\n", (int)filter->name.size, filter->name.ptr);
+				}
 				break;
 			}
 
@@ -156,6 +402,24 @@ print_tree(struct node *node, int depth)
 	}
 }
 
+static void
+filter_free(struct node_filter *filter)
+{
+	while (filter != NULL) {
+		struct node_filter *next = filter->next;
+		free(filter);
+		filter = next;
+	}
+}
+
+static void
+scope_free(struct scope *scope)
+{
+	free(scope->slots);
+	free(scope->keys);
+	free(scope->position);
+}
+
 static void
 node_free(struct node *node)
 {
@@ -165,16 +429,21 @@ node_free(struct node *node)
 		switch (node->type) {
 		case CRUSTACHE_NODE_TAG:
 			node_free(((struct node_tag *)node)->tag_value);
+			filter_free(((struct node_tag *)node)->filters);
 			break;
 
 		case CRUSTACHE_NODE_SECTION:
 			node_free(((struct node_section *)node)->section_key);
 			node_free(((struct node_section *)node)->content);
+			scope_free(&((struct node_section *)node)->scope);
+			break;
+
+		case CRUSTACHE_NODE_FETCH:
+			free(((struct node_fetch *)node)->path);
 			break;
 
 		case CRUSTACHE_NODE_MULTIROOT:
 		case CRUSTACHE_NODE_STATIC:
-		case CRUSTACHE_NODE_FETCH:
 			break;
 		}
 
@@ -469,6 +738,235 @@ parse_mustache_name(struct node_str *str, struct mustache *mst)
 	return 0;
 }
 
+/* Parse a variable name, splitting dotted names into their segments */
+static int
+parse_fetch_name(struct node_fetch *fetch, struct mustache *mst)
+{
+	static const struct {
+		const char *name;
+		fetch_t kind;
+	} SPECIAL_NAMES[] = {
+		{".", FETCH_IMPLICIT},
+		{"@index", FETCH_INDEX},
+		{"@first", FETCH_FIRST},
+		{"@last", FETCH_LAST},
+	};
+
+	size_t i, org = 0, segments = 0;
+
+	fetch->kind = FETCH_NAME;
+	fetch->var.ptr = fetch->head.ptr = mst->name;
+	fetch->var.size = fetch->head.size = mst->size;
+
+	for (i = 0; i < sizeof(SPECIAL_NAMES) / sizeof(SPECIAL_NAMES[0]); ++i) {
+		if (strlen(SPECIAL_NAMES[i].name) == mst->size &&
+			memcmp(SPECIAL_NAMES[i].name, mst->name, mst->size) == 0) {
+			fetch->kind = SPECIAL_NAMES[i].kind;
+			return 0;
+		}
+	}
+
+	for (i = 0; i <= mst->size; ++i) {
+		if (i == mst->size || mst->name[i] == '.') {
+			if (i == org)
+				return CR_EPARSE_BAD_MUSTACHE_NAME;
+
+			segments++;
+			org = i + 1;
+		} else if (!isalnum((unsigned char)mst->name[i]) && mst->name[i] != '_') {
+			return CR_EPARSE_BAD_MUSTACHE_NAME;
+		}
+	}
+
+	if (segments == 1) {
+		fetch->head_hash = hash_str(fetch->head.ptr, fetch->head.size);
+		return 0;
+	}
+
+	fetch->path = malloc((segments - 1) * sizeof(crustache_key));
+	if (fetch->path == NULL)
+		return CR_ENOMEM;
+
+	for (i = 0, org = 0; i <= mst->size; ++i) {
+		if (i < mst->size && mst->name[i] != '.')
+			continue;
+
+		if (org == 0) {
+			fetch->head.size = i;
+			fetch->head_hash = hash_str(fetch->head.ptr, fetch->head.size);
+		} else {
+			crustache_key *segment = &fetch->path[fetch->path_len++];
+			segment->name = mst->name + org;
+			segment->size = i - org;
+			segment->hash = hash_str(segment->name, segment->size);
+		}
+
+		org = i + 1;
+	}
+
+	return 0;
+}
+
+static crustache_filter_fn
+find_filter(crustache_template *template, const char *name, size_t name_size)
+{
+	const crustache_filter *filter;
+
+	/* filters registered by the host can override the builtin ones */
+	for (filter = template->api.filters; filter && filter->name; ++filter) {
+		if (strlen(filter->name) == name_size &&
+			memcmp(filter->name, name, name_size) == 0)
+			return filter->filter;
+	}
+
+	return filters_builtin(name, name_size);
+}
+
+static int
+parse_filter_arg(crustache_var *arg, const char **buffer, const char *end)
+{
+	const char *p = *buffer;
+
+	memset(arg, 0x0, sizeof(crustache_var));
+
+	if (p < end && (*p == '"' || *p == '\'')) {
+		const char *closing = memchr(p + 1, *p, end - p - 1);
+
+		if (closing == NULL)
+			return CR_EPARSE_BAD_FILTER;
+
+		arg->type = CRUSTACHE_VAR_STR;
+		arg->data = (void *)(p + 1);
+		arg->size = closing - p - 1;
+		*buffer = closing + 1;
+		return 0;
+	}
+
+	if (p < end && (isdigit((unsigned char)*p) ||
+		(*p == '-' && p + 1 < end && isdigit((unsigned char)p[1])))) {
+		int negative = (*p == '-');
+		int64_t value = 0;
+
+		if (negative)
+			p++;
+
+		while (p < end && isdigit((unsigned char)*p)) {
+			if (value > (INT64_MAX - 9) / 10)
+				return CR_EPARSE_BAD_FILTER;
+
+			value = (value * 10) + (*p++ - '0');
+		}
+
+		arg->type = CRUSTACHE_VAR_INT64;
+		arg->value.integer = negative ? -value : value;
+		*buffer = p;
+		return 0;
+	}
+
+	return CR_EPARSE_BAD_FILTER;
+}
+
+/*
+ * Parse a filter pipeline, the part of a tag which comes after
+ * the first pipe, e.g. `truncate: 20, "..." | upcase`
+ */
+static int
+parse_filters(
+	struct node_filter **filters,
+	crustache_template *template,
+	const char *buffer,
+	size_t size)
+{
+	const char *end = buffer + size;
+	struct node_filter **tail = filters;
+
+	for (;;) {
+		struct node_filter *filter;
+		crustache_var args[MAX_FILTER_ARGS];
+		size_t arg_count = 0;
+		const char *name;
+		size_t name_size;
+
+		while (buffer < end && tag_isspace(*buffer))
+			buffer++;
+
+		name = buffer;
+		while (buffer < end && (isalnum((unsigned char)*buffer) || *buffer == '_'))
+			buffer++;
+
+		name_size = buffer - name;
+
+		while (buffer < end && tag_isspace(*buffer))
+			buffer++;
+
+		if (name_size == 0)
+			return CR_EPARSE_BAD_FILTER;
+
+		if (buffer < end && *buffer == ':') {
+			do {
+				buffer++;
+
+				while (buffer < end && tag_isspace(*buffer))
+					buffer++;
+
+				if (arg_count == MAX_FILTER_ARGS ||
+					parse_filter_arg(&args[arg_count++], &buffer, end) < 0)
+					return CR_EPARSE_BAD_FILTER;
+
+				while (buffer < end && tag_isspace(*buffer))
+					buffer++;
+
+			} while (buffer < end && *buffer == ',');
+		}
+
+		filter = malloc(sizeof(struct node_filter) + arg_count * sizeof(crustache_var));
+		if (filter == NULL)
+			return CR_ENOMEM;
+
+		filter->name.ptr = name;
+		filter->name.size = name_size;
+		filter->filter = find_filter(template, name, name_size);
+		filter->args = (crustache_var *)(filter + 1);
+		filter->arg_count = arg_count;
+		filter->next = NULL;
+		memcpy(filter->args, args, arg_count * sizeof(crustache_var));
+
+		*tail = filter;
+		tail = &filter->next;
+
+		if (filter->filter == NULL)
+			return CR_EPARSE_BAD_FILTER;
+
+		if (buffer == end)
+			break;
+
+		if (*buffer++ != '|')
+			return CR_EPARSE_BAD_FILTER;
+	}
+
+	return 0;
+}
+
+static int
+parse_static(struct stack *node_stack, const char *text, size_t size)
+{
+	struct node_static *stnode;
+	struct node *old_root;
+
+	stnode = node_alloc(CRUSTACHE_NODE_STATIC, struct node_static);
+	if (stnode == NULL)
+		return CR_ENOMEM;
+
+	stnode->str.ptr = text;
+	stnode->str.size = size;
+
+	old_root = stack_pop(node_stack);
+	old_root->next = (struct node *)stnode;
+
+	stack_push(node_stack, stnode);
+	return 0;
+}
+
 static int
 parse_internal(
 	crustache_template *template,
@@ -492,27 +990,10 @@ parse_internal(
 		if (error <= 0) /* failed, or no mustache found */
 			break;
 
-		if (mst_pos + mst_size) {
-
-		}
-
 		if (mst_pos > i) {
-			struct node_static *stnode;
-			struct node *old_root;
-
-			stnode = node_alloc(CRUSTACHE_NODE_STATIC, struct node_static);
-			if (stnode == NULL) {
-				error = CR_ENOMEM;
+			error = parse_static(&node_stack, buffer + i, mst_pos - i);
+			if (error < 0)
 				break;
-			}
-
-			stnode->str.ptr = buffer + i;
-			stnode->str.size = mst_pos - i;
-
-			old_root = stack_pop(&node_stack);
-			old_root->next = (struct node *)stnode;
-
-			stack_push(&node_stack, stnode);
 		}
 
 		error = parse_mustache(&mst,
@@ -543,8 +1024,11 @@ parse_internal(
 					break;
 				}
 
+				section_key->path = NULL;
+				section_key->path_len = 0;
+
 				/* Parse section key */
-				if ((error = parse_mustache_name(&section_key->var, &mst)) < 0)
+				if ((error = parse_fetch_name(section_key, &mst)) < 0)
 					break;
 
 				/* Parse section node */
@@ -553,6 +1037,12 @@ parse_internal(
 				section->raw_content.ptr = buffer + i;
 				section->raw_content.size = 0;
 				section->inverted = (mst.modifier == '^');
+				memset(&section->scope, 0x0, sizeof(struct scope));
+
+				section->delim_open.ptr = template->mustache_open.chars;
+				section->delim_open.size = template->mustache_open.size;
+				section->delim_close.ptr = template->mustache_close.chars;
+				section->delim_close.size = template->mustache_close.size;
 
 				old_root = stack_pop(&node_stack);
 				old_root->next = (struct node *)section;
@@ -586,6 +1076,8 @@ parse_internal(
 				}
 
 				section_open->raw_content.size = (buffer + mst_pos - section_open->raw_content.ptr);
+				section_open->content_hash = hash_str(
+					section_open->raw_content.ptr, section_open->raw_content.size);
 				break;
 			}
 
@@ -611,6 +1103,8 @@ parse_internal(
 					break;
 				}
 
+				partial->entry = NULL;
+
 				if ((error = parse_mustache_name(&partial->partial_name, &mst)) < 0)
 					break;
 
@@ -627,23 +1121,48 @@ parse_internal(
 				struct node_tag *tag;
 				struct node_fetch *tag_name;
 				struct node *old_root;
+				const char *pipe;
 
 				/* Alloc nodes */
 				tag_name = node_alloc(CRUSTACHE_NODE_FETCH, struct node_fetch);
 				tag = node_alloc(CRUSTACHE_NODE_TAG, struct node_tag);
 
 				if (tag_name == NULL || tag == NULL) {
+					free(tag_name);
+					free(tag);
 					error = CR_ENOMEM;
 					break;
 				}
 
+				tag_name->path = NULL;
+				tag_name->path_len = 0;
+
+				tag->tag_value = (struct node *)tag_name;
+				tag->filters = NULL;
+
+				/* Split the filter pipeline from the tag name */
+				pipe = memchr(mst.name, '|', mst.size);
+				if (pipe != NULL) {
+					error = parse_filters(&tag->filters, template,
+						pipe + 1, mst.name + mst.size - pipe - 1);
+
+					if (error < 0) {
+						node_free((struct node *)tag);
+						break;
+					}
+
+					mst.size = pipe - mst.name;
+					while (mst.size && tag_isspace(mst.name[mst.size - 1]))
+						mst.size--;
+				}
+
 				/* Parse tag name for fetching */
-				if ((error = parse_mustache_name(&tag_name->var, &mst)) < 0)
+				if ((error = parse_fetch_name(tag_name, &mst)) < 0) {
+					node_free((struct node *)tag);
 					break;
+				}
 
 				/* Parse the actual tag */
-				tag->tag_value = (struct node *)tag_name;
-
 				switch (mst.modifier) {
 				case '{':
 					tag->print_mode = CRUSTACHE_TAG_RAW;
@@ -672,14 +1191,35 @@ parse_internal(
 		}
 	}
 
+	/* static text after the last mustache */
+	if (error == 0 && i < size)
+		error = parse_static(&node_stack, buffer + i, size - i);
+
 	stack_free(&node_stack);
 	return error;
 }
 
+void
+api_free_var(const crustache_api *api, crustache_var *var)
+{
+	if (api->var_free == NULL)
+		return;
+
+	if (var->flags & CRUSTACHE_VAR_BORROWED) {
+		if (api->stats != NULL && (var->flags & VAR_ALIAS) != VAR_ALIAS)
+			api->stats->var_free_skipped++;
+		return;
+	}
+
+	if (api->stats != NULL)
+		api->stats->var_free_calls++;
+
+	api->var_free(var->type, var->data);
+}
+
 static void free_var(crustache_template *template, crustache_var *var)
 {
-	if (template->api.var_free != NULL)
-		template->api.var_free(var->type, var->data);
+	api_free_var(&template->api, var);
 }
 
 static int
@@ -698,319 +1238,4099 @@ render_node_static(struct buf *ob, struct node_static *node)
 }
 
 static int
-render_node_partial(
+render_compiled(
 	struct buf *ob,
 	crustache_template *template,
-	struct node_partial *node,
+	struct stack *context,
+	int depth);
+
+/* Render the content of a section */
+static int
+render_content(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
 	struct stack *context,
 	int depth)
 {
-	int error;
-	crustache_template *partial = NULL;
-
-	error = template->api.partial(
-		&partial,
-		node->partial_name.ptr,
-		node->partial_name.size);
-
-	if (error < 0 || partial == NULL || partial->error_pos != 0) {
-		error = CR_ERENDER_BAD_PARTIAL;
-	} else {
-		error = render_node(ob, partial, &partial->root, context, depth);
-	}
-
-	if (error < 0)
-		template->error_node = (struct node *)node;
-
-	if (template->api.free_partials)
-		crustache_free(partial);
-
-	return error;
+	return render_node(ob, template, node->content, context, depth);
 }
 
 static int
-render_node_fetch(
-	crustache_var *out,
+render_root(
+	struct buf *ob,
 	crustache_template *template,
-	struct node_fetch *node,
-	struct stack *context)
+	struct stack *context,
+	int depth)
 {
-	int i;
+	if (template->compiled != NULL)
+		return render_compiled(ob, template, context, depth);
 
-	assert(node->base.type == CRUSTACHE_NODE_FETCH && context->size);
+	return render_node(ob, template, &template->root, context, depth);
+}
 
-	for (i = (int)context->size - 1; i >= 0; --i) {
-		crustache_var *ctx = context->item[i];
+static int
+partial_entry(struct partial_entry **output, crustache_template *template, const struct node_str *name);
 
-		assert(ctx->type == CRUSTACHE_VAR_CONTEXT);
-		if (template->api.context_find(out, ctx->data, node->var.ptr, node->var.size) == 0)
-			break;
-	}
+/*
+ * Point the partial tags of a partial we have just loaded at the cache
+ * of the root template, so a partial is loaded once for the whole tree
+ * (and a recursive one is not compiled again at every level).
+ */
+static int
+share_partials(crustache_template *root, crustache_template *partial)
+{
+	struct partial_entry *entry;
+	int error;
 
-	if (i < 0) { /* not found */
-		if (template->fail_on_not_found) {
-			template->error_node = (struct node *)node;
-			return CR_ERENDER_NOT_FOUND;
-		}
+	partial->partial_root = root;
 
-		out->type = CRUSTACHE_VAR_FALSE;
-		out->data = NULL;
+	for (entry = partial->partials; entry != NULL; entry = entry->next) {
+		if ((error = partial_entry(&entry->shared, root, &entry->name)) < 0)
+			return error;
 	}
 
 	return 0;
 }
 
+/*
+ * Get the template for a partial tag. The library can only keep the
+ * partials it owns (`free_partials`): those are loaded the first time
+ * their name is seen anywhere in the template or its partials, and kept
+ * until crustache_clear_partials. Partials owned by the host are asked
+ * for every time they are rendered.
+ *
+ * The cache is filled in while rendering, so it's only read and written
+ * under the lock of the root template. The `partial` callback is called
+ * without it: if two threads load the same partial at once, the first
+ * one to finish keeps its copy, and the other one is freed.
+ */
 static int
-render_node_tag(
-	struct buf *ob,
+load_partial(
+	crustache_template **output,
 	crustache_template *template,
-	struct node_tag *node,
-	struct stack *context)
+	struct node_partial *node)
 {
-	crustache_var tag_value;
+	crustache_template *root = template->partial_root ? template->partial_root : template;
+	struct partial_entry *entry = node->entry;
+	crustache_template *partial = NULL;
 	int error = 0;
 
-	assert(node->base.type == CRUSTACHE_NODE_TAG);
+	if (template->api.free_partials) {
+		cr_lock(&root->partial_lock);
 
-	error = render_node_fetch(
-		&tag_value,
-		template,
-		(struct node_fetch *)node->tag_value,
-		context);
+		if (entry->shared != NULL)
+			entry = entry->shared;
 
-	if (error < 0)
-		return error;
+		partial = entry->template;
+		cr_unlock(&root->partial_lock);
 
-	switch (tag_value.type) {
-	case CRUSTACHE_VAR_FALSE:
+		if (partial != NULL) {
+			*output = partial;
+			return 0;
+		}
+	}
+
+	error = template->api.partial(
+		&partial,
+		node->partial_name.ptr,
+		node->partial_name.size);
+
+	if (error < 0 || partial == NULL || partial->error_pos != 0) {
+		if (template->api.free_partials)
+			crustache_free(partial);
+
+		template->error_node = (struct node *)node;
+		return CR_ERENDER_BAD_PARTIAL;
+	}
+
+	if (template->api.free_partials) {
+		crustache_template *loaded;
+
+		cr_lock(&root->partial_lock);
+
+		loaded = entry->template;
+		if (loaded == NULL && (error = share_partials(root, partial)) == 0)
+			entry->template = partial;
+
+		cr_unlock(&root->partial_lock);
+
+		if (loaded != NULL || error < 0)
+			crustache_free(partial);
+
+		if (error < 0)
+			return error;
+
+		if (loaded != NULL)
+			partial = loaded;
+	}
+
+	*output = partial;
+	return 0;
+}
+
+static int
+render_node_partial(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_partial *node,
+	struct stack *context,
+	int depth)
+{
+	crustache_template *partial;
+	int error;
+
+	error = load_partial(&partial, template, node);
+	if (error < 0)
+		return error;
+
+	error = render_root(ob, partial, context, depth);
+	if (error < 0)
+		template->error_node = (struct node *)node;
+
+	return error;
+}
+
+static void
+frame_init(struct frame *frame, crustache_var *var)
+{
+	memset(frame, 0x0, sizeof(struct frame));
+	frame->var = var;
+}
+
+/* Hang `state` off the bottom of a context stack, once the first
+ * frame has been pushed */
+static void
+render_state_init(struct render_state *state, struct stack *context)
+{
+	struct frame *bottom = context->item[0];
+
+	memset(state, 0x0, sizeof(struct render_state));
+	bottom->render = state;
+}
+
+static struct render_state *
+render_state(struct stack *context)
+{
+	struct frame *bottom = context->item[0];
+	return bottom->render;
+}
+
+static void
+render_state_free(struct render_state *state)
+{
+	bufrelease(state->filter_scratch[0]);
+	bufrelease(state->filter_scratch[1]);
+}
+
+static void
+frame_release(crustache_template *template, struct frame *frame, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (frame->found[i])
+			free_var(template, &frame->resolved[i]);
+	}
+
+	if (frame->resolved != frame->local_resolved)
+		free(frame->resolved);
+
+	frame->scope = NULL;
+}
+
+/*
+ * Push a frame into the context stack. If the host can look up many
+ * keys at once, all the names fetched inside `scope` are resolved
+ * right away with a single call, instead of one call per tag.
+ */
+static void
+frame_push(
+	struct stack *context,
+	crustache_template *template,
+	struct frame *frame,
+	const struct scope *scope)
+{
+	size_t count = scope->key_count;
+
+	if (template->api.context_find_many != NULL && count > 0 &&
+		frame->var->type == CRUSTACHE_VAR_CONTEXT) {
+
+		if (count <= FRAME_LOCAL_KEYS) {
+			frame->resolved = frame->local_resolved;
+			frame->found = frame->local_found;
+		} else {
+			frame->resolved = malloc(count * (sizeof(crustache_var) + sizeof(int)));
+			frame->found = (int *)(frame->resolved + count);
+		}
+
+		if (frame->resolved != NULL) {
+			memset(frame->resolved, 0x0, count * sizeof(crustache_var));
+			memset(frame->found, 0x0, count * sizeof(int));
+
+			frame->scope = scope;
+			frame->template = template;
+
+			/* if the host fails, we'll just look up every name by itself */
+			if (template->api.context_find_many(frame->resolved, frame->found,
+				frame->var->data, scope->keys, count) < 0)
+				frame_release(template, frame, count);
+		}
+	}
+
+	stack_push(context, frame);
+}
+
+/* For frames which don't resolve any names up front */
+static const struct scope NO_SCOPE;
+
+static void
+frame_pop(struct stack *context, crustache_template *template)
+{
+	struct frame *frame = stack_pop(context);
+
+	if (frame->scope != NULL)
+		frame_release(template, frame, frame->scope->key_count);
+}
+
+static int
+find_column(const crustache_columns *columns, const char *name, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < columns->column_count; ++i) {
+		const crustache_column *column = &columns->columns[i];
+
+		if (column->name_size == size && memcmp(column->name, name, size) == 0)
+			return (int)i;
+	}
+
+	return -1;
+}
+
+static void
+fetch_column(crustache_var *out, const crustache_column *column, size_t row)
+{
+	memset(out, 0x0, sizeof(crustache_var));
+
+	switch (column->type) {
+	case CRUSTACHE_COLUMN_STR:
+	case CRUSTACHE_COLUMN_SAFE_STR: {
+		const char *str = ((const char * const *)column->values)[row];
+
+		if (str != NULL) {
+			out->type = (column->type == CRUSTACHE_COLUMN_STR) ?
+				CRUSTACHE_VAR_STR : CRUSTACHE_VAR_SAFE_STR;
+			out->data = (void *)str;
+			out->size = column->sizes ? column->sizes[row] : strlen(str);
+		}
+		break;
+	}
+
+	case CRUSTACHE_COLUMN_INT64:
+		out->type = CRUSTACHE_VAR_INT64;
+		out->value.integer = ((const int64_t *)column->values)[row];
+		break;
+
+	case CRUSTACHE_COLUMN_DOUBLE:
+		out->type = CRUSTACHE_VAR_DOUBLE;
+		out->value.number = ((const double *)column->values)[row];
+		break;
+
+	case CRUSTACHE_COLUMN_BOOL:
+		if (((const unsigned char *)column->values)[row])
+			out->type = CRUSTACHE_VAR_TRUE;
+		break;
+	}
+
+	/* cells belong to the table */
+	out->flags = VAR_ALIAS;
+}
+
+static int
+fetch_not_found(
+	crustache_var *out,
+	crustache_template *template,
+	struct node_fetch *node,
+	struct stack *context)
+{
+	struct frame *bottom = context->item[0];
+
+	if (template->fail_on_not_found || bottom->strict) {
+		template->error_node = (struct node *)node;
+		return CR_ERENDER_NOT_FOUND;
+	}
+
+	memset(out, 0x0, sizeof(crustache_var));
+	return 0;
+}
+
+/*
+ * Look up a single name, through `context_find_many` if the host has it,
+ * so the hash we worked out when compiling the template is used.
+ */
+static int
+find_key(crustache_var *out, crustache_template *template, void *context, const crustache_key *key)
+{
+	memset(out, 0x0, sizeof(crustache_var));
+
+	if (template->api.context_find_many != NULL) {
+		int found = 0;
+
+		if (template->api.context_find_many(out, &found, context, key, 1) == 0)
+			return found ? 0 : -1;
+
+		memset(out, 0x0, sizeof(crustache_var));
+	}
+
+	return template->api.context_find(out, context, key->name, key->size);
+}
+
+/*
+ * Resolve the rest of a dotted name, starting from the variable we found
+ * for its first segment. Each segment is looked up straight in the one
+ * before it; the intermediate variables are freed as we go.
+ */
+static int
+fetch_path(
+	crustache_var *out,
+	crustache_template *template,
+	struct node_fetch *node,
+	const crustache_key *path, size_t path_len,
+	struct stack *context)
+{
+	size_t i;
+
+	for (i = 0; i < path_len; ++i) {
+		crustache_var parent = *out;
+		int found = 0;
+
+		if (parent.type == CRUSTACHE_VAR_CONTEXT)
+			found = (find_key(out, template, parent.data, &path[i]) == 0);
+
+		free_var(template, &parent);
+
+		if (!found)
+			return fetch_not_found(out, template, node, context);
+	}
+
+	return 0;
+}
+
+/*
+ * The implicit iterator is the innermost frame of the stack; loop
+ * variables come from the innermost list or table being rendered.
+ */
+static int
+fetch_special(
+	crustache_var *out,
+	crustache_template *template,
+	struct node_fetch *node,
+	struct stack *context)
+{
+	struct frame *frame = NULL;
+	int i;
+
+	memset(out, 0x0, sizeof(crustache_var));
+
+	if (node->kind == FETCH_IMPLICIT) {
+		frame = stack_top(context);
+
+		/* a row of a table has no value of its own */
+		if (frame->columns == NULL)
+			*out = *frame->var;
+
+		out->flags |= VAR_ALIAS;
+		return 0;
+	}
+
+	for (i = (int)context->size - 1; i >= 0; --i) {
+		frame = context->item[i];
+		if (frame->loop)
+			break;
+	}
+
+	if (i < 0)
+		return fetch_not_found(out, template, node, context);
+
+	switch (node->kind) {
+	case FETCH_INDEX:
+		out->type = CRUSTACHE_VAR_INT64;
+		out->value.integer = (int64_t)frame->index;
+		break;
+
+	case FETCH_FIRST:
+		out->type = (frame->index == 0) ? CRUSTACHE_VAR_TRUE : CRUSTACHE_VAR_FALSE;
+		break;
+
+	case FETCH_LAST:
+		out->type = frame->last ? CRUSTACHE_VAR_TRUE : CRUSTACHE_VAR_FALSE;
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Look up a variable in the context stack by its `key` and the `path`
+ * of a dotted name: the ones of `node`, or the constant copies the code
+ * generated by crustache-aot has of them.
+ */
+static int
+fetch_key(
+	crustache_var *out,
+	crustache_template *template,
+	struct node_fetch *node,
+	const crustache_key *key,
+	const crustache_key *path, size_t path_len,
+	struct stack *context)
+{
+	int i;
+
+	assert(node->base.type == CRUSTACHE_NODE_FETCH && context->size);
+
+	if (node->kind != FETCH_NAME)
+		return fetch_special(out, template, node, context);
+
+	for (i = (int)context->size - 1; i >= 0; --i) {
+		struct frame *frame = context->item[i];
+
+		if (frame->columns != NULL) {
+			int column;
+
+			/* rows of a table rendered by this very template have
+			 * their columns bound to our name slots */
+			if (frame->template == template) {
+				column = frame->binding[node->slot];
+
+				if (column == COLUMN_UNBOUND) {
+					column = find_column(frame->columns, key->name, key->size);
+					frame->binding[node->slot] = column;
+				}
+			} else {
+				column = find_column(frame->columns, key->name, key->size);
+			}
+
+			if (column >= 0) {
+				fetch_column(out, &frame->columns->columns[column], frame->index);
+				return fetch_path(out, template, node, path, path_len, context);
+			}
+
+			continue;
+		}
+
+		if (frame->var->type != CRUSTACHE_VAR_CONTEXT)
+			continue;
+
+		/* the name may have been resolved when the frame was pushed */
+		if (frame->scope != NULL && frame->template == template) {
+			int position = frame->scope->position[node->slot];
+
+			if (position >= 0) {
+				if (!frame->found[position])
+					continue;
+
+				/* the frame releases it once popped */
+				*out = frame->resolved[position];
+				out->flags |= VAR_ALIAS;
+				return fetch_path(out, template, node, path, path_len, context);
+			}
+		}
+
+		if (find_key(out, template, frame->var->data, key) == 0)
+			return fetch_path(out, template, node, path, path_len, context);
+	}
+
+	return fetch_not_found(out, template, node, context);
+}
+
+/* Look up a variable in the context stack */
+static int
+render_node_fetch(
+	crustache_var *out,
+	crustache_template *template,
+	struct node_fetch *node,
+	struct stack *context)
+{
+	crustache_key key;
+
+	key.name = node->head.ptr;
+	key.size = node->head.size;
+	key.hash = node->head_hash;
+
+	return fetch_key(out, template, node, &key, node->path, node->path_len, context);
+}
+
+static int
+render_str(
+	struct buf *ob,
+	crustache_template *template,
+	tag_mode_t print_mode,
+	const char *str, size_t size,
+	int cacheable)
+{
+	crustache_utf8_t utf8 = template->api.validate_utf8;
+	size_t org = ob->size;
+	int error = 0;
+
+	switch (print_mode) {
+	case CRUSTACHE_TAG_ESCAPE:
+		if (cacheable && template->api.escape_cache != NULL)
+			error = escape_cache_html(template->api.escape_cache, ob, str, size, utf8);
+		else if (utf8 != CRUSTACHE_UTF8_PASSTHROUGH)
+			error = houdini_escape_html_utf8(ob, str, size, utf8 == CRUSTACHE_UTF8_REPLACE);
+		else
+			houdini_escape_html(ob, str, size);
+		break;
+
+	case CRUSTACHE_TAG_UNESCAPE:
+		if (utf8 != CRUSTACHE_UTF8_PASSTHROUGH && houdini_validate_utf8(NULL, str, size, 0) < 0) {
+			struct buf *valid;
+
+			if (utf8 == CRUSTACHE_UTF8_FAIL) {
+				error = -1;
+				break;
+			}
+
+			if ((valid = bufnew(size + 16)) == NULL)
+				return CR_ENOMEM;
+
+			houdini_validate_utf8(valid, str, size, 1);
+			houdini_unescape_html(ob, valid->data, valid->size);
+			bufrelease(valid);
+		} else {
+			houdini_unescape_html(ob, str, size);
+		}
+		break;
+
+	case CRUSTACHE_TAG_RAW:
+		if (utf8 != CRUSTACHE_UTF8_PASSTHROUGH)
+			error = houdini_validate_utf8(ob, str, size, utf8 == CRUSTACHE_UTF8_REPLACE);
+		else
+			bufput(ob, str, size);
+		break;
+	}
+
+	if (error < 0) {
+		ob->size = org;
+		return CR_ERENDER_BAD_UTF8;
+	}
+
+	return 0;
+}
+
+static int
+render_filters(
+	crustache_var *out,
+	crustache_template *template,
+	struct node_tag *node,
+	crustache_var *in,
+	struct stack *context)
+{
+	struct render_state *state = render_state(context);
+	struct node_filter *filter;
+	crustache_var value = *in;
+
+	if (state->filter_scratch[0] == NULL) {
+		state->filter_scratch[0] = bufnew(64);
+		state->filter_scratch[1] = bufnew(64);
+
+		if (!state->filter_scratch[0] || !state->filter_scratch[1])
+			return CR_ENOMEM;
+	}
+
+	for (filter = node->filters; filter != NULL; filter = filter->next) {
+		struct buf *scratch = state->filter_scratch[0];
+
+		/* never write into the scratch buffer that holds our input */
+		if ((char *)value.data >= scratch->data &&
+			(char *)value.data < scratch->data + scratch->asize)
+			scratch = state->filter_scratch[1];
+
+		scratch->size = 0;
+		memset(out, 0x0, sizeof(crustache_var));
+
+		if (filter->filter(out, &value,
+			filter->args, filter->arg_count, scratch, &template->api) < 0)
+			return CR_ERENDER_FILTER;
+
+		value = *out;
+	}
+
+	*out = value;
+	return 0;
+}
+
+/* Print the value of a tag; `cacheable` strings may be escaped
+ * through the escape cache */
+static int
+render_value(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_tag *node,
+	crustache_var *value,
+	int cacheable)
+{
+	int error = 0;
+
+	switch (value->type) {
+	case CRUSTACHE_VAR_FALSE:
+		break;
+
+	case CRUSTACHE_VAR_STR:
+		error = render_str(ob, template, node->print_mode, value->data, value->size, cacheable);
+		break;
+
+	case CRUSTACHE_VAR_SAFE_STR:
+		error = render_str(ob, template, CRUSTACHE_TAG_RAW, value->data, value->size, 0);
+		break;
+
+	case CRUSTACHE_VAR_INT64:
+		bufputi64(ob, value->value.integer);
+		break;
+
+	case CRUSTACHE_VAR_DOUBLE:
+		bufputd(ob, value->value.number);
+		break;
+
+	case CRUSTACHE_VAR_TRUE:
+		BUFPUTSL(ob, "true");
+		break;
+
+	default:
+		error = CR_ERENDER_WRONG_VARTYPE;
+		break;
+	}
+
+	if (error < 0)
+		template->error_node = (struct node *)node->tag_value;
+
+	return error;
+}
+
+static int
+render_node_tag(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_tag *node,
+	struct stack *context)
+{
+	crustache_var tag_value, value;
+	int error = 0;
+
+	assert(node->base.type == CRUSTACHE_NODE_TAG);
+
+	error = render_node_fetch(
+		&tag_value,
+		template,
+		(struct node_fetch *)node->tag_value,
+		context);
+
+	if (error < 0)
+		return error;
+
+	value = tag_value;
+
+	if (node->filters != NULL) {
+		error = render_filters(&value, template, node, &tag_value, context);
+		if (error < 0) {
+			template->error_node = (struct node *)node->tag_value;
+			free_var(template, &tag_value);
+			return error;
+		}
+	}
+
+	/* filters write into scratch buffers which get reused,
+	 * so their output can't be keyed by address */
+	error = render_value(ob, template, node, &value, node->filters == NULL);
+
+	free_var(template, &tag_value);
+	return error;
+}
+
+static int
+next_batch(crustache_template *template, crustache_var *batch, size_t *count, void *iterator)
+{
+	memset(batch, 0x0, LIST_BATCH_SIZE * sizeof(crustache_var));
+	*count = 0;
+
+	if (template->api.list_next_batch(batch, LIST_BATCH_SIZE, count, iterator) < 0) {
+		*count = 0;
+		return CR_ERENDER_NOT_FOUND;
+	}
+
+	assert(*count <= LIST_BATCH_SIZE);
+	return 0;
+}
+
+/*
+ * Whether a list is empty, peeking into it if its size is unknown.
+ * The peek uses a cursor of its own, so lists of unknown size need
+ * `list_begin`: the list pointer can't be both cursors at once.
+ */
+static int
+list_is_empty(crustache_template *template, crustache_var *list)
+{
+	crustache_var first;
+	void *iterator;
+	size_t count = 0;
+	int error = 0;
+
+	if (list->size != CRUSTACHE_LIST_UNKNOWN)
+		return list->size == 0;
+
+	if (template->api.list_begin == NULL || template->api.list_next_batch == NULL)
+		return CR_ERENDER_WRONG_VARTYPE;
+
+	if (template->api.list_begin(&iterator, list->data) < 0)
+		return CR_ERENDER_NOT_FOUND;
+
+	memset(&first, 0x0, sizeof(crustache_var));
+
+	if (template->api.list_next_batch(&first, 1, &count, iterator) < 0)
+		error = CR_ERENDER_NOT_FOUND;
+	else if (count > 0)
+		free_var(template, &first);
+
+	if (template->api.list_end != NULL)
+		template->api.list_end(iterator);
+
+	return error < 0 ? error : count == 0;
+}
+
+static int
+template_new(
+	crustache_template **output,
+	crustache_api *api,
+	const char *raw_template, size_t raw_length,
+	const struct node_str *delim_open,
+	const struct node_str *delim_close);
+
+static int
+node_str_eq(const struct node_str *a, const struct node_str *b)
+{
+	return a->size == b->size && memcmp(a->ptr, b->ptr, a->size) == 0;
+}
+
+/* Look for a template compiled from `text` in the lambda cache, and
+ * mark it as in use. Called with the lock held. */
+static struct lambda_cache_entry *
+lambda_cache_find(
+	crustache_template *template,
+	struct node_section *node,
+	size_t hash,
+	const char *text, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < LAMBDA_CACHE_SIZE; ++i) {
+		struct lambda_cache_entry *e = &template->lambda_cache[i];
+
+		if (e->template != NULL && e->hash == hash &&
+			e->template->raw_content.size == size &&
+			memcmp(e->template->raw_content.ptr, text, size) == 0 &&
+			node_str_eq(&e->delim_open, &node->delim_open) &&
+			node_str_eq(&e->delim_close, &node->delim_close)) {
+			e->last_used = ++template->lambda_clock;
+			e->in_use++;
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/* An empty entry, or else the least recently used one which nobody is
+ * rendering (another thread, or a recursive partial). Called with the
+ * lock held. */
+static struct lambda_cache_entry *
+lambda_cache_victim(crustache_template *template)
+{
+	struct lambda_cache_entry *victim = NULL;
+	size_t i;
+
+	for (i = 0; i < LAMBDA_CACHE_SIZE; ++i) {
+		struct lambda_cache_entry *e = &template->lambda_cache[i];
+
+		if (e->template == NULL)
+			return e;
+
+		if (e->in_use == 0 && (victim == NULL || e->last_used < victim->last_used))
+			victim = e;
+	}
+
+	return victim;
+}
+
+/* Find the template compiled from the output of a lambda, or compile
+ * it and cache it in place of the least recently used one. `entry` is
+ * set to NULL if every entry was in use and the caller must free the
+ * result. The lock is not held while compiling. */
+static int
+lambda_template(
+	crustache_template **output,
+	struct lambda_cache_entry **entry,
+	crustache_template *template,
+	struct node_section *node,
+	const char *text, size_t size)
+{
+	struct lambda_cache_entry *found, *victim;
+	crustache_template *evicted = NULL;
+	size_t hash = hash_str(text, size);
+	crustache_api api;
+	int error;
+
+	*output = NULL;
+
+	cr_lock(&template->lambda_lock);
+	*entry = lambda_cache_find(template, node, hash, text, size);
+	cr_unlock(&template->lambda_lock);
+
+	if (*entry != NULL) {
+		*output = (*entry)->template;
+		return 0;
+	}
+
+	/* the output is printed wherever the section is, and we can't
+	 * know the HTML state there, so it is never minified */
+	api = template->api;
+	api.minify_html = 0;
+
+	error = template_new(output, &api, text, size,
+		&node->delim_open, &node->delim_close);
+
+	if (error < 0) {
+		crustache_free(*output);
+		*output = NULL;
+		return error;
+	}
+
+	cr_lock(&template->lambda_lock);
+
+	/* another thread may have compiled the same text meanwhile */
+	found = lambda_cache_find(template, node, hash, text, size);
+	victim = found ? NULL : lambda_cache_victim(template);
+
+	if (victim != NULL) {
+		evicted = victim->template;
+
+		victim->hash = hash;
+		victim->delim_open = node->delim_open;
+		victim->delim_close = node->delim_close;
+		victim->template = *output;
+		victim->last_used = ++template->lambda_clock;
+		victim->in_use = 1;
+	}
+
+	cr_unlock(&template->lambda_lock);
+
+	crustache_free(evicted);
+
+	if (found != NULL) {
+		crustache_free(*output);
+		*output = found->template;
+	}
+
+	*entry = found ? found : victim;
+	return 0;
+}
+
+/* Render the output of a lambda as a template, against the current
+ * context stack */
+static int
+render_lambda(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
+	crustache_var *output,
+	struct stack *context,
+	int depth)
+{
+	struct lambda_cache_entry *entry;
+	crustache_template *compiled;
+	int error;
+
+	error = lambda_template(&compiled, &entry, template, node, output->data, output->size);
+
+	if (error == 0)
+		error = render_node(ob, compiled, &compiled->root, context, depth);
+
+	if (error < 0)
+		template->error_node = (struct node *)node;
+
+	if (entry != NULL) {
+		cr_lock(&template->lambda_lock);
+		entry->in_use--;
+		cr_unlock(&template->lambda_lock);
+	} else {
+		crustache_free(compiled);
+	}
+
+	return error;
+}
+
+static int
+render_lambda_section(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
+	crustache_var *lambda,
+	struct stack *context,
+	int depth)
+{
+	crustache_section section;
+
+	section.template = template;
+	section.node = node;
+	section.context = context;
+	section.depth = depth;
+	section.error = 0;
+
+	if (template->api.lambda_section(ob, lambda->data, &section) < 0) {
+		template->error_node = (struct node *)node;
+		return section.error < 0 ? section.error : CR_ERENDER_NOT_FOUND;
+	}
+
+	return 0;
+}
+
+/*
+ * Rendering a section is split in steps, so the code generated by
+ * crustache-aot can run the loop itself: section_begin decides whether
+ * the content has to be rendered and pushes the first context for it,
+ * and section_next moves to the next one after each pass. Both return
+ * 1 while there is content to render, 0 once the section is done (and
+ * cleaned up), or an error. section_end cleans up a section abandoned
+ * halfway through.
+ */
+enum {
+	LOOP_ONCE,	/* render the content once, as it is */
+	LOOP_CONTEXT,	/* once, with the value pushed */
+	LOOP_LIST,	/* once per element, through `list_get` */
+	LOOP_BATCHED,	/* once per element, through `list_next_batch` */
+	LOOP_COLUMNS	/* once per row of a table */
+};
+
+struct section_loop {
+	crustache_template *template;
+	struct node_section *node;
+	struct stack *context;
+	int open;
+	int kind;
+
+	/* the value of the section's name */
+	crustache_var value;
+
+	/* the frame pushed for each pass, if any */
+	struct frame frame;
+	int pushed;
+	size_t index;
+
+	/* LOOP_LIST: the current element */
+	crustache_var item;
+
+	/* LOOP_BATCHED: the batch being rendered, and the one fetched
+	 * ahead of it so we can tell which element is the last */
+	void *iterator;
+	crustache_var *batches[2];
+	size_t count[2];
+	size_t pos;
+	int cur;
+
+	/* LOOP_COLUMNS: the column index for each name slot */
+	int local_binding[COLUMN_BINDING_SIZE];
+	int *binding;
+};
+
+static void
+section_end(struct section_loop *loop)
+{
+	crustache_template *template = loop->template;
+	size_t i;
+
+	if (!loop->open)
+		return;
+
+	loop->open = 0;
+
+	if (loop->pushed) {
+		if (loop->kind == LOOP_COLUMNS)
+			stack_pop(loop->context);
+		else
+			frame_pop(loop->context, template);
+	}
+
+	switch (loop->kind) {
+	case LOOP_LIST:
+		if (loop->pushed)
+			free_var(template, &loop->item);
+		break;
+
+	case LOOP_BATCHED:
+		for (i = loop->pos; i < loop->count[loop->cur]; ++i)
+			free_var(template, &loop->batches[loop->cur][i]);
+
+		for (i = 0; i < loop->count[!loop->cur]; ++i)
+			free_var(template, &loop->batches[!loop->cur][i]);
+
+		if (template->api.list_end != NULL)
+			template->api.list_end(loop->iterator);
+
+		free(loop->batches[0]);
+		break;
+
+	case LOOP_COLUMNS:
+		if (loop->binding != loop->local_binding)
+			free(loop->binding);
+		break;
+	}
+
+	loop->pushed = 0;
+	free_var(template, &loop->value);
+}
+
+/* Fetch the batch after the current one into the other buffer */
+static int
+section_fetch_ahead(struct section_loop *loop)
+{
+	int next = !loop->cur;
+	int error = next_batch(loop->template, loop->batches[next], &loop->count[next], loop->iterator);
+
+	if (error < 0) {
+		section_end(loop);
+		return error;
+	}
+
+	return 0;
+}
+
+/* Push the frame for the element at `index` of a list or a table */
+static int
+section_push(struct section_loop *loop)
+{
+	crustache_template *template = loop->template;
+	struct frame *frame = &loop->frame;
+
+	switch (loop->kind) {
+	case LOOP_COLUMNS:
+		frame->index = loop->index;
+		frame->last = (loop->index + 1 == loop->value.size);
+
+		if (!loop->pushed)
+			stack_push(loop->context, frame);
+		break;
+
+	case LOOP_LIST:
+		memset(&loop->item, 0x0, sizeof(crustache_var));
+
+		if (template->api.list_get(&loop->item, loop->value.data, loop->index) < 0) {
+			section_end(loop);
+			return CR_ERENDER_NOT_FOUND;
+		}
+
+		frame_init(frame, &loop->item);
+		frame->loop = 1;
+		frame->index = loop->index;
+		frame->last = (loop->index + 1 == loop->value.size);
+		frame_push(loop->context, template, frame, &loop->node->scope);
+		break;
+
+	case LOOP_BATCHED:
+		frame_init(frame, &loop->batches[loop->cur][loop->pos]);
+		frame->loop = 1;
+		frame->index = loop->index;
+		frame->last = (loop->pos + 1 == loop->count[loop->cur] && loop->count[!loop->cur] == 0);
+		frame_push(loop->context, template, frame, &loop->node->scope);
+		break;
+	}
+
+	loop->pushed = 1;
+	return 1;
+}
+
+static int
+section_begin_list(struct section_loop *loop)
+{
+	crustache_template *template = loop->template;
+
+	/* see list_is_empty() */
+	if (loop->value.size == CRUSTACHE_LIST_UNKNOWN &&
+		(template->api.list_begin == NULL || template->api.list_next_batch == NULL)) {
+		template->error_node = loop->node->section_key;
+		section_end(loop);
+		return CR_ERENDER_WRONG_VARTYPE;
+	}
+
+	if (template->api.list_next_batch == NULL) {
+		if (loop->value.size == 0) {
+			section_end(loop);
+			return 0;
+		}
+
+		loop->kind = LOOP_LIST;
+		return section_push(loop);
+	}
+
+	loop->iterator = loop->value.data;
+
+	if (template->api.list_begin != NULL &&
+		template->api.list_begin(&loop->iterator, loop->value.data) < 0) {
+		section_end(loop);
+		return CR_ERENDER_NOT_FOUND;
+	}
+
+	loop->kind = LOOP_BATCHED;
+	loop->count[0] = loop->count[1] = 0;
+	loop->pos = 0;
+	loop->cur = 0;
+	loop->batches[0] = malloc(2 * LIST_BATCH_SIZE * sizeof(crustache_var));
+
+	if (loop->batches[0] == NULL) {
+		section_end(loop);
+		return CR_ENOMEM;
+	}
+
+	loop->batches[1] = loop->batches[0] + LIST_BATCH_SIZE;
+
+	/* fetch the first batch as if it was the one ahead */
+	loop->cur = 1;
+	if (section_fetch_ahead(loop) < 0)
+		return CR_ERENDER_NOT_FOUND;
+
+	loop->cur = 0;
+	if (loop->count[0] == 0) {
+		section_end(loop);
+		return 0;
+	}
+
+	if (section_fetch_ahead(loop) < 0)
+		return CR_ERENDER_NOT_FOUND;
+
+	return section_push(loop);
+}
+
+/*
+ * The names used in a section over a table are bound to column indexes
+ * once, so every cell is then a plain array read with no calls into the
+ * host.
+ */
+static int
+section_begin_columns(struct section_loop *loop)
+{
+	crustache_template *template = loop->template;
+	struct node_section *node = loop->node;
+	const crustache_columns *table = loop->value.data;
+	size_t i;
+
+	if (loop->value.size == 0) {
+		section_end(loop);
+		return 0;
+	}
+
+	loop->kind = LOOP_COLUMNS;
+	loop->binding = loop->local_binding;
+
+	if (template->name_count > COLUMN_BINDING_SIZE) {
+		loop->binding = malloc(template->name_count * sizeof(int));
+		if (loop->binding == NULL) {
+			loop->binding = loop->local_binding;
+			section_end(loop);
+			return CR_ENOMEM;
+		}
+	}
+
+	for (i = 0; i < template->name_count; ++i)
+		loop->binding[i] = COLUMN_UNBOUND;
+
+	for (i = 0; i < node->scope.slot_count; ++i) {
+		size_t slot = node->scope.slots[i];
+		struct node_fetch *fetch = template->names[slot];
+		loop->binding[slot] = find_column(table, fetch->head.ptr, fetch->head.size);
+	}
+
+	frame_init(&loop->frame, &loop->value);
+	loop->frame.columns = table;
+	loop->frame.binding = loop->binding;
+	loop->frame.template = template;
+	loop->frame.loop = 1;
+
+	return section_push(loop);
+}
+
+static int
+section_lambda(
+	struct section_loop *loop,
+	struct buf *ob,
+	int depth)
+{
+	crustache_template *template = loop->template;
+	struct node_section *node = loop->node;
+	crustache_var lambda_result;
+	int result;
+
+	memset(&lambda_result, 0x0, sizeof(crustache_var));
+	render_state(loop->context)->lambda_calls++;
+
+	if (template->api.lambda_section != NULL) {
+		result = render_lambda_section(ob, template, node, &loop->value, loop->context, depth);
+	} else if (template->api.lambda(&lambda_result, loop->value.data,
+		node->raw_content.ptr, node->raw_content.size) < 0) {
+		result = CR_ERENDER_NOT_FOUND;
+		template->error_node = (struct node *)node;
+	} else if (lambda_result.type == CRUSTACHE_VAR_STR) {
+		result = render_lambda(ob, template, node, &lambda_result, loop->context, depth);
+	} else if (lambda_result.type == CRUSTACHE_VAR_SAFE_STR) {
+		bufput(ob, lambda_result.data, lambda_result.size);
+		result = 0;
+	} else {
+		result = CR_ERENDER_WRONG_VARTYPE;
+		template->error_node = (struct node *)node;
+	}
+
+	free_var(template, &lambda_result);
+	section_end(loop);
+	return result;
+}
+
+/*
+ * Start rendering a section whose name has been looked up into `value`,
+ * which the loop now owns. Lambdas are rendered right away.
+ */
+static int
+section_begin(
+	struct section_loop *loop,
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
+	crustache_var *value,
+	struct stack *context,
+	int depth)
+{
+	loop->template = template;
+	loop->node = node;
+	loop->context = context;
+	loop->open = 1;
+	loop->kind = LOOP_ONCE;
+	loop->value = *value;
+	loop->pushed = 0;
+	loop->index = 0;
+
+	if (node->inverted) {
+		int empty = value->type == CRUSTACHE_VAR_FALSE ||
+			(value->type == CRUSTACHE_VAR_COLUMNS && value->size == 0);
+
+		if (value->type == CRUSTACHE_VAR_LIST)
+			empty = list_is_empty(template, value);
+
+		if (empty < 0)
+			template->error_node = node->section_key;
+
+		if (empty <= 0)
+			section_end(loop);
+
+		return empty;
+	}
+
+	switch (value->type) {
+	case CRUSTACHE_VAR_FALSE:
+		section_end(loop);
+		return 0;
+
+	case CRUSTACHE_VAR_TRUE:
+		return 1;
+
+	case CRUSTACHE_VAR_CONTEXT:
+		loop->kind = LOOP_CONTEXT;
+		frame_init(&loop->frame, &loop->value);
+		frame_push(context, template, &loop->frame, &node->scope);
+		loop->pushed = 1;
+		return 1;
+
+	case CRUSTACHE_VAR_COLUMNS:
+		return section_begin_columns(loop);
+
+	case CRUSTACHE_VAR_LIST:
+		return section_begin_list(loop);
+
+	case CRUSTACHE_VAR_LAMBDA:
+		return section_lambda(loop, ob, depth);
+
+	default:
+		template->error_node = node->section_key;
+		section_end(loop);
+		return CR_ERENDER_WRONG_VARTYPE;
+	}
+}
+
+static int
+section_next(struct section_loop *loop)
+{
+	crustache_template *template = loop->template;
+
+	switch (loop->kind) {
+	case LOOP_LIST:
+		frame_pop(loop->context, template);
+		free_var(template, &loop->item);
+		loop->pushed = 0;
+
+		if (++loop->index < loop->value.size)
+			return section_push(loop);
+		break;
+
+	case LOOP_BATCHED:
+		frame_pop(loop->context, template);
+		free_var(template, &loop->batches[loop->cur][loop->pos]);
+		loop->pushed = 0;
+		loop->index++;
+
+		if (++loop->pos < loop->count[loop->cur])
+			return section_push(loop);
+
+		/* the batch we fetched ahead becomes the current one */
+		loop->cur = !loop->cur;
+		loop->count[!loop->cur] = 0;
+		loop->pos = 0;
+
+		if (loop->count[loop->cur] == 0)
+			break;
+
+		if (section_fetch_ahead(loop) < 0)
+			return CR_ERENDER_NOT_FOUND;
+
+		return section_push(loop);
+
+	case LOOP_COLUMNS:
+		if (++loop->index < loop->value.size)
+			return section_push(loop);
+		break;
+	}
+
+	section_end(loop);
+	return 0;
+}
+
+static int
+render_section(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
+	struct stack *context,
+	int depth)
+{
+	struct section_loop loop;
+	crustache_var value;
+	int result;
+
+	assert(node->base.type == CRUSTACHE_NODE_SECTION);
+
+	result = render_node_fetch(&value, template, (struct node_fetch *)node->section_key, context);
+	if (result < 0)
+		return result;
+
+	result = section_begin(&loop, ob, template, node, &value, context, depth);
+
+	while (result > 0) {
+		result = render_content(ob, template, node, context, depth);
+
+		if (result < 0)
+			section_end(&loop);
+		else
+			result = section_next(&loop);
+	}
+
+	return result;
+}
+
+/*
+ * Serve a section from the fragment cache if the host gives us a key
+ * for it, skipping the section and all its callbacks. The key is
+ * prefixed with the name of the section, a hash of its text and the
+ * id of the template, as the same text may render differently with
+ * another template's options.
+ *
+ * Returns 1 if the section was served from the cache. Otherwise, `key`
+ * is set to the key to store the output of the section with, if any.
+ */
+static int
+fragment_get(
+	struct buf **output,
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
+	struct stack *context,
+	int depth)
+{
+	struct node_fetch *name = (struct node_fetch *)node->section_key;
+	crustache_section section;
+	struct buf *key;
+	int result;
+
+	*output = NULL;
+
+	if (template->api.fragment_cache == NULL || template->api.cache_key == NULL || node->inverted)
+		return 0;
+
+	key = bufnew(64);
+	if (key == NULL)
+		return CR_ENOMEM;
+
+	bufput(key, name->var.ptr, name->var.size);
+	bufputc(key, '\0');
+	bufput(key, &node->content_hash, sizeof(node->content_hash));
+	bufput(key, &template->fragment_id, sizeof(template->fragment_id));
+
+	section.template = template;
+	section.node = node;
+	section.context = context;
+	section.depth = depth;
+	section.error = 0;
+
+	result = template->api.cache_key(key, name->var.ptr, name->var.size, &section);
+
+	if (result < 0) {
+		template->error_node = (struct node *)node;
+		bufrelease(key);
+		return CR_ERENDER_NOT_FOUND;
+	}
+
+	if (result > 0 && fragment_cache_get(template->api.fragment_cache, ob, key->data, key->size) == 0) {
+		bufrelease(key);
+		return 1;
+	}
+
+	if (result > 0)
+		*output = key;
+	else
+		bufrelease(key);
+
+	return 0;
+}
+
+/* Store the output of a section rendered from `start`, if it has a key */
+static void
+fragment_put(
+	struct buf *ob,
+	crustache_template *template,
+	struct buf *key,
+	size_t start,
+	int result)
+{
+	if (key == NULL)
+		return;
+
+	if (result == 0)
+		fragment_cache_put(template->api.fragment_cache,
+			key->data, key->size, ob->data + start, ob->size - start);
+
+	bufrelease(key);
+}
+
+static int
+render_node_section(
+	struct buf *ob,
+	crustache_template *template,
+	struct node_section *node,
+	struct stack *context,
+	int depth)
+{
+	struct buf *key;
+	size_t start = ob->size;
+	int result;
+
+	result = fragment_get(&key, ob, template, node, context, depth);
+	if (result != 0)
+		return result < 0 ? result : 0;
+
+	result = render_section(ob, template, node, context, depth);
+	fragment_put(ob, template, key, start, result);
+	return result;
+}
+
+/* Render a single node, without its siblings */
+static int
+render_one(
+	struct buf *ob,
+	crustache_template *template,
+	struct node *node,
+	struct stack *context,
+	int depth)
+{
+	switch (node->type) {
+	case CRUSTACHE_NODE_MULTIROOT:
+		break;
+
+	case CRUSTACHE_NODE_STATIC:
+		render_node_static(ob, (struct node_static *)node);
+		break;
+
+	case CRUSTACHE_NODE_TAG:
+		return render_node_tag(ob, template, (struct node_tag *)node, context);
+
+	case CRUSTACHE_NODE_SECTION:
+		return render_node_section(ob, template, (struct node_section *)node, context, depth + 1);
+
+	case CRUSTACHE_NODE_PARTIAL:
+		return render_node_partial(ob, template, (struct node_partial *)node, context, depth + 1);
+	}
+
+	return 0;
+}
+
+static int
+render_node(
+	struct buf *ob,
+	crustache_template *template,
+	struct node *node,
+	struct stack *context,
+	int depth)
+{
+	int result = 0;
+	size_t context_size;
+
+	struct frame *frame;
+
+	if (depth >= MAX_RENDER_RECURSION) {
+		template->error_node = node;
+		return CR_ERENDER_TOO_DEEP;
+	}
+
+	frame = stack_top(context);
+	if (frame == NULL) {
+		template->error_node = node;
+		return CR_ERENDER_INVALID_CONTEXT;
+	}
+
+	context_size = context->size;
+
+	while (result == 0 && node != NULL) {
+		result = render_one(ob, template, node, context, depth);
+		node = node->next;
+	}
+
+	/* the stack should come out as it came in */
+	assert(context->size == context_size);
+	return result;
+}
+
+int
+crustache_render(struct buf *ob, crustache_template *template, crustache_var *context)
+{
+	return crustache_render_layers(ob, template, context, 1);
+}
+
+int
+crustache_render_layers(
+	struct buf *ob,
+	crustache_template *template,
+	crustache_var *contexts,
+	size_t context_count)
+{
+	int error;
+	struct stack context_stack;
+	struct render_state state;
+	struct arena_mark arena_start;
+	struct frame local_layers[LOCAL_LAYERS];
+	struct frame *layers = local_layers;
+	struct frame static_frame;
+	size_t i;
+
+	if (context_count == 0) {
+		template->error_node = &template->root;
+		return CR_ERENDER_INVALID_CONTEXT;
+	}
+
+	for (i = 0; i < context_count; ++i) {
+		if (contexts[i].type != CRUSTACHE_VAR_CONTEXT) {
+			template->error_node = &template->root;
+			return CR_ERENDER_INVALID_CONTEXT;
+		}
+	}
+
+	if (context_count > LOCAL_LAYERS) {
+		layers = malloc(context_count * sizeof(struct frame));
+		if (layers == NULL)
+			return CR_ENOMEM;
+	}
+
+	/* whatever the callbacks allocate from the arena only lives
+	 * until we are done; we rewind instead of resetting it, in case
+	 * we are being rendered from inside another render */
+	if (template->api.arena != NULL)
+		arena_mark(template->api.arena, &arena_start);
+
+	stack_init(&context_stack, DEFAULT_STACK_SIZE + context_count + 1);
+
+	/* a specialized template looks at its static context last */
+	if (template->has_static_context) {
+		frame_init(&static_frame, &template->static_context);
+		frame_push(&context_stack, template, &static_frame, &NO_SCOPE);
+	}
+
+	/* the first layer takes precedence, so it goes on top */
+	for (i = context_count; i > 0; --i) {
+		frame_init(&layers[i - 1], &contexts[i - 1]);
+		frame_push(&context_stack, template, &layers[i - 1], &template->root_scope);
+	}
+
+	render_state_init(&state, &context_stack);
+	error = render_root(ob, template, &context_stack, 0);
+	render_state_free(&state);
+
+	for (i = 0; i < context_count; ++i)
+		frame_pop(&context_stack, template);
+
+	if (template->has_static_context)
+		frame_pop(&context_stack, template);
+
+	stack_free(&context_stack);
+
+	if (template->api.arena != NULL)
+		arena_rewind(template->api.arena, &arena_start);
+
+	if (layers != local_layers)
+		free(layers);
+
+	return error;
+}
+
+/*
+ * Render the body of a section from its `lambda_section` callback, with
+ * `context` (if any) pushed on top of the stack the section sees.
+ */
+int
+crustache_render_section(struct buf *ob, crustache_section *section, crustache_var *context)
+{
+	crustache_template *template = section->template;
+	struct node_section *node = section->node;
+	struct frame frame;
+	int error;
+
+	if (context != NULL) {
+		frame_init(&frame, context);
+		frame_push(section->context, template, &frame, &node->scope);
+	}
+
+	error = render_content(ob, template, node, section->context, section->depth);
+
+	if (context != NULL)
+		frame_pop(section->context, template);
+
+	if (error < 0)
+		section->error = error;
+
+	return error;
+}
+
+const char *
+crustache_section_text(crustache_section *section, size_t *size)
+{
+	*size = section->node->raw_content.size;
+	return section->node->raw_content.ptr;
+}
+
+/*
+ * Look up a name in the context stack of a section, like a tag in the
+ * section would: a dotted name is split, and each segment after the
+ * first one is looked up straight in the variable before it.
+ */
+int
+crustache_section_find(crustache_var *var, crustache_section *section, const char *name, size_t name_size)
+{
+	crustache_template *template = section->template;
+	struct stack *context = section->context;
+	const char *end = name + name_size;
+	const char *dot = memchr(name, '.', name_size);
+	crustache_key key;
+	int i, found = 0;
+
+	key.name = name;
+	key.size = dot ? (size_t)(dot - name) : name_size;
+	key.hash = hash_str(key.name, key.size);
+
+	for (i = (int)context->size - 1; i >= 0 && !found; --i) {
+		struct frame *frame = context->item[i];
+
+		if (frame->columns != NULL) {
+			int column = find_column(frame->columns, key.name, key.size);
+
+			if (column >= 0) {
+				fetch_column(var, &frame->columns->columns[column], frame->index);
+				found = 1;
+			}
+
+			continue;
+		}
+
+		if (frame->var->type == CRUSTACHE_VAR_CONTEXT)
+			found = (find_key(var, template, frame->var->data, &key) == 0);
+	}
+
+	if (!found)
+		return -1;
+
+	while (dot != NULL) {
+		crustache_var parent = *var;
+
+		key.name = dot + 1;
+		dot = memchr(key.name, '.', end - key.name);
+		key.size = (dot ? dot : end) - key.name;
+		key.hash = hash_str(key.name, key.size);
+
+		found = (parent.type == CRUSTACHE_VAR_CONTEXT &&
+			find_key(var, template, parent.data, &key) == 0);
+
+		free_var(template, &parent);
+
+		if (!found)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+key_matches(const struct node_str *name, const crustache_key *keys, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; ++i) {
+		if (keys[i].size == name->size && memcmp(keys[i].name, name->ptr, name->size) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Whether rendering `node` may read any of the top-level `keys`. Every
+ * name is matched by its first segment, wherever it is in the subtree;
+ * that's conservative, as names inside a section may come from its own
+ * value instead. Partials can read anything.
+ */
+static int
+node_depends(struct node *node, const crustache_key *keys, size_t count, int top)
+{
+	struct node_fetch *fetch;
+
+	switch (node->type) {
+	case CRUSTACHE_NODE_TAG:
+		fetch = (struct node_fetch *)((struct node_tag *)node)->tag_value;
+		break;
+
+	case CRUSTACHE_NODE_SECTION: {
+		struct node *child;
+
+		fetch = (struct node_fetch *)((struct node_section *)node)->section_key;
+
+		for (child = ((struct node_section *)node)->content; child != NULL; child = child->next) {
+			if (node_depends(child, keys, count, 0))
+				return 1;
+		}
+		break;
+	}
+
+	case CRUSTACHE_NODE_PARTIAL:
+		return 1;
+
+	default:
+		return 0;
+	}
+
+	switch (fetch->kind) {
+	case FETCH_NAME:
+		return key_matches(&fetch->head, keys, count);
+
+	case FETCH_IMPLICIT:
+		/* {{.}} at the top is the whole context */
+		return top;
+
+	default:
+		return 0;
+	}
+}
+
+static void
+add_change(crustache_result *result, size_t old_start, size_t old_size, size_t new_start, size_t new_size)
+{
+	crustache_change *last = result->change_count ?
+		&result->changes[result->change_count - 1] : NULL;
+
+	/* merge with the previous change if they touch */
+	if (last != NULL &&
+		last->old_start + last->old_size == old_start &&
+		last->new_start + last->new_size == new_start) {
+		last->old_size += old_size;
+		last->new_size += new_size;
+		return;
+	}
+
+	last = &result->changes[result->change_count++];
+	last->old_start = old_start;
+	last->old_size = old_size;
+	last->new_start = new_start;
+	last->new_size = new_size;
+}
+
+/*
+ * Render the segments which depend on `keys` (or all of them) into a
+ * new output, copying the rest from the previous one. The result is
+ * left untouched if the render fails.
+ */
+static int
+render_segments(crustache_result *result, const crustache_key *keys, size_t count, int all)
+{
+	crustache_template *template = result->template;
+	struct buf *old = result->output;
+	struct buf *out;
+	struct result_segment *segments;
+	struct stack context_stack;
+	struct render_state state;
+	struct arena_mark arena_start;
+	struct frame root, static_frame;
+	size_t i;
+	int error = 0;
+
+	out = bufnew(old ? old->size + 64 : 1024);
+	segments = malloc(result->segment_count * sizeof(struct result_segment) + 1);
+
+	if (out == NULL || segments == NULL) {
+		bufrelease(out);
+		free(segments);
+		return CR_ENOMEM;
+	}
+
+	memcpy(segments, result->segments, result->segment_count * sizeof(struct result_segment));
+	result->change_count = 0;
+
+	if (template->api.arena != NULL)
+		arena_mark(template->api.arena, &arena_start);
+
+	stack_init(&context_stack, DEFAULT_STACK_SIZE);
+
+	if (template->has_static_context) {
+		frame_init(&static_frame, &template->static_context);
+		frame_push(&context_stack, template, &static_frame, &NO_SCOPE);
+	}
+
+	frame_init(&root, &result->context);
+	frame_push(&context_stack, template, &root, &template->root_scope);
+	render_state_init(&state, &context_stack);
+
+	for (i = 0; error == 0 && i < result->segment_count; ++i) {
+		struct result_segment *seg = &segments[i];
+		size_t start = out->size;
+
+		if (all || seg->any_key || node_depends(seg->node, keys, count, 1)) {
+			unsigned long calls = state.lambda_calls;
+
+			error = render_one(out, template, seg->node, &context_stack, 0);
+			seg->any_key = (state.lambda_calls != calls);
+
+			if (!all && (out->size - start != seg->size ||
+				memcmp(out->data + start, old->data + seg->start, seg->size) != 0))
+				add_change(result, seg->start, seg->size, start, out->size - start);
+		} else {
+			bufput(out, old->data + seg->start, seg->size);
+		}
+
+		seg->start = start;
+		seg->size = out->size - start;
+	}
+
+	render_state_free(&state);
+	frame_pop(&context_stack, template);
+
+	if (template->has_static_context)
+		frame_pop(&context_stack, template);
+
+	stack_free(&context_stack);
+
+	if (template->api.arena != NULL)
+		arena_rewind(template->api.arena, &arena_start);
+
+	if (error < 0) {
+		result->change_count = 0;
+		bufrelease(out);
+		free(segments);
+		return error;
+	}
+
+	bufrelease(old);
+	free(result->segments);
+	result->output = out;
+	result->segments = segments;
+	return 0;
+}
+
+/*
+ * Render a template and keep track of which output bytes came from which
+ * top-level node, so it can be rendered again with crustache_rerender
+ * once some keys of `context` have changed. The context must stay alive
+ * (and be updated in place) as long as the result is used.
+ */
+int
+crustache_render_tracked(crustache_result **output, crustache_template *template, crustache_var *context)
+{
+	crustache_result *result;
+	struct node *node;
+	size_t count = 0;
+	int error;
+
+	*output = NULL;
+
+	if (context->type != CRUSTACHE_VAR_CONTEXT) {
+		template->error_node = &template->root;
+		return CR_ERENDER_INVALID_CONTEXT;
+	}
+
+	result = malloc(sizeof(crustache_result));
+	if (result == NULL)
+		return CR_ENOMEM;
+
+	memset(result, 0x0, sizeof(crustache_result));
+	result->template = template;
+	result->context = *context;
+
+	for (node = template->root.next; node != NULL; node = node->next)
+		count++;
+
+	result->segments = calloc(count + 1, sizeof(struct result_segment));
+	result->changes = calloc(count + 1, sizeof(crustache_change));
+
+	if (result->segments == NULL || result->changes == NULL) {
+		crustache_result_free(result);
+		return CR_ENOMEM;
+	}
+
+	for (node = template->root.next; node != NULL; node = node->next)
+		result->segments[result->segment_count++].node = node;
+
+	error = render_segments(result, NULL, 0, 1);
+	if (error < 0) {
+		crustache_result_free(result);
+		return error;
+	}
+
+	*output = result;
+	return 0;
+}
+
+/* Render again the parts of a tracked render which depend on `changed` */
+int
+crustache_rerender(crustache_result *result, const crustache_key *changed, size_t count)
+{
+	return render_segments(result, changed, count, 0);
+}
+
+const char *
+crustache_result_output(crustache_result *result, size_t *size)
+{
+	*size = result->output->size;
+	return result->output->data;
+}
+
+const crustache_change *
+crustache_result_changes(crustache_result *result, size_t *count)
+{
+	*count = result->change_count;
+	return result->changes;
+}
+
+void
+crustache_result_free(crustache_result *result)
+{
+	if (!result)
+		return;
+
+	bufrelease(result->output);
+	free(result->segments);
+	free(result->changes);
+	free(result);
+}
+
+/* Whether rendering `node` prints nothing right next to its neighbours */
+static int
+node_is_silent(struct node *node)
+{
+	return node == NULL ||
+		node->type == CRUSTACHE_NODE_MULTIROOT ||
+		node->type == CRUSTACHE_NODE_STATIC ||
+		node->type == CRUSTACHE_NODE_SECTION;
+}
+
+static void
+minify_nodes(crustache_template *template, struct node *node, struct minify_state *state)
+{
+	struct node *prev = NULL;
+
+	for (; node != NULL; prev = node, node = node->next) {
+		switch (node->type) {
+		case CRUSTACHE_NODE_STATIC: {
+			struct node_static *stnode = (struct node_static *)node;
+			struct buf *content = template->static_content;
+			size_t start = content->size;
+
+			minify_html(content, state, stnode->str.ptr, stnode->str.size,
+				node_is_silent(prev), node_is_silent(node->next));
+
+			/* minified text is never larger than the original, so
+			 * `content` never gets reallocated under our feet */
+			assert(content->size <= template->raw_content.size);
+
+			stnode->str.ptr = content->data + start;
+			stnode->str.size = content->size - start;
+			break;
+		}
+
+		case CRUSTACHE_NODE_SECTION:
+			minify_nodes(template, ((struct node_section *)node)->content, state);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * Rewrite the static text of the template with its whitespace
+ * collapsed. The minified text is stored separately, so the raw
+ * content (which lambdas see) stays untouched.
+ */
+static int
+minify_template(crustache_template *template)
+{
+	struct minify_state state;
+
+	if (template->raw_content.size == 0)
+		return 0;
+
+	template->static_content = bufnew(64);
+	if (template->static_content == NULL ||
+		bufgrow(template->static_content, template->raw_content.size) < 0)
+		return CR_ENOMEM;
+
+	memset(&state, 0x0, sizeof(state));
+	minify_nodes(template, template->root.next, &state);
+	return 0;
+}
+
+/* Give each variable name in the template a slot number */
+static int
+intern_name(crustache_template *template, struct node_fetch *fetch)
+{
+	size_t i;
+
+	for (i = 0; i < template->name_count; ++i) {
+		struct node_str *name = &template->names[i]->var;
+
+		if (name->size == fetch->var.size && memcmp(name->ptr, fetch->var.ptr, name->size) == 0) {
+			fetch->slot = i;
+			return 0;
+		}
+	}
+
+	if (template->name_count % 16 == 0) {
+		struct node_fetch **names = realloc(template->names,
+			(template->name_count + 16) * sizeof(struct node_fetch *));
+
+		if (names == NULL)
+			return CR_ENOMEM;
+
+		template->names = names;
+	}
+
+	template->names[template->name_count] = fetch;
+	fetch->slot = template->name_count++;
+	return 0;
+}
+
+static int
+intern_names(crustache_template *template, struct node *node)
+{
+	int error = 0;
+
+	for (; error == 0 && node != NULL; node = node->next) {
+		switch (node->type) {
+		case CRUSTACHE_NODE_TAG:
+			error = intern_name(template,
+				(struct node_fetch *)((struct node_tag *)node)->tag_value);
+			break;
+
+		case CRUSTACHE_NODE_SECTION: {
+			struct node_section *section = (struct node_section *)node;
+
+			error = intern_name(template, (struct node_fetch *)section->section_key);
+			if (error == 0)
+				error = intern_names(template, section->content);
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	return error;
+}
+
+static void
+collect_slots(struct node *node, unsigned char *seen, size_t *slots, size_t *count)
+{
+	for (; node != NULL; node = node->next) {
+		struct node_fetch *fetch;
+
+		switch (node->type) {
+		case CRUSTACHE_NODE_TAG:
+			fetch = (struct node_fetch *)((struct node_tag *)node)->tag_value;
+			break;
+
+		case CRUSTACHE_NODE_SECTION:
+			fetch = (struct node_fetch *)((struct node_section *)node)->section_key;
+			collect_slots(((struct node_section *)node)->content, seen, slots, count);
+			break;
+
+		default:
+			continue;
+		}
+
+		if (!seen[fetch->slot]) {
+			seen[fetch->slot] = 1;
+			slots[(*count)++] = fetch->slot;
+		}
+	}
+}
+
+/* Gather the distinct keys to look up for a scope in one go. Dotted
+ * names only need their first segment resolved. */
+static int
+bind_scope_keys(crustache_template *template, struct scope *scope)
+{
+	size_t i, k;
+
+	scope->keys = malloc(scope->slot_count * sizeof(crustache_key) + 1);
+	scope->position = malloc(template->name_count * sizeof(int));
+
+	if (scope->keys == NULL || scope->position == NULL)
+		return CR_ENOMEM;
+
+	for (i = 0; i < template->name_count; ++i)
+		scope->position[i] = -1;
+
+	for (i = 0; i < scope->slot_count; ++i) {
+		struct node_fetch *fetch = template->names[scope->slots[i]];
+
+		if (fetch->kind != FETCH_NAME)
+			continue;
+
+		for (k = 0; k < scope->key_count; ++k) {
+			if (scope->keys[k].size == fetch->head.size &&
+				memcmp(scope->keys[k].name, fetch->head.ptr, fetch->head.size) == 0)
+				break;
+		}
+
+		if (k == scope->key_count) {
+			scope->keys[k].name = fetch->head.ptr;
+			scope->keys[k].size = fetch->head.size;
+			scope->keys[k].hash = fetch->head_hash;
+			scope->key_count++;
+		}
+
+		scope->position[scope->slots[i]] = (int)k;
+	}
+
+	return 0;
+}
+
+static int
+bind_sections(crustache_template *template, struct node *node, unsigned char *seen)
+{
+	int error = 0;
+
+	for (; error == 0 && node != NULL; node = node->next) {
+		struct node_section *section = (struct node_section *)node;
+
+		if (node->type != CRUSTACHE_NODE_SECTION)
+			continue;
+
+		section->scope.slots = malloc(template->name_count * sizeof(size_t));
+		if (section->scope.slots == NULL)
+			return CR_ENOMEM;
+
+		memset(seen, 0x0, template->name_count);
+		collect_slots(section->content, seen, section->scope.slots, &section->scope.slot_count);
+
+		if (template->api.context_find_many != NULL &&
+			(error = bind_scope_keys(template, &section->scope)) < 0)
+			break;
+
+		error = bind_sections(template, section->content, seen);
+	}
+
+	return error;
+}
+
+/* Find the cache entry for a partial name, adding it if needed */
+static int
+partial_entry(struct partial_entry **output, crustache_template *template, const struct node_str *name)
+{
+	struct partial_entry *entry;
+
+	for (entry = template->partials; entry != NULL; entry = entry->next) {
+		if (node_str_eq(&entry->name, name))
+			break;
+	}
+
+	if (entry == NULL) {
+		entry = malloc(sizeof(struct partial_entry) + name->size);
+		if (entry == NULL)
+			return CR_ENOMEM;
+
+		memcpy(entry + 1, name->ptr, name->size);
+		entry->name.ptr = (const char *)(entry + 1);
+		entry->name.size = name->size;
+		entry->template = NULL;
+		entry->shared = NULL;
+		entry->next = template->partials;
+		template->partials = entry;
+	}
+
+	*output = entry;
+	return 0;
+}
+
+/* Give a partial tag the cache entry for its name */
+static int
+bind_partial(crustache_template *template, struct node_partial *partial)
+{
+	return partial_entry(&partial->entry, template, &partial->partial_name);
+}
+
+static int
+bind_partials(crustache_template *template, struct node *node)
+{
+	int error = 0;
+
+	for (; error == 0 && node != NULL; node = node->next) {
+		if (node->type == CRUSTACHE_NODE_SECTION)
+			error = bind_partials(template, ((struct node_section *)node)->content);
+		else if (node->type == CRUSTACHE_NODE_PARTIAL)
+			error = bind_partial(template, (struct node_partial *)node);
+	}
+
+	return error;
+}
+
+/*
+ * Number the variable names in the template, and record which of them
+ * are used inside each section. This lets the renderer bind the names
+ * in a section to the columns of a CRUSTACHE_VAR_COLUMNS table before
+ * walking its rows, or resolve all of them at once with
+ * `context_find_many` whenever a context is pushed.
+ */
+static int
+bind_template(crustache_template *template)
+{
+	unsigned char *seen;
+	size_t i;
+	int error;
+
+	error = bind_partials(template, template->root.next);
+	if (error < 0)
+		return error;
+
+	error = intern_names(template, template->root.next);
+	if (error < 0 || template->name_count == 0)
+		return error;
+
+	seen = malloc(template->name_count);
+	if (seen == NULL)
+		return CR_ENOMEM;
+
+	error = bind_sections(template, template->root.next, seen);
+	free(seen);
+
+	/* every name in the template can end up being looked up
+	 * in the root contexts */
+	if (error == 0 && template->api.context_find_many != NULL) {
+		struct scope *root = &template->root_scope;
+
+		root->slots = malloc(template->name_count * sizeof(size_t));
+		if (root->slots == NULL)
+			return CR_ENOMEM;
+
+		for (i = 0; i < template->name_count; ++i)
+			root->slots[i] = i;
+
+		root->slot_count = template->name_count;
+		error = bind_scope_keys(template, root);
+	}
+
+	return error;
+}
+
+static crustache_schema_key *
+schema_key(crustache_schema_key **scope, const char *name, size_t size)
+{
+	crustache_schema_key *key;
+
+	for (; *scope != NULL; scope = &(*scope)->next) {
+		key = *scope;
+		if (key->name_size == size && memcmp(key->name, name, size) == 0)
+			return key;
+	}
+
+	/* the name is stored right after the key, so the schema
+	 * can outlive the template */
+	key = malloc(sizeof(crustache_schema_key) + size);
+	if (key == NULL)
+		return NULL;
+
+	memcpy(key + 1, name, size);
+	key->name = (const char *)(key + 1);
+	key->name_size = size;
+	key->usage = 0;
+	key->children = NULL;
+	key->next = NULL;
+
+	*scope = key;
+	return key;
+}
+
+/* Add the key read by `fetch` to the scope; `out` is NULL for
+ * implicit iterators and loop variables, which read no keys */
+static int
+schema_fetch(
+	crustache_schema_key **out,
+	crustache_schema_key **scope,
+	struct node_fetch *fetch,
+	unsigned int usage)
+{
+	crustache_schema_key *key;
+	size_t i;
+
+	*out = NULL;
+
+	if (fetch->kind != FETCH_NAME)
+		return 0;
+
+	key = schema_key(scope, fetch->head.ptr, fetch->head.size);
+
+	for (i = 0; key != NULL && i < fetch->path_len; ++i) {
+		key->usage |= CRUSTACHE_KEY_PARENT;
+		key = schema_key(&key->children, fetch->path[i].name, fetch->path[i].size);
+	}
+
+	if (key == NULL)
+		return CR_ENOMEM;
+
+	key->usage |= usage;
+	*out = key;
+	return 0;
+}
+
+static int
+schema_partial(crustache_schema *schema, struct node_str *name)
+{
+	crustache_schema_partial **partial;
+
+	for (partial = &schema->partials; *partial != NULL; partial = &(*partial)->next) {
+		if ((*partial)->name_size == name->size &&
+			memcmp((*partial)->name, name->ptr, name->size) == 0)
+			return 0;
+	}
+
+	*partial = malloc(sizeof(crustache_schema_partial) + name->size);
+	if (*partial == NULL)
+		return CR_ENOMEM;
+
+	memcpy(*partial + 1, name->ptr, name->size);
+	(*partial)->name = (const char *)(*partial + 1);
+	(*partial)->name_size = name->size;
+	(*partial)->next = NULL;
+	return 0;
+}
+
+/* The partials being expanded, to stop at recursive ones */
+struct partial_chain {
+	struct node_str name;
+	struct partial_chain *parent;
+};
+
+static int
+schema_nodes(
+	crustache_schema *schema,
+	crustache_template *template,
+	struct node *node,
+	crustache_schema_key **scope,
+	struct partial_chain *chain,
+	int expand_partials);
+
+static int
+schema_expand_partial(
+	crustache_schema *schema,
+	crustache_template *template,
+	struct node_partial *node,
+	crustache_schema_key **scope,
+	struct partial_chain *chain)
+{
+	struct partial_chain link, *p;
+	crustache_template *partial;
+	int error;
+
+	for (p = chain; p != NULL; p = p->parent) {
+		if (p->name.size == node->partial_name.size &&
+			memcmp(p->name.ptr, node->partial_name.ptr, p->name.size) == 0)
+			return 0;
+	}
+
+	error = load_partial(&partial, template, node);
+	if (error < 0)
+		return error;
+
+	link.name = node->partial_name;
+	link.parent = chain;
+
+	return schema_nodes(schema, partial, partial->root.next, scope, &link, 1);
+}
+
+static int
+schema_nodes(
+	crustache_schema *schema,
+	crustache_template *template,
+	struct node *node,
+	crustache_schema_key **scope,
+	struct partial_chain *chain,
+	int expand_partials)
+{
+	crustache_schema_key *key;
+	int error = 0;
+
+	for (; error == 0 && node != NULL; node = node->next) {
+		switch (node->type) {
+		case CRUSTACHE_NODE_TAG:
+			error = schema_fetch(&key, scope,
+				(struct node_fetch *)((struct node_tag *)node)->tag_value,
+				CRUSTACHE_KEY_VARIABLE);
+			break;
+
+		case CRUSTACHE_NODE_SECTION: {
+			struct node_section *section = (struct node_section *)node;
+
+			error = schema_fetch(&key, scope,
+				(struct node_fetch *)section->section_key,
+				section->inverted ? CRUSTACHE_KEY_INVERTED : CRUSTACHE_KEY_SECTION);
+
+			if (error < 0)
+				break;
+
+			/* inverted sections (and implicit iterators) don't
+			 * open a new scope */
+			error = schema_nodes(schema, template, section->content,
+				(key && !section->inverted) ? &key->children : scope,
+				chain, expand_partials);
+			break;
+		}
+
+		case CRUSTACHE_NODE_PARTIAL: {
+			struct node_partial *partial = (struct node_partial *)node;
+
+			error = schema_partial(schema, &partial->partial_name);
+
+			if (error == 0 && expand_partials)
+				error = schema_expand_partial(schema, template, partial, scope, chain);
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	return error;
+}
+
+static void
+schema_keys_free(crustache_schema_key *key)
+{
+	while (key != NULL) {
+		crustache_schema_key *next = key->next;
+		schema_keys_free(key->children);
+		free(key);
+		key = next;
+	}
+}
+
+void
+crustache_schema_free(crustache_schema *schema)
+{
+	crustache_schema_partial *partial;
+
+	if (!schema)
+		return;
+
+	schema_keys_free(schema->keys);
+
+	partial = schema->partials;
+	while (partial != NULL) {
+		crustache_schema_partial *next = partial->next;
+		free(partial);
+		partial = next;
+	}
+
+	free(schema);
+}
+
+int
+crustache_template_schema(crustache_schema **output, crustache_template *template, int expand_partials)
+{
+	crustache_schema *schema;
+	int error;
+
+	*output = NULL;
+
+	schema = malloc(sizeof(crustache_schema));
+	if (schema == NULL)
+		return CR_ENOMEM;
+
+	schema->keys = NULL;
+	schema->partials = NULL;
+
+	error = schema_nodes(schema, template, template->root.next,
+		&schema->keys, NULL, expand_partials);
+
+	if (error < 0) {
+		crustache_schema_free(schema);
+		return error;
+	}
+
+	*output = schema;
+	return 0;
+}
+
+static int
+template_new(
+	crustache_template **output,
+	crustache_api *api,
+	const char *raw_template, size_t raw_length,
+	const struct node_str *delim_open,
+	const struct node_str *delim_close)
+{
+	crustache_template *crt;
+	int error;
+
+	crt = malloc(sizeof(crustache_template));
+	if (!crt)
+		return CR_ENOMEM;
+
+	memset(crt, 0x0, sizeof(crustache_template));
+
+	if (cr_lock_init(&crt->lambda_lock) != 0) {
+		free(crt);
+		return CR_ENOMEM;
+	}
+
+	if (cr_lock_init(&crt->partial_lock) != 0) {
+		cr_lock_free(&crt->lambda_lock);
+		free(crt);
+		return CR_ENOMEM;
+	}
+
+	memcpy(&crt->api, api, sizeof(crustache_api));
+
+	if (crt->api.fragment_cache != NULL)
+		crt->fragment_id = fragment_cache_new_id(crt->api.fragment_cache);
+
+	crt->raw_content.ptr = malloc(raw_length);
+	crt->raw_content.size = raw_length;
+
+	if (crt->raw_content.ptr == NULL) {
+		free(crt);
+		return CR_ENOMEM;
+	}
+
+	memcpy(crt->raw_content.ptr, raw_template, raw_length);
+
+	crt->mustache_open.chars = delim_open->ptr;
+	crt->mustache_open.size = delim_open->size;
+
+	crt->mustache_close.chars = delim_close->ptr;
+	crt->mustache_close.size = delim_close->size;
+
+	crt->root.type = CRUSTACHE_NODE_MULTIROOT;
+	crt->root.next = NULL;
+
+	*output = crt;
+
+	error = parse_internal(crt, crt->raw_content.ptr, crt->raw_content.size, &crt->root);
+
+	if (error == 0)
+		error = bind_template(crt);
+
+	if (error == 0 && crt->api.minify_html)
+		error = minify_template(crt);
+
+	return error;
+}
+
+int
+crustache_new(
+	crustache_template **output,
+	crustache_api *api,
+	const char *raw_template, size_t raw_length)
+{
+	static const struct node_str MUSTACHE_OPEN = {"{{", 2};
+	static const struct node_str MUSTACHE_CLOSE = {"}}", 2};
+
+	return template_new(output, api, raw_template, raw_length,
+		&MUSTACHE_OPEN, &MUSTACHE_CLOSE);
+}
+
+/*
+ * Copying nodes between templates. The text they point to (the source
+ * of the template, the static text rewritten by the minifier, and the
+ * text of the partials linked into it) is copied into a block owned by
+ * the new template.
+ */
+struct linked_text {
+	struct linked_text *next;
+	size_t size;
+};
+
+struct text_range {
+	const char *from;
+	size_t size;
+	const char *to;
+};
+
+struct text_move {
+	struct text_range *ranges;
+	size_t count;
+};
+
+/*
+ * Copy the text of `source` into `target`. If `raw_to` is set, the
+ * target already has a copy of the raw source there.
+ */
+static int
+text_move_init(
+	struct text_move *move,
+	crustache_template *target,
+	crustache_template *source,
+	const char *raw_to)
+{
+	struct linked_text *block, *linked;
+	size_t count = 3, size = 0, i;
+	char *to;
+
+	for (linked = source->linked; linked != NULL; linked = linked->next)
+		count++;
+
+	move->ranges = malloc(count * sizeof(struct text_range));
+	if (move->ranges == NULL)
+		return CR_ENOMEM;
+
+	move->count = 0;
+	move->ranges[move->count].from = source->raw_content.ptr;
+	move->ranges[move->count++].size = source->raw_content.size;
+
+	if (source->static_content != NULL) {
+		move->ranges[move->count].from = source->static_content->data;
+		move->ranges[move->count++].size = source->static_content->size;
+	}
+
+	for (linked = source->linked; linked != NULL; linked = linked->next) {
+		move->ranges[move->count].from = (const char *)(linked + 1);
+		move->ranges[move->count++].size = linked->size;
+	}
+
+	for (i = (raw_to != NULL); i < move->count; ++i)
+		size += move->ranges[i].size;
+
+	block = malloc(sizeof(struct linked_text) + size);
+	if (block == NULL) {
+		free(move->ranges);
+		return CR_ENOMEM;
+	}
+
+	block->size = size;
+	block->next = target->linked;
+	target->linked = block;
+
+	to = (char *)(block + 1);
+
+	for (i = 0; i < move->count; ++i) {
+		struct text_range *range = &move->ranges[i];
+
+		if (i == 0 && raw_to != NULL) {
+			range->to = raw_to;
+			continue;
+		}
+
+		memcpy(to, range->from, range->size);
+		range->to = to;
+		to += range->size;
+	}
+
+	return 0;
+}
+
+static const char *
+move_text(const struct text_move *move, const char *ptr)
+{
+	size_t i;
+
+	for (i = 0; i < move->count; ++i) {
+		const struct text_range *range = &move->ranges[i];
+
+		if (ptr >= range->from && ptr <= range->from + range->size)
+			return range->to + (ptr - range->from);
+	}
+
+	return ptr;
+}
+
+static struct node *
+clone_fetch(const struct text_move *move, struct node_fetch *fetch)
+{
+	struct node_fetch *copy = node_alloc(CRUSTACHE_NODE_FETCH, struct node_fetch);
+	size_t i;
+
+	if (copy == NULL)
+		return NULL;
+
+	*copy = *fetch;
+	copy->base.next = NULL;
+	copy->var.ptr = move_text(move, fetch->var.ptr);
+	copy->head.ptr = move_text(move, fetch->head.ptr);
+
+	if (fetch->path_len > 0) {
+		copy->path = malloc(fetch->path_len * sizeof(crustache_key));
+		if (copy->path == NULL) {
+			free(copy);
+			return NULL;
+		}
+
+		for (i = 0; i < fetch->path_len; ++i) {
+			copy->path[i] = fetch->path[i];
+			copy->path[i].name = move_text(move, fetch->path[i].name);
+		}
+	}
+
+	return (struct node *)copy;
+}
+
+static struct node_filter *
+clone_filters(const struct text_move *move, struct node_filter *filter)
+{
+	struct node_filter *head = NULL, **tail = &head;
+	size_t i;
+
+	for (; filter != NULL; filter = filter->next) {
+		struct node_filter *copy = malloc(
+			sizeof(struct node_filter) + filter->arg_count * sizeof(crustache_var));
+
+		if (copy == NULL) {
+			filter_free(head);
+			return NULL;
+		}
+
+		*copy = *filter;
+		copy->name.ptr = move_text(move, filter->name.ptr);
+		copy->args = (crustache_var *)(copy + 1);
+		copy->next = NULL;
+
+		for (i = 0; i < filter->arg_count; ++i) {
+			copy->args[i] = filter->args[i];
+			if (copy->args[i].type == CRUSTACHE_VAR_STR)
+				copy->args[i].data = (void *)move_text(move, filter->args[i].data);
+		}
+
+		*tail = copy;
+		tail = &copy->next;
+	}
+
+	return head;
+}
+
+/*
+ * Specialization: fold the parts of a template which only depend on a
+ * static context into static text. Folded keys can't be overridden by
+ * the contexts given at render time any more.
+ */
+
+struct specializer {
+	crustache_template *source;
+	crustache_template *target;
+	crustache_var *statics;
+	struct stack context;
+	struct buf *scratch;
+	struct text_move move;
+
+	/* some kept node may still read the static context */
+	int needs_static;
+	int error;
+};
+
+/* The end of a chain of nodes being built */
+struct spec_chain {
+	struct node *last;
+};
+
+static void
+spec_link(struct spec_chain *chain, struct node *node)
+{
+	chain->last->next = node;
+	chain->last = node;
+}
+
+/*
+ * Static text goes into the `static_content` of the new template, which
+ * may still be reallocated; until the tree is finished, static nodes
+ * hold an offset into it instead of a pointer. Text next to the last
+ * static node of the chain is merged into it.
+ */
+static void
+spec_static(struct specializer *sp, struct spec_chain *chain, const char *text, size_t size)
+{
+	struct buf *content = sp->target->static_content;
+	struct node_static *node;
+
+	if (size == 0 || sp->error < 0)
+		return;
+
+	if (chain->last->type == CRUSTACHE_NODE_STATIC) {
+		node = (struct node_static *)chain->last;
+
+		if ((size_t)node->str.ptr + node->str.size == content->size) {
+			bufput(content, text, size);
+			node->str.size += size;
+			return;
+		}
+	}
+
+	node = node_alloc(CRUSTACHE_NODE_STATIC, struct node_static);
+	if (node == NULL) {
+		sp->error = CR_ENOMEM;
+		return;
+	}
+
+	node->str.ptr = (const char *)content->size;
+	node->str.size = size;
+	bufput(content, text, size);
+	spec_link(chain, (struct node *)node);
+}
+
+static void
+spec_fix_static(struct buf *content, struct node *node)
+{
+	for (; node != NULL; node = node->next) {
+		if (node->type == CRUSTACHE_NODE_STATIC) {
+			struct node_static *stnode = (struct node_static *)node;
+			stnode->str.ptr = content->data + (size_t)stnode->str.ptr;
+		} else if (node->type == CRUSTACHE_NODE_SECTION) {
+			spec_fix_static(content, ((struct node_section *)node)->content);
+		}
+	}
+}
+
+/* Look up the first segment of a name in the static context */
+static int
+spec_lookup(struct specializer *sp, crustache_var *out, struct node_fetch *fetch)
+{
+	if (fetch->kind != FETCH_NAME)
+		return -1;
+
+	memset(out, 0x0, sizeof(crustache_var));
+	return sp->source->api.context_find(out, sp->statics->data, fetch->head.ptr, fetch->head.size);
+}
+
+static int
+spec_is_static(struct specializer *sp, struct node_fetch *fetch)
+{
+	crustache_var var;
+
+	if (spec_lookup(sp, &var, fetch) < 0)
+		return 0;
+
+	free_var(sp->source, &var);
+	return 1;
+}
+
+static void
+spec_nodes(struct specializer *sp, struct spec_chain *chain, struct node *node, int fold);
+
+static void
+spec_clone_tag(struct specializer *sp, struct spec_chain *chain, struct node_tag *tag)
+{
+	struct node_tag *copy = node_alloc(CRUSTACHE_NODE_TAG, struct node_tag);
+
+	if (copy == NULL) {
+		sp->error = CR_ENOMEM;
+		return;
+	}
+
+	copy->print_mode = tag->print_mode;
+	copy->tag_value = clone_fetch(&sp->move, (struct node_fetch *)tag->tag_value);
+	copy->filters = NULL;
+
+	if (tag->filters != NULL)
+		copy->filters = clone_filters(&sp->move, tag->filters);
+
+	spec_link(chain, (struct node *)copy);
+
+	if (copy->tag_value == NULL || (tag->filters != NULL && copy->filters == NULL))
+		sp->error = CR_ENOMEM;
+}
+
+static void
+spec_clone_section(struct specializer *sp, struct spec_chain *chain, struct node_section *section)
+{
+	struct node_section *copy = node_alloc(CRUSTACHE_NODE_SECTION, struct node_section);
+	struct spec_chain content;
+
+	if (copy == NULL) {
+		sp->error = CR_ENOMEM;
+		return;
+	}
+
+	*copy = *section;
+	copy->base.next = NULL;
+	copy->section_key = clone_fetch(&sp->move, (struct node_fetch *)section->section_key);
+	copy->content = node_alloc(CRUSTACHE_NODE_MULTIROOT, struct node);
+	copy->raw_content.ptr = move_text(&sp->move, section->raw_content.ptr);
+	copy->delim_open.ptr = move_text(&sp->move, section->delim_open.ptr);
+	copy->delim_close.ptr = move_text(&sp->move, section->delim_close.ptr);
+	memset(&copy->scope, 0x0, sizeof(struct scope));
+
+	spec_link(chain, (struct node *)copy);
+
+	if (copy->section_key == NULL || copy->content == NULL) {
+		sp->error = CR_ENOMEM;
+		return;
+	}
+
+	/* names inside may be shadowed by the value of the section,
+	 * so there's nothing to fold in there */
+	content.last = copy->content;
+	spec_nodes(sp, &content, section->content->next, 0);
+}
+
+/* Render a node of the source template against the static context */
+static int
+spec_render(struct specializer *sp, struct node *node)
+{
+	int error;
+
+	sp->scratch->size = 0;
+
+	/* anything that isn't static fails, as the bottom frame is
+	 * strict, and is left for the real render */
+	if (node->type == CRUSTACHE_NODE_TAG)
+		error = render_node_tag(sp->scratch, sp->source, (struct node_tag *)node, &sp->context);
+	else
+		error = render_section(sp->scratch, sp->source, (struct node_section *)node, &sp->context, 1);
+
+	return error;
+}
+
+static void
+spec_section(struct specializer *sp, struct spec_chain *chain, struct node_section *section)
+{
+	crustache_var value;
+	int empty;
+
+	if (spec_lookup(sp, &value, (struct node_fetch *)section->section_key) < 0) {
+		spec_clone_section(sp, chain, section);
+		return;
+	}
+
+	switch (value.type) {
+	case CRUSTACHE_VAR_FALSE:
+	case CRUSTACHE_VAR_TRUE:
+		/* no frame is pushed for these, so we can keep folding inside */
+		if ((value.type == CRUSTACHE_VAR_TRUE) != section->inverted)
+			spec_nodes(sp, chain, section->content->next, 1);
 		break;
 
-	case CRUSTACHE_VAR_STR:
-		switch (node->print_mode) {
-		case CRUSTACHE_TAG_ESCAPE:
-			houdini_escape_html(ob, tag_value.data, tag_value.size);
-			break;
+	case CRUSTACHE_VAR_LIST:
+	case CRUSTACHE_VAR_CONTEXT:
+	case CRUSTACHE_VAR_COLUMNS:
+		empty = value.type == CRUSTACHE_VAR_COLUMNS && value.size == 0;
+
+		if (value.type == CRUSTACHE_VAR_LIST)
+			empty = list_is_empty(sp->source, &value);
+
+		if (empty < 0) {
+			/* leave the error to be reported when rendering */
+			spec_clone_section(sp, chain, section);
+		} else if (section->inverted) {
+			if (empty)
+				spec_nodes(sp, chain, section->content->next, 1);
+		} else if (!empty) {
+			if (spec_render(sp, (struct node *)section) == 0) {
+				spec_static(sp, chain, sp->scratch->data, sp->scratch->size);
+			} else {
+				spec_clone_section(sp, chain, section);
+				sp->needs_static = 1;
+			}
+		}
+		break;
+
+	default:
+		/* lambdas, or values which can't open a section */
+		spec_clone_section(sp, chain, section);
+		sp->needs_static = 1;
+		break;
+	}
+
+	free_var(sp->source, &value);
+}
+
+/*
+ * Copy a chain of nodes into the new template. With `fold` set, the
+ * nodes are rendered against the bare static context, so any name
+ * found there can be replaced by its value.
+ */
+static void
+spec_nodes(struct specializer *sp, struct spec_chain *chain, struct node *node, int fold)
+{
+	for (; sp->error == 0 && node != NULL; node = node->next) {
+		switch (node->type) {
+		case CRUSTACHE_NODE_STATIC:
+			spec_static(sp, chain, ((struct node_static *)node)->str.ptr,
+				((struct node_static *)node)->str.size);
+			break;
+
+		case CRUSTACHE_NODE_TAG: {
+			struct node_tag *tag = (struct node_tag *)node;
+			struct node_fetch *fetch = (struct node_fetch *)tag->tag_value;
+
+			if (fold && spec_is_static(sp, fetch) && spec_render(sp, node) == 0) {
+				spec_static(sp, chain, sp->scratch->data, sp->scratch->size);
+				break;
+			}
+
+			if (spec_is_static(sp, fetch))
+				sp->needs_static = 1;
+
+			spec_clone_tag(sp, chain, tag);
+			break;
+		}
+
+		case CRUSTACHE_NODE_SECTION:
+			if (fold) {
+				spec_section(sp, chain, (struct node_section *)node);
+			} else {
+				if (spec_is_static(sp, (struct node_fetch *)((struct node_section *)node)->section_key))
+					sp->needs_static = 1;
+
+				spec_clone_section(sp, chain, (struct node_section *)node);
+			}
+			break;
+
+		case CRUSTACHE_NODE_PARTIAL: {
+			struct node_partial *copy = node_alloc(CRUSTACHE_NODE_PARTIAL, struct node_partial);
+
+			if (copy == NULL) {
+				sp->error = CR_ENOMEM;
+				break;
+			}
+
+			copy->partial_name.ptr = move_text(&sp->move, ((struct node_partial *)node)->partial_name.ptr);
+			copy->partial_name.size = ((struct node_partial *)node)->partial_name.size;
+			copy->entry = NULL;
+			spec_link(chain, (struct node *)copy);
+
+			/* we can't tell what the partial reads */
+			sp->needs_static = 1;
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+}
+
+int
+crustache_specialize(crustache_template **output, crustache_template *template, crustache_var *statics)
+{
+	struct specializer sp;
+	struct spec_chain root;
+	struct arena_mark arena_start;
+	struct frame frame;
+	struct render_state state;
+	crustache_template *crt;
+	int error;
+
+	*output = NULL;
+
+	if (statics->type != CRUSTACHE_VAR_CONTEXT) {
+		template->error_node = &template->root;
+		return CR_ERENDER_INVALID_CONTEXT;
+	}
+
+	crt = malloc(sizeof(crustache_template));
+	if (crt == NULL)
+		return CR_ENOMEM;
+
+	memset(crt, 0x0, sizeof(crustache_template));
+
+	if (cr_lock_init(&crt->lambda_lock) != 0) {
+		free(crt);
+		return CR_ENOMEM;
+	}
+
+	if (cr_lock_init(&crt->partial_lock) != 0) {
+		cr_lock_free(&crt->lambda_lock);
+		free(crt);
+		return CR_ENOMEM;
+	}
+
+	memcpy(&crt->api, &template->api, sizeof(crustache_api));
+
+	if (crt->api.fragment_cache != NULL)
+		crt->fragment_id = fragment_cache_new_id(crt->api.fragment_cache);
+
+	crt->raw_content.ptr = malloc(template->raw_content.size + 1);
+	crt->raw_content.size = template->raw_content.size;
+	crt->static_content = bufnew(64);
+	crt->root.type = CRUSTACHE_NODE_MULTIROOT;
+
+	if (crt->raw_content.ptr == NULL || crt->static_content == NULL) {
+		crustache_free(crt);
+		return CR_ENOMEM;
+	}
+
+	memcpy(crt->raw_content.ptr, template->raw_content.ptr, template->raw_content.size);
+	crt->raw_content.ptr[crt->raw_content.size] = '\0';
+
+	memset(&sp, 0x0, sizeof(sp));
+	sp.source = template;
+	sp.target = crt;
+	sp.statics = statics;
+	sp.scratch = bufnew(64);
+
+	if (sp.scratch == NULL || text_move_init(&sp.move, crt, template, crt->raw_content.ptr) < 0) {
+		bufrelease(sp.scratch);
+		crustache_free(crt);
+		return CR_ENOMEM;
+	}
+
+	crt->mustache_open.chars = move_text(&sp.move, template->mustache_open.chars);
+	crt->mustache_open.size = template->mustache_open.size;
+	crt->mustache_close.chars = move_text(&sp.move, template->mustache_close.chars);
+	crt->mustache_close.size = template->mustache_close.size;
+
+	if (template->api.arena != NULL)
+		arena_mark(template->api.arena, &arena_start);
+
+	stack_init(&sp.context, DEFAULT_STACK_SIZE);
+	frame_init(&frame, statics);
+	frame.strict = 1;
+	frame_push(&sp.context, template, &frame, &NO_SCOPE);
+	render_state_init(&state, &sp.context);
+
+	root.last = &crt->root;
+	spec_nodes(&sp, &root, template->root.next, 1);
+
+	render_state_free(&state);
+	frame_pop(&sp.context, template);
+	stack_free(&sp.context);
+	bufrelease(sp.scratch);
+	free(sp.move.ranges);
+
+	if (template->api.arena != NULL)
+		arena_rewind(template->api.arena, &arena_start);
+
+	spec_fix_static(crt->static_content, crt->root.next);
+
+	error = sp.error;
+	if (error == 0)
+		error = bind_template(crt);
+
+	if (error < 0) {
+		crustache_free(crt);
+		return error;
+	}
+
+	/* whatever wasn't folded may still need to look up the static
+	 * context at render time, below the ones given to render */
+	if (sp.needs_static) {
+		crt->static_context = *statics;
+		crt->has_static_context = 1;
+	}
+
+	*output = crt;
+	return 0;
+}
+
+/*
+ * Templates compiled into C by crustache-aot. The generated code writes
+ * the static text of the template straight into the output, looks up
+ * the names of its tags and sections with keys built at compile time,
+ * and runs the loops of the sections itself. Filtered tags and partials
+ * are rendered by the interpreter. The generated code refers to the
+ * nodes by their position in the template: every node but the heads of
+ * the content lists, in document order.
+ */
+
+#define COMPILED_HASH_SEED 2166136261u
+
+/* A section the generated code is looping through */
+struct aot_section {
+	struct section_loop loop;
+
+	/* where to store its output in the fragment cache, if anywhere */
+	struct buf *fragment_key;
+	size_t fragment_start;
+};
+
+/* Fewer nested sections than this are tracked on the stack */
+#define AOT_LOCAL_SECTIONS 4
+
+static int
+render_compiled(
+	struct buf *ob,
+	crustache_template *template,
+	struct stack *context,
+	int depth)
+{
+	struct aot_section local[AOT_LOCAL_SECTIONS];
+	const crustache_compiled *compiled = template->compiled;
+	crustache_aot aot;
+	int error;
+
+	if (depth >= MAX_RENDER_RECURSION) {
+		template->error_node = &template->root;
+		return CR_ERENDER_TOO_DEEP;
+	}
+
+	aot.template = template;
+	aot.context = context;
+	aot.depth = depth;
+	aot.open = local;
+	aot.open_count = 0;
+
+	if (compiled->loop_depth > AOT_LOCAL_SECTIONS) {
+		aot.open = malloc(compiled->loop_depth * sizeof(struct aot_section));
+		if (aot.open == NULL)
+			return CR_ENOMEM;
+	}
+
+	error = compiled->root(ob, &aot);
+
+	/* the sections we bailed out of */
+	while (aot.open_count > 0) {
+		struct aot_section *section = &aot.open[--aot.open_count];
+
+		section_end(&section->loop);
+		fragment_put(ob, template, section->fragment_key, section->fragment_start, error);
+	}
+
+	if (aot.open != local)
+		free(aot.open);
+
+	return error;
+}
+
+static uint32_t
+compiled_hash(uint32_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = data;
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint32_t
+compiled_hash_str(uint32_t hash, const struct node_str *str)
+{
+	unsigned char end = 0;
+
+	hash = compiled_hash(hash, str->ptr, str->size);
+	return compiled_hash(hash, &end, 1);
+}
+
+/* Number the nodes of a template, and hash its shape, static text and
+ * names to tell whether some generated code was compiled from it */
+static void
+compiled_walk(struct node *node, struct node **nodes, size_t *count, uint32_t *hash)
+{
+	for (; node != NULL; node = node->next) {
+		unsigned char type = (unsigned char)node->type;
+
+		if (node->type == CRUSTACHE_NODE_MULTIROOT)
+			continue;
+
+		if (nodes != NULL)
+			nodes[*count] = node;
+
+		(*count)++;
+		*hash = compiled_hash(*hash, &type, 1);
+
+		switch (node->type) {
+		case CRUSTACHE_NODE_STATIC:
+			*hash = compiled_hash_str(*hash, &((struct node_static *)node)->str);
+			break;
+
+		case CRUSTACHE_NODE_TAG: {
+			struct node_tag *tag = (struct node_tag *)node;
+			unsigned char flags = (unsigned char)tag->print_mode | (tag->filters ? 0x80 : 0);
+
+			*hash = compiled_hash(*hash, &flags, 1);
+			*hash = compiled_hash_str(*hash, &((struct node_fetch *)tag->tag_value)->var);
+			break;
+		}
+
+		case CRUSTACHE_NODE_SECTION: {
+			struct node_section *section = (struct node_section *)node;
+			unsigned char inverted = (unsigned char)section->inverted;
+
+			*hash = compiled_hash(*hash, &inverted, 1);
+			*hash = compiled_hash_str(*hash, &((struct node_fetch *)section->section_key)->var);
+			compiled_walk(section->content, nodes, count, hash);
+			break;
+		}
+
+		case CRUSTACHE_NODE_PARTIAL:
+			*hash = compiled_hash_str(*hash, &((struct node_partial *)node)->partial_name);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void
+compiled_detach(crustache_template *template)
+{
+	free(template->compiled_nodes);
+	template->compiled_nodes = NULL;
+	template->compiled = NULL;
+}
+
+/*
+ * Have a template rendered by the code crustache-aot generated for it
+ * from now on, or by the interpreter again if `compiled` is NULL. The
+ * template must have been compiled from the same source, and with the
+ * same `minify_html` setting, as the generated code. Attach it before
+ * rendering the template or sharing it between threads.
+ */
+int
+crustache_attach_compiled(crustache_template *template, const crustache_compiled *compiled)
+{
+	uint32_t hash = COMPILED_HASH_SEED;
+	struct node **nodes;
+	size_t count = 0;
+
+	compiled_detach(template);
+
+	if (compiled == NULL)
+		return 0;
+
+	compiled_walk(template->root.next, NULL, &count, &hash);
+
+	if (count != compiled->node_count || hash != compiled->hash)
+		return CR_ECOMPILED_MISMATCH;
+
+	nodes = malloc((count + 1) * sizeof(struct node *));
+	if (nodes == NULL)
+		return CR_ENOMEM;
+
+	count = 0;
+	compiled_walk(template->root.next, nodes, &count, &hash);
+
+	template->compiled_nodes = nodes;
+	template->compiled = compiled;
+	return 0;
+}
+
+/* Create a template from the source embedded in the generated code,
+ * with the code already attached to it */
+int
+crustache_new_compiled(
+	crustache_template **output,
+	crustache_api *api,
+	const crustache_compiled *compiled)
+{
+	int error = crustache_new(output, api, compiled->source, compiled->source_size);
+
+	if (error == 0)
+		error = crustache_attach_compiled(*output, compiled);
+
+	return error;
+}
+
+static struct node *
+aot_node(crustache_aot *aot, size_t node)
+{
+	const crustache_compiled *compiled = aot->template->compiled;
+
+	assert(compiled != NULL && node < compiled->node_count);
+	return aot->template->compiled_nodes[node];
+}
+
+int
+crustache_aot_node(struct buf *ob, crustache_aot *aot, size_t node)
+{
+	return render_one(ob, aot->template, aot_node(aot, node),
+		aot->context, aot->depth + (int)aot->open_count);
+}
+
+/* Look up the name of a tag */
+int
+crustache_aot_fetch(crustache_var *out, crustache_aot *aot, const crustache_aot_name *name)
+{
+	struct node_tag *tag = (struct node_tag *)aot_node(aot, name->node);
+
+	assert(tag->base.type == CRUSTACHE_NODE_TAG);
+	return fetch_key(out, aot->template, (struct node_fetch *)tag->tag_value,
+		&name->key, name->path, name->path_len, aot->context);
+}
+
+/* Print the value of a tag, and release it */
+int
+crustache_aot_put(struct buf *ob, crustache_aot *aot, crustache_var *var, const crustache_aot_name *name)
+{
+	struct node_tag *tag = (struct node_tag *)aot_node(aot, name->node);
+	int error;
+
+	assert(tag->base.type == CRUSTACHE_NODE_TAG);
+	error = render_value(ob, aot->template, tag, var, 1);
+	free_var(aot->template, var);
+	return error;
+}
+
+static int
+aot_section_done(struct buf *ob, crustache_aot *aot, int result)
+{
+	struct aot_section *section = &aot->open[--aot->open_count];
+
+	fragment_put(ob, aot->template, section->fragment_key, section->fragment_start, result);
+	return result;
+}
+
+/*
+ * Start a section: returns 1 if its content has to be rendered, and
+ * then crustache_aot_next after each pass until it returns 0. Errors
+ * are negative, and the generated code must return them right away.
+ */
+int
+crustache_aot_begin(struct buf *ob, crustache_aot *aot, const crustache_aot_name *name)
+{
+	crustache_template *template = aot->template;
+	struct node_section *node = (struct node_section *)aot_node(aot, name->node);
+	int depth = aot->depth + (int)aot->open_count + 1;
+	struct aot_section *section;
+	crustache_var value;
+	int result;
+
+	assert(node->base.type == CRUSTACHE_NODE_SECTION);
+	assert(aot->open_count < template->compiled->loop_depth);
+
+	if (depth >= MAX_RENDER_RECURSION) {
+		template->error_node = (struct node *)node;
+		return CR_ERENDER_TOO_DEEP;
+	}
+
+	section = &aot->open[aot->open_count];
+
+	result = fragment_get(&section->fragment_key, ob, template, node, aot->context, depth);
+	if (result != 0)
+		return result < 0 ? result : 0;
+
+	section->fragment_start = ob->size;
+	section->loop.open = 0;
+	aot->open_count++;
+
+	result = fetch_key(&value, template, (struct node_fetch *)node->section_key,
+		&name->key, name->path, name->path_len, aot->context);
+	if (result < 0)
+		return aot_section_done(ob, aot, result);
+
+	result = section_begin(&section->loop, ob, template, node, &value, aot->context, depth);
+	if (result <= 0)
+		return aot_section_done(ob, aot, result);
+
+	return result;
+}
+
+int
+crustache_aot_next(struct buf *ob, crustache_aot *aot)
+{
+	int result;
+
+	assert(aot->open_count > 0);
+
+	result = section_next(&aot->open[aot->open_count - 1].loop);
+	if (result <= 0)
+		return aot_section_done(ob, aot, result);
+
+	return result;
+}
+
+/* Write `data` as a C string literal, broken after each newline */
+static void
+compile_string(struct buf *ob, const char *data, size_t size, const char *indent)
+{
+	size_t i;
+
+	bufputc(ob, '"');
+
+	for (i = 0; i < size; ++i) {
+		unsigned char c = (unsigned char)data[i];
 
-		case CRUSTACHE_TAG_UNESCAPE:
-			houdini_unescape_html(ob, tag_value.data, tag_value.size);
+		switch (c) {
+		case '"': BUFPUTSL(ob, "\\\""); break;
+		case '\\': BUFPUTSL(ob, "\\\\"); break;
+		case '\t': BUFPUTSL(ob, "\\t"); break;
+		case '\r': BUFPUTSL(ob, "\\r"); break;
+
+		case '\n':
+			BUFPUTSL(ob, "\\n");
+			if (i + 1 < size)
+				bufprintf(ob, "\"\n%s\"", indent);
 			break;
 
-		case CRUSTACHE_TAG_RAW:
-			bufput(ob, tag_value.data, tag_value.size);
+		/* avoid trigraphs */
+		case '?': BUFPUTSL(ob, "\\?"); break;
+
+		default:
+			/* octal escapes always take three digits, so they
+			 * can't run into the digits that follow */
+			if (c < 0x20 || c >= 0x7f)
+				bufprintf(ob, "\\%03o", c);
+			else
+				bufputc(ob, c);
 			break;
 		}
+	}
+
+	bufputc(ob, '"');
+}
+
+static void
+compile_comment(struct buf *ob, struct node *node, const char *indent)
+{
+	struct node_str *name;
+	const char *open = "{{", *close = "}}";
+	size_t i;
+
+	switch (node->type) {
+	case CRUSTACHE_NODE_TAG: {
+		struct node_tag *tag = (struct node_tag *)node;
+
+		name = &((struct node_fetch *)tag->tag_value)->var;
+		if (tag->print_mode != CRUSTACHE_TAG_ESCAPE) {
+			open = "{{{";
+			close = "}}}";
+		}
 		break;
+	}
 
-	default:
-		error = CR_ERENDER_WRONG_VARTYPE;
-		template->error_node = (struct node *)node->tag_value;
+	case CRUSTACHE_NODE_SECTION:
+		name = &((struct node_fetch *)((struct node_section *)node)->section_key)->var;
+		open = ((struct node_section *)node)->inverted ? "{{^" : "{{#";
+		break;
+
+	case CRUSTACHE_NODE_PARTIAL:
+		name = &((struct node_partial *)node)->partial_name;
+		open = "{{>";
 		break;
+
+	default:
+		return;
 	}
 
-	free_var(template, &tag_value);
-	return error;
-}
+	/* names can't close the comment, but be careful anyway */
+	for (i = 0; i + 1 < name->size; ++i) {
+		if (name->ptr[i] == '*' && name->ptr[i + 1] == '/')
+			return;
+	}
 
-static int
-render_node_section(
-	struct buf *ob,
-	crustache_template *template,
-	struct node_section *node,
-	struct stack *context,
-	int depth)
-{
-	crustache_var section_key = {0, 0, 0};
-	int result = 0;
+	bufprintf(ob, "%s/* %s%.*s%s */\n", indent, open, (int)name->size, name->ptr, close);
+}
 
-	assert(node->base.type == CRUSTACHE_NODE_SECTION);
+/* What the code generated for a list of nodes needs */
+struct compile_info {
+	int fetches;	/* looks up tags itself */
+	int errors;	/* may fail */
+	size_t loop_depth;	/* nests this many sections */
+};
 
-	result = render_node_fetch(
-		&section_key,
-		template,
-		(struct node_fetch *)node->section_key,
-		context);
+static void
+compile_scan(struct node *node, struct compile_info *info, size_t depth)
+{
+	if (depth > info->loop_depth)
+		info->loop_depth = depth;
 
-	if (result < 0)
-		return result;
+	for (; node != NULL; node = node->next) {
+		switch (node->type) {
+		case CRUSTACHE_NODE_TAG:
+			if (((struct node_tag *)node)->filters == NULL)
+				info->fetches = 1;
+			info->errors = 1;
+			break;
 
-	if (node->inverted) {
-		if (section_key.type == CRUSTACHE_VAR_FALSE ||
-			(section_key.type == CRUSTACHE_VAR_LIST && section_key.size == 0))
-			result = render_node(ob, template, node->content, context, depth);
+		case CRUSTACHE_NODE_SECTION:
+			info->errors = 1;
+			compile_scan(((struct node_section *)node)->content, info, depth + 1);
+			break;
 
-	} else {
-		switch (section_key.type) {
-		case CRUSTACHE_VAR_FALSE:
+		case CRUSTACHE_NODE_PARTIAL:
+			info->errors = 1;
 			break;
 
-		case CRUSTACHE_VAR_CONTEXT:
-			stack_push(context, &section_key);
-			result = render_node(ob, template, node->content, context, depth);
-			stack_pop(context);
+		default:
 			break;
+		}
+	}
+}
 
-		case CRUSTACHE_VAR_LIST:
-		{
-			size_t i;
+/* Write a key, with its hash worked out now */
+static void
+compile_key(struct buf *ob, const char *name, size_t size)
+{
+	bufputc(ob, '{');
+	compile_string(ob, name, size, "");
+	bufprintf(ob, ", %lu, 0x%08lxu}", (unsigned long)size,
+		(unsigned long)hash_str(name, size));
+}
+
+/* Declare the names looked up by the generated code: one for every
+ * section and tag without filters, after their position */
+static void
+compile_names(struct buf *ob, const char *name, struct node *node, size_t *index)
+{
+	for (; node != NULL; node = node->next) {
+		struct node_fetch *fetch = NULL;
+		size_t i, self;
 
-			for (i = 0; result == 0 && i < section_key.size; ++i) {
-				crustache_var subcontext = {0, 0, 0};
+		if (node->type == CRUSTACHE_NODE_MULTIROOT)
+			continue;
 
-				if (template->api.list_get(&subcontext, section_key.data, i) < 0) {
-					result = CR_ERENDER_NOT_FOUND;
-					break;
-				}
+		self = (*index)++;
+
+		if (node->type == CRUSTACHE_NODE_TAG && ((struct node_tag *)node)->filters == NULL)
+			fetch = (struct node_fetch *)((struct node_tag *)node)->tag_value;
+		else if (node->type == CRUSTACHE_NODE_SECTION)
+			fetch = (struct node_fetch *)((struct node_section *)node)->section_key;
 
-				stack_push(context, &subcontext);
-				result = render_node(ob, template, node->content, context, depth);
-				free_var(template, stack_pop(context));
+		if (fetch == NULL)
+			continue;
+
+		if (fetch->path_len > 0) {
+			bufprintf(ob, "static const crustache_key %s_path_%lu[] = {\n", name, (unsigned long)self);
+
+			for (i = 0; i < fetch->path_len; ++i) {
+				BUFPUTSL(ob, "\t");
+				compile_key(ob, fetch->path[i].name, fetch->path[i].size);
+				bufputs(ob, i + 1 < fetch->path_len ? ",\n" : "\n");
 			}
+
+			BUFPUTSL(ob, "};\n");
+		}
+
+		bufprintf(ob, "static const crustache_aot_name %s_name_%lu = {\n\t", name, (unsigned long)self);
+		compile_key(ob, fetch->head.ptr, fetch->head.size);
+
+		if (fetch->path_len > 0)
+			bufprintf(ob, ", %s_path_%lu, %lu, %lu\n};\n", name, (unsigned long)self,
+				(unsigned long)fetch->path_len, (unsigned long)self);
+		else
+			bufprintf(ob, ", NULL, 0, %lu\n};\n", (unsigned long)self);
+
+		if (node->type == CRUSTACHE_NODE_SECTION)
+			compile_names(ob, name, ((struct node_section *)node)->content, index);
+	}
+}
+
+/* Generate the code for a list of nodes, indented `level` times */
+static void
+compile_nodes(struct buf *ob, const char *name, struct node *node, size_t *index, int level)
+{
+	char indent[32];
+	int i;
+
+	for (i = 0; i < level && i + 1 < (int)sizeof(indent); ++i)
+		indent[i] = '\t';
+	indent[i] = '\0';
+
+	for (; node != NULL; node = node->next) {
+		size_t self;
+
+		if (node->type == CRUSTACHE_NODE_MULTIROOT)
+			continue;
+
+		self = (*index)++;
+
+		switch (node->type) {
+		case CRUSTACHE_NODE_STATIC: {
+			struct node_static *stnode = (struct node_static *)node;
+
+			bufprintf(ob, "%sbufput(ob, ", indent);
+			compile_string(ob, stnode->str.ptr, stnode->str.size, indent);
+			bufprintf(ob, ", %lu);\n", (unsigned long)stnode->str.size);
 			break;
 		}
 
-		case CRUSTACHE_VAR_LAMBDA:
-		{
-			crustache_var lambda_result = {0, 0, 0};
+		case CRUSTACHE_NODE_TAG:
+			compile_comment(ob, node, indent);
 
-			if (template->api.lambda(&lambda_result, section_key.data,
-				node->raw_content.ptr, node->raw_content.size) < 0) {
-				result = CR_ERENDER_NOT_FOUND;
+			if (((struct node_tag *)node)->filters != NULL) {
+				bufprintf(ob, "%sif ((error = crustache_aot_node(ob, aot, %lu)) < 0)\n"
+					"%s\treturn error;\n", indent, (unsigned long)self, indent);
 				break;
 			}
 
-			if (lambda_result.type == CRUSTACHE_VAR_STR) {
-				bufput(ob, lambda_result.data, lambda_result.size);
-			} else {
-				result = CR_ERENDER_WRONG_VARTYPE;
-				template->error_node = (struct node *)node;
-			}
+			bufprintf(ob, "%sif ((error = crustache_aot_fetch(&var, aot, &%s_name_%lu)) < 0 ||\n"
+				"%s\t(error = crustache_aot_put(ob, aot, &var, &%s_name_%lu)) < 0)\n"
+				"%s\treturn error;\n",
+				indent, name, (unsigned long)self,
+				indent, name, (unsigned long)self, indent);
+			break;
 
-			free_var(template, &lambda_result);
+		case CRUSTACHE_NODE_SECTION:
+			compile_comment(ob, node, indent);
+			bufprintf(ob, "%sfor (error = crustache_aot_begin(ob, aot, &%s_name_%lu); error > 0;\n"
+				"%s\terror = crustache_aot_next(ob, aot)) {\n",
+				indent, name, (unsigned long)self, indent);
+			compile_nodes(ob, name, ((struct node_section *)node)->content, index, level + 1);
+			bufprintf(ob, "%s}\n%sif (error < 0)\n%s\treturn error;\n", indent, indent, indent);
+			break;
+
+		case CRUSTACHE_NODE_PARTIAL:
+			compile_comment(ob, node, indent);
+			bufprintf(ob, "%sif ((error = crustache_aot_node(ob, aot, %lu)) < 0)\n"
+				"%s\treturn error;\n", indent, (unsigned long)self, indent);
 			break;
-		}
 
 		default:
-			result = CR_ERENDER_WRONG_VARTYPE;
-			template->error_node = (struct node *)node->section_key;
 			break;
 		}
 	}
+}
 
-	free_var(template, &section_key);
-	return result;
+/*
+ * Generate a C translation unit rendering `template`, with an exported
+ * `<name>_compiled` description (holding the source of the template),
+ * the source itself as `<name>_source` and a `<name>_new` function to
+ * create the template with the code attached. `name` must be a valid
+ * C identifier.
+ */
+int
+crustache_compile_c(struct buf *ob, crustache_template *template, const char *name)
+{
+	uint32_t hash = COMPILED_HASH_SEED;
+	struct compile_info info;
+	size_t count = 0, index = 0;
+
+	compiled_walk(template->root.next, NULL, &count, &hash);
+
+	memset(&info, 0x0, sizeof(info));
+	compile_scan(template->root.next, &info, 0);
+
+	compile_names(ob, name, template->root.next, &index);
+
+	bufprintf(ob, "\nstatic int\n%s_root(struct buf *ob, crustache_aot *aot)\n{\n", name);
+
+	if (info.fetches)
+		BUFPUTSL(ob, "\tcrustache_var var;\n");
+	if (info.errors)
+		BUFPUTSL(ob, "\tint error;\n");
+	if (info.fetches || info.errors)
+		BUFPUTSL(ob, "\n");
+
+	index = 0;
+	compile_nodes(ob, name, template->root.next, &index, 1);
+
+	if (!info.errors)
+		BUFPUTSL(ob, "\t(void)aot;\n");
+
+	BUFPUTSL(ob, "\treturn 0;\n}\n\n");
+
+	bufprintf(ob, "const size_t %s_source_size = %lu;\n", name, (unsigned long)template->raw_content.size);
+	bufprintf(ob, "const char %s_source[] =\n\t", name);
+	compile_string(ob, template->raw_content.ptr, template->raw_content.size, "\t");
+	BUFPUTSL(ob, ";\n\n");
+
+	bufprintf(ob, "const crustache_compiled %s_compiled = {\n"
+		"\t&%s_root, %lu, %lu, 0x%08lxu, %s_source, %lu\n};\n\n",
+		name, name, (unsigned long)count, (unsigned long)info.loop_depth,
+		(unsigned long)hash, name, (unsigned long)template->raw_content.size);
+
+	bufprintf(ob, "int\n%s_new(crustache_template **template, crustache_api *api)\n"
+		"{\n\treturn crustache_new_compiled(template, api, &%s_compiled);\n}\n",
+		name, name);
+
+	return 0;
 }
 
+/*
+ * Linking: splice the nodes of the partials into the template which
+ * uses them, so it renders as a single tree.
+ */
+
+/* The partials being inlined, from the innermost one */
+struct link_chain {
+	struct node_str name;
+	struct link_chain *parent;
+	int depth;
+};
+
+/* Copy a list of nodes; on error the copied ones are still chained in `output` */
 static int
-render_node(
-	struct buf *ob,
-	crustache_template *template,
-	struct node *node,
-	struct stack *context,
-	int depth)
+clone_nodes(struct node **output, const struct text_move *move, struct node *node)
 {
-	int result = 0;
-	size_t context_size;
+	struct node **tail = output;
 
-	crustache_var *ctx;
+	*output = NULL;
 
-	if (depth >= MAX_RENDER_RECURSION) {
-		template->error_node = node;
-		return CR_ERENDER_TOO_DEEP;
-	}
+	for (; node != NULL; node = node->next) {
+		struct node *copy;
+		int error = 0;
 
-	ctx = stack_top(context);
-	if (ctx == NULL || ctx->type != CRUSTACHE_VAR_CONTEXT) {
-		template->error_node = node;
-		return CR_ERENDER_INVALID_CONTEXT;
-	}
+		switch (node->type) {
+		case CRUSTACHE_NODE_STATIC: {
+			struct node_static *stnode = node_alloc(CRUSTACHE_NODE_STATIC, struct node_static);
 
-	context_size = context->size;
+			if (stnode != NULL) {
+				stnode->str.ptr = move_text(move, ((struct node_static *)node)->str.ptr);
+				stnode->str.size = ((struct node_static *)node)->str.size;
+			}
 
-	while (result == 0 && node != NULL) {
-		switch (node->type) {
-		case CRUSTACHE_NODE_MULTIROOT:
+			copy = (struct node *)stnode;
 			break;
+		}
 
-		case CRUSTACHE_NODE_STATIC:
-			render_node_static(ob, (struct node_static *)node);
-			break;
+		case CRUSTACHE_NODE_TAG: {
+			struct node_tag *tag = (struct node_tag *)node;
+			struct node_tag *tcopy = node_alloc(CRUSTACHE_NODE_TAG, struct node_tag);
 
-		case CRUSTACHE_NODE_TAG:
-			result = render_node_tag(ob, template, (struct node_tag *)node, context);
+			if (tcopy != NULL) {
+				tcopy->print_mode = tag->print_mode;
+				tcopy->tag_value = clone_fetch(move, (struct node_fetch *)tag->tag_value);
+				tcopy->filters = tag->filters ? clone_filters(move, tag->filters) : NULL;
+
+				if (tcopy->tag_value == NULL || (tag->filters != NULL && tcopy->filters == NULL))
+					error = CR_ENOMEM;
+			}
+
+			copy = (struct node *)tcopy;
 			break;
+		}
 
-		case CRUSTACHE_NODE_SECTION:
-			result = render_node_section(ob, template, (struct node_section *)node, context, depth + 1);
+		case CRUSTACHE_NODE_SECTION: {
+			struct node_section *section = (struct node_section *)node;
+			struct node_section *scopy = node_alloc(CRUSTACHE_NODE_SECTION, struct node_section);
+
+			if (scopy != NULL) {
+				*scopy = *section;
+				scopy->base.next = NULL;
+				scopy->section_key = clone_fetch(move, (struct node_fetch *)section->section_key);
+				scopy->content = node_alloc(CRUSTACHE_NODE_MULTIROOT, struct node);
+				scopy->raw_content.ptr = move_text(move, section->raw_content.ptr);
+				scopy->delim_open.ptr = move_text(move, section->delim_open.ptr);
+				scopy->delim_close.ptr = move_text(move, section->delim_close.ptr);
+				memset(&scopy->scope, 0x0, sizeof(struct scope));
+
+				if (scopy->section_key == NULL || scopy->content == NULL)
+					error = CR_ENOMEM;
+				else
+					error = clone_nodes(&scopy->content->next, move, section->content->next);
+			}
+
+			copy = (struct node *)scopy;
 			break;
+		}
 
-		case CRUSTACHE_NODE_PARTIAL:
-			result = render_node_partial(ob, template, (struct node_partial *)node, context, depth + 1);
+		case CRUSTACHE_NODE_PARTIAL: {
+			struct node_partial *pcopy = node_alloc(CRUSTACHE_NODE_PARTIAL, struct node_partial);
+
+			if (pcopy != NULL) {
+				pcopy->partial_name.ptr = move_text(move, ((struct node_partial *)node)->partial_name.ptr);
+				pcopy->partial_name.size = ((struct node_partial *)node)->partial_name.size;
+				pcopy->entry = NULL;
+			}
+
+			copy = (struct node *)pcopy;
 			break;
 		}
 
-		node = node->next;
+		default:
+			continue;
+		}
+
+		if (copy == NULL)
+			return CR_ENOMEM;
+
+		*tail = copy;
+		tail = &copy->next;
+
+		if (error < 0)
+			return error;
 	}
 
-	/* the stack should come out as it came in */
-	assert(context->size == context_size);
-	return result;
+	return 0;
 }
 
-int
-crustache_render(struct buf *ob, crustache_template *template, crustache_var *context)
+static int
+link_nodes(crustache_template *template, struct node *head, struct link_chain *chain);
+
+/*
+ * Replace the partial tag after `prev` with a copy of the nodes of the
+ * partial, and set `last` to the last of them. Partials which include
+ * themselves, or which can't be loaded, are left to be rendered (or to
+ * fail) as usual.
+ */
+static int
+link_partial(
+	crustache_template *template,
+	struct node *prev,
+	struct node **last,
+	struct link_chain *chain)
 {
+	struct node_partial *node = (struct node_partial *)prev->next;
+	crustache_template *partial;
+	struct text_move move;
+	struct link_chain link, *p;
+	struct node head, *tail;
 	int error;
-	struct stack context_stack;
 
-	stack_init(&context_stack, DEFAULT_STACK_SIZE);
-	stack_push(&context_stack, context);
-	error = render_node(ob, template, &template->root, &context_stack, 0);
-	stack_free(&context_stack);
+	*last = (struct node *)node;
 
-	return error;
+	if (chain != NULL && chain->depth >= MAX_RENDER_RECURSION)
+		return 0;
+
+	for (p = chain; p != NULL; p = p->parent) {
+		if (node_str_eq(&p->name, &node->partial_name))
+			return 0;
+	}
+
+	if (node->entry == NULL && (error = bind_partial(template, node)) < 0)
+		return error;
+
+	if (load_partial(&partial, template, node) < 0)
+		return 0;
+
+	/* the partial may be freed along with the cache */
+	if ((error = text_move_init(&move, template, partial, NULL)) < 0)
+		return error;
+
+	head.type = CRUSTACHE_NODE_MULTIROOT;
+	error = clone_nodes(&head.next, &move, partial->root.next);
+	free(move.ranges);
+
+	if (error == 0) {
+		link.name = node->partial_name;
+		link.parent = chain;
+		link.depth = chain ? chain->depth + 1 : 1;
+		error = link_nodes(template, &head, &link);
+	}
+
+	if (error < 0) {
+		node_free(head.next);
+		return error;
+	}
+
+	for (tail = &head; tail->next != NULL; tail = tail->next)
+		;
+
+	tail->next = node->base.next;
+	prev->next = head.next ? head.next : node->base.next;
+	*last = (tail == &head) ? prev : tail;
+
+	node->base.next = NULL;
+	node_free((struct node *)node);
+	return 0;
 }
 
-int
-crustache_new(
-	crustache_template **output,
-	crustache_api *api,
-	const char *raw_template, size_t raw_length)
+static int
+link_nodes(crustache_template *template, struct node *head, struct link_chain *chain)
 {
-	static const char MUSTACHE_OPEN[] = "{{";
-	static const char MUSTACHE_CLOSE[] = "}}";
+	struct node *prev = head;
+	int error = 0;
 
-	crustache_template *crt;
+	while (error == 0 && prev->next != NULL) {
+		struct node *node = prev->next;
 
-	crt = malloc(sizeof(crustache_template));
-	if (!crt)
-		return CR_ENOMEM;
+		switch (node->type) {
+		case CRUSTACHE_NODE_SECTION:
+			error = link_nodes(template, ((struct node_section *)node)->content, chain);
+			prev = node;
+			break;
 
-	memset(crt, 0x0, sizeof(crustache_template));
+		case CRUSTACHE_NODE_PARTIAL:
+			error = link_partial(template, prev, &prev, chain);
+			break;
 
-	memcpy(&crt->api, api, sizeof(crustache_api));
+		default:
+			prev = node;
+			break;
+		}
+	}
 
-	crt->raw_content.ptr = malloc(raw_length);
-	crt->raw_content.size = raw_length;
+	return error;
+}
 
-	if (crt->raw_content.ptr == NULL) {
-		free(crt);
-		return CR_ENOMEM;
+static void
+unbind_sections(struct node *node)
+{
+	for (; node != NULL; node = node->next) {
+		if (node->type == CRUSTACHE_NODE_SECTION) {
+			struct node_section *section = (struct node_section *)node;
+
+			scope_free(&section->scope);
+			memset(&section->scope, 0x0, sizeof(struct scope));
+			unbind_sections(section->content);
+		}
 	}
+}
 
-	memcpy(crt->raw_content.ptr, raw_template, raw_length);
+/*
+ * Inline all the partials of a template which don't include themselves
+ * (directly or through other partials), loading them through the
+ * `partial` callback. Each partial keeps the delimiters it was compiled
+ * with. If the template is itself a partial, `name` is the name it's
+ * loaded with, so it's never inlined into itself. Must be called before
+ * the template is rendered.
+ */
+int
+crustache_link_partials(crustache_template *template, const char *name, size_t name_size)
+{
+	struct link_chain root;
+	int error, bind_error;
 
-	crt->mustache_open.chars = MUSTACHE_OPEN;
-	crt->mustache_open.size = 2;
+	compiled_detach(template);
 
-	crt->mustache_close.chars = MUSTACHE_CLOSE;
-	crt->mustache_close.size = 2;
+	root.name.ptr = name;
+	root.name.size = name_size;
+	root.parent = NULL;
+	root.depth = 0;
 
-	crt->root.type = CRUSTACHE_NODE_MULTIROOT;
-	crt->root.next = NULL;
+	error = link_nodes(template, &template->root, name ? &root : NULL);
 
-	*output = crt;
+	/* the names and scopes are bound again for the whole tree */
+	unbind_sections(template->root.next);
+	scope_free(&template->root_scope);
+	memset(&template->root_scope, 0x0, sizeof(struct scope));
+	free(template->names);
+	template->names = NULL;
+	template->name_count = 0;
 
-	return parse_internal(crt, crt->raw_content.ptr, crt->raw_content.size, &crt->root);
+	bind_error = bind_template(template);
+	return error < 0 ? error : bind_error;
 }
 
 const char *
@@ -1110,7 +5430,7 @@ crustache_error_rendernode(char *buffer, size_t size, crustache_template *templa
 const char *
 crustache_strerror(int error)
 {
-	static const int SMALLEST_ERROR = CR_ENOMEM;
+	static const int SMALLEST_ERROR = CR_ECOMPILED_MISMATCH;
 	static const char *ERRORS[] = {
 		NULL,
 		"Mismatched bracers in mustache tag",
@@ -1126,6 +5446,13 @@ crustache_strerror(int error)
 		"The given Partial template is broken",
 
 		"Out of memory",
+
+		"A template variable is not valid UTF-8",
+		"Unknown filter or invalid filter arguments",
+		"A filter could not process its input",
+		"Invalid JSON",
+		"Invalid binary context",
+		"The compiled code doesn't match the template",
 	};
 
 	if (error >= 0 || error < SMALLEST_ERROR)
@@ -1134,13 +5461,62 @@ crustache_strerror(int error)
 	return ERRORS[-error];
 }
 
+/*
+ * Forget the partial called `name`, or all of them if `name` is NULL,
+ * so they are loaded again the next time they are rendered. Must not
+ * be called while the template is being rendered.
+ */
+void
+crustache_clear_partials(crustache_template *template, const char *name, size_t name_size)
+{
+	struct partial_entry *entry;
+
+	for (entry = template->partials; entry != NULL; entry = entry->next) {
+		if (name != NULL && (entry->name.size != name_size ||
+			memcmp(entry->name.ptr, name, name_size) != 0))
+			continue;
+
+		if (template->api.free_partials)
+			crustache_free(entry->template);
+
+		entry->template = NULL;
+	}
+}
+
 void
 crustache_free(crustache_template *template)
 {
+	size_t i;
+
 	if (!template)
 		return;
 
+	for (i = 0; i < LAMBDA_CACHE_SIZE; ++i)
+		crustache_free(template->lambda_cache[i].template);
+
+	cr_lock_free(&template->lambda_lock);
+	cr_lock_free(&template->partial_lock);
+
+	free(template->compiled_nodes);
+
+	crustache_clear_partials(template, NULL, 0);
+	while (template->partials != NULL) {
+		struct partial_entry *next = template->partials->next;
+		free(template->partials);
+		template->partials = next;
+	}
+
 	node_free(template->root.next);
+
+	while (template->linked != NULL) {
+		struct linked_text *next = template->linked->next;
+		free(template->linked);
+		template->linked = next;
+	}
+
+	bufrelease(template->static_content);
+	free(template->names);
+	scope_free(&template->root_scope);
 	free(template->raw_content.ptr);
 	free(template);
 }
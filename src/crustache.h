@@ -20,6 +20,13 @@ typedef enum {
 	CR_ERENDER_BAD_PARTIAL = -10,
 
 	CR_ENOMEM = -11,
+
+	CR_ERENDER_BAD_UTF8 = -12,
+	CR_EPARSE_BAD_FILTER = -13,
+	CR_ERENDER_FILTER = -14,
+	CR_EJSON_SYNTAX = -15,
+	CR_EBLOB = -16,
+	CR_ECOMPILED_MISMATCH = -17,
 } crustache_error_t;
 
 typedef enum {
@@ -28,17 +35,171 @@ typedef enum {
 	CRUSTACHE_VAR_LIST,
 	CRUSTACHE_VAR_LAMBDA,
 	CRUSTACHE_VAR_CONTEXT,
+	CRUSTACHE_VAR_INT64,
+	CRUSTACHE_VAR_DOUBLE,
+	CRUSTACHE_VAR_TRUE,
+	CRUSTACHE_VAR_SAFE_STR,
+	CRUSTACHE_VAR_COLUMNS,
 } crustache_var_t;
 
+typedef enum {
+	CRUSTACHE_UTF8_PASSTHROUGH = 0,
+	CRUSTACHE_UTF8_REPLACE,
+	CRUSTACHE_UTF8_FAIL,
+} crustache_utf8_t;
+
+/* Size of a CRUSTACHE_VAR_LIST whose length is not known in advance */
+#define CRUSTACHE_LIST_UNKNOWN ((size_t)-1)
+
+/* Flags for a crustache_var */
+#define CRUSTACHE_VAR_BORROWED (1 << 0) /* never passed to `var_free` */
+
 typedef struct {
 	crustache_var_t type;
 	void *data;
 	size_t size;
+	union {
+		int64_t integer;
+		double number;
+	} value;
+	unsigned int flags;
 } crustache_var;
 
+typedef struct {
+	size_t var_free_calls;
+	size_t var_free_skipped;
+} crustache_stats;
+
+typedef enum {
+	CRUSTACHE_COLUMN_STR,
+	CRUSTACHE_COLUMN_SAFE_STR,
+	CRUSTACHE_COLUMN_INT64,
+	CRUSTACHE_COLUMN_DOUBLE,
+	CRUSTACHE_COLUMN_BOOL,
+} crustache_column_t;
+
+/*
+ * A column of a CRUSTACHE_VAR_COLUMNS table. `values` points to an
+ * array with one entry per row:
+ *
+ *	STR, SAFE_STR: const char *, with the lengths in `sizes`
+ *	               (NULL entries are missing cells)
+ *	INT64: int64_t
+ *	DOUBLE: double
+ *	BOOL: unsigned char
+ */
+typedef struct {
+	const char *name;
+	size_t name_size;
+	crustache_column_t type;
+	const void *values;
+	const size_t *sizes;
+} crustache_column;
+
+typedef struct {
+	const crustache_column *columns;
+	size_t column_count;
+} crustache_columns;
+
+/* How a key is used by a template; see crustache_template_schema */
+enum {
+	CRUSTACHE_KEY_VARIABLE = (1 << 0),
+	CRUSTACHE_KEY_SECTION = (1 << 1),
+	CRUSTACHE_KEY_INVERTED = (1 << 2),
+	CRUSTACHE_KEY_PARENT = (1 << 3),
+};
+
+typedef struct crustache_schema_key {
+	const char *name;
+	size_t name_size;
+	unsigned int usage;
+
+	/* keys read inside the sections opened by this key, or
+	 * through dotted names starting with it */
+	struct crustache_schema_key *children;
+	struct crustache_schema_key *next;
+} crustache_schema_key;
+
+typedef struct crustache_schema_partial {
+	const char *name;
+	size_t name_size;
+	struct crustache_schema_partial *next;
+} crustache_schema_partial;
+
+typedef struct {
+	crustache_schema_key *keys;
+	crustache_schema_partial *partials;
+} crustache_schema;
+
+typedef struct {
+	const char *name;
+	size_t size;
+	size_t hash; /* crustache_key_hash(name, size) */
+} crustache_key;
+
 typedef struct crustache_template crustache_template;
+typedef struct crustache_escape_cache crustache_escape_cache;
+typedef struct crustache_arena crustache_arena;
+typedef struct crustache_value crustache_value;
+typedef struct crustache_section crustache_section;
+typedef struct crustache_fragment_cache crustache_fragment_cache;
+typedef struct crustache_result crustache_result;
+typedef struct crustache_aot crustache_aot;
+
+/* The function generated by crustache-aot to render a template */
+typedef int (*crustache_aot_fn)(struct buf *ob, crustache_aot *aot);
+
+/* A template compiled into C by crustache-aot. `loop_depth` is how
+ * deep its sections nest, and `source` is the text it was compiled
+ * from */
+typedef struct {
+	crustache_aot_fn root;
+	size_t node_count;
+	size_t loop_depth;
+	uint32_t hash;
+	const char *source;
+	size_t source_size;
+} crustache_compiled;
 
+/* A name looked up by the code generated by crustache-aot, split into
+ * keys like in the template, for the node at position `node` */
 typedef struct {
+	crustache_key key;
+	const crustache_key *path;
+	size_t path_len;
+	size_t node;
+} crustache_aot_name;
+
+/* A range of the output which changed in a crustache_rerender: the old
+ * bytes were at `old_start` in the previous output, the new ones are at
+ * `new_start` in the current one */
+typedef struct {
+	size_t old_start, old_size;
+	size_t new_start, new_size;
+} crustache_change;
+typedef struct crustache_blob_writer crustache_blob_writer;
+
+struct crustache_api;
+
+/*
+ * A filter transforms the variable `in` into `out`. Strings produced
+ * by the filter must be written into `scratch`, which is owned by the
+ * renderer, or point into the input or the arguments. Filter output is
+ * never passed to `var_free`.
+ */
+typedef int (*crustache_filter_fn)(
+	crustache_var *out,
+	crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch,
+	const struct crustache_api *api);
+
+typedef struct {
+	const char *name;
+	crustache_filter_fn filter;
+} crustache_filter;
+
+typedef struct crustache_api {
 	int (*context_find)(crustache_var *, void *context, const char *key, size_t key_size);
 	int (*list_get)(crustache_var *, void *list, size_t i);
 	int (*lambda)(crustache_var *, void *lambda, const char *raw_template, size_t raw_size);
@@ -46,18 +207,99 @@ typedef struct {
 
 	int (*partial)(crustache_template **partial, const char *partial_name, size_t name_size);
 	int free_partials;
+
+	crustache_escape_cache *escape_cache;
+	crustache_utf8_t validate_utf8;
+
+	const crustache_filter *filters;
+	int minify_html;
+
+	int (*list_begin)(void **iterator, void *list);
+	int (*list_next_batch)(crustache_var *vars, size_t max, size_t *count, void *iterator);
+	void (*list_end)(void *iterator);
+
+	int (*context_find_many)(crustache_var *vars, int *found, void *context, const crustache_key *keys, size_t count);
+
+	crustache_stats *stats;
+	crustache_arena *arena;
+
+	int (*lambda_section)(struct buf *ob, void *lambda, crustache_section *section);
+
+	crustache_fragment_cache *fragment_cache;
+	int (*cache_key)(struct buf *key, const char *section_name, size_t name_size, crustache_section *section);
 } crustache_api;
 
 
 extern void
 crustache_free(crustache_template *template);
 
+extern void
+crustache_clear_partials(crustache_template *template, const char *name, size_t name_size);
+
 extern int
 crustache_new(crustache_template **output, crustache_api *api, const char *raw_template, size_t raw_length);
 
+extern int
+crustache_link_partials(crustache_template *template, const char *name, size_t name_size);
+
+extern int
+crustache_specialize(crustache_template **output, crustache_template *template, crustache_var *statics);
+
 extern int
 crustache_render(struct buf *ob, crustache_template *template, crustache_var *context);
 
+extern int
+crustache_render_layers(struct buf *ob, crustache_template *template, crustache_var *contexts, size_t context_count);
+
+extern int
+crustache_render_tracked(crustache_result **result, crustache_template *template, crustache_var *context);
+
+extern int
+crustache_rerender(crustache_result *result, const crustache_key *changed, size_t count);
+
+extern const char *
+crustache_result_output(crustache_result *result, size_t *size);
+
+extern const crustache_change *
+crustache_result_changes(crustache_result *result, size_t *count);
+
+extern void
+crustache_result_free(crustache_result *result);
+
+extern int
+crustache_attach_compiled(crustache_template *template, const crustache_compiled *compiled);
+
+extern int
+crustache_new_compiled(crustache_template **output, crustache_api *api, const crustache_compiled *compiled);
+
+extern int
+crustache_compile_c(struct buf *ob, crustache_template *template, const char *name);
+
+/* Used by the code generated by crustache-aot */
+extern int
+crustache_aot_node(struct buf *ob, crustache_aot *aot, size_t node);
+
+extern int
+crustache_aot_fetch(crustache_var *out, crustache_aot *aot, const crustache_aot_name *name);
+
+extern int
+crustache_aot_put(struct buf *ob, crustache_aot *aot, crustache_var *var, const crustache_aot_name *name);
+
+extern int
+crustache_aot_begin(struct buf *ob, crustache_aot *aot, const crustache_aot_name *name);
+
+extern int
+crustache_aot_next(struct buf *ob, crustache_aot *aot);
+
+extern int
+crustache_render_section(struct buf *ob, crustache_section *section, crustache_var *context);
+
+extern const char *
+crustache_section_text(crustache_section *section, size_t *size);
+
+extern int
+crustache_section_find(crustache_var *var, crustache_section *section, const char *name, size_t name_size);
+
 const char *
 crustache_error_syntaxline(
 	size_t *line_n,
@@ -71,4 +313,146 @@ crustache_error_rendernode(char *buffer, size_t size, crustache_template *templa
 extern const char *
 crustache_strerror(int error);
 
+extern size_t
+crustache_key_hash(const char *key, size_t size);
+
+extern int
+crustache_template_schema(crustache_schema **schema, crustache_template *template, int expand_partials);
+
+extern void
+crustache_schema_free(crustache_schema *schema);
+
+extern crustache_escape_cache *
+crustache_escape_cache_new(size_t max_entries, size_t max_bytes);
+
+extern void
+crustache_escape_cache_clear(crustache_escape_cache *cache);
+
+extern void
+crustache_escape_cache_stats(crustache_escape_cache *cache, size_t *hits, size_t *misses);
+
+extern void
+crustache_escape_cache_free(crustache_escape_cache *cache);
+
+extern crustache_fragment_cache *
+crustache_fragment_cache_new(size_t max_bytes, unsigned int ttl);
+
+extern void
+crustache_fragment_cache_clear(crustache_fragment_cache *cache);
+
+extern void
+crustache_fragment_cache_stats(crustache_fragment_cache *cache, size_t *hits, size_t *misses);
+
+extern void
+crustache_fragment_cache_free(crustache_fragment_cache *cache);
+
+extern crustache_arena *
+crustache_arena_new(size_t chunk_size);
+
+extern void *
+crustache_arena_alloc(crustache_arena *arena, size_t size);
+
+extern void
+crustache_arena_reset(crustache_arena *arena);
+
+extern void
+crustache_arena_free(crustache_arena *arena);
+
+extern crustache_value *
+crustache_value_new_str(crustache_arena *arena, const char *str, size_t size);
+
+extern crustache_value *
+crustache_value_new_safe_str(crustache_arena *arena, const char *str, size_t size);
+
+extern crustache_value *
+crustache_value_new_int(crustache_arena *arena, int64_t integer);
+
+extern crustache_value *
+crustache_value_new_double(crustache_arena *arena, double number);
+
+extern crustache_value *
+crustache_value_new_bool(crustache_arena *arena, int boolean);
+
+extern crustache_value *
+crustache_value_new_array(crustache_arena *arena, size_t capacity);
+
+extern crustache_value *
+crustache_value_new_map(crustache_arena *arena, size_t capacity);
+
+extern int
+crustache_value_push(crustache_arena *arena, crustache_value *array, crustache_value *item);
+
+extern int
+crustache_value_set(
+	crustache_arena *arena,
+	crustache_value *map,
+	const char *key, size_t key_size,
+	crustache_value *value);
+
+extern crustache_value *
+crustache_value_get(crustache_value *map, const char *key, size_t key_size);
+
+extern crustache_value *
+crustache_value_at(crustache_value *array, size_t i);
+
+extern size_t
+crustache_value_size(crustache_value *value);
+
+extern void
+crustache_value_var(crustache_var *var, crustache_value *value);
+
+extern void
+crustache_value_api(crustache_api *api);
+
+extern int
+crustache_json_parse(crustache_value **value, crustache_arena *arena, const char *json, size_t size);
+
+extern int
+crustache_json_decode_all(crustache_value *value);
+
+extern crustache_blob_writer *
+crustache_blob_writer_new(struct buf *ob);
+
+extern void
+crustache_blob_writer_free(crustache_blob_writer *writer);
+
+extern int
+crustache_blob_put_str(crustache_blob_writer *writer, const char *str, size_t size);
+
+extern int
+crustache_blob_put_safe_str(crustache_blob_writer *writer, const char *str, size_t size);
+
+extern int
+crustache_blob_put_int(crustache_blob_writer *writer, int64_t integer);
+
+extern int
+crustache_blob_put_double(crustache_blob_writer *writer, double number);
+
+extern int
+crustache_blob_put_bool(crustache_blob_writer *writer, int boolean);
+
+extern int
+crustache_blob_begin_array(crustache_blob_writer *writer);
+
+extern int
+crustache_blob_begin_map(crustache_blob_writer *writer);
+
+extern int
+crustache_blob_put_key(crustache_blob_writer *writer, const char *key, size_t key_size);
+
+extern int
+crustache_blob_end(crustache_blob_writer *writer);
+
+extern int
+crustache_blob_finish(crustache_blob_writer *writer);
+
+extern int
+crustache_blob_var(crustache_var *var, const void *blob, size_t size);
+
+extern int
+crustache_blob_check(const void *blob, size_t size);
+
+extern void
+crustache_blob_api(crustache_api *api);
+
 #endif
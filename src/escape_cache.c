@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "escape_cache.h"
+#include "houdini.h"
+
+/* Strings shorter than this are escaped faster than they can be looked up */
+#define ESCAPE_CACHE_MIN_SIZE 8
+
+struct escape_entry {
+	const char *src;
+	size_t src_size;
+	size_t out_offset;
+	size_t out_size;
+	crustache_utf8_t utf8;
+};
+
+struct crustache_escape_cache {
+	struct escape_entry *table;
+	size_t mask;
+	size_t used;
+	size_t max_entries;
+
+	struct buf *data;
+	size_t max_bytes;
+
+	size_t hits;
+	size_t misses;
+};
+
+static size_t
+hash_ptr(const char *ptr, size_t size)
+{
+	uintptr_t h = (uintptr_t)ptr;
+
+	h = (h >> 4) ^ (h >> 16);
+	h ^= (uintptr_t)size * 2654435761u;
+	return (size_t)h;
+}
+
+crustache_escape_cache *
+crustache_escape_cache_new(size_t max_entries, size_t max_bytes)
+{
+	crustache_escape_cache *cache;
+	size_t table_size = 16;
+
+	if (max_entries == 0)
+		return NULL;
+
+	/* keep the load factor under 50% */
+	while (table_size < max_entries * 2)
+		table_size *= 2;
+
+	cache = malloc(sizeof(crustache_escape_cache));
+	if (cache == NULL)
+		return NULL;
+
+	memset(cache, 0x0, sizeof(crustache_escape_cache));
+
+	cache->table = calloc(table_size, sizeof(struct escape_entry));
+	cache->data = bufnew(1024);
+
+	if (cache->table == NULL || cache->data == NULL) {
+		crustache_escape_cache_free(cache);
+		return NULL;
+	}
+
+	cache->mask = table_size - 1;
+	cache->max_entries = max_entries;
+	cache->max_bytes = max_bytes;
+	return cache;
+}
+
+void
+crustache_escape_cache_clear(crustache_escape_cache *cache)
+{
+	if (!cache)
+		return;
+
+	memset(cache->table, 0x0, (cache->mask + 1) * sizeof(struct escape_entry));
+	cache->used = 0;
+	cache->data->size = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+}
+
+void
+crustache_escape_cache_stats(crustache_escape_cache *cache, size_t *hits, size_t *misses)
+{
+	*hits = cache->hits;
+	*misses = cache->misses;
+}
+
+void
+crustache_escape_cache_free(crustache_escape_cache *cache)
+{
+	if (!cache)
+		return;
+
+	free(cache->table);
+	bufrelease(cache->data);
+	free(cache);
+}
+
+static int
+escape_html(struct buf *ob, const char *src, size_t size, crustache_utf8_t utf8)
+{
+	if (utf8 == CRUSTACHE_UTF8_PASSTHROUGH) {
+		houdini_escape_html(ob, src, size);
+		return 0;
+	}
+
+	return houdini_escape_html_utf8(ob, src, size, utf8 == CRUSTACHE_UTF8_REPLACE);
+}
+
+int
+escape_cache_html(
+	crustache_escape_cache *cache,
+	struct buf *ob,
+	const char *src, size_t size,
+	crustache_utf8_t utf8)
+{
+	struct escape_entry *entry;
+	size_t i, out_start;
+
+	if (size < ESCAPE_CACHE_MIN_SIZE)
+		return escape_html(ob, src, size, utf8);
+
+	i = hash_ptr(src, size) & cache->mask;
+
+	while ((entry = &cache->table[i])->src != NULL) {
+		if (entry->src == src && entry->src_size == size && entry->utf8 == utf8) {
+			cache->hits++;
+			bufput(ob, cache->data->data + entry->out_offset, entry->out_size);
+			return 0;
+		}
+
+		i = (i + 1) & cache->mask;
+	}
+
+	cache->misses++;
+
+	out_start = ob->size;
+	if (escape_html(ob, src, size, utf8) < 0)
+		return -1;
+
+	/* the cache is full: keep serving the entries we have,
+	 * but don't store any more */
+	if (cache->used >= cache->max_entries ||
+		(cache->max_bytes && cache->data->size + (ob->size - out_start) > cache->max_bytes))
+		return 0;
+
+	entry->out_offset = cache->data->size;
+	bufput(cache->data, ob->data + out_start, ob->size - out_start);
+
+	if (cache->data->size != entry->out_offset + (ob->size - out_start))
+		return 0; /* out of memory */
+
+	entry->src = src;
+	entry->src_size = size;
+	entry->out_size = ob->size - out_start;
+	entry->utf8 = utf8;
+	cache->used++;
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef __CR_ESCAPE_CACHE_H__
+#define __CR_ESCAPE_CACHE_H__
+
+#include "crustache.h"
+
+/* Escape `src` into `ob`, serving the result from the cache when the
+ * same (pointer, size) pair has been escaped before with the same
+ * UTF-8 validation mode. Returns -1 if `src` is not valid UTF-8 and
+ * the mode is CRUSTACHE_UTF8_FAIL */
+extern int
+escape_cache_html(
+	crustache_escape_cache *cache,
+	struct buf *ob,
+	const char *src, size_t size,
+	crustache_utf8_t utf8);
+
+#endif
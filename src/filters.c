@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "filters.h"
+
+static int
+is_string(const crustache_var *var)
+{
+	return var->type == CRUSTACHE_VAR_STR || var->type == CRUSTACHE_VAR_SAFE_STR;
+}
+
+static void
+set_string(crustache_var *out, crustache_var_t type, const char *data, size_t size)
+{
+	out->type = type;
+	out->data = (void *)data;
+	out->size = size;
+}
+
+/* Print a scalar variable as text; returns -1 if it has no text form */
+static int
+put_scalar(struct buf *ob, const crustache_var *var)
+{
+	switch (var->type) {
+	case CRUSTACHE_VAR_STR:
+	case CRUSTACHE_VAR_SAFE_STR:
+		bufput(ob, var->data, var->size);
+		return 0;
+
+	case CRUSTACHE_VAR_INT64:
+		bufputi64(ob, var->value.integer);
+		return 0;
+
+	case CRUSTACHE_VAR_DOUBLE:
+		bufputd(ob, var->value.number);
+		return 0;
+
+	case CRUSTACHE_VAR_TRUE:
+		BUFPUTSL(ob, "true");
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Length of the HTML tag or character reference at `str[i]`, or 0 if
+ * there's none. Filters skip them when rewriting safe strings, so the
+ * markup stays intact.
+ */
+static size_t
+markup_len(const char *str, size_t size, size_t i)
+{
+	size_t j;
+
+	if (str[i] == '<') {
+		const char *end = memchr(str + i, '>', size - i);
+		return end ? (size_t)(end - str) - i + 1 : 0;
+	}
+
+	if (str[i] == '&') {
+		for (j = i + 1; j < size && j - i < 32; ++j) {
+			char c = str[j];
+
+			if (c == ';')
+				return j > i + 1 ? j - i + 1 : 0;
+
+			if (!(c == '#' || (c >= '0' && c <= '9') ||
+				(c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+				break;
+		}
+	}
+
+	return 0;
+}
+
+static int
+filter_case(crustache_var *out, crustache_var *in, struct buf *scratch, int upper)
+{
+	int safe = (in->type == CRUSTACHE_VAR_SAFE_STR);
+	size_t i, skip;
+
+	if (in->type == CRUSTACHE_VAR_FALSE) {
+		*out = *in;
+		return 0;
+	}
+
+	if (put_scalar(scratch, in) < 0)
+		return -1;
+
+	for (i = 0; i < scratch->size; ++i) {
+		char c = scratch->data[i];
+
+		if (safe && (skip = markup_len(scratch->data, scratch->size, i)) > 0) {
+			i += skip - 1;
+			continue;
+		}
+
+		if (upper && c >= 'a' && c <= 'z')
+			scratch->data[i] = c - 'a' + 'A';
+		else if (!upper && c >= 'A' && c <= 'Z')
+			scratch->data[i] = c - 'A' + 'a';
+	}
+
+	set_string(out, safe ? CRUSTACHE_VAR_SAFE_STR : CRUSTACHE_VAR_STR, scratch->data, scratch->size);
+	return 0;
+}
+
+/* {{name | upcase}} */
+static int
+filter_upcase(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	(void)args;
+	(void)api;
+
+	if (arg_count != 0)
+		return -1;
+
+	return filter_case(out, in, scratch, 1);
+}
+
+/* {{name | downcase}} */
+static int
+filter_downcase(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	(void)args;
+	(void)api;
+
+	if (arg_count != 0)
+		return -1;
+
+	return filter_case(out, in, scratch, 0);
+}
+
+/* {{title | truncate: 20}}, {{title | truncate: 20, " (more)"}}
+ *
+ * Truncates to a number of UTF-8 characters, appending an ellipsis
+ * (or the given suffix) if anything was cut off. Strings which are
+ * short enough are not copied. In safe strings, a character reference
+ * counts as one character and tags as none, and neither is cut. */
+static int
+filter_truncate(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	const char *str;
+	size_t i, chars = 0, limit, skip = 0;
+
+	if (arg_count < 1 || arg_count > 2 ||
+		args[0].type != CRUSTACHE_VAR_INT64 || args[0].value.integer < 0 ||
+		(arg_count == 2 && args[1].type != CRUSTACHE_VAR_STR))
+		return -1;
+
+	if (in->type == CRUSTACHE_VAR_FALSE) {
+		*out = *in;
+		return 0;
+	}
+
+	if (!is_string(in))
+		return -1;
+
+	str = in->data;
+	limit = (size_t)args[0].value.integer;
+
+	(void)api;
+
+	for (i = 0; i < in->size; i += skip ? skip : 1) {
+		skip = (in->type == CRUSTACHE_VAR_SAFE_STR) ? markup_len(str, in->size, i) : 0;
+
+		if (skip > 0 && str[i] == '<')
+			continue;
+
+		if ((str[i] & 0xC0) != 0x80 && chars++ == limit)
+			break;
+	}
+
+	if (i == in->size) {
+		*out = *in;
+		return 0;
+	}
+
+	bufput(scratch, str, i);
+
+	if (arg_count == 2)
+		bufput(scratch, args[1].data, args[1].size);
+	else
+		BUFPUTSL(scratch, "...");
+
+	set_string(out, in->type, scratch->data, scratch->size);
+	return 0;
+}
+
+/* {{name | default: "Anonymous"}}
+ *
+ * Replaces missing, false and empty values */
+static int
+filter_default(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	(void)scratch;
+	(void)api;
+
+	if (arg_count != 1)
+		return -1;
+
+	if (in->type == CRUSTACHE_VAR_FALSE ||
+		(is_string(in) && in->size == 0) ||
+		((in->type == CRUSTACHE_VAR_LIST || in->type == CRUSTACHE_VAR_COLUMNS) && in->size == 0))
+		*out = args[0];
+	else
+		*out = *in;
+
+	return 0;
+}
+
+static void
+put_separator(struct buf *scratch, const crustache_var *args, size_t arg_count)
+{
+	if (arg_count == 1)
+		bufput(scratch, args[0].data, args[0].size);
+	else
+		BUFPUTSL(scratch, ", ");
+}
+
+static int
+join_item(struct buf *scratch, crustache_var *item, const crustache_api *api)
+{
+	int error = put_scalar(scratch, item);
+	api_free_var(api, item);
+	return error;
+}
+
+static int
+join_batched(
+	struct buf *scratch, crustache_var *list,
+	const crustache_var *args, size_t arg_count,
+	const crustache_api *api)
+{
+	crustache_var batch[16];
+	void *iterator = list->data;
+	size_t count, i, n = 0;
+	int error = 0;
+
+	if (api->list_begin != NULL && api->list_begin(&iterator, list->data) < 0)
+		return -1;
+
+	do {
+		memset(batch, 0x0, sizeof(batch));
+		count = 0;
+
+		if (api->list_next_batch(batch, 16, &count, iterator) < 0) {
+			error = -1;
+			break;
+		}
+
+		for (i = 0; i < count; ++i) {
+			if (n++ > 0)
+				put_separator(scratch, args, arg_count);
+
+			if (join_item(scratch, &batch[i], api) < 0)
+				error = -1;
+		}
+	} while (error == 0 && count > 0);
+
+	if (api->list_end != NULL)
+		api->list_end(iterator);
+
+	return error;
+}
+
+/* {{tags | join}}, {{tags | join: " / "}} */
+static int
+filter_join(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	size_t i;
+
+	if (arg_count > 1 || (arg_count == 1 && args[0].type != CRUSTACHE_VAR_STR))
+		return -1;
+
+	if (in->type == CRUSTACHE_VAR_FALSE) {
+		*out = *in;
+		return 0;
+	}
+
+	if (in->type != CRUSTACHE_VAR_LIST)
+		return -1;
+
+	/* lists of unknown size can only be walked with a cursor of their own */
+	if (in->size == CRUSTACHE_LIST_UNKNOWN &&
+		(api->list_begin == NULL || api->list_next_batch == NULL))
+		return -1;
+
+	if (api->list_next_batch != NULL) {
+		if (join_batched(scratch, in, args, arg_count, api) < 0)
+			return -1;
+	} else {
+		for (i = 0; i < in->size; ++i) {
+			crustache_var item;
+
+			memset(&item, 0x0, sizeof(crustache_var));
+
+			if (api->list_get(&item, in->data, i) < 0)
+				return -1;
+
+			if (i > 0)
+				put_separator(scratch, args, arg_count);
+
+			if (join_item(scratch, &item, api) < 0)
+				return -1;
+		}
+	}
+
+	set_string(out, CRUSTACHE_VAR_STR, scratch->data, scratch->size);
+	return 0;
+}
+
+/* {{price | number: 2}} => 1,234.50 */
+static int
+filter_number(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	char digits[400];
+	int decimals = 0, len, int_len, i;
+
+	(void)api;
+
+	if (arg_count > 1 || (arg_count == 1 &&
+		(args[0].type != CRUSTACHE_VAR_INT64 ||
+		 args[0].value.integer < 0 || args[0].value.integer > 17)))
+		return -1;
+
+	if (arg_count == 1)
+		decimals = (int)args[0].value.integer;
+
+	switch (in->type) {
+	case CRUSTACHE_VAR_FALSE:
+		*out = *in;
+		return 0;
+
+	case CRUSTACHE_VAR_INT64:
+		len = snprintf(digits, sizeof(digits), "%lld", (long long)in->value.integer);
+		if (len > 0 && decimals > 0) {
+			digits[len++] = '.';
+			memset(digits + len, '0', decimals);
+			len += decimals;
+		}
+		break;
+
+	case CRUSTACHE_VAR_DOUBLE:
+		/* NaN and infinities have no digits to group */
+		if (!isfinite(in->value.number)) {
+			bufputd(scratch, in->value.number);
+			set_string(out, CRUSTACHE_VAR_STR, scratch->data, scratch->size);
+			return 0;
+		}
+
+		len = snprintf(digits, sizeof(digits), "%.*f", decimals, in->value.number);
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (len < 0 || len >= (int)sizeof(digits))
+		return -1;
+
+	i = 0;
+	if (digits[0] == '-') {
+		bufputc(scratch, '-');
+		i = 1;
+	}
+
+	int_len = i;
+	while (int_len < len && digits[int_len] >= '0' && digits[int_len] <= '9')
+		int_len++;
+
+	/* group the integral part in thousands */
+	for (; i < int_len; ++i) {
+		bufputc(scratch, digits[i]);
+		if (i + 1 < int_len && (int_len - i - 1) % 3 == 0)
+			bufputc(scratch, ',');
+	}
+
+	/* the locale may have given us a decimal comma */
+	if (int_len < len) {
+		bufputc(scratch, '.');
+		bufput(scratch, digits + int_len + 1, len - int_len - 1);
+	}
+
+	set_string(out, CRUSTACHE_VAR_STR, scratch->data, scratch->size);
+	return 0;
+}
+
+crustache_filter_fn
+filters_builtin(const char *name, size_t name_size)
+{
+	static const crustache_filter BUILTINS[] = {
+		{"upcase", &filter_upcase},
+		{"downcase", &filter_downcase},
+		{"truncate", &filter_truncate},
+		{"default", &filter_default},
+		{"join", &filter_join},
+		{"number", &filter_number},
+	};
+
+	size_t i;
+
+	for (i = 0; i < sizeof(BUILTINS) / sizeof(BUILTINS[0]); ++i) {
+		if (strlen(BUILTINS[i].name) == name_size &&
+			memcmp(BUILTINS[i].name, name, name_size) == 0)
+			return BUILTINS[i].filter;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef __CR_FILTERS_H__
+#define __CR_FILTERS_H__
+
+#include "crustache.h"
+
+/* Find a built-in filter by name; returns NULL if there's no such filter */
+extern crustache_filter_fn
+filters_builtin(const char *name, size_t name_size);
+
+/* Hand a variable fetched from the host back to its `var_free` callback */
+extern void
+api_free_var(const crustache_api *api, crustache_var *var);
+
+#endif
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fragment_cache.h"
+#include "lock.h"
+
+#define FRAGMENT_MIN_BUCKETS 64
+
+/* The key and the rendered bytes are stored right after the entry */
+struct fragment_entry {
+	size_t hash;
+	size_t key_size;
+	size_t size;
+	time_t expires;
+
+	struct fragment_entry *next_in_bucket;
+	struct fragment_entry *newer, *older;
+};
+
+struct crustache_fragment_cache {
+	cr_lock_t lock;
+
+	struct fragment_entry **buckets;
+	size_t mask;
+	size_t count;
+
+	/* most and least recently used */
+	struct fragment_entry *newest, *oldest;
+
+	size_t bytes;
+	size_t max_bytes;
+	unsigned int ttl;
+
+	size_t hits;
+	size_t misses;
+
+	/* handed out to the templates using the cache */
+	unsigned long last_id;
+};
+
+/* FNV-1a */
+static size_t
+hash_key(const char *key, size_t size)
+{
+	size_t i, h = (size_t)2166136261u;
+
+	for (i = 0; i < size; ++i) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static const char *
+entry_key(const struct fragment_entry *entry)
+{
+	return (const char *)(entry + 1);
+}
+
+static size_t
+entry_bytes(const struct fragment_entry *entry)
+{
+	return sizeof(struct fragment_entry) + entry->key_size + entry->size;
+}
+
+crustache_fragment_cache *
+crustache_fragment_cache_new(size_t max_bytes, unsigned int ttl)
+{
+	crustache_fragment_cache *cache;
+
+	if (max_bytes == 0)
+		return NULL;
+
+	cache = malloc(sizeof(crustache_fragment_cache));
+	if (cache == NULL)
+		return NULL;
+
+	memset(cache, 0x0, sizeof(crustache_fragment_cache));
+
+	cache->buckets = calloc(FRAGMENT_MIN_BUCKETS, sizeof(struct fragment_entry *));
+	if (cache->buckets == NULL || cr_lock_init(&cache->lock) != 0) {
+		free(cache->buckets);
+		free(cache);
+		return NULL;
+	}
+
+	cache->mask = FRAGMENT_MIN_BUCKETS - 1;
+	cache->max_bytes = max_bytes;
+	cache->ttl = ttl;
+	return cache;
+}
+
+static void
+lru_unlink(crustache_fragment_cache *cache, struct fragment_entry *entry)
+{
+	if (entry->newer)
+		entry->newer->older = entry->older;
+	else
+		cache->newest = entry->older;
+
+	if (entry->older)
+		entry->older->newer = entry->newer;
+	else
+		cache->oldest = entry->newer;
+}
+
+static void
+lru_push(crustache_fragment_cache *cache, struct fragment_entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = cache->newest;
+
+	if (cache->newest)
+		cache->newest->newer = entry;
+	else
+		cache->oldest = entry;
+
+	cache->newest = entry;
+}
+
+static void
+entry_remove(crustache_fragment_cache *cache, struct fragment_entry *entry)
+{
+	struct fragment_entry **slot = &cache->buckets[entry->hash & cache->mask];
+
+	while (*slot != entry)
+		slot = &(*slot)->next_in_bucket;
+
+	*slot = entry->next_in_bucket;
+	lru_unlink(cache, entry);
+
+	cache->bytes -= entry_bytes(entry);
+	cache->count--;
+	free(entry);
+}
+
+static struct fragment_entry *
+entry_find(crustache_fragment_cache *cache, size_t hash, const char *key, size_t key_size)
+{
+	struct fragment_entry *entry = cache->buckets[hash & cache->mask];
+
+	while (entry != NULL) {
+		if (entry->hash == hash && entry->key_size == key_size &&
+			memcmp(entry_key(entry), key, key_size) == 0)
+			return entry;
+
+		entry = entry->next_in_bucket;
+	}
+
+	return NULL;
+}
+
+/* Keep the chains short; a failed resize just leaves them longer */
+static void
+buckets_grow(crustache_fragment_cache *cache)
+{
+	size_t size = (cache->mask + 1) * 2, i;
+	struct fragment_entry **buckets = calloc(size, sizeof(struct fragment_entry *));
+
+	if (buckets == NULL)
+		return;
+
+	for (i = 0; i <= cache->mask; ++i) {
+		struct fragment_entry *entry = cache->buckets[i];
+
+		while (entry != NULL) {
+			struct fragment_entry *next = entry->next_in_bucket;
+
+			entry->next_in_bucket = buckets[entry->hash & (size - 1)];
+			buckets[entry->hash & (size - 1)] = entry;
+			entry = next;
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->mask = size - 1;
+}
+
+int
+fragment_cache_get(
+	crustache_fragment_cache *cache,
+	struct buf *ob,
+	const char *key, size_t key_size)
+{
+	size_t hash = hash_key(key, key_size);
+	struct fragment_entry *entry;
+	int result = -1;
+
+	cr_lock(&cache->lock);
+
+	entry = entry_find(cache, hash, key, key_size);
+
+	if (entry != NULL && entry->expires != 0 && time(NULL) >= entry->expires) {
+		entry_remove(cache, entry);
+		entry = NULL;
+	}
+
+	if (entry != NULL) {
+		lru_unlink(cache, entry);
+		lru_push(cache, entry);
+
+		bufput(ob, entry_key(entry) + entry->key_size, entry->size);
+		cache->hits++;
+		result = 0;
+	} else {
+		cache->misses++;
+	}
+
+	cr_unlock(&cache->lock);
+	return result;
+}
+
+void
+fragment_cache_put(
+	crustache_fragment_cache *cache,
+	const char *key, size_t key_size,
+	const char *data, size_t size)
+{
+	size_t hash = hash_key(key, key_size);
+	size_t bytes = sizeof(struct fragment_entry) + key_size + size;
+	struct fragment_entry *entry, **bucket;
+
+	if (bytes > cache->max_bytes)
+		return;
+
+	/* build the entry before taking the lock */
+	entry = malloc(bytes);
+	if (entry == NULL)
+		return;
+
+	entry->hash = hash;
+	entry->key_size = key_size;
+	entry->size = size;
+	entry->expires = cache->ttl ? time(NULL) + cache->ttl : 0;
+	memcpy((char *)(entry + 1), key, key_size);
+	memcpy((char *)(entry + 1) + key_size, data, size);
+
+	cr_lock(&cache->lock);
+
+	/* another thread may have rendered the same fragment */
+	{
+		struct fragment_entry *old = entry_find(cache, hash, key, key_size);
+		if (old != NULL)
+			entry_remove(cache, old);
+	}
+
+	while (cache->bytes + bytes > cache->max_bytes)
+		entry_remove(cache, cache->oldest);
+
+	if (cache->count >= (cache->mask + 1) * 2)
+		buckets_grow(cache);
+
+	bucket = &cache->buckets[hash & cache->mask];
+	entry->next_in_bucket = *bucket;
+	*bucket = entry;
+
+	lru_push(cache, entry);
+	cache->bytes += bytes;
+	cache->count++;
+
+	cr_unlock(&cache->lock);
+}
+
+unsigned long
+fragment_cache_new_id(crustache_fragment_cache *cache)
+{
+	unsigned long id;
+
+	cr_lock(&cache->lock);
+	id = ++cache->last_id;
+	cr_unlock(&cache->lock);
+
+	return id;
+}
+
+void
+crustache_fragment_cache_clear(crustache_fragment_cache *cache)
+{
+	if (!cache)
+		return;
+
+	cr_lock(&cache->lock);
+
+	while (cache->oldest != NULL)
+		entry_remove(cache, cache->oldest);
+
+	cache->hits = 0;
+	cache->misses = 0;
+
+	cr_unlock(&cache->lock);
+}
+
+void
+crustache_fragment_cache_stats(crustache_fragment_cache *cache, size_t *hits, size_t *misses)
+{
+	cr_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	cr_unlock(&cache->lock);
+}
+
+void
+crustache_fragment_cache_free(crustache_fragment_cache *cache)
+{
+	if (!cache)
+		return;
+
+	crustache_fragment_cache_clear(cache);
+	cr_lock_free(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
@@ -0,0 +1,28 @@
+#ifndef __CR_FRAGMENT_CACHE_H__
+#define __CR_FRAGMENT_CACHE_H__
+
+#include "crustache.h"
+
+/* Append the fragment stored under `key` to `ob`. Returns -1 if there
+ * is no such fragment, or if it has expired */
+extern int
+fragment_cache_get(
+	crustache_fragment_cache *cache,
+	struct buf *ob,
+	const char *key, size_t key_size);
+
+/* Store a rendered fragment, evicting the least recently used ones
+ * until it fits. Fragments larger than the whole cache are dropped */
+extern void
+fragment_cache_put(
+	crustache_fragment_cache *cache,
+	const char *key, size_t key_size,
+	const char *data, size_t size);
+
+/* A number for a template, which no other template using the cache
+ * gets. It goes into the keys of all its fragments, so templates
+ * built with different options never serve each other's output */
+extern unsigned long
+fragment_cache_new_id(crustache_fragment_cache *cache);
+
+#endif
@@ -4,6 +4,8 @@
 #include "buffer.h"
 
 extern void houdini_escape_html(struct buf *ob, const char *src, size_t size);
+extern int houdini_escape_html_utf8(struct buf *ob, const char *src, size_t size, int replace);
+extern int houdini_validate_utf8(struct buf *ob, const char *src, size_t size, int replace);
 extern void houdini_unescape_html(struct buf *ob, const char *src, size_t size);
 extern void houdini_escape_uri(struct buf *ob, const char *src, size_t size);
 extern void houdini_escape_url(struct buf *ob, const char *src, size_t size);
@@ -1,13 +1,17 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "houdini.h"
 #include "html_unescape.h"
+#include "simd.h"
 
 #define ESCAPE_GROW_FACTOR(x) (((x) * 12) / 10) /* this is very scientific, yes */
 #define UNESCAPE_GROW_FACTOR(x) (x) /* unescaping shouldn't grow our buffer */
 
+static const char UTF8_REPLACEMENT[] = "\xEF\xBF\xBD"; /* U+FFFD */
+
 /**
  * According to the OWASP rules:
  *
@@ -40,19 +44,101 @@ static const char *HTML_ESCAPES[] = {
         "&gt;"
 };
 
+#ifdef SIMD_SSE2
+/* Bytes of `chunk` which need HTML escaping */
+static inline __m128i
+html_special(__m128i chunk)
+{
+	return _mm_or_si128(
+		_mm_or_si128(
+			_mm_or_si128(
+				_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+				_mm_cmpeq_epi8(chunk, _mm_set1_epi8('&'))),
+			_mm_or_si128(
+				_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\'')),
+				_mm_cmpeq_epi8(chunk, _mm_set1_epi8('/')))),
+		_mm_or_si128(
+			_mm_cmpeq_epi8(chunk, _mm_set1_epi8('<')),
+			_mm_cmpeq_epi8(chunk, _mm_set1_epi8('>'))));
+}
+#endif
+
+/**
+ * Length of the prefix of `src` which needs no HTML escaping.
+ * Checks 16 bytes at a time when SSE2 is around.
+ */
+static inline size_t
+scan_html_plain(const char *src, size_t size)
+{
+	size_t i = 0;
+
+#ifdef SIMD_SSE2
+	while (i + 16 <= size) {
+		int mask = _mm_movemask_epi8(html_special(_mm_loadu_si128((const __m128i *)(src + i))));
+		if (mask)
+			return i + simd_ctz(mask);
+
+		i += 16;
+	}
+#endif
+
+	while (i < size && ((src[i] & ~0x7F) || HTML_ESCAPE_TABLE[(int)src[i]] == 0))
+		i++;
+
+	return i;
+}
+
+/**
+ * Check the multibyte UTF-8 sequence at the start of `src`.
+ * Returns 1 if it's well formed (no overlongs, surrogates or codepoints
+ * past U+10FFFF), and 0 otherwise. In both cases `len` is set to the
+ * amount of bytes to skip: the whole sequence, or its maximal invalid
+ * subpart, which gets replaced with a single U+FFFD.
+ */
+static inline int
+utf8_sequence(const unsigned char *src, size_t size, size_t *len)
+{
+	unsigned char c = src[0];
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t i, seq_len;
+
+	if (c >= 0xC2 && c <= 0xDF) {
+		seq_len = 2;
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		seq_len = 3;
+		if (c == 0xE0) lo = 0xA0;
+		else if (c == 0xED) hi = 0x9F;
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		seq_len = 4;
+		if (c == 0xF0) lo = 0x90;
+		else if (c == 0xF4) hi = 0x8F;
+	} else {
+		*len = 1;
+		return 0;
+	}
+
+	for (i = 1; i < seq_len; ++i) {
+		if (i >= size || src[i] < lo || src[i] > hi) {
+			*len = i;
+			return 0;
+		}
+		lo = 0x80; hi = 0xBF;
+	}
+
+	*len = seq_len;
+	return 1;
+}
+
 void
 houdini_escape_html(struct buf *ob, const char *src, size_t size)
 {
-	size_t  i = 0, org, esc;
+	size_t i = 0, org;
 
-	bufgrow(ob, ESCAPE_GROW_FACTOR(size));
+	bufgrow(ob, ob->size + ESCAPE_GROW_FACTOR(size));
 
 	while (i < size) {
 		org = i;
-		while (i < size &&
-			(esc = HTML_ESCAPE_TABLE[src[i] & 0x7F]) == 0 &&
-			(src[i] & ~0x7F) == 0)
-			i++;
+		i += scan_html_plain(src + i, size - i);
 
 		if (i > org)
 			bufput(ob, src + org, i - org);
@@ -61,11 +147,251 @@ houdini_escape_html(struct buf *ob, const char *src, size_t size)
 		if (i >= size)
 			break;
 
-		bufputs(ob, HTML_ESCAPES[esc]);
+		bufputs(ob, HTML_ESCAPES[(int)HTML_ESCAPE_TABLE[(int)src[i]]]);
 		i++;
 	}
 }
 
+#ifdef SIMD_SSE2
+#	define SIMD_SET(c) _mm_set1_epi8((char)(c))
+
+/**
+ * Flag the bytes of `chunk` which break UTF-8, given the 16 bytes in
+ * front of it in `prev`. Every byte is checked against the three bytes
+ * before it: a continuation byte must follow the lead byte of a sequence
+ * which isn't complete yet, and anything else must not. Leads which can
+ * never be valid (C0, C1, F5 to FF) and the second bytes which make
+ * overlongs, surrogates or codepoints past U+10FFFF are flagged too.
+ *
+ * The flags are any non-zero byte, not necessarily 0xFF. SSE2 only has
+ * signed compares, which still order the bytes from 0x80 to 0xFF right
+ * among themselves.
+ */
+static inline __m128i
+utf8_block_errors(__m128i chunk, __m128i prev)
+{
+	__m128i prev1 = _mm_or_si128(_mm_slli_si128(chunk, 1), _mm_srli_si128(prev, 15));
+	__m128i prev2 = _mm_or_si128(_mm_slli_si128(chunk, 2), _mm_srli_si128(prev, 14));
+	__m128i prev3 = _mm_or_si128(_mm_slli_si128(chunk, 3), _mm_srli_si128(prev, 13));
+
+	/* 80..BF */
+	__m128i cont = _mm_cmplt_epi8(chunk, SIMD_SET(0xC0));
+
+	/* after C0..FF, or two bytes after E0..FF, or three after F0..FF */
+	__m128i needs_cont = _mm_cmpgt_epi8(
+		_mm_or_si128(
+			_mm_subs_epu8(prev1, SIMD_SET(0xBF)),
+			_mm_or_si128(
+				_mm_subs_epu8(prev2, SIMD_SET(0xDF)),
+				_mm_subs_epu8(prev3, SIMD_SET(0xEF)))),
+		_mm_setzero_si128());
+
+	__m128i bad_lead = _mm_or_si128(
+		_mm_cmpeq_epi8(_mm_and_si128(chunk, SIMD_SET(0xFE)), SIMD_SET(0xC0)),
+		_mm_subs_epu8(chunk, SIMD_SET(0xF4)));
+
+	/*
+	 * E0 80..9F, ED A0..BF, F0 80..8F and F4 90..BF. A second byte
+	 * below 80 is already wrong, so it doesn't matter how it compares.
+	 */
+	__m128i ge_a0 = _mm_cmpgt_epi8(chunk, SIMD_SET(0x9F));
+	__m128i ge_90 = _mm_cmpgt_epi8(chunk, SIMD_SET(0x8F));
+	__m128i bad_second = _mm_or_si128(
+		_mm_or_si128(
+			_mm_andnot_si128(ge_a0, _mm_cmpeq_epi8(prev1, SIMD_SET(0xE0))),
+			_mm_and_si128(ge_a0, _mm_cmpeq_epi8(prev1, SIMD_SET(0xED)))),
+		_mm_or_si128(
+			_mm_andnot_si128(ge_90, _mm_cmpeq_epi8(prev1, SIMD_SET(0xF0))),
+			_mm_and_si128(ge_90, _mm_cmpeq_epi8(prev1, SIMD_SET(0xF4)))));
+
+	return _mm_or_si128(_mm_xor_si128(cont, needs_cont), _mm_or_si128(bad_lead, bad_second));
+}
+
+/*
+ * The same as utf8_block_errors() when neither `chunk` nor the end of
+ * `prev` have bytes from E0 up, i.e. all the sequences are two bytes
+ * long. That's most of the text in Latin, Greek or Cyrillic scripts.
+ */
+static inline __m128i
+utf8_block_errors2(__m128i chunk, __m128i prev)
+{
+	__m128i prev1 = _mm_or_si128(_mm_slli_si128(chunk, 1), _mm_srli_si128(prev, 15));
+	__m128i cont = _mm_cmplt_epi8(chunk, SIMD_SET(0xC0));
+	__m128i needs_cont = _mm_cmpgt_epi8(_mm_subs_epu8(prev1, SIMD_SET(0xBF)), _mm_setzero_si128());
+
+	return _mm_or_si128(
+		_mm_xor_si128(cont, needs_cont),
+		_mm_cmpeq_epi8(_mm_and_si128(chunk, SIMD_SET(0xFE)), SIMD_SET(0xC0)));
+}
+
+#	undef SIMD_SET
+
+/**
+ * Check `src` 64 bytes at a time for well formed UTF-8 and, if `html`
+ * is set, for chars which need HTML escaping. Returns the length of the
+ * prefix which passed the check, which always ends between two UTF-8
+ * sequences; the rest is left for the scalar scanner, which finds the
+ * exact place where it went wrong.
+ */
+static inline size_t
+scan_utf8_blocks(const char *src, size_t size, int html)
+{
+	const __m128i zero = _mm_setzero_si128();
+	/* the last bytes of a block which leave a sequence open */
+	const __m128i tail = _mm_setr_epi8(
+		(char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF,
+		(char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xFF, (char)0xEF, (char)0xDF, (char)0xBF);
+	__m128i prev = zero;
+	size_t i = 0, j;
+
+	while (i + 64 <= size) {
+		__m128i c0 = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i c1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		__m128i c2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+		__m128i c3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+
+		__m128i top = _mm_max_epu8(_mm_max_epu8(c0, c1), _mm_max_epu8(c2, c3));
+		__m128i error;
+
+		if (_mm_movemask_epi8(top) == 0) {
+			/* plain ASCII, unless the last block left a sequence open */
+			error = _mm_subs_epu8(prev, tail);
+		} else if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_subs_epu8(_mm_max_epu8(top, _mm_srli_si128(prev, 13)), _mm_set1_epi8((char)0xDF)),
+				zero)) == 0xFFFF) {
+			error = _mm_or_si128(
+				_mm_or_si128(utf8_block_errors2(c0, prev), utf8_block_errors2(c1, c0)),
+				_mm_or_si128(utf8_block_errors2(c2, c1), utf8_block_errors2(c3, c2)));
+		} else {
+			error = _mm_or_si128(
+				_mm_or_si128(utf8_block_errors(c0, prev), utf8_block_errors(c1, c0)),
+				_mm_or_si128(utf8_block_errors(c2, c1), utf8_block_errors(c3, c2)));
+		}
+
+		if (html) {
+			error = _mm_or_si128(error, _mm_or_si128(
+				_mm_or_si128(html_special(c0), html_special(c1)),
+				_mm_or_si128(html_special(c2), html_special(c3))));
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xFFFF)
+			break;
+
+		prev = c3;
+		i += 64;
+	}
+
+	/* don't stop in the middle of a sequence which spans two blocks */
+	for (j = i; j > 0 && i - j < 3; --j) {
+		unsigned char c = (unsigned char)src[j - 1];
+
+		if (c < 0x80)
+			break;
+
+		if (c >= 0xC0) {
+			size_t seq_len = c >= 0xF0 ? 4 : (c >= 0xE0 ? 3 : 2);
+			if (i - (j - 1) < seq_len)
+				i = j - 1;
+			break;
+		}
+	}
+
+	return i;
+}
+#endif
+
+/**
+ * Length of the prefix of `src` which is well formed UTF-8 and, if
+ * `html` is set, has nothing to escape.
+ */
+static inline size_t
+scan_utf8(const char *src, size_t size, int html)
+{
+	size_t i = 0, len;
+
+#ifdef SIMD_SSE2
+	i = scan_utf8_blocks(src, size, html);
+#endif
+
+	while (i < size) {
+		unsigned char c = (unsigned char)src[i];
+
+		if (c < 0x80) {
+			if (html && HTML_ESCAPE_TABLE[c] != 0)
+				break;
+			i++;
+		} else {
+			if (!utf8_sequence((const unsigned char *)src + i, size - i, &len))
+				break;
+			i += len;
+		}
+	}
+
+	return i;
+}
+
+int
+houdini_escape_html_utf8(struct buf *ob, const char *src, size_t size, int replace)
+{
+	size_t i = 0, org, len = 0;
+
+	bufgrow(ob, ob->size + ESCAPE_GROW_FACTOR(size));
+
+	while (i < size) {
+		org = i;
+		i += scan_utf8(src + i, size - i, 1);
+
+		if (i > org)
+			bufput(ob, src + org, i - org);
+
+		if (i >= size)
+			break;
+
+		if (src[i] & ~0x7F) {
+			/* broken UTF-8 */
+			if (!replace)
+				return -1;
+
+			utf8_sequence((const unsigned char *)src + i, size - i, &len);
+			bufput(ob, UTF8_REPLACEMENT, 3);
+			i += len;
+		} else {
+			/* escaping */
+			bufputs(ob, HTML_ESCAPES[(int)HTML_ESCAPE_TABLE[(int)src[i]]]);
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+int
+houdini_validate_utf8(struct buf *ob, const char *src, size_t size, int replace)
+{
+	size_t i = 0, org, len = 0;
+
+	while (i < size) {
+		org = i;
+		i += scan_utf8(src + i, size - i, 0);
+
+		if (ob && i > org)
+			bufput(ob, src + org, i - org);
+
+		if (i >= size)
+			break;
+
+		/* broken UTF-8 */
+		if (!replace || !ob)
+			return -1;
+
+		utf8_sequence((const unsigned char *)src + i, size - i, &len);
+		bufput(ob, UTF8_REPLACEMENT, 3);
+		i += len;
+	}
+
+	return 0;
+}
+
 static inline void
 bufput_utf8(struct buf *ob, int c)
 {
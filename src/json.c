@@ -0,0 +1,862 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "value.h"
+#include "simd.h"
+
+#define JSON_MAX_NUMBER 64
+
+struct json_parser {
+	const char *src;
+	size_t size;
+	size_t pos;
+	crustache_arena *arena;
+};
+
+static int
+json_isspace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int
+json_isdigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static void
+skip_space(struct json_parser *p)
+{
+	while (p->pos < p->size && json_isspace(p->src[p->pos]))
+		p->pos++;
+}
+
+/* Length of the prefix of `src` with no quotes, backslashes or
+ * control characters */
+static inline size_t
+scan_string(const char *src, size_t size)
+{
+	size_t i = 0;
+
+#ifdef SIMD_SSE2
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1F);
+
+	while (i + 16 <= size) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i special = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, quot), _mm_cmpeq_epi8(chunk, bslash)),
+			_mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+
+		int mask = _mm_movemask_epi8(special);
+		if (mask)
+			return i + simd_ctz(mask);
+
+		i += 16;
+	}
+#endif
+
+	while (i < size && src[i] != '"' && src[i] != '\\' && (unsigned char)src[i] >= 0x20)
+		i++;
+
+	return i;
+}
+
+/* Length of the prefix of `src` with no quotes or brackets */
+static inline size_t
+scan_structural(const char *src, size_t size)
+{
+	size_t i = 0;
+
+#ifdef SIMD_SSE2
+	const __m128i quot = _mm_set1_epi8('"');
+	const __m128i lbrace = _mm_set1_epi8('{');
+	const __m128i rbrace = _mm_set1_epi8('}');
+	const __m128i lbracket = _mm_set1_epi8('[');
+	const __m128i rbracket = _mm_set1_epi8(']');
+
+	while (i + 16 <= size) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i special = _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, lbrace), _mm_cmpeq_epi8(chunk, rbrace)),
+				_mm_or_si128(_mm_cmpeq_epi8(chunk, lbracket), _mm_cmpeq_epi8(chunk, rbracket))),
+			_mm_cmpeq_epi8(chunk, quot));
+
+		int mask = _mm_movemask_epi8(special);
+		if (mask)
+			return i + simd_ctz(mask);
+
+		i += 16;
+	}
+#endif
+
+	while (i < size) {
+		char c = src[i];
+		if (c == '"' || c == '{' || c == '}' || c == '[' || c == ']')
+			break;
+		i++;
+	}
+
+	return i;
+}
+
+/* Skip the rest of a string, starting right after its opening quote.
+ * `escaped` is set if the string contains any escape sequences. */
+static int
+skip_string(struct json_parser *p, int *escaped)
+{
+	for (;;) {
+		if (p->pos >= p->size)
+			return -1;
+
+		p->pos += scan_string(p->src + p->pos, p->size - p->pos);
+
+		if (p->pos >= p->size)
+			return -1;
+
+		if (p->src[p->pos] == '"') {
+			p->pos++;
+			return 0;
+		}
+
+		if (p->src[p->pos] != '\\')
+			return -1;
+
+		*escaped = 1;
+		p->pos += 2;
+	}
+}
+
+/* Skip a whole object or array by matching its brackets. The contents
+ * are only checked when the container is decoded. */
+static int
+skip_container(struct json_parser *p)
+{
+	int depth = 0, escaped;
+
+	for (;;) {
+		if (p->pos >= p->size)
+			return -1;
+
+		p->pos += scan_structural(p->src + p->pos, p->size - p->pos);
+
+		if (p->pos >= p->size)
+			return -1;
+
+		switch (p->src[p->pos++]) {
+		case '"':
+			if (skip_string(p, &escaped) < 0)
+				return -1;
+			break;
+
+		case '{':
+		case '[':
+			depth++;
+			break;
+
+		default:
+			if (--depth == 0)
+				return 0;
+			break;
+		}
+	}
+}
+
+static int
+parse_hex4(const char *src, unsigned int *out)
+{
+	unsigned int cp = 0;
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		char c = src[i];
+
+		cp <<= 4;
+		if (c >= '0' && c <= '9')
+			cp |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			cp |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			cp |= c - 'A' + 10;
+		else
+			return -1;
+	}
+
+	*out = cp;
+	return 0;
+}
+
+static size_t
+put_utf8(char *out, unsigned int cp)
+{
+	if (cp < 0x80) {
+		out[0] = (char)cp;
+		return 1;
+	}
+
+	if (cp < 0x800) {
+		out[0] = (char)(0xC0 | (cp >> 6));
+		out[1] = (char)(0x80 | (cp & 0x3F));
+		return 2;
+	}
+
+	if (cp < 0x10000) {
+		out[0] = (char)(0xE0 | (cp >> 12));
+		out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+		out[2] = (char)(0x80 | (cp & 0x3F));
+		return 3;
+	}
+
+	out[0] = (char)(0xF0 | (cp >> 18));
+	out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+	out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+	out[3] = (char)(0x80 | (cp & 0x3F));
+	return 4;
+}
+
+/* Decode the escapes of a string into the arena. The decoded string
+ * is never longer than its source. */
+static int
+unescape_string(struct json_parser *p, const char *src, size_t size, const char **out, size_t *out_size)
+{
+	char *dst = crustache_arena_alloc(p->arena, size + 1);
+	size_t i = 0, n = 0;
+
+	if (dst == NULL)
+		return -1;
+
+	while (i < size) {
+		unsigned int cp, low;
+
+		if (src[i] != '\\') {
+			dst[n++] = src[i++];
+			continue;
+		}
+
+		if (i + 1 >= size)
+			return -1;
+
+		switch (src[i + 1]) {
+		case '"': dst[n++] = '"'; break;
+		case '\\': dst[n++] = '\\'; break;
+		case '/': dst[n++] = '/'; break;
+		case 'b': dst[n++] = '\b'; break;
+		case 'f': dst[n++] = '\f'; break;
+		case 'n': dst[n++] = '\n'; break;
+		case 'r': dst[n++] = '\r'; break;
+		case 't': dst[n++] = '\t'; break;
+
+		case 'u':
+			if (i + 6 > size || parse_hex4(src + i + 2, &cp) < 0)
+				return -1;
+
+			i += 6;
+
+			if (cp >= 0xD800 && cp <= 0xDBFF) {
+				/* a surrogate pair, hopefully */
+				if (i + 6 <= size && src[i] == '\\' && src[i + 1] == 'u' &&
+					parse_hex4(src + i + 2, &low) == 0 &&
+					low >= 0xDC00 && low <= 0xDFFF) {
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+					i += 6;
+				} else {
+					cp = 0xFFFD;
+				}
+			} else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+				cp = 0xFFFD;
+			}
+
+			n += put_utf8(dst + n, cp);
+			continue;
+
+		default:
+			return -1;
+		}
+
+		i += 2;
+	}
+
+	dst[n] = 0;
+	*out = dst;
+	*out_size = n;
+	return 0;
+}
+
+/* Parse a string starting at its opening quote. Strings with no
+ * escapes point straight into the JSON source. */
+static int
+parse_string(struct json_parser *p, const char **out, size_t *out_size)
+{
+	size_t start = ++p->pos;
+	int escaped = 0;
+
+	if (skip_string(p, &escaped) < 0)
+		return -1;
+
+	if (!escaped) {
+		*out = p->src + start;
+		*out_size = p->pos - 1 - start;
+		return 0;
+	}
+
+	return unescape_string(p, p->src + start, p->pos - 1 - start, out, out_size);
+}
+
+/* Length of the number at the start of `src`, or 0 if it's not a valid
+ * JSON number. `is_float` is set if it has a fraction or an exponent. */
+static size_t
+scan_number(const char *src, size_t size, int *is_float)
+{
+	size_t i = 0;
+
+	*is_float = 0;
+
+	if (i < size && src[i] == '-')
+		i++;
+
+	if (i >= size || !json_isdigit(src[i]))
+		return 0;
+
+	/* no leading zeros */
+	if (src[i] == '0' && i + 1 < size && json_isdigit(src[i + 1]))
+		return 0;
+
+	while (i < size && json_isdigit(src[i]))
+		i++;
+
+	if (i < size && src[i] == '.') {
+		*is_float = 1;
+		if (++i >= size || !json_isdigit(src[i]))
+			return 0;
+
+		while (i < size && json_isdigit(src[i]))
+			i++;
+	}
+
+	if (i < size && (src[i] == 'e' || src[i] == 'E')) {
+		*is_float = 1;
+		if (++i < size && (src[i] == '+' || src[i] == '-'))
+			i++;
+
+		if (i >= size || !json_isdigit(src[i]))
+			return 0;
+
+		while (i < size && json_isdigit(src[i]))
+			i++;
+	}
+
+	return i;
+}
+
+static int
+parse_number(struct json_parser *p, crustache_value **out)
+{
+	const char *src = p->src + p->pos;
+	int is_float;
+	size_t i = scan_number(src, p->size - p->pos, &is_float);
+
+	if (i == 0)
+		return -1;
+
+	p->pos += i;
+
+	if (!is_float) {
+		uint64_t limit = (src[0] == '-') ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+		uint64_t acc = 0;
+		size_t j = (src[0] == '-');
+
+		for (; j < i; ++j) {
+			unsigned int digit = src[j] - '0';
+
+			if (acc > (limit - digit) / 10)
+				break;
+
+			acc = acc * 10 + digit;
+		}
+
+		if (j == i) {
+			int64_t integer = (src[0] == '-') ? (int64_t)(0 - acc) : (int64_t)acc;
+			*out = crustache_value_new_int(p->arena, integer);
+			return *out ? 0 : -1;
+		}
+
+		/* too large for an int64; keep it as a double */
+	}
+
+	/* strtod needs a NUL-terminated copy */
+	{
+		char local[JSON_MAX_NUMBER];
+		char *copy = local;
+
+		if (i >= JSON_MAX_NUMBER && (copy = crustache_arena_alloc(p->arena, i + 1)) == NULL)
+			return -1;
+
+		memcpy(copy, src, i);
+		copy[i] = 0;
+
+		*out = crustache_value_new_double(p->arena, strtod(copy, NULL));
+		return *out ? 0 : -1;
+	}
+}
+
+static int
+parse_literal(struct json_parser *p, const char *literal, size_t size)
+{
+	if (p->size - p->pos < size || memcmp(p->src + p->pos, literal, size) != 0)
+		return -1;
+
+	p->pos += size;
+	return 0;
+}
+
+/* Check a string starting at its opening quote, escapes included */
+static int
+check_string(struct json_parser *p)
+{
+	unsigned int cp;
+
+	p->pos++;
+
+	for (;;) {
+		p->pos += scan_string(p->src + p->pos, p->size - p->pos);
+
+		if (p->pos >= p->size)
+			return -1;
+
+		if (p->src[p->pos] == '"') {
+			p->pos++;
+			return 0;
+		}
+
+		/* control characters must be escaped */
+		if (p->src[p->pos] != '\\' || p->pos + 1 >= p->size)
+			return -1;
+
+		switch (p->src[p->pos + 1]) {
+		case '"': case '\\': case '/':
+		case 'b': case 'f': case 'n': case 'r': case 't':
+			p->pos += 2;
+			break;
+
+		case 'u':
+			if (p->pos + 6 > p->size || parse_hex4(p->src + p->pos + 2, &cp) < 0)
+				return -1;
+
+			p->pos += 6;
+			break;
+
+		default:
+			return -1;
+		}
+	}
+}
+
+/* Check an object key, up to and including its colon */
+static int
+check_key(struct json_parser *p)
+{
+	skip_space(p);
+
+	if (p->pos >= p->size || p->src[p->pos] != '"' || check_string(p) < 0)
+		return -1;
+
+	skip_space(p);
+
+	if (p->pos >= p->size || p->src[p->pos] != ':')
+		return -1;
+
+	p->pos++;
+	return 0;
+}
+
+static int
+check_scalar(struct json_parser *p)
+{
+	size_t length;
+	int is_float;
+
+	switch (p->src[p->pos]) {
+	case '"': return check_string(p);
+	case 't': return parse_literal(p, "true", 4);
+	case 'f': return parse_literal(p, "false", 5);
+	case 'n': return parse_literal(p, "null", 4);
+
+	default:
+		length = scan_number(p->src + p->pos, p->size - p->pos, &is_float);
+		if (length == 0)
+			return -1;
+
+		p->pos += length;
+		return 0;
+	}
+}
+
+/* Check the syntax of the whole value at `p->pos` without building
+ * anything, so lazy objects and arrays never fail to decode later on.
+ * Nesting is tracked in a heap stack of open brackets, as documents
+ * can be nested deeper than our own stack would allow. */
+static int
+check_value(struct json_parser *p)
+{
+	char *stack = NULL;
+	size_t depth = 0, capacity = 0;
+	int error = CR_EJSON_SYNTAX;
+
+	for (;;) {
+		char c;
+
+		skip_space(p);
+
+		if (p->pos >= p->size)
+			break;
+
+		c = p->src[p->pos];
+
+		if (c == '{' || c == '[') {
+			if (depth == capacity) {
+				char *grown = realloc(stack, capacity ? capacity * 2 : 64);
+				if (grown == NULL) {
+					error = CR_ENOMEM;
+					break;
+				}
+
+				stack = grown;
+				capacity = capacity ? capacity * 2 : 64;
+			}
+
+			stack[depth++] = c + 2; /* the closing bracket */
+			p->pos++;
+			skip_space(p);
+
+			if (p->pos >= p->size)
+				break;
+
+			if (p->src[p->pos] != stack[depth - 1]) {
+				if (c == '{' && check_key(p) < 0)
+					break;
+
+				continue;
+			}
+
+			/* an empty one, closed below */
+		} else if (check_scalar(p) < 0) {
+			break;
+		}
+
+		/* after a value: close the containers it ends */
+		while (depth > 0) {
+			skip_space(p);
+
+			if (p->pos >= p->size)
+				break;
+
+			c = p->src[p->pos++];
+
+			if (c == ',') {
+				if (stack[depth - 1] == '}' && check_key(p) < 0)
+					p->pos = p->size;
+				break;
+			}
+
+			if (c != stack[depth - 1]) {
+				p->pos = p->size;
+				break;
+			}
+
+			depth--;
+		}
+
+		if (depth == 0) {
+			error = 0;
+			break;
+		}
+
+		if (p->pos >= p->size)
+			break;
+	}
+
+	free(stack);
+	return error;
+}
+
+/* Parse any value. Objects and arrays are only skipped over, and
+ * become lazy values pointing at their source. */
+static int
+parse_value(struct json_parser *p, crustache_value **out)
+{
+	const char *str;
+	size_t start, size;
+
+	skip_space(p);
+
+	if (p->pos >= p->size)
+		return -1;
+
+	switch (p->src[p->pos]) {
+	case '{':
+	case '[':
+		start = p->pos;
+
+		if (skip_container(p) < 0)
+			return -1;
+
+		*out = value_new(p->arena,
+			p->src[start] == '{' ? CRUSTACHE_VAR_CONTEXT : CRUSTACHE_VAR_LIST);
+
+		if (*out == NULL)
+			return -1;
+
+		(*out)->json = p->src + start;
+		(*out)->json_size = p->pos - start;
+		(*out)->arena = p->arena;
+		return 0;
+
+	case '"':
+		if (parse_string(p, &str, &size) < 0)
+			return -1;
+
+		*out = value_new_str_ref(p->arena, CRUSTACHE_VAR_STR, str, size);
+		return *out ? 0 : -1;
+
+	case 't':
+		if (parse_literal(p, "true", 4) < 0)
+			return -1;
+
+		*out = crustache_value_new_bool(p->arena, 1);
+		return *out ? 0 : -1;
+
+	case 'f':
+		if (parse_literal(p, "false", 5) < 0)
+			return -1;
+
+		*out = crustache_value_new_bool(p->arena, 0);
+		return *out ? 0 : -1;
+
+	case 'n':
+		if (parse_literal(p, "null", 4) < 0)
+			return -1;
+
+		*out = crustache_value_new_bool(p->arena, 0);
+		return *out ? 0 : -1;
+
+	default:
+		return parse_number(p, out);
+	}
+}
+
+static int
+decode_object(struct json_parser *p, crustache_value *map)
+{
+	if (value_init_map(p->arena, map, 0) < 0)
+		return -1;
+
+	p->pos++;
+	skip_space(p);
+
+	if (p->pos < p->size && p->src[p->pos] == '}') {
+		p->pos++;
+		return 0;
+	}
+
+	for (;;) {
+		crustache_value *member;
+		const char *key;
+		size_t key_size;
+
+		skip_space(p);
+
+		if (p->pos >= p->size || p->src[p->pos] != '"' ||
+			parse_string(p, &key, &key_size) < 0)
+			return -1;
+
+		skip_space(p);
+
+		if (p->pos >= p->size || p->src[p->pos] != ':')
+			return -1;
+
+		p->pos++;
+
+		if (parse_value(p, &member) < 0 ||
+			value_set(p->arena, map, key, key_size, 0, member) < 0)
+			return -1;
+
+		skip_space(p);
+
+		if (p->pos >= p->size)
+			return -1;
+
+		if (p->src[p->pos] == '}') {
+			p->pos++;
+			return 0;
+		}
+
+		if (p->src[p->pos++] != ',')
+			return -1;
+	}
+}
+
+static int
+decode_array(struct json_parser *p, crustache_value *array)
+{
+	if (value_init_array(p->arena, array, 0) < 0)
+		return -1;
+
+	p->pos++;
+	skip_space(p);
+
+	if (p->pos < p->size && p->src[p->pos] == ']') {
+		p->pos++;
+		return 0;
+	}
+
+	for (;;) {
+		crustache_value *item;
+
+		if (parse_value(p, &item) < 0 ||
+			crustache_value_push(p->arena, array, item) < 0)
+			return -1;
+
+		skip_space(p);
+
+		if (p->pos >= p->size)
+			return -1;
+
+		if (p->src[p->pos] == ']') {
+			p->pos++;
+			return 0;
+		}
+
+		if (p->src[p->pos++] != ',')
+			return -1;
+	}
+}
+
+void
+json_decode(crustache_value *value)
+{
+	struct json_parser p;
+	int error;
+
+	p.src = value->json;
+	p.size = value->json_size;
+	p.pos = 0;
+	p.arena = value->arena;
+
+	/* the value is decoded (or broken) from now on */
+	value->json = NULL;
+
+	if (value->type == CRUSTACHE_VAR_CONTEXT)
+		error = decode_object(&p, value);
+	else
+		error = decode_array(&p, value);
+
+	if (error < 0 || p.pos != p.size) {
+		value->type = CRUSTACHE_VAR_FALSE;
+		value->size = 0;
+	}
+}
+
+int
+crustache_json_parse(crustache_value **value, crustache_arena *arena, const char *json, size_t size)
+{
+	struct json_parser p;
+	crustache_value *root;
+	crustache_var_t type;
+
+	int error;
+
+	p.src = json;
+	p.size = size;
+	p.pos = 0;
+	p.arena = arena;
+
+	/* the whole document is checked up front, so syntax errors deep
+	 * inside are reported here and not found halfway through a render */
+	if ((error = check_value(&p)) < 0)
+		return error;
+
+	skip_space(&p);
+
+	if (p.pos != p.size)
+		return CR_EJSON_SYNTAX;
+
+	p.pos = 0;
+
+	if (parse_value(&p, &root) < 0)
+		return CR_ENOMEM;
+
+	/* the top level is always decoded */
+	type = root->type;
+	value_decode(root);
+
+	if (root->type != type)
+		return CR_ENOMEM;
+
+	*value = root;
+	return 0;
+}
+
+int
+crustache_json_decode_all(crustache_value *value)
+{
+	crustache_value **pending;
+	size_t count = 0, capacity = 64, i;
+	int error = 0;
+
+	pending = malloc(capacity * sizeof(crustache_value *));
+	if (pending == NULL)
+		return CR_ENOMEM;
+
+	pending[count++] = value;
+
+	while (count > 0 && error == 0) {
+		crustache_value *next = pending[--count];
+		size_t children;
+
+		if (next->json != NULL) {
+			json_decode(next);
+
+			if (next->type == CRUSTACHE_VAR_FALSE) {
+				error = CR_ENOMEM;
+				break;
+			}
+		}
+
+		if (next->type != CRUSTACHE_VAR_LIST && next->type != CRUSTACHE_VAR_CONTEXT)
+			continue;
+
+		children = (next->type == CRUSTACHE_VAR_LIST) ? next->size : next->capacity;
+
+		for (i = 0; i < children; ++i) {
+			crustache_value *child;
+
+			if (next->type == CRUSTACHE_VAR_LIST)
+				child = next->as.items[i];
+			else
+				child = next->as.entries[i].key ? next->as.entries[i].value : NULL;
+
+			if (child == NULL || (child->type != CRUSTACHE_VAR_LIST &&
+				child->type != CRUSTACHE_VAR_CONTEXT))
+				continue;
+
+			if (count == capacity) {
+				crustache_value **grown = realloc(pending, capacity * 2 * sizeof(crustache_value *));
+				if (grown == NULL) {
+					error = CR_ENOMEM;
+					break;
+				}
+
+				pending = grown;
+				capacity *= 2;
+			}
+
+			pending[count++] = child;
+		}
+	}
+
+	free(pending);
+	return error;
+}
@@ -0,0 +1,21 @@
+#ifndef __CR_LOCK_H__
+#define __CR_LOCK_H__
+
+/* A plain mutex, for the caches which are shared by rendering threads */
+#if defined(_WIN32)
+#	include <windows.h>
+typedef CRITICAL_SECTION cr_lock_t;
+#	define cr_lock_init(l) (InitializeCriticalSection(l), 0)
+#	define cr_lock(l) EnterCriticalSection(l)
+#	define cr_unlock(l) LeaveCriticalSection(l)
+#	define cr_lock_free(l) DeleteCriticalSection(l)
+#else
+#	include <pthread.h>
+typedef pthread_mutex_t cr_lock_t;
+#	define cr_lock_init(l) pthread_mutex_init(l, NULL)
+#	define cr_lock(l) pthread_mutex_lock(l)
+#	define cr_unlock(l) pthread_mutex_unlock(l)
+#	define cr_lock_free(l) pthread_mutex_destroy(l)
+#endif
+
+#endif
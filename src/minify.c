@@ -0,0 +1,240 @@
+#include <string.h>
+#include <ctype.h>
+
+#include "minify.h"
+
+/* Elements whose contents are whitespace-sensitive, or not HTML at all */
+static const struct {
+	const char *name;
+	size_t size;
+} RAW_ELEMENTS[] = {
+	{"pre", 3},
+	{"textarea", 8},
+	{"script", 6},
+	{"style", 5},
+};
+
+static int
+html_isspace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static int
+prefix_icase(const char *src, size_t size, const char *prefix, size_t prefix_size)
+{
+	size_t i;
+
+	if (size < prefix_size)
+		return 0;
+
+	for (i = 0; i < prefix_size; ++i) {
+		if (tolower((unsigned char)src[i]) != prefix[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* If `src` starts with the name of one of the RAW_ELEMENTS, return its index + 1 */
+static int
+raw_element(const char *src, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(RAW_ELEMENTS) / sizeof(RAW_ELEMENTS[0]); ++i) {
+		size_t n = RAW_ELEMENTS[i].size;
+
+		if (prefix_icase(src, size, RAW_ELEMENTS[i].name, n) &&
+			(size == n || html_isspace(src[n]) || src[n] == '>' || src[n] == '/'))
+			return (int)i + 1;
+	}
+
+	return 0;
+}
+
+/* Find the closing tag of the current raw element */
+static const char *
+find_raw_end(const char *src, size_t size, int element)
+{
+	const char *name = RAW_ELEMENTS[element - 1].name;
+	size_t n = RAW_ELEMENTS[element - 1].size;
+	size_t i;
+
+	for (i = 0; i + 2 <= size; ++i) {
+		if (src[i] == '<' && src[i + 1] == '/' &&
+			prefix_icase(src + i + 2, size - i - 2, name, n))
+			return src + i;
+	}
+
+	return NULL;
+}
+
+static const char *
+find_comment_end(const char *src, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 3 <= size; ++i) {
+		if (src[i] == '-' && src[i + 1] == '-' && src[i + 2] == '>')
+			return src + i;
+	}
+
+	return NULL;
+}
+
+/**
+ * Whitespace runs are collapsed into a single space, and dropped
+ * altogether when they sit between two tags and contain a line break
+ * (i.e. they are just indentation). Runs which separate inline elements
+ * in the same line are kept, as they are significant for the layout.
+ *
+ * Indentation around section tags which sit on their own line is
+ * handled likewise, mirroring the standalone lines of the Mustache spec.
+ *
+ * Comments are stripped, except for IE conditional comments and
+ * comments which enclose mustache tags. Quoted attribute values and the
+ * contents of RAW_ELEMENTS are copied verbatim.
+ */
+void
+minify_html(
+	struct buf *ob,
+	struct minify_state *state,
+	const char *src, size_t size,
+	int silent_start, int silent_end)
+{
+	size_t i = 0, org;
+
+	/* the last char we printed; if the chunk starts right after
+	 * a variable tag, we don't know what that is */
+	char last = silent_start ? state->last : 0;
+
+	while (i < size) {
+		char c = src[i];
+
+		if (state->in_comment) {
+			const char *end = find_comment_end(src + i, size - i);
+			size_t len = end ? (size_t)(end + 3 - src) - i : size - i;
+
+			bufput(ob, src + i, len);
+			i += len;
+
+			if (end) {
+				state->in_comment = 0;
+				last = '>';
+			}
+			continue;
+		}
+
+		if (state->raw_element) {
+			const char *end = find_raw_end(src + i, size - i, state->raw_element);
+			size_t len = end ? (size_t)(end - src) - i : size - i;
+
+			bufput(ob, src + i, len);
+			i += len;
+
+			if (end)
+				state->raw_element = 0;
+			continue;
+		}
+
+		if (state->quote) {
+			const char *end = memchr(src + i, state->quote, size - i);
+			size_t len = end ? (size_t)(end + 1 - src) - i : size - i;
+
+			bufput(ob, src + i, len);
+			i += len;
+
+			if (end) {
+				state->quote = 0;
+				last = *end;
+			}
+			continue;
+		}
+
+		if (html_isspace(c)) {
+			int newline = 0, drop = 0;
+
+			org = i;
+			while (i < size && html_isspace(src[i])) {
+				if (src[i] == '\n')
+					newline = 1;
+				i++;
+			}
+
+			if (state->in_tag) {
+				drop = 0;
+			} else if (org == 0 && silent_start && last == ' ') {
+				drop = 1; /* we already printed a space */
+			} else if (newline) {
+				int after_tag = (last == '>');
+				int before_tag = (i < size && src[i] == '<');
+
+				drop = (after_tag && before_tag) ||
+					(after_tag && i == size && silent_end) ||
+					(before_tag && org == 0 && silent_start);
+			}
+
+			if (!drop) {
+				bufputc(ob, ' ');
+				last = ' ';
+			}
+			continue;
+		}
+
+		if (state->in_tag) {
+			if (c == '"' || c == '\'') {
+				state->quote = c;
+			} else if (c == '>') {
+				state->in_tag = 0;
+				state->raw_element = state->opening_raw;
+				state->opening_raw = 0;
+			}
+
+			bufputc(ob, c);
+			last = c;
+			i++;
+			continue;
+		}
+
+		if (c == '<' && i + 1 < size) {
+			char next = src[i + 1];
+
+			if (next == '!' && i + 4 <= size && memcmp(src + i, "<!--", 4) == 0) {
+				const char *end = find_comment_end(src + i + 4, size - i - 4);
+
+				if (end != NULL && !(i + 4 < size && src[i + 4] == '[')) {
+					i = (end + 3) - src;
+					continue;
+				}
+
+				if (end == NULL)
+					state->in_comment = 1;
+
+				bufput(ob, src + i, 4);
+				i += 4;
+				continue;
+			}
+
+			if (isalpha((unsigned char)next) || next == '/' || next == '!') {
+				state->in_tag = 1;
+				state->opening_raw = isalpha((unsigned char)next) ?
+					raw_element(src + i + 1, size - i - 1) : 0;
+
+				bufputc(ob, c);
+				last = c;
+				i++;
+				continue;
+			}
+		}
+
+		org = i++;
+		while (i < size && !html_isspace(src[i]) && src[i] != '<')
+			i++;
+
+		bufput(ob, src + org, i - org);
+		last = src[i - 1];
+	}
+
+	state->last = last;
+}
@@ -0,0 +1,27 @@
+#ifndef __CR_MINIFY_H__
+#define __CR_MINIFY_H__
+
+#include "buffer.h"
+
+/* HTML state carried between the static chunks of a template */
+struct minify_state {
+	int in_tag;
+	int in_comment;
+	char quote;
+	int raw_element;
+	int opening_raw;
+	char last;
+};
+
+/* Minify a chunk of static HTML into `ob`. The output is never
+ * larger than the input. `silent_start` and `silent_end` tell whether
+ * the chunk is next to a mustache tag which prints nothing (e.g. a
+ * section opening or closing) on each side. */
+extern void
+minify_html(
+	struct buf *ob,
+	struct minify_state *state,
+	const char *src, size_t size,
+	int silent_start, int silent_end);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+/*
+ * SSE2 detection for the scanners which check 16 bytes at a time.
+ * SIMD_SSE2 is defined when the intrinsics can be used, along with
+ * simd_ctz() to find the first byte flagged in a movemask.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	include <emmintrin.h>
+#	define SIMD_SSE2 1
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+static inline unsigned int
+simd_ctz(unsigned int mask)
+{
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned int)index;
+}
+#	else
+#		define simd_ctz(mask) ((unsigned int)__builtin_ctz(mask))
+#	endif
+#endif
+
+#endif
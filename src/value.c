@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "value.h"
+
+#define VALUE_MIN_CAPACITY 4
+
+crustache_value *
+value_new(crustache_arena *arena, crustache_var_t type)
+{
+	crustache_value *value = crustache_arena_alloc(arena, sizeof(crustache_value));
+	if (value == NULL)
+		return NULL;
+
+	memset(value, 0x0, sizeof(crustache_value));
+	value->type = type;
+	return value;
+}
+
+static const char *
+copy_str(crustache_arena *arena, const char *str, size_t size)
+{
+	char *copy = crustache_arena_alloc(arena, size + 1);
+	if (copy == NULL)
+		return NULL;
+
+	memcpy(copy, str, size);
+	copy[size] = '\0';
+	return copy;
+}
+
+static crustache_value *
+value_new_str(crustache_arena *arena, crustache_var_t type, const char *str, size_t size)
+{
+	const char *copy = copy_str(arena, str, size);
+	if (copy == NULL)
+		return NULL;
+
+	return value_new_str_ref(arena, type, copy, size);
+}
+
+crustache_value *
+value_new_str_ref(crustache_arena *arena, crustache_var_t type, const char *str, size_t size)
+{
+	crustache_value *value = value_new(arena, type);
+	if (value == NULL)
+		return NULL;
+
+	value->as.str = str;
+	value->size = size;
+	return value;
+}
+
+crustache_value *
+crustache_value_new_str(crustache_arena *arena, const char *str, size_t size)
+{
+	return value_new_str(arena, CRUSTACHE_VAR_STR, str, size);
+}
+
+crustache_value *
+crustache_value_new_safe_str(crustache_arena *arena, const char *str, size_t size)
+{
+	return value_new_str(arena, CRUSTACHE_VAR_SAFE_STR, str, size);
+}
+
+crustache_value *
+crustache_value_new_int(crustache_arena *arena, int64_t integer)
+{
+	crustache_value *value = value_new(arena, CRUSTACHE_VAR_INT64);
+	if (value != NULL)
+		value->as.integer = integer;
+	return value;
+}
+
+crustache_value *
+crustache_value_new_double(crustache_arena *arena, double number)
+{
+	crustache_value *value = value_new(arena, CRUSTACHE_VAR_DOUBLE);
+	if (value != NULL)
+		value->as.number = number;
+	return value;
+}
+
+crustache_value *
+crustache_value_new_bool(crustache_arena *arena, int boolean)
+{
+	return value_new(arena, boolean ? CRUSTACHE_VAR_TRUE : CRUSTACHE_VAR_FALSE);
+}
+
+int
+value_init_array(crustache_arena *arena, crustache_value *array, size_t capacity)
+{
+	if (capacity < VALUE_MIN_CAPACITY)
+		capacity = VALUE_MIN_CAPACITY;
+
+	array->type = CRUSTACHE_VAR_LIST;
+	array->size = 0;
+	array->as.items = crustache_arena_alloc(arena, capacity * sizeof(crustache_value *));
+	array->capacity = capacity;
+	return array->as.items ? 0 : CR_ENOMEM;
+}
+
+crustache_value *
+crustache_value_new_array(crustache_arena *arena, size_t capacity)
+{
+	crustache_value *array = value_new(arena, CRUSTACHE_VAR_LIST);
+
+	if (array == NULL || value_init_array(arena, array, capacity) < 0)
+		return NULL;
+
+	return array;
+}
+
+int
+crustache_value_push(crustache_arena *arena, crustache_value *array, crustache_value *item)
+{
+	value_decode(array);
+
+	if (array->type != CRUSTACHE_VAR_LIST || item == NULL)
+		return -1;
+
+	/* the old items stay in the arena until the whole document goes */
+	if (array->size == array->capacity) {
+		crustache_value **items = crustache_arena_alloc(arena,
+			array->capacity * 2 * sizeof(crustache_value *));
+
+		if (items == NULL)
+			return CR_ENOMEM;
+
+		memcpy(items, array->as.items, array->size * sizeof(crustache_value *));
+		array->as.items = items;
+		array->capacity *= 2;
+	}
+
+	array->as.items[array->size++] = item;
+	return 0;
+}
+
+static struct value_entry *
+map_alloc(crustache_arena *arena, size_t capacity)
+{
+	struct value_entry *entries = crustache_arena_alloc(arena, capacity * sizeof(struct value_entry));
+	if (entries != NULL)
+		memset(entries, 0x0, capacity * sizeof(struct value_entry));
+	return entries;
+}
+
+int
+value_init_map(crustache_arena *arena, crustache_value *map, size_t capacity)
+{
+	size_t table_size = VALUE_MIN_CAPACITY * 2;
+
+	/* keep the load factor under 50% */
+	while (table_size < capacity * 2)
+		table_size *= 2;
+
+	map->type = CRUSTACHE_VAR_CONTEXT;
+	map->size = 0;
+	map->as.entries = map_alloc(arena, table_size);
+	map->capacity = table_size;
+	return map->as.entries ? 0 : CR_ENOMEM;
+}
+
+crustache_value *
+crustache_value_new_map(crustache_arena *arena, size_t capacity)
+{
+	crustache_value *map = value_new(arena, CRUSTACHE_VAR_CONTEXT);
+
+	if (map == NULL || value_init_map(arena, map, capacity) < 0)
+		return NULL;
+
+	return map;
+}
+
+static struct value_entry *
+map_find(struct value_entry *entries, size_t capacity, size_t hash, const char *key, size_t key_size)
+{
+	size_t mask = capacity - 1, i = hash & mask;
+
+	for (;;) {
+		struct value_entry *entry = &entries[i];
+
+		if (entry->key == NULL)
+			return entry;
+
+		if (entry->hash == hash && entry->key_size == key_size &&
+			memcmp(entry->key, key, key_size) == 0)
+			return entry;
+
+		i = (i + 1) & mask;
+	}
+}
+
+static int
+map_grow(crustache_arena *arena, crustache_value *map)
+{
+	size_t capacity = map->capacity * 2, i;
+	struct value_entry *entries = map_alloc(arena, capacity);
+
+	if (entries == NULL)
+		return CR_ENOMEM;
+
+	for (i = 0; i < map->capacity; ++i) {
+		struct value_entry *entry = &map->as.entries[i];
+
+		if (entry->key != NULL)
+			*map_find(entries, capacity, entry->hash, entry->key, entry->key_size) = *entry;
+	}
+
+	map->as.entries = entries;
+	map->capacity = capacity;
+	return 0;
+}
+
+int
+crustache_value_set(
+	crustache_arena *arena,
+	crustache_value *map,
+	const char *key, size_t key_size,
+	crustache_value *value)
+{
+	return value_set(arena, map, key, key_size, 1, value);
+}
+
+int
+value_set(
+	crustache_arena *arena,
+	crustache_value *map,
+	const char *key, size_t key_size,
+	int copy_key,
+	crustache_value *value)
+{
+	struct value_entry *entry;
+	size_t hash;
+
+	value_decode(map);
+
+	if (map->type != CRUSTACHE_VAR_CONTEXT || value == NULL)
+		return -1;
+
+	if ((map->size + 1) * 2 > map->capacity && map_grow(arena, map) < 0)
+		return CR_ENOMEM;
+
+	hash = crustache_key_hash(key, key_size);
+	entry = map_find(map->as.entries, map->capacity, hash, key, key_size);
+
+	if (entry->key == NULL) {
+		entry->key = copy_key ? copy_str(arena, key, key_size) : key;
+		if (entry->key == NULL)
+			return CR_ENOMEM;
+
+		entry->hash = hash;
+		entry->key_size = key_size;
+		map->size++;
+	}
+
+	entry->value = value;
+	return 0;
+}
+
+crustache_value *
+crustache_value_get(crustache_value *map, const char *key, size_t key_size)
+{
+	value_decode(map);
+
+	if (map->type != CRUSTACHE_VAR_CONTEXT)
+		return NULL;
+
+	return map_find(map->as.entries, map->capacity,
+		crustache_key_hash(key, key_size), key, key_size)->value;
+}
+
+crustache_value *
+crustache_value_at(crustache_value *array, size_t i)
+{
+	value_decode(array);
+
+	if (array->type != CRUSTACHE_VAR_LIST || i >= array->size)
+		return NULL;
+
+	return array->as.items[i];
+}
+
+size_t
+crustache_value_size(crustache_value *value)
+{
+	value_decode(value);
+	return value->size;
+}
+
+void
+crustache_value_var(crustache_var *var, crustache_value *value)
+{
+	value_decode(value);
+	memset(var, 0x0, sizeof(crustache_var));
+
+	/* the arena owns everything */
+	var->flags = CRUSTACHE_VAR_BORROWED;
+	var->type = value->type;
+
+	switch (value->type) {
+	case CRUSTACHE_VAR_STR:
+	case CRUSTACHE_VAR_SAFE_STR:
+		var->data = (void *)value->as.str;
+		var->size = value->size;
+		break;
+
+	case CRUSTACHE_VAR_INT64:
+		var->value.integer = value->as.integer;
+		break;
+
+	case CRUSTACHE_VAR_DOUBLE:
+		var->value.number = value->as.number;
+		break;
+
+	case CRUSTACHE_VAR_LIST:
+		var->data = value;
+		var->size = value->size;
+		break;
+
+	case CRUSTACHE_VAR_CONTEXT:
+		var->data = value;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int
+value_context_find(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	crustache_value *value = crustache_value_get(context, key, key_size);
+	if (value == NULL)
+		return -1;
+
+	crustache_value_var(var, value);
+	return 0;
+}
+
+/* The keys come with the hash worked out when the template was compiled */
+static int
+value_context_find_many(crustache_var *vars, int *found, void *context, const crustache_key *keys, size_t count)
+{
+	crustache_value *map = context;
+	size_t i;
+
+	value_decode(map);
+
+	for (i = 0; i < count; ++i) {
+		crustache_value *value = NULL;
+
+		if (map->type == CRUSTACHE_VAR_CONTEXT)
+			value = map_find(map->as.entries, map->capacity,
+				keys[i].hash, keys[i].name, keys[i].size)->value;
+
+		found[i] = (value != NULL);
+		if (value != NULL)
+			crustache_value_var(&vars[i], value);
+	}
+
+	return 0;
+}
+
+static int
+value_list_get(crustache_var *var, void *list, size_t i)
+{
+	crustache_value *value = crustache_value_at(list, i);
+	if (value == NULL)
+		return -1;
+
+	crustache_value_var(var, value);
+	return 0;
+}
+
+static int
+value_lambda(crustache_var *var, void *lambda, const char *raw_template, size_t raw_size)
+{
+	(void)var;
+	(void)lambda;
+	(void)raw_template;
+	(void)raw_size;
+
+	/* there are no lambdas in a document */
+	return -1;
+}
+
+void
+crustache_value_api(crustache_api *api)
+{
+	memset(api, 0x0, sizeof(crustache_api));
+
+	api->context_find = &value_context_find;
+	api->context_find_many = &value_context_find_many;
+	api->list_get = &value_list_get;
+	api->lambda = &value_lambda;
+}
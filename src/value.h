@@ -0,0 +1,64 @@
+#ifndef __CR_VALUE_H__
+#define __CR_VALUE_H__
+
+#include "crustache.h"
+
+struct value_entry {
+	size_t hash;
+	const char *key;
+	size_t key_size;
+	crustache_value *value;
+};
+
+struct crustache_value {
+	crustache_var_t type;
+
+	/* the length of a string, or the number of items in an array or map */
+	size_t size;
+	size_t capacity;
+
+	union {
+		const char *str;
+		int64_t integer;
+		double number;
+		crustache_value **items;
+		struct value_entry *entries;
+	} as;
+
+	/* JSON objects and arrays are only decoded once they are used;
+	 * until then, this is their source text */
+	const char *json;
+	size_t json_size;
+	crustache_arena *arena;
+};
+
+extern crustache_value *
+value_new(crustache_arena *arena, crustache_var_t type);
+
+extern int
+value_init_array(crustache_arena *arena, crustache_value *array, size_t capacity);
+
+extern int
+value_init_map(crustache_arena *arena, crustache_value *map, size_t capacity);
+
+/* Create a string pointing straight at `str`, with no copy */
+extern crustache_value *
+value_new_str_ref(crustache_arena *arena, crustache_var_t type, const char *str, size_t size);
+
+extern int
+value_set(
+	crustache_arena *arena,
+	crustache_value *map,
+	const char *key, size_t key_size,
+	int copy_key,
+	crustache_value *value);
+
+/* Decode a lazy JSON object or array in place. The syntax has been
+ * checked when the document was loaded; values which can't be
+ * decoded (out of memory) become false */
+extern void
+json_decode(crustache_value *value);
+
+#define value_decode(v) do { if ((v)->json != NULL) json_decode(v); } while (0)
+
+#endif
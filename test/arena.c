@@ -0,0 +1,222 @@
+#include <stdint.h>
+
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"items\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,"
+	" 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40]}";
+
+#define BIG_SIZE 5000
+
+static crustache_api arena_api;
+static crustache_arena *arena;
+static crustache_template *inner;
+
+/* every allocation made by the callbacks, in order */
+static void *allocs[256];
+static size_t alloc_count;
+static int misaligned;
+
+static void *
+track_alloc(size_t size)
+{
+	void *ptr = crustache_arena_alloc(arena, size);
+
+	if (ptr != NULL && ((uintptr_t)ptr % 16) != 0)
+		misaligned++;
+
+	if (alloc_count < sizeof(allocs) / sizeof(allocs[0]))
+		allocs[alloc_count++] = ptr;
+
+	return ptr;
+}
+
+static void
+borrowed_str(crustache_var *var, char *str, size_t size)
+{
+	memset(var, 0x0, sizeof(crustache_var));
+	var->type = CRUSTACHE_VAR_STR;
+	var->data = str;
+	var->size = size;
+	var->flags = CRUSTACHE_VAR_BORROWED;
+}
+
+/*
+ * `num` is a counter formatted into the arena, `big` a string larger
+ * than a whole chunk, and `nest` a lambda; the rest is in the document.
+ */
+static int
+find_arena(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	static int counter;
+	char *str;
+
+	if (key_size == 3 && memcmp(key, "num", 3) == 0) {
+		if ((str = track_alloc(24)) == NULL)
+			return -1;
+
+		borrowed_str(var, str, snprintf(str, 24, "(%d)", counter++ % 10));
+		return 0;
+	}
+
+	if (key_size == 3 && memcmp(key, "big", 3) == 0) {
+		if ((str = track_alloc(BIG_SIZE)) == NULL)
+			return -1;
+
+		memset(str, 'b', BIG_SIZE);
+		borrowed_str(var, str, BIG_SIZE);
+		return 0;
+	}
+
+	if (key_size == 4 && memcmp(key, "nest", 4) == 0) {
+		memset(var, 0x0, sizeof(crustache_var));
+		var->type = CRUSTACHE_VAR_LAMBDA;
+		var->flags = CRUSTACHE_VAR_BORROWED;
+		return 0;
+	}
+
+	return test_value_find(var, context, key, key_size);
+}
+
+/*
+ * Keep a string in the arena across a whole render of `inner`, which
+ * allocates from the same arena, then print it.
+ */
+static int
+nest_lambda(struct buf *ob, void *lambda, crustache_section *section)
+{
+	crustache_var context;
+	char *kept;
+
+	(void)lambda;
+
+	if ((kept = track_alloc(8)) == NULL)
+		return -1;
+
+	memcpy(kept, "kept", 5);
+
+	memset(&context, 0x0, sizeof(context));
+	context.type = CRUSTACHE_VAR_CONTEXT;
+
+	if (crustache_render(ob, inner, &context) < 0)
+		return -1;
+
+	bufput(ob, kept, strlen(kept));
+	return crustache_render_section(ob, section, NULL);
+}
+
+static void
+setup(void)
+{
+	test_counting_api(&arena_api, &find_arena);
+	arena_api.lambda_section = &nest_lambda;
+	arena_api.arena = arena;
+}
+
+/* Every number in the list, through the arena */
+static void
+test_callbacks(struct buf *ob)
+{
+	void *first[128];
+	size_t count, i;
+
+	alloc_count = misaligned = 0;
+	CHECK(test_render(ob, &arena_api, "{{#items}}{{num}}{{/items}}", CONTEXT) == 0);
+	CHECK(ob->size == 40 * 3 && memcmp(ob->data, "(0)(1)(2)", 9) == 0);
+
+	/* 40 allocations don't fit in a single 1KB chunk */
+	CHECK(alloc_count == 40 && misaligned == 0);
+
+	count = alloc_count;
+	memcpy(first, allocs, count * sizeof(void *));
+
+	/* the arena is rewound when the render is over, and the next one
+	 * reuses the same memory, chunks and all */
+	ob->size = 0;
+	alloc_count = 0;
+	CHECK(test_render(ob, &arena_api, "{{#items}}{{num}}{{/items}}", CONTEXT) == 0);
+	CHECK(alloc_count == count);
+
+	for (i = 0; i < count && i < alloc_count; ++i)
+		CHECK(allocs[i] == first[i]);
+
+	/* even when the render fails */
+	ob->size = 0;
+	alloc_count = 0;
+	CHECK(test_render(ob, &arena_api, "{{num}}{{#num}}{{/num}}", CONTEXT) == CR_ERENDER_WRONG_VARTYPE);
+	CHECK(alloc_count == 2 && allocs[0] == first[0]);
+}
+
+/* A lambda rendering another template keeps what it allocated before */
+static void
+test_nested(struct buf *ob)
+{
+	CHECK(crustache_new(&inner, &arena_api, "[{{num}}{{num}}{{big}}]", 23) == 0);
+
+	ob->size = 0;
+	alloc_count = 0;
+	CHECK(test_render(ob, &arena_api, "{{num}}{{#nest}}{{num}}{{/nest}}", CONTEXT) == 0);
+
+	/* num, kept, the inner render, then num again */
+	CHECK(alloc_count == 6);
+	CHECK(ob->size == 3 + 1 + 6 + BIG_SIZE + 1 + 4 + 3);
+	CHECK(ob->size > 4 && memcmp(ob->data + ob->size - 7, "kept(", 5) == 0);
+
+	/* the inner render rewound to just after `kept` */
+	CHECK(alloc_count == 6 && allocs[5] == allocs[2]);
+
+	crustache_free(inner);
+	inner = NULL;
+}
+
+/* An allocation larger than a chunk gets one of its own */
+static void
+test_oversized(struct buf *ob)
+{
+	const char *template = "{{num}}{{big}}{{num}}{{big}}{{num}}";
+	void *first[5];
+	size_t i, bs = 0;
+
+	ob->size = 0;
+	alloc_count = misaligned = 0;
+	CHECK(test_render(ob, &arena_api, template, CONTEXT) == 0);
+	CHECK(ob->size == 3 * 3 + 2 * BIG_SIZE);
+
+	for (i = 0; i < ob->size; ++i)
+		bs += (ob->data[i] == 'b');
+	CHECK(bs == 2 * BIG_SIZE);
+
+	CHECK(alloc_count == 5 && misaligned == 0);
+	CHECK(alloc_count == 5 && allocs[1] != allocs[3]);
+	memcpy(first, allocs, sizeof(first));
+
+	/* the same render fits in the same chunks next time */
+	ob->size = 0;
+	alloc_count = 0;
+	CHECK(test_render(ob, &arena_api, template, CONTEXT) == 0);
+	CHECK(alloc_count == 5);
+
+	for (i = 0; i < 5 && i < alloc_count; ++i)
+		CHECK(allocs[i] == first[i]);
+
+	/* reset outside of a render */
+	crustache_arena_reset(arena);
+	CHECK(track_alloc(16) == first[0]);
+	crustache_arena_reset(arena);
+}
+
+void
+test_arena(void)
+{
+	struct buf *ob = bufnew(256);
+
+	arena = crustache_arena_new(1024);
+	setup();
+
+	test_callbacks(ob);
+	test_nested(ob);
+	test_oversized(ob);
+
+	crustache_arena_free(arena);
+	bufrelease(ob);
+}
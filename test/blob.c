@@ -0,0 +1,191 @@
+#include "test.h"
+
+static const char *TEMPLATE =
+	"{{title}}{{{safe}}}{{n}}{{d}}{{#yes}}Y{{/yes}}{{^no}}N{{/no}}"
+	"{{#items}}{{#@last}}{{i}}{{/@last}}{{/items}}{{^empty}}E{{/empty}}{{x}}";
+
+static const char *EXPECTED = "Hello<b>-422.5YN49E";
+
+static int
+write_blob(struct buf *blob)
+{
+	crustache_blob_writer *writer = crustache_blob_writer_new(blob);
+	int i, error;
+
+	crustache_blob_begin_map(writer);
+	crustache_blob_put_key(writer, "title", 5);
+	crustache_blob_put_str(writer, "<Hi>", 4);
+	crustache_blob_put_key(writer, "safe", 4);
+	crustache_blob_put_safe_str(writer, "<b>", 3);
+	crustache_blob_put_key(writer, "n", 1);
+	crustache_blob_put_int(writer, -42);
+	crustache_blob_put_key(writer, "d", 1);
+	crustache_blob_put_double(writer, 2.5);
+	crustache_blob_put_key(writer, "yes", 3);
+	crustache_blob_put_bool(writer, 1);
+	crustache_blob_put_key(writer, "no", 2);
+	crustache_blob_put_bool(writer, 0);
+
+	/* the last value for a key wins */
+	crustache_blob_put_key(writer, "title", 5);
+	crustache_blob_put_str(writer, "Hello", 5);
+
+	crustache_blob_put_key(writer, "items", 5);
+	crustache_blob_begin_array(writer);
+
+	for (i = 0; i < 50; ++i) {
+		crustache_blob_begin_map(writer);
+		crustache_blob_put_key(writer, "i", 1);
+		crustache_blob_put_int(writer, i);
+		crustache_blob_end(writer);
+	}
+
+	crustache_blob_end(writer);
+
+	crustache_blob_put_key(writer, "empty", 5);
+	crustache_blob_begin_array(writer);
+	crustache_blob_end(writer);
+	crustache_blob_end(writer);
+
+	error = crustache_blob_finish(writer);
+
+	/* a blob has a single root */
+	CHECK(crustache_blob_put_int(writer, 1) == CR_EBLOB);
+
+	crustache_blob_writer_free(writer);
+	return error;
+}
+
+static int
+render_blob(struct buf *ob, struct buf *blob)
+{
+	crustache_template *template;
+	crustache_var context;
+	crustache_api api;
+	int error;
+
+	crustache_blob_api(&api);
+
+	error = crustache_blob_var(&context, blob->data, blob->size);
+	if (error < 0)
+		return error;
+
+	CHECK(crustache_new(&template, &api, TEMPLATE, strlen(TEMPLATE)) == 0);
+	error = crustache_render(ob, template, &context);
+	crustache_free(template);
+	return error;
+}
+
+static uint32_t
+read_u32(struct buf *blob, size_t offset)
+{
+	uint32_t value;
+
+	memcpy(&value, blob->data + offset, sizeof(value));
+	return value;
+}
+
+static void
+write_u32(struct buf *blob, size_t offset, uint32_t value)
+{
+	memcpy(blob->data + offset, &value, sizeof(value));
+}
+
+static void
+test_corrupt(struct buf *blob)
+{
+	struct buf *copy = bufnew(blob->size);
+	struct buf *ob = bufnew(64);
+	uint32_t root = read_u32(blob, 4);
+	crustache_var var;
+	size_t i;
+
+	bufput(copy, blob->data, blob->size);
+
+	/* the header */
+	copy->data[0] = 'X';
+	CHECK(crustache_blob_check(copy->data, copy->size) == CR_EBLOB);
+	CHECK(crustache_blob_var(&var, copy->data, copy->size) == CR_EBLOB);
+	copy->data[0] = blob->data[0];
+
+	CHECK(crustache_blob_check(copy->data, copy->size - 8) == CR_EBLOB);
+
+	write_u32(copy, 4, (uint32_t)copy->size);
+	CHECK(crustache_blob_check(copy->data, copy->size) == CR_EBLOB);
+	write_u32(copy, 4, root);
+
+	/* an unknown type for the root map */
+	write_u32(copy, root, 9);
+	CHECK(crustache_blob_check(copy->data, copy->size) == CR_EBLOB);
+	write_u32(copy, root, read_u32(blob, root));
+
+	/* a map with more entries than fit in the blob */
+	write_u32(copy, root + 4, 0xFFFFFF);
+	CHECK(crustache_blob_check(copy->data, copy->size) == CR_EBLOB);
+	write_u32(copy, root + 4, read_u32(blob, root + 4));
+
+	/* an entry pointing outside of the blob */
+	write_u32(copy, root + 8, root + 64);
+	CHECK(crustache_blob_check(copy->data, copy->size) == CR_EBLOB);
+	write_u32(copy, root + 8, read_u32(blob, root + 8));
+
+	CHECK(crustache_blob_check(copy->data, copy->size) == 0);
+
+	/* whatever the damage, a blob which passes the check can be
+	 * rendered safely */
+	for (i = 0; i < copy->size; ++i) {
+		copy->data[i] ^= 0x5A;
+
+		if (crustache_blob_check(copy->data, copy->size) == 0) {
+			ob->size = 0;
+			render_blob(ob, copy);
+		}
+
+		copy->data[i] = blob->data[i];
+	}
+
+	bufrelease(ob);
+	bufrelease(copy);
+}
+
+static void
+test_misuse(void)
+{
+	struct buf *blob = bufnew(64);
+	crustache_blob_writer *writer = crustache_blob_writer_new(blob);
+
+	/* a value in a map needs a key first, and errors stick */
+	CHECK(crustache_blob_begin_map(writer) == 0);
+	CHECK(crustache_blob_put_int(writer, 1) == CR_EBLOB);
+	CHECK(crustache_blob_put_key(writer, "a", 1) == CR_EBLOB);
+	CHECK(crustache_blob_finish(writer) == CR_EBLOB);
+	crustache_blob_writer_free(writer);
+
+	/* containers must be closed */
+	blob->size = 0;
+	writer = crustache_blob_writer_new(blob);
+	crustache_blob_begin_array(writer);
+	CHECK(crustache_blob_finish(writer) == CR_EBLOB);
+	crustache_blob_writer_free(writer);
+
+	bufrelease(blob);
+}
+
+void
+test_blob(void)
+{
+	struct buf *blob = bufnew(256);
+	struct buf *ob = bufnew(64);
+
+	CHECK(write_blob(blob) == 0);
+	CHECK(crustache_blob_check(blob->data, blob->size) == 0);
+
+	CHECK(render_blob(ob, blob) == 0);
+	CHECK_OUTPUT(ob, EXPECTED);
+
+	test_corrupt(blob);
+	test_misuse();
+
+	bufrelease(ob);
+	bufrelease(blob);
+}
@@ -0,0 +1,48 @@
+#include "test.h"
+
+static int frees;
+
+/* Lend every variable but the ones whose name starts with `o` */
+static int
+find_owned(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	int error = test_value_find(var, context, key, key_size);
+
+	if (error == 0 && key[0] == 'o')
+		var->flags &= ~CRUSTACHE_VAR_BORROWED;
+
+	return error;
+}
+
+static void
+count_free(crustache_var_t type, void *var)
+{
+	(void)type;
+	(void)var;
+	frees++;
+}
+
+void
+test_borrowed(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_stats stats = {0, 0};
+	crustache_api api;
+
+	test_counting_api(&api, &find_owned);
+	api.var_free = &count_free;
+	api.stats = &stats;
+
+	/* `own` and `olist` are freed; `b` and the two items are borrowed.
+	 * The `{{.}}` pointing at the items are the renderer's own copies,
+	 * and don't count as saved calls */
+	CHECK(test_render(ob, &api, "{{own}}{{b}}{{#olist}}{{.}}{{/olist}}",
+		"{\"own\": \"O\", \"b\": \"B\", \"olist\": [\"1\", \"2\"]}") == 0);
+	CHECK_OUTPUT(ob, "OB12");
+
+	CHECK(frees == 2);
+	CHECK(stats.var_free_calls == 2);
+	CHECK(stats.var_free_skipped == 3);
+
+	bufrelease(ob);
+}
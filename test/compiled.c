@@ -0,0 +1,141 @@
+#include "test.h"
+
+static const char *SOURCE = "<{{title}}>{{#items}}[{{.}}]{{/items}}";
+
+static const char *CONTEXT = "{\"title\": \"a&b\", \"items\": [\"x\", \"y\"]}";
+
+/* What crustache-aot generates for SOURCE, written out by hand */
+static const crustache_aot_name name_title = {
+	{"title", 5, 0}, NULL, 0, 1
+};
+
+static const crustache_aot_name name_items = {
+	{"items", 5, 0}, NULL, 0, 3
+};
+
+static const crustache_aot_name name_dot = {
+	{".", 1, 0}, NULL, 0, 5
+};
+
+static int calls;
+
+static int
+page_root(struct buf *ob, crustache_aot *aot)
+{
+	crustache_var var;
+	int error;
+
+	calls++;
+
+	bufput(ob, "<", 1);
+	if ((error = crustache_aot_fetch(&var, aot, &name_title)) < 0 ||
+		(error = crustache_aot_put(ob, aot, &var, &name_title)) < 0)
+		return error;
+	bufput(ob, ">", 1);
+
+	for (error = crustache_aot_begin(ob, aot, &name_items); error > 0;
+		error = crustache_aot_next(ob, aot)) {
+		bufput(ob, "[", 1);
+		if ((error = crustache_aot_fetch(&var, aot, &name_dot)) < 0 ||
+			(error = crustache_aot_put(ob, aot, &var, &name_dot)) < 0)
+			return error;
+		bufput(ob, "]", 1);
+	}
+
+	return error;
+}
+
+static crustache_compiled page_compiled = {
+	&page_root, 0, 1, 0, NULL, 0
+};
+
+/* Generate the code for `crt` into `ob`, and take the node count and
+ * hash of the template from it */
+static void
+generate(struct buf *ob, crustache_template *crt, const char *source)
+{
+	const char *compiled;
+	unsigned int hash;
+
+	ob->size = 0;
+	CHECK(crustache_compile_c(ob, crt, "page") == 0);
+	bufputc(ob, '\0');
+
+	compiled = strstr((char *)ob->data, "&page_root, ");
+	CHECK(compiled != NULL);
+
+	if (compiled != NULL &&
+		sscanf(compiled, "&page_root, %zu, %zu, 0x%xu", &page_compiled.node_count,
+			&page_compiled.loop_depth, &hash) == 3)
+		page_compiled.hash = hash;
+
+	page_compiled.source = source;
+	page_compiled.source_size = strlen(source);
+}
+
+void
+test_compiled(void)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_template *crt, *other;
+	crustache_value *value;
+	crustache_var context;
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+	CHECK(crustache_json_parse(&value, arena, CONTEXT, strlen(CONTEXT)) == 0);
+	crustache_value_var(&context, value);
+
+	CHECK(crustache_new(&crt, &api, SOURCE, strlen(SOURCE)) == 0);
+	generate(ob, crt, SOURCE);
+
+	CHECK(strstr((char *)ob->data, "crustache_aot_fetch(&var, aot, &page_name_1)") != NULL);
+	CHECK(strstr((char *)ob->data, "for (error = crustache_aot_begin(ob, aot, &page_name_3)") != NULL);
+	CHECK(strstr((char *)ob->data, "bufput(ob, \"]\", 1);") != NULL);
+	CHECK(page_compiled.node_count == 7 && page_compiled.loop_depth == 1);
+
+	/* the compiled code renders just like the interpreter */
+	ob->size = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK_OUTPUT(ob, "<a&amp;b>[x][y]");
+
+	CHECK(crustache_attach_compiled(crt, &page_compiled) == 0);
+	ob->size = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK_OUTPUT(ob, "<a&amp;b>[x][y]");
+	CHECK(calls == 1);
+
+	/* until it's detached */
+	CHECK(crustache_attach_compiled(crt, NULL) == 0);
+	ob->size = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK(calls == 1);
+	crustache_free(crt);
+
+	/* or created with it */
+	CHECK(crustache_new_compiled(&crt, &api, &page_compiled) == 0);
+	ob->size = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK_OUTPUT(ob, "<a&amp;b>[x][y]");
+	CHECK(calls == 2);
+	crustache_free(crt);
+
+	/* templates from another source, or minified, are refused */
+	CHECK(crustache_new(&other, &api, "{{x}}", 5) == 0);
+	CHECK(crustache_attach_compiled(other, &page_compiled) == CR_ECOMPILED_MISMATCH);
+	crustache_free(other);
+
+	api.minify_html = 1;
+	CHECK(crustache_new(&other, &api, "<p>  {{x}}</p>", 14) == 0);
+	api.minify_html = 0;
+	CHECK(crustache_new(&crt, &api, "<p>  {{x}}</p>", 14) == 0);
+	generate(ob, crt, "<p>  {{x}}</p>");
+	CHECK(crustache_attach_compiled(crt, &page_compiled) == 0);
+	CHECK(crustache_attach_compiled(other, &page_compiled) == CR_ECOMPILED_MISMATCH);
+	crustache_free(other);
+	crustache_free(crt);
+
+	crustache_arena_free(arena);
+	bufrelease(ob);
+}
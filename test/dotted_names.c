@@ -0,0 +1,38 @@
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"a\": {\"b\": {\"c\": \"deep <c>\"}, \"n\": 7},"
+	" \"list\": [{\"a\": {}}, {\"a\": {\"b\": {\"c\": \"inner\"}}}],"
+	" \"x\": \"top\"}";
+
+static void
+check_dotted(const char *template, const char *expected)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+
+	CHECK(test_render(ob, &api, template, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+void
+test_dotted_names(void)
+{
+	check_dotted("{{a.b.c}}|{{{a.b.c}}}|{{a.n}}", "deep &lt;c&gt;|deep <c>|7");
+
+	/* missing segments render nothing */
+	check_dotted("[{{a.z}}][{{a.b.c.d}}][{{z.b}}]", "[][][]");
+
+	/* sections on dotted names push the last value */
+	check_dotted("{{#a.b}}{{c}}{{/a.b}}|{{^a.z}}none{{/a.z}}", "deep &lt;c&gt;|none");
+
+	/* only the first segment is looked up the context stack: once it's
+	 * found, a missing segment doesn't fall back to an outer context */
+	check_dotted("{{#list}}[{{a.b.c}}]{{/list}}", "[][inner]");
+
+	/* inside a section, names start from its value and fall back to the outer contexts */
+	check_dotted("{{#a}}{{b.c}}{{x}}{{/a}}", "deep &lt;c&gt;top");
+}
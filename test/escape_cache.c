@@ -0,0 +1,109 @@
+#include "test.h"
+
+static const char *ESCAPED = "&lt;b&gt;fish &amp; chips&lt;&#47;b&gt;";
+
+static void
+test_hits(void)
+{
+	crustache_escape_cache *cache = crustache_escape_cache_new(16, 0);
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+	size_t hits, misses;
+
+	crustache_value_api(&api);
+	api.escape_cache = cache;
+
+	/* every tag finds the same string, but only the first one escapes it */
+	CHECK(test_render(ob, &api, "{{a}}|{{#l}}{{a}}|{{/l}}{{{a}}}",
+		"{\"a\": \"<b>fish & chips</b>\", \"l\": [1, 2]}") == 0);
+	CHECK_OUTPUT(ob, "&lt;b&gt;fish &amp; chips&lt;&#47;b&gt;|"
+		"&lt;b&gt;fish &amp; chips&lt;&#47;b&gt;|"
+		"&lt;b&gt;fish &amp; chips&lt;&#47;b&gt;|<b>fish & chips</b>");
+
+	crustache_escape_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 2 && misses == 1);
+
+	/* short strings skip the cache */
+	ob->size = 0;
+	CHECK(test_render(ob, &api, "{{a}}{{a}}", "{\"a\": \"<i>\"}") == 0);
+	CHECK_OUTPUT(ob, "&lt;i&gt;&lt;i&gt;");
+
+	crustache_escape_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 2 && misses == 1);
+
+	bufrelease(ob);
+	crustache_escape_cache_free(cache);
+}
+
+static void
+test_clear(void)
+{
+	crustache_escape_cache *cache = crustache_escape_cache_new(16, 0);
+	crustache_arena *arena = crustache_arena_new(1024);
+	struct buf *ob = bufnew(64);
+	crustache_template *template;
+	crustache_value *value;
+	crustache_var context;
+	crustache_api api;
+	size_t hits, misses;
+	const char *json = "{\"a\": \"<b>fish & chips</b>\"}";
+
+	crustache_value_api(&api);
+	api.escape_cache = cache;
+
+	CHECK(crustache_json_parse(&value, arena, json, strlen(json)) == 0);
+	crustache_value_var(&context, value);
+	CHECK(crustache_new(&template, &api, "{{a}}", 5) == 0);
+
+	CHECK(crustache_render(ob, template, &context) == 0);
+	CHECK(crustache_render(ob, template, &context) == 0);
+	crustache_escape_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 1 && misses == 1);
+
+	/* clearing drops the entries and the counters */
+	crustache_escape_cache_clear(cache);
+	crustache_escape_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 0 && misses == 0);
+
+	ob->size = 0;
+	CHECK(crustache_render(ob, template, &context) == 0);
+	CHECK_OUTPUT(ob, ESCAPED);
+	crustache_escape_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 0 && misses == 1);
+
+	crustache_free(template);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+	crustache_escape_cache_free(cache);
+}
+
+static void
+test_full(void)
+{
+	crustache_escape_cache *cache = crustache_escape_cache_new(1, 0);
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+	size_t hits, misses;
+
+	crustache_value_api(&api);
+	api.escape_cache = cache;
+
+	/* a full cache still serves what it has, but stores nothing new */
+	CHECK(test_render(ob, &api, "{{a}}{{b}}{{a}}{{b}}",
+		"{\"a\": \"<first one>\", \"b\": \"<second one>\"}") == 0);
+	CHECK_OUTPUT(ob, "&lt;first one&gt;&lt;second one&gt;&lt;first one&gt;&lt;second one&gt;");
+
+	crustache_escape_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 1 && misses == 3);
+
+	bufrelease(ob);
+	crustache_escape_cache_free(cache);
+}
+
+void
+test_escape_cache(void)
+{
+	test_hits();
+	test_clear();
+	test_full();
+}
@@ -0,0 +1,209 @@
+#include <pthread.h>
+
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"name\": \"Cr\xC3\xBCstache <tpl>\", \"tags\": [\"a\", \"b<\", \"c\"],"
+	" \"empty\": \"\", \"n\": \"x\", \"price\": 1234567.456, \"big\": -1234567}";
+
+static void
+check_filter(const char *template, const char *expected)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+
+	CHECK(test_render(ob, &api, template, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+static int
+filter_currency(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	(void)args;
+	(void)arg_count;
+	(void)api;
+
+	if (in->type != CRUSTACHE_VAR_DOUBLE)
+		return -1;
+
+	BUFPUTSL(scratch, "$");
+	bufputd(scratch, in->value.number);
+
+	out->type = CRUSTACHE_VAR_STR;
+	out->data = scratch->data;
+	out->size = scratch->size;
+	return 0;
+}
+
+static const crustache_filter FILTERS[] = {
+	{"currency", &filter_currency},
+	{NULL, NULL}
+};
+
+static void
+test_custom(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+	api.filters = FILTERS;
+
+	CHECK(test_render(ob, &api, "{{price | currency}}", CONTEXT) == 0);
+	CHECK_OUTPUT(ob, "$1234567.456");
+
+	/* a filter failing fails the render */
+	CHECK(test_render(ob, &api, "{{name | currency}}", CONTEXT) == CR_ERENDER_FILTER);
+
+	/* the builtin filters are still there */
+	ob->size = 0;
+	CHECK(test_render(ob, &api, "{{n | upcase}}", CONTEXT) == 0);
+	CHECK_OUTPUT(ob, "X");
+
+	bufrelease(ob);
+}
+
+static void
+test_syntax(void)
+{
+	static const char *BAD[] = {
+		"{{name | nope}}",
+		"{{name | truncate: }}",
+		"{{name |}}",
+		"{{name | upcase upcase}}",
+		"{{name | truncate: \"x}}",
+	};
+	crustache_api api;
+	size_t i;
+
+	crustache_value_api(&api);
+
+	for (i = 0; i < sizeof(BAD) / sizeof(BAD[0]); ++i) {
+		crustache_template *template;
+
+		CHECK(crustache_new(&template, &api, BAD[i], strlen(BAD[i])) == CR_EPARSE_BAD_FILTER);
+		crustache_free(template);
+	}
+}
+
+/* Safe strings keep their markup through the filters */
+static void
+test_safe(void)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_value *map = crustache_value_new_map(arena, 1);
+	struct buf *ob = bufnew(64);
+	crustache_template *template;
+	crustache_var context;
+	crustache_api api;
+	const char *source = "{{html | upcase}}|{{html | truncate: 6}}";
+
+	crustache_value_api(&api);
+	crustache_value_set(arena, map, "html", 4,
+		crustache_value_new_safe_str(arena, "caf&eacute; <b>au</b> lait", 26));
+	crustache_value_var(&context, map);
+
+	CHECK(crustache_new(&template, &api, source, strlen(source)) == 0);
+	CHECK(crustache_render(ob, template, &context) == 0);
+	CHECK_OUTPUT(ob, "CAF&eacute; <b>AU</b> LAIT|caf&eacute; <b>a...");
+
+	crustache_free(template);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+}
+
+struct render_thread {
+	crustache_template *template;
+	const char *json, *expected;
+	int bad;
+};
+
+static void *
+render_thread(void *arg)
+{
+	struct render_thread *thread = arg;
+	crustache_arena *arena = crustache_arena_new(1024);
+	struct buf *ob = bufnew(64);
+	crustache_value *value;
+	crustache_var context;
+	int i;
+
+	crustache_json_parse(&value, arena, thread->json, strlen(thread->json));
+	crustache_value_var(&context, value);
+
+	for (i = 0; i < 20000; ++i) {
+		ob->size = 0;
+
+		if (crustache_render(ob, thread->template, &context) < 0 ||
+			ob->size != strlen(thread->expected) ||
+			memcmp(ob->data, thread->expected, ob->size) != 0)
+			thread->bad++;
+	}
+
+	bufrelease(ob);
+	crustache_arena_free(arena);
+	return NULL;
+}
+
+/* Filter output belongs to the render, so a template can be shared */
+static void
+test_threads(void)
+{
+	struct render_thread threads[2] = {
+		{NULL, "{\"a\": \"abcdefgh\"}", "ABCDEFGH", 0},
+		{NULL, "{\"a\": \"zyxwvutsrq\"}", "ZYXWVUTSRQ", 0},
+	};
+	pthread_t ids[2];
+	crustache_template *crt;
+	crustache_api api;
+	int i;
+
+	crustache_value_api(&api);
+	CHECK(crustache_new(&crt, &api, "{{a | upcase}}", 14) == 0);
+
+	for (i = 0; i < 2; ++i) {
+		threads[i].template = crt;
+		pthread_create(&ids[i], NULL, &render_thread, &threads[i]);
+	}
+
+	for (i = 0; i < 2; ++i) {
+		pthread_join(ids[i], NULL);
+		CHECK(threads[i].bad == 0);
+	}
+
+	crustache_free(crt);
+}
+
+void
+test_filters(void)
+{
+	check_filter("{{name | upcase}}", "CR\xC3\xBCSTACHE &lt;TPL&gt;");
+	check_filter("{{ name|downcase }}", "cr\xC3\xBCstache &lt;tpl&gt;");
+
+	/* truncate counts characters, not bytes */
+	check_filter("{{name | truncate: 4}}", "Cr\xC3\xBCs...");
+	check_filter("{{name | truncate: 3, \"\xE2\x80\xA6\"}}", "Cr\xC3\xBC\xE2\x80\xA6");
+	check_filter("{{name | truncate: 100}}", "Cr\xC3\xBCstache &lt;tpl&gt;");
+
+	check_filter("{{missing | default: 'anon'}}|{{empty | default: \"e\"}}|{{n | default: 'z'}}",
+		"anon|e|x");
+
+	check_filter("{{tags | join}}|{{{tags | join: \" / \"}}}", "a, b&lt;, c|a / b< / c");
+
+	check_filter("{{price | number: 2}}|{{big | number}}|{{big | number: 1}}",
+		"1,234,567.46|-1,234,567|-1,234,567.0");
+
+	/* a chain runs from left to right */
+	check_filter("{{name | upcase | truncate: 2 | downcase | default: 'q' | upcase}}", "CR...");
+
+	test_custom();
+	test_syntax();
+	test_safe();
+	test_threads();
+}
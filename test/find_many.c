@@ -0,0 +1,78 @@
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"items\": [{\"a\": \"1\", \"b\": \"2\", \"c\": false}, {\"a\": \"3\", \"b\": \"4\"}, {\"a\": \"5\"}],"
+	" \"b\": \"B\", \"c\": \"C\", \"user\": {\"name\": \"ann\"}}";
+
+static const char *TEMPLATE =
+	"{{#items}}{{a}}{{b}}{{c}}{{user.name}}{{#user}}{{name}}{{b}}{{/user}};{{/items}}{{^items}}x{{/items}}";
+
+static const char *EXPECTED = "12annann2;34Cannann4;5BCannannB;";
+
+static int (*value_find_many)(crustache_var *, int *, void *, const crustache_key *, size_t);
+
+static int batches, bad_hashes, fail_batches;
+
+static int
+count_find_many(crustache_var *vars, int *found, void *context, const crustache_key *keys, size_t count)
+{
+	size_t i;
+
+	batches++;
+
+	for (i = 0; i < count; ++i) {
+		if (keys[i].hash != crustache_key_hash(keys[i].name, keys[i].size))
+			bad_hashes++;
+	}
+
+	if (fail_batches)
+		return -1;
+
+	return value_find_many(vars, found, context, keys, count);
+}
+
+static void
+setup(crustache_api *api, int many)
+{
+	crustache_value_api(api);
+	value_find_many = api->context_find_many;
+
+	test_counting_api(api, NULL);
+	api->context_find_many = many ? &count_find_many : NULL;
+
+	batches = bad_hashes = fail_batches = 0;
+}
+
+void
+test_find_many(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	/* one name at a time */
+	setup(&api, 0);
+	CHECK(test_render(ob, &api, TEMPLATE, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, EXPECTED);
+	CHECK(test_finds > 0 && batches == 0);
+
+	/* the names of each section are resolved in a single call per
+	 * context pushed: the root, each item and `user` in each item,
+	 * plus the rest of `user.name` on its own */
+	ob->size = 0;
+	setup(&api, 1);
+	CHECK(test_render(ob, &api, TEMPLATE, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, EXPECTED);
+	CHECK(test_finds == 0);
+	CHECK(batches == 1 + 3 + 3 + 3);
+	CHECK(bad_hashes == 0);
+
+	/* when the host fails, we fall back to context_find */
+	ob->size = 0;
+	setup(&api, 1);
+	fail_batches = 1;
+	CHECK(test_render(ob, &api, TEMPLATE, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, EXPECTED);
+	CHECK(test_finds > 0);
+
+	bufrelease(ob);
+}
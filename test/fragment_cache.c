@@ -0,0 +1,124 @@
+#include "test.h"
+
+static const char *TEMPLATE =
+	"{{#nav}}{{#@first}}[{{/@first}}{{x}}{{^@last}}:{{/@last}}{{#@last}}]{{/@last}}{{/nav}}{{user}}";
+
+static const char *ANN =
+	"{\"user\": \"Ann\", \"nav\": [{\"x\": \"a\"}, {\"x\": \"b\"}, {\"x\": \"c\"}]}";
+
+static const char *BOB =
+	"{\"user\": \"Bob\", \"nav\": [{\"x\": \"z\"}]}";
+
+/* `nav` is cached per user, `err` fails, the rest is never cached */
+static int
+cache_key(struct buf *key, const char *name, size_t name_size, crustache_section *section)
+{
+	crustache_var user;
+
+	if (name_size == 3 && memcmp(name, "nav", 3) == 0) {
+		if (crustache_section_find(&user, section, "user", 4) == 0 &&
+			user.type == CRUSTACHE_VAR_STR)
+			bufput(key, user.data, user.size);
+		return 1;
+	}
+
+	if (name_size == 3 && memcmp(name, "err", 3) == 0)
+		return -1;
+
+	return 0;
+}
+
+/* Render `json` with `crt` and count the lookups it took */
+static int
+render_counted(struct buf *ob, crustache_template *crt, const char *json)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_value *value;
+	crustache_var context;
+
+	CHECK(crustache_json_parse(&value, arena, json, strlen(json)) == 0);
+	crustache_value_var(&context, value);
+
+	ob->size = 0;
+	test_finds = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+
+	crustache_arena_free(arena);
+	return test_finds;
+}
+
+static void
+setup(crustache_api *api, crustache_fragment_cache *cache)
+{
+	test_counting_api(api, NULL);
+	api->fragment_cache = cache;
+	api->cache_key = &cache_key;
+}
+
+void
+test_fragment_cache(void)
+{
+	crustache_fragment_cache *cache = crustache_fragment_cache_new(1 << 20, 0);
+	crustache_template *crt;
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+	size_t hits, misses;
+	int first;
+
+	setup(&api, cache);
+	CHECK(crustache_new(&crt, &api, TEMPLATE, strlen(TEMPLATE)) == 0);
+
+	/* on a hit, the section is not even looked up */
+	first = render_counted(ob, crt, ANN);
+	CHECK_OUTPUT(ob, "[a:b:c]Ann");
+
+	CHECK(render_counted(ob, crt, ANN) < first);
+	CHECK_OUTPUT(ob, "[a:b:c]Ann");
+
+	crustache_fragment_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 1 && misses == 1);
+
+	/* the key depends on the user */
+	render_counted(ob, crt, BOB);
+	CHECK_OUTPUT(ob, "[z]Bob");
+
+	crustache_fragment_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 1 && misses == 2);
+
+	/* clearing drops the fragments and the counters */
+	crustache_fragment_cache_clear(cache);
+	crustache_fragment_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 0 && misses == 0);
+
+	CHECK(render_counted(ob, crt, ANN) == first);
+	CHECK_OUTPUT(ob, "[a:b:c]Ann");
+	crustache_free(crt);
+
+	/* another template with the same source doesn't share fragments */
+	api.minify_html = 1;
+	CHECK(crustache_new(&crt, &api, TEMPLATE, strlen(TEMPLATE)) == 0);
+	CHECK(render_counted(ob, crt, ANN) == first);
+	CHECK_OUTPUT(ob, "[a:b:c]Ann");
+	crustache_free(crt);
+	api.minify_html = 0;
+
+	/* fragments bigger than the cache are rendered every time */
+	crustache_fragment_cache_free(cache);
+	cache = crustache_fragment_cache_new(4, 0);
+	setup(&api, cache);
+
+	CHECK(crustache_new(&crt, &api, TEMPLATE, strlen(TEMPLATE)) == 0);
+	render_counted(ob, crt, ANN);
+	CHECK(render_counted(ob, crt, ANN) == first);
+	CHECK_OUTPUT(ob, "[a:b:c]Ann");
+
+	crustache_fragment_cache_stats(cache, &hits, &misses);
+	CHECK(hits == 0 && misses == 2);
+	crustache_free(crt);
+
+	/* cache_key can fail the render */
+	CHECK(test_render(ob, &api, "{{#err}}x{{/err}}", ANN) == CR_ERENDER_NOT_FOUND);
+
+	crustache_fragment_cache_free(cache);
+	bufrelease(ob);
+}
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+
+#include "test.h"
+#include "../src/value.h"
+
+static void
+check_json(const char *json, const char *template, const char *expected)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+
+	CHECK(test_render(ob, &api, template, json) == 0);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+static void
+check_bad(const char *json)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_value *value;
+
+	CHECK(crustache_json_parse(&value, arena, json, strlen(json)) == CR_EJSON_SYNTAX);
+	crustache_arena_free(arena);
+}
+
+static void
+test_values(void)
+{
+	check_json("{\"a\": \"x\", \"n\": -12, \"big\": 99999999999999999999, \"f\": 1.5e2,"
+		" \"t\": true, \"z\": null, \"list\": [1, 2, {\"k\": \"v\"}], \"o\": {\"p\": {\"q\": \"deep\"}}}",
+		"{{a}}|{{n}}|{{f}}|{{#t}}T{{/t}}{{^z}}Z{{/z}}|{{#list}}{{k}},{{/list}}|{{o.p.q}}|{{big}}",
+		"x|-12|150|TZ|,,v,|deep|1e+20");
+
+	check_json("{\"m\": -9223372036854775808, \"z\": 0, \"y\": -0.5, \"x\": 0e1}",
+		"{{m}} {{z}} {{y}} {{x}}", "-9223372036854775808 0 -0.5 0");
+
+	check_json("{\"s\": \"a\\n\\\"b\\u00e9\\ud83d\\ude00\\/ abcdefghijklmnopqrstuvwxyz\"}",
+		"{{{s}}}", "a\n\"b\xC3\xA9\xF0\x9F\x98\x80/ abcdefghijklmnopqrstuvwxyz");
+
+	/* skipping over a container must not trip on brackets in strings */
+	check_json("  { \"x\" : [ ] , \"y\" : { } , \"w\" : [ \"}\" , \"]\" , \"\\\"{\" ] }  ",
+		"{{^x}}E{{/x}}{{#w}}{{{.}}}{{/w}}", "E}]\"{");
+}
+
+static void
+test_syntax(void)
+{
+	static const char *BAD[] = {
+		"", "{", "{]", "[}", "{\"a\" 1}", "[1 2]", "{\"a\":}", "[1,]", "{} x",
+		"tru", "\"abc", "[\"\\q\"]", "[\"\\u12g4\"]", "-", "1.",
+
+		/* leading zeros */
+		"[007]", "-01",
+
+		/* unescaped control characters */
+		"{\"a\": \"x\ny\"}", "[\"\t\"]", "\"\x01\"",
+		"[\"a string long enough for a whole vector\x1f\"]",
+
+		/* errors deep inside containers which are decoded lazily */
+		"{\"bad\": {\"a\": 1,,}, \"ok\": 2}",
+		"[[1, [2, ]]]",
+		"{\"a\": [{\"b\": 01}]}",
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(BAD) / sizeof(BAD[0]); ++i)
+		check_bad(BAD[i]);
+}
+
+/* Any value can be the root of a document */
+static void
+test_scalars(void)
+{
+	static const char *SCALARS[] = { "\"str\"", " 12 ", "true", "null", "-0.5", "\"\\u00e9\"" };
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_value *value;
+	crustache_var var;
+	size_t i;
+
+	for (i = 0; i < sizeof(SCALARS) / sizeof(SCALARS[0]); ++i)
+		CHECK(crustache_json_parse(&value, arena, SCALARS[i], strlen(SCALARS[i])) == 0);
+
+	CHECK(crustache_json_parse(&value, arena, "\"str\"", 5) == 0);
+	crustache_value_var(&var, value);
+	CHECK(var.type == CRUSTACHE_VAR_STR && var.size == 3 && memcmp(var.data, "str", 3) == 0);
+
+	crustache_arena_free(arena);
+}
+
+/* Nesting is only limited by memory, and checking it doesn't recurse */
+static void
+test_deep(void)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	size_t depth = 100000, i;
+	char *json = malloc(2 * depth);
+	crustache_value *value;
+
+	for (i = 0; i < depth; ++i) {
+		json[i] = '[';
+		json[2 * depth - 1 - i] = ']';
+	}
+
+	CHECK(crustache_json_parse(&value, arena, json, 2 * depth) == 0);
+
+	json[depth] = '}';
+	CHECK(crustache_json_parse(&value, arena, json, 2 * depth) == CR_EJSON_SYNTAX);
+
+	free(json);
+	crustache_arena_free(arena);
+}
+
+static void
+test_lazy(void)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	const char *json = "{\"s\": \"plain\", \"a\": [{\"b\": [1, {\"c\": \"d\"}]}], \"e\": {}}";
+	crustache_value *root, *a, *b;
+	crustache_var var;
+
+	CHECK(crustache_json_parse(&root, arena, json, strlen(json)) == 0);
+
+	/* strings without escapes point into the source */
+	crustache_value_var(&var, crustache_value_get(root, "s", 1));
+	CHECK(var.type == CRUSTACHE_VAR_STR && (const char *)var.data == json + 7);
+
+	/* containers are decoded when they are first looked at */
+	a = crustache_value_get(root, "a", 1);
+	CHECK(a != NULL && a->json != NULL);
+	CHECK(crustache_value_size(a) == 1 && a->json == NULL);
+	CHECK(crustache_value_at(a, 0)->json != NULL);
+
+	/* or all at once */
+	CHECK(crustache_json_decode_all(root) == 0);
+	b = crustache_value_get(crustache_value_at(a, 0), "b", 1);
+	CHECK(b != NULL && b->json == NULL);
+	CHECK(crustache_value_at(b, 1)->json == NULL);
+	CHECK(crustache_value_get(root, "e", 1)->json == NULL);
+
+	crustache_arena_free(arena);
+}
+
+void
+test_json(void)
+{
+	test_values();
+	test_syntax();
+	test_scalars();
+	test_deep();
+	test_lazy();
+}
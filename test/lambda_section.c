@@ -0,0 +1,222 @@
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"name\": \"Ann\", \"user\": {\"name\": \"bob\", \"home\": {\"city\": \"Oslo\"}},"
+	" \"items\": [{\"name\": \"x\"}, {\"name\": \"y\"}], \"flag\": \"on\"}";
+
+static int (*value_find_many)(crustache_var *, int *, void *, const crustache_key *, size_t);
+
+static crustache_api section_api;
+static int batches;
+
+/* The names in LAMBDAS resolve to lambdas; the rest to the document */
+static const char *LAMBDAS[] = { "twice", "never", "text", "find", "where", "fail", "broken" };
+
+static const char *
+find_lambda(const char *key, size_t key_size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(LAMBDAS) / sizeof(LAMBDAS[0]); ++i) {
+		if (strlen(LAMBDAS[i]) == key_size && memcmp(LAMBDAS[i], key, key_size) == 0)
+			return LAMBDAS[i];
+	}
+
+	return NULL;
+}
+
+static void
+lambda_var(crustache_var *var, const char *name)
+{
+	memset(var, 0x0, sizeof(crustache_var));
+	var->type = CRUSTACHE_VAR_LAMBDA;
+	var->data = (void *)name;
+	var->flags = CRUSTACHE_VAR_BORROWED;
+}
+
+static int
+find_one(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	const char *lambda = find_lambda(key, key_size);
+
+	if (lambda != NULL) {
+		lambda_var(var, lambda);
+		return 0;
+	}
+
+	return test_value_find(var, context, key, key_size);
+}
+
+static int
+find_many(crustache_var *vars, int *found, void *context, const crustache_key *keys, size_t count)
+{
+	size_t i;
+
+	batches++;
+
+	for (i = 0; i < count; ++i) {
+		const char *lambda = find_lambda(keys[i].name, keys[i].size);
+
+		if (lambda != NULL) {
+			lambda_var(&vars[i], lambda);
+			found[i] = 1;
+		} else if (value_find_many(&vars[i], &found[i], context, &keys[i], 1) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+section_lambda(struct buf *ob, void *lambda, crustache_section *section)
+{
+	const char *name = lambda;
+	const char *text;
+	crustache_var var;
+	size_t size;
+
+	/* the body, rendered as many times as we like */
+	if (strcmp(name, "twice") == 0)
+		return (crustache_render_section(ob, section, NULL) < 0 ||
+			crustache_render_section(ob, section, NULL) < 0) ? -1 : 0;
+
+	if (strcmp(name, "never") == 0)
+		return 0;
+
+	/* the raw text, as `lambda` would get it */
+	if (strcmp(name, "text") == 0) {
+		text = crustache_section_text(section, &size);
+		bufputc(ob, '<');
+		bufput(ob, text, size);
+		bufputc(ob, '>');
+		return 0;
+	}
+
+	/* the section text is a name to look up from where the section is */
+	if (strcmp(name, "find") == 0) {
+		text = crustache_section_text(section, &size);
+
+		if (crustache_section_find(&var, section, text, size) < 0)
+			bufputc(ob, '?');
+		else if (var.type == CRUSTACHE_VAR_STR)
+			bufput(ob, var.data, var.size);
+		else
+			bufputc(ob, '*');
+
+		return 0;
+	}
+
+	/* the body, rendered against `user.home` */
+	if (strcmp(name, "where") == 0) {
+		if (crustache_section_find(&var, section, "user.home", 9) < 0)
+			return -1;
+
+		return crustache_render_section(ob, section, &var) < 0 ? -1 : 0;
+	}
+
+	if (strcmp(name, "fail") == 0)
+		return -1;
+
+	/* a failed render is passed on to the template */
+	if (strcmp(name, "broken") == 0) {
+		crustache_render_section(ob, section, NULL);
+		return -1;
+	}
+
+	return -1;
+}
+
+static void
+setup(int many)
+{
+	crustache_value_api(&section_api);
+	value_find_many = section_api.context_find_many;
+
+	test_counting_api(&section_api, &find_one);
+	section_api.context_find_many = many ? &find_many : NULL;
+	section_api.lambda_section = &section_lambda;
+}
+
+static void
+check_section(const char *template, const char *expected)
+{
+	struct buf *ob = bufnew(64);
+
+	CHECK(test_render(ob, &section_api, template, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+static void
+check_sections(void)
+{
+	check_section("{{#twice}}{{name}};{{/twice}}", "Ann;Ann;");
+	check_section("{{#items}}{{#twice}}{{name}}{{/twice}}{{/items}}", "xxyy");
+	check_section("a{{#never}}{{name}}{{/never}}b", "ab");
+	check_section("{{#text}}{{name}} & {{flag}}{{/text}}", "<{{name}} & {{flag}}>");
+	check_section("{{=<% %>=}}<%#text%><%name%><%/text%>", "<<%name%>>");
+
+	/* the context pushed by the callback sits on top of the stack */
+	check_section("{{#where}}{{city}}, {{name}}{{/where}}", "Oslo, Ann");
+	check_section("{{#items}}{{#where}}{{city}}-{{name}}{{/where}}{{/items}}", "Oslo-xOslo-y");
+
+	/* names are found like tags in the section find them */
+	check_section("{{#find}}name{{/find}}", "Ann");
+	check_section("{{#items}}{{#find}}name{{/find}}|{{#find}}flag{{/find}};{{/items}}", "x|on;y|on;");
+	check_section("{{#user}}{{#find}}name{{/find}}{{/user}}", "bob");
+
+	/* dotted names included */
+	check_section("{{#find}}user.name{{/find}}", "bob");
+	check_section("{{#find}}user.home.city{{/find}}", "Oslo");
+	check_section("{{#items}}{{#find}}user.home.city{{/find}}{{/items}}", "OsloOslo");
+	check_section("{{#find}}user.home{{/find}}", "*");
+	check_section("{{#find}}user.nope{{/find}}", "?");
+	check_section("{{#find}}name.first{{/find}}", "?");
+	check_section("{{#find}}nope.name{{/find}}", "?");
+	check_section("{{#find}}user.{{/find}}", "?");
+}
+
+void
+test_lambda_section(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_template *crt;
+	char error[128];
+
+	setup(0);
+	check_sections();
+
+	/* through `context_find_many`, a key at a time */
+	setup(1);
+	batches = 0;
+	check_sections();
+	CHECK(batches > 0);
+
+	/* a failing callback fails the render at its section, with the
+	 * error from the body if rendering it failed */
+	CHECK(test_render(ob, &section_api, "{{#fail}}{{/fail}}", CONTEXT) == CR_ERENDER_NOT_FOUND);
+
+	CHECK(test_render(ob, &section_api, "{{#broken}}{{flag | join}}{{/broken}}", CONTEXT) ==
+		CR_ERENDER_FILTER);
+
+	{
+		crustache_arena *arena = crustache_arena_new(1024);
+		crustache_value *value;
+		crustache_var context;
+
+		CHECK(crustache_json_parse(&value, arena, CONTEXT, strlen(CONTEXT)) == 0);
+		crustache_value_var(&context, value);
+
+		CHECK(crustache_new(&crt, &section_api, "x{{#fail}}oops{{/fail}}", 23) == 0);
+		CHECK(crustache_render(ob, crt, &context) == CR_ERENDER_NOT_FOUND);
+
+		crustache_error_rendernode(error, sizeof(error), crt);
+		CHECK(strstr(error, "oops") != NULL);
+
+		crustache_free(crt);
+		crustache_arena_free(arena);
+	}
+
+	bufrelease(ob);
+}
@@ -0,0 +1,261 @@
+#include <pthread.h>
+
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"name\": \"Ann\", \"people\": [{\"name\": \"A\"}, {\"name\": \"B\"}, {\"name\": \"C\"}]}";
+
+static crustache_api lambda_api;
+static int partial_loads, distinct, calls;
+
+/* The names in LAMBDAS resolve to lambdas; the rest to the document */
+static const char *LAMBDAS[] = { "wrap", "safe", "same", "cycle", "echo", "fail", "bad" };
+
+static int
+find_lambda(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(LAMBDAS) / sizeof(LAMBDAS[0]); ++i) {
+		if (strlen(LAMBDAS[i]) == key_size && memcmp(LAMBDAS[i], key, key_size) == 0) {
+			memset(var, 0x0, sizeof(crustache_var));
+			var->type = CRUSTACHE_VAR_LAMBDA;
+			var->data = (void *)LAMBDAS[i];
+			var->flags = CRUSTACHE_VAR_BORROWED;
+			return 0;
+		}
+	}
+
+	return test_value_find(var, context, key, key_size);
+}
+
+static int
+call_lambda(crustache_var *var, void *lambda, const char *raw, size_t raw_size)
+{
+	static char text[256];
+	const char *name = lambda;
+
+	memset(var, 0x0, sizeof(crustache_var));
+	var->type = CRUSTACHE_VAR_STR;
+	var->data = text;
+
+	if (strcmp(name, "wrap") == 0)
+		snprintf(text, sizeof(text), "[%.*s]", (int)raw_size, raw);
+
+	else if (strcmp(name, "safe") == 0) {
+		var->type = CRUSTACHE_VAR_SAFE_STR;
+		snprintf(text, sizeof(text), "{{%.*s}}", (int)raw_size, raw);
+	}
+
+	/* the text is new each time, but the same every time */
+	else if (strcmp(name, "same") == 0)
+		snprintf(text, sizeof(text), "{{>p}}");
+
+	/* the section, as it is; this one is safe to call from threads */
+	else if (strcmp(name, "echo") == 0) {
+		var->data = (void *)raw;
+		var->size = raw_size;
+		return 0;
+	}
+
+	else if (strcmp(name, "fail") == 0)
+		return -1;
+
+	/* `distinct` different texts, one after the other */
+	else if (strcmp(name, "cycle") == 0)
+		snprintf(text, sizeof(text), "{{>p}}%d;", calls++ % distinct);
+
+	else
+		snprintf(text, sizeof(text), "{{=x}}");
+
+	var->size = strlen(text);
+	return 0;
+}
+
+/* Partials are owned by the library, so each template compiled from
+ * the output of a lambda loads `p` once */
+static int
+load_partial(crustache_template **partial, const char *name, size_t name_size)
+{
+	(void)name;
+	(void)name_size;
+
+	partial_loads++;
+	return crustache_new(partial, &lambda_api, "{{name}}", 8);
+}
+
+static void
+setup(void)
+{
+	crustache_value_api(&lambda_api);
+
+	lambda_api.context_find = &find_lambda;
+	lambda_api.context_find_many = NULL;
+	lambda_api.lambda = &call_lambda;
+	lambda_api.partial = &load_partial;
+	lambda_api.free_partials = 1;
+}
+
+static void
+check_lambda(const char *template, const char *expected)
+{
+	struct buf *ob = bufnew(64);
+
+	CHECK(test_render(ob, &lambda_api, template, CONTEXT) == 0);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+/* Render the output of `cycle` 3 * `count` times with a single template */
+static void
+check_cycle(int count, int expected_loads)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	const char *template = "{{#people}}{{#cycle}}{{/cycle}}{{/people}}";
+	crustache_template *crt;
+	crustache_value *value;
+	crustache_var context;
+	struct buf *ob = bufnew(64);
+	int i;
+
+	CHECK(crustache_json_parse(&value, arena, CONTEXT, strlen(CONTEXT)) == 0);
+	crustache_value_var(&context, value);
+	CHECK(crustache_new(&crt, &lambda_api, template, strlen(template)) == 0);
+
+	partial_loads = calls = 0;
+
+	for (i = 0; i < count; ++i)
+		CHECK(crustache_render(ob, crt, &context) == 0);
+
+	CHECK(partial_loads == expected_loads);
+
+	crustache_free(crt);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+}
+
+struct render_thread {
+	crustache_template *template;
+	const char *expected;
+	int bad;
+};
+
+static void *
+render_thread(void *arg)
+{
+	struct render_thread *thread = arg;
+	crustache_arena *arena = crustache_arena_new(1024);
+	struct buf *ob = bufnew(256);
+	crustache_value *value;
+	crustache_var context;
+	int i;
+
+	crustache_json_parse(&value, arena, CONTEXT, strlen(CONTEXT));
+	crustache_value_var(&context, value);
+
+	for (i = 0; i < 2000; ++i) {
+		ob->size = 0;
+
+		if (crustache_render(ob, thread->template, &context) < 0 ||
+			ob->size != strlen(thread->expected) ||
+			memcmp(ob->data, thread->expected, ob->size) != 0)
+			thread->bad++;
+	}
+
+	bufrelease(ob);
+	crustache_arena_free(arena);
+	return NULL;
+}
+
+/* Threads sharing a template share its cache, and never free a
+ * template another one is rendering: there are more distinct texts
+ * than fit, so entries keep getting evicted */
+static void
+test_threads(void)
+{
+	struct render_thread threads[4];
+	struct buf *template = bufnew(512);
+	struct buf *expected = bufnew(512);
+	pthread_t ids[4];
+	crustache_template *crt;
+	int i;
+
+	for (i = 0; i < 20; ++i) {
+		bufprintf(template, "{{#echo}}%d{{name}};{{/echo}}", i);
+		bufprintf(expected, "%dAnn;", i);
+	}
+
+	bufputc(expected, '\0');
+	CHECK(crustache_new(&crt, &lambda_api, (char *)template->data, template->size) == 0);
+
+	for (i = 0; i < 4; ++i) {
+		threads[i].template = crt;
+		threads[i].expected = (char *)expected->data;
+		threads[i].bad = 0;
+		pthread_create(&ids[i], NULL, &render_thread, &threads[i]);
+	}
+
+	for (i = 0; i < 4; ++i) {
+		pthread_join(ids[i], NULL);
+		CHECK(threads[i].bad == 0);
+	}
+
+	crustache_free(crt);
+	bufrelease(template);
+	bufrelease(expected);
+}
+
+void
+test_lambdas(void)
+{
+	struct buf *ob = bufnew(64);
+
+	setup();
+
+	/* the output is rendered against the current context, with the
+	 * delimiters in effect at the section */
+	check_lambda("{{#wrap}}{{name}}{{/wrap}}", "[Ann]");
+	check_lambda("{{#people}}{{#wrap}}{{name}}{{/wrap}}{{/people}}", "[A][B][C]");
+	check_lambda("{{=<% %>=}}<%#wrap%>x <%name%><%/wrap%>", "[x Ann]");
+
+	/* safe strings are printed as they are */
+	check_lambda("{{#safe}}name{{/safe}}", "{{name}}");
+
+	/* the same text is only compiled once, however often it's returned */
+	partial_loads = 0;
+	check_lambda("{{#people}}{{#same}}{{/same}}{{/people}}{{#same}}{{/same}}", "ABCAnn");
+	CHECK(partial_loads == 1);
+
+	/* as many texts as fit in the cache are compiled once each; one
+	 * more, used round-robin, and each one has been evicted by the time
+	 * it comes back */
+	distinct = 16;
+	check_cycle(20, 16);
+
+	distinct = 17;
+	check_cycle(20, 60);
+
+	/* a lambda returning a broken template fails the render */
+	CHECK(test_render(ob, &lambda_api, "{{#bad}}{{/bad}}", CONTEXT) < 0);
+
+	/* and so does a lambda which fails, at its section */
+	{
+		crustache_template *crt;
+		crustache_var context;
+		char error[128];
+
+		memset(&context, 0x0, sizeof(context));
+		context.type = CRUSTACHE_VAR_CONTEXT;
+
+		CHECK(crustache_new(&crt, &lambda_api, "x{{#fail}}oops{{/fail}}", 23) == 0);
+		CHECK(crustache_render(ob, crt, &context) == CR_ERENDER_NOT_FOUND);
+
+		crustache_error_rendernode(error, sizeof(error), crt);
+		CHECK(strstr(error, "oops") != NULL);
+		crustache_free(crt);
+	}
+
+	test_threads();
+
+	bufrelease(ob);
+}
@@ -0,0 +1,74 @@
+#include "test.h"
+
+static const char *LAYERS[] = {
+	"{\"title\": \"Page\"}",
+	"{\"title\": \"Req\", \"user\": \"ann\"}",
+	"{\"title\": \"Site\", \"name\": \"S\", \"user\": \"nobody\", \"footer\": {\"title\": \"Foot\"}}",
+};
+
+/* Render `template` with the layers from `first` on, the first one on top */
+static int
+render_layers(struct buf *ob, const char *template, size_t first, size_t count)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_template *crt;
+	crustache_var contexts[3];
+	crustache_api api;
+	size_t i;
+	int error;
+
+	crustache_value_api(&api);
+
+	for (i = 0; i < count; ++i) {
+		crustache_value *value;
+		const char *json = LAYERS[first + i];
+
+		CHECK(crustache_json_parse(&value, arena, json, strlen(json)) == 0);
+		crustache_value_var(&contexts[i], value);
+	}
+
+	ob->size = 0;
+	CHECK(crustache_new(&crt, &api, template, strlen(template)) == 0);
+	error = crustache_render_layers(ob, crt, contexts, count);
+
+	crustache_free(crt);
+	crustache_arena_free(arena);
+	return error;
+}
+
+void
+test_layers(void)
+{
+	struct buf *ob = bufnew(64);
+
+	/* names are looked up from the first layer down */
+	CHECK(render_layers(ob, "{{title}}|{{user}}|{{name}}", 0, 3) == 0);
+	CHECK_OUTPUT(ob, "Page|ann|S");
+
+	CHECK(render_layers(ob, "{{title}}|{{user}}", 1, 2) == 0);
+	CHECK_OUTPUT(ob, "Req|ann");
+
+	/* sections push on top of all the layers */
+	CHECK(render_layers(ob, "{{#footer}}{{title}} by {{user}}{{/footer}}", 0, 3) == 0);
+	CHECK_OUTPUT(ob, "Foot by ann");
+
+	/* every layer must be a context */
+	{
+		crustache_template *crt;
+		crustache_var contexts[2];
+		crustache_api api;
+
+		crustache_value_api(&api);
+		memset(contexts, 0x0, sizeof(contexts));
+		contexts[0].type = CRUSTACHE_VAR_CONTEXT;
+		contexts[1].type = CRUSTACHE_VAR_STR;
+		contexts[1].data = "x";
+		contexts[1].size = 1;
+
+		CHECK(crustache_new(&crt, &api, "x", 1) == 0);
+		CHECK(crustache_render_layers(ob, crt, contexts, 2) == CR_ERENDER_INVALID_CONTEXT);
+		crustache_free(crt);
+	}
+
+	bufrelease(ob);
+}
@@ -0,0 +1,147 @@
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"title\": \"T<\", \"items\": [\"x\", \"y\"], \"more\": [{\"more\": [{\"more\": false}]}]}";
+
+static const char *PARTIALS[][2] = {
+	{"head", "<h>{{title}}</h>{{>sub}}"},
+	{"sub", "[sub {{#items}}{{.}}{{/items}}]"},
+	{"delim", "{{=<% %>=}}<%title%>{{not a tag}}<%#items%>(<%.%>)<%/items%>"},
+	{"a", "A{{#more}}{{>b}}{{/more}}"},
+	{"b", "B{{>a}}"},
+	{"self", "S{{#more}}{{>self}}{{/more}}"},
+	{"empty", ""},
+};
+
+static crustache_api partial_api;
+static int loads;
+
+static const char *
+find_partial(const char *name, size_t name_size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(PARTIALS) / sizeof(PARTIALS[0]); ++i) {
+		if (strlen(PARTIALS[i][0]) == name_size &&
+			memcmp(PARTIALS[i][0], name, name_size) == 0)
+			return PARTIALS[i][1];
+	}
+
+	return NULL;
+}
+
+static int
+load_partial(crustache_template **partial, const char *name, size_t name_size)
+{
+	const char *text = find_partial(name, name_size);
+
+	loads++;
+
+	if (text == NULL)
+		return -1;
+
+	return crustache_new(partial, &partial_api, text, strlen(text));
+}
+
+/*
+ * Render `template` as it is, then linked with its partials cleared,
+ * and check both give `expected`. Returns how many partials the linked
+ * template still had to load.
+ */
+static int
+check_linked(const char *template, const char *expected)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_template *crt;
+	crustache_value *value;
+	crustache_var context;
+	struct buf *ob = bufnew(64);
+
+	CHECK(crustache_json_parse(&value, arena, CONTEXT, strlen(CONTEXT)) == 0);
+	crustache_value_var(&context, value);
+
+	CHECK(crustache_new(&crt, &partial_api, template, strlen(template)) == 0);
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK_OUTPUT(ob, expected);
+
+	/* the copied nodes don't need the partials any more */
+	CHECK(crustache_link_partials(crt, NULL, 0) == 0);
+	crustache_clear_partials(crt, NULL, 0);
+
+	ob->size = 0;
+	loads = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK_OUTPUT(ob, expected);
+
+	crustache_free(crt);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+	return loads;
+}
+
+/* Link a partial under its own name, so it isn't copied into itself */
+static void
+test_own_name(void)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	const char *text = find_partial("a", 1);
+	crustache_schema *schema;
+	crustache_template *crt;
+	crustache_value *value;
+	crustache_var context;
+	struct buf *ob = bufnew(64);
+
+	CHECK(crustache_json_parse(&value, arena, CONTEXT, strlen(CONTEXT)) == 0);
+	crustache_value_var(&context, value);
+
+	CHECK(crustache_new(&crt, &partial_api, text, strlen(text)) == 0);
+	CHECK(crustache_link_partials(crt, "a", 1) == 0);
+	CHECK(crustache_render(ob, crt, &context) == 0);
+	CHECK_OUTPUT(ob, "ABABA");
+
+	/* `b` was copied in, and its `{{>a}}` is left as a partial */
+	CHECK(crustache_template_schema(&schema, crt, 0) == 0);
+	CHECK(schema->partials != NULL && schema->partials->next == NULL);
+	CHECK(schema->partials != NULL &&
+		schema->partials->name_size == 1 && schema->partials->name[0] == 'a');
+	crustache_schema_free(schema);
+
+	crustache_free(crt);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+}
+
+void
+test_link_partials(void)
+{
+	crustache_value_api(&partial_api);
+	partial_api.partial = &load_partial;
+	partial_api.free_partials = 1;
+
+	CHECK(check_linked("{{>head}}!", "<h>T&lt;</h>[sub xy]!") == 0);
+	CHECK(check_linked("{{#items}}{{>sub}}{{/items}}", "[sub xy][sub xy]") == 0);
+	CHECK(check_linked("x{{>empty}}y", "xy") == 0);
+
+	/* partials keep their own delimiters */
+	CHECK(check_linked("{{>delim}}|{{title}}", "T&lt;{{not a tag}}(x)(y)|T&lt;") == 0);
+
+	/* recursive partials are left to be loaded when rendered */
+	CHECK(check_linked("{{>self}}", "SSS") > 0);
+	CHECK(check_linked("{{>a}}", "ABABA") > 0);
+
+	/* and so are the ones which fail to load */
+	{
+		crustache_template *crt;
+
+		CHECK(crustache_new(&crt, &partial_api, "{{>missing}}", 12) == 0);
+		CHECK(crustache_link_partials(crt, NULL, 0) == 0);
+		crustache_free(crt);
+	}
+
+	/* the text is minified with the template's options */
+	partial_api.minify_html = 1;
+	CHECK(check_linked("<p>\n  {{>head}}\n</p>", "<p> <h>T&lt;</h>[sub xy] </p>") == 0);
+	partial_api.minify_html = 0;
+
+	test_own_name();
+}
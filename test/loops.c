@@ -0,0 +1,212 @@
+#include <stdlib.h>
+
+#include "test.h"
+
+static const char *CONTEXT =
+	"{\"tags\": [\"x\", \"y<\", \"z\"], \"one\": [\"solo\"], \"none\": [],"
+	" \"nested\": [[\"1\", \"2\"], [\"3\"]], \"big\": [%s]}";
+
+/* A list of 0..69, to span a few batches */
+static const char *
+context(void)
+{
+	static char json[1024];
+	char numbers[512];
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < 70; ++i)
+		size += sprintf(numbers + size, i ? ",%d" : "%d", i);
+
+	sprintf(json, CONTEXT, numbers);
+	return json;
+}
+
+static const char *
+big_expected(void)
+{
+	static char expected[512];
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < 70; ++i)
+		size += sprintf(expected + size, i < 69 ? "%d:%d," : "%d:%d", i, i);
+
+	return expected;
+}
+
+/* Iterate the lists of the value API through the batched interface */
+struct iterator {
+	crustache_value *list;
+	size_t pos;
+};
+
+static int
+batch_begin(void **output, void *list)
+{
+	struct iterator *iterator = malloc(sizeof(struct iterator));
+
+	if (iterator == NULL)
+		return -1;
+
+	iterator->list = list;
+	iterator->pos = 0;
+	*output = iterator;
+	return 0;
+}
+
+static int
+batch_next(crustache_var *vars, size_t max, size_t *count, void *data)
+{
+	struct iterator *iterator = data;
+	size_t size = crustache_value_size(iterator->list);
+
+	*count = 0;
+
+	while (*count < max && iterator->pos < size)
+		crustache_value_var(&vars[(*count)++], crustache_value_at(iterator->list, iterator->pos++));
+
+	return 0;
+}
+
+static void
+batch_end(void *iterator)
+{
+	free(iterator);
+}
+
+static void
+check_loops(crustache_api *api)
+{
+	struct buf *ob = bufnew(256);
+
+	CHECK(test_render(ob, api,
+		"{{#tags}}{{@index}}={{.}}{{#@first}}(first){{/@first}}{{^@last}}, {{/@last}}{{/tags}}",
+		context()) == 0);
+	CHECK_OUTPUT(ob, "0=x(first), 1=y&lt;, 2=z");
+
+	/* a single element is both the first and the last one */
+	ob->size = 0;
+	CHECK(test_render(ob, api, "{{#one}}{{.|upcase}}{{@first}}{{@last}}{{/one}}{{^none}}-{{/none}}",
+		context()) == 0);
+	CHECK_OUTPUT(ob, "SOLOtruetrue-");
+
+	/* each loop has its own metadata */
+	ob->size = 0;
+	CHECK(test_render(ob, api,
+		"{{#nested}}[{{@index}}:{{#.}}{{.}}@{{@index}}{{#@last}}!{{/@last}}{{/.}}]{{/nested}}",
+		context()) == 0);
+	CHECK_OUTPUT(ob, "[0:1@02@1!][1:3@0!]");
+
+	ob->size = 0;
+	CHECK(test_render(ob, api, "{{#big}}{{@index}}:{{.}}{{^@last}},{{/@last}}{{/big}}", context()) == 0);
+	CHECK_OUTPUT(ob, big_expected());
+
+	/* outside of a loop there's no metadata */
+	ob->size = 0;
+	CHECK(test_render(ob, api, "[{{@index}}{{@first}}{{@last}}]", context()) == 0);
+	CHECK_OUTPUT(ob, "[]");
+
+	bufrelease(ob);
+}
+
+/* A table with a single column `n` */
+static const char *NAMES[] = {"a", "b", "c"};
+static const size_t NAME_SIZES[] = {1, 1, 1};
+static const crustache_column COLUMNS[] = {
+	{"n", 1, CRUSTACHE_COLUMN_STR, NAMES, NAME_SIZES}
+};
+static const crustache_columns TABLE = {COLUMNS, 1};
+
+static int
+find_table(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	if (key_size == 3 && memcmp(key, "tab", 3) == 0) {
+		memset(var, 0x0, sizeof(crustache_var));
+		var->type = CRUSTACHE_VAR_COLUMNS;
+		var->data = (void *)&TABLE;
+		var->size = 3;
+		return 0;
+	}
+
+	return test_value_find(var, context, key, key_size);
+}
+
+static void
+check_table(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	test_counting_api(&api, &find_table);
+
+	CHECK(test_render(ob, &api, "{{#tab}}{{@index}}{{n}}{{#@first}}<{{/@first}}{{#@last}}.{{/@last}}{{/tab}}",
+		context()) == 0);
+	CHECK_OUTPUT(ob, "0a<1b2c.");
+
+	bufrelease(ob);
+}
+
+/* `unknown` is `tags`, without its size */
+static int
+find_unknown(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	if (key_size == 7 && memcmp(key, "unknown", 7) == 0) {
+		if (test_value_find(var, context, "tags", 4) < 0)
+			return -1;
+
+		var->size = CRUSTACHE_LIST_UNKNOWN;
+		return 0;
+	}
+
+	return test_value_find(var, context, key, key_size);
+}
+
+static void
+check_unknown(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	test_counting_api(&api, &find_unknown);
+	api.list_begin = &batch_begin;
+	api.list_next_batch = &batch_next;
+	api.list_end = &batch_end;
+
+	/* peeking into the list for an inverted section doesn't take an
+	 * item away from the loops around it */
+	CHECK(test_render(ob, &api, "{{^unknown}}none{{/unknown}}{{#unknown}}{{.}},{{/unknown}}",
+		context()) == 0);
+	CHECK_OUTPUT(ob, "x,y&lt;,z,");
+
+	ob->size = 0;
+	CHECK(test_render(ob, &api, "{{#unknown}}{{.}},{{/unknown}}{{^unknown}}none{{/unknown}}|{{unknown | join}}",
+		context()) == 0);
+	CHECK_OUTPUT(ob, "x,y&lt;,z,|x, y&lt;, z");
+
+	/* without `list_begin` there's no cursor to peek with */
+	api.list_begin = NULL;
+	api.list_end = NULL;
+
+	CHECK(test_render(ob, &api, "{{^unknown}}none{{/unknown}}", context()) == CR_ERENDER_WRONG_VARTYPE);
+	CHECK(test_render(ob, &api, "{{#unknown}}{{.}}{{/unknown}}", context()) == CR_ERENDER_WRONG_VARTYPE);
+
+	bufrelease(ob);
+}
+
+void
+test_loops(void)
+{
+	crustache_api api;
+
+	crustache_value_api(&api);
+	check_loops(&api);
+
+	api.list_begin = &batch_begin;
+	api.list_next_batch = &batch_next;
+	api.list_end = &batch_end;
+	check_loops(&api);
+
+	check_table();
+	check_unknown();
+}
@@ -0,0 +1,133 @@
+/*
+ * crustache-test: behaviour tests for Crustache. See "Running the tests"
+ * in the README for how to build it.
+ *
+ * Exits with a non-zero status if any check fails.
+ */
+#include <stdlib.h>
+
+#include "test.h"
+
+int test_failures;
+int test_finds;
+
+static int (*value_find)(crustache_var *, void *, const char *, size_t);
+static int (*suite_find)(crustache_var *, void *, const char *, size_t);
+
+void
+test_check(int ok, const char *file, int line, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+		test_failures++;
+	}
+}
+
+void
+test_check_output(struct buf *ob, const char *expected, const char *file, int line)
+{
+	size_t size = strlen(expected);
+
+	if (ob->size != size || memcmp(ob->data, expected, size) != 0) {
+		fprintf(stderr, "%s:%d: expected \"%s\", got \"%.*s\"\n",
+			file, line, expected, (int)ob->size, ob->data);
+		test_failures++;
+	}
+}
+
+int
+test_render(struct buf *ob, crustache_api *api, const char *template, const char *json)
+{
+	crustache_arena *arena = crustache_arena_new(4096);
+	crustache_template *crt = NULL;
+	crustache_value *value;
+	crustache_var context;
+	int error;
+
+	error = crustache_json_parse(&value, arena, json, strlen(json));
+
+	if (error == 0)
+		error = crustache_new(&crt, api, template, strlen(template));
+
+	if (error == 0) {
+		crustache_value_var(&context, value);
+		error = crustache_render(ob, crt, &context);
+	}
+
+	crustache_free(crt);
+	crustache_arena_free(arena);
+	return error;
+}
+
+int
+test_value_find(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	return value_find(var, context, key, key_size);
+}
+
+static int
+count_find(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	test_finds++;
+	return suite_find(var, context, key, key_size);
+}
+
+void
+test_counting_api(crustache_api *api,
+	int (*find)(crustache_var *, void *, const char *, size_t))
+{
+	crustache_value_api(api);
+
+	api->context_find = &count_find;
+	api->context_find_many = NULL;
+
+	suite_find = find ? find : &test_value_find;
+	test_finds = 0;
+}
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} SUITES[] = {
+	{"escape cache", &test_escape_cache},
+	{"utf8", &test_utf8},
+	{"numbers", &test_numbers},
+	{"filters", &test_filters},
+	{"minify", &test_minify},
+	{"dotted names", &test_dotted_names},
+	{"loops", &test_loops},
+	{"layers", &test_layers},
+	{"schema", &test_schema},
+	{"context_find_many", &test_find_many},
+	{"borrowed variables", &test_borrowed},
+	{"render arena", &test_arena},
+	{"json", &test_json},
+	{"binary contexts", &test_blob},
+	{"lambdas", &test_lambdas},
+	{"lambda sections", &test_lambda_section},
+	{"fragment cache", &test_fragment_cache},
+	{"tracked renders", &test_rerender},
+	{"specialize", &test_specialize},
+	{"partial cache", &test_partial_cache},
+	{"linked partials", &test_link_partials},
+	{"compiled templates", &test_compiled},
+};
+
+int
+main(void)
+{
+	crustache_api api;
+	size_t i;
+
+	crustache_value_api(&api);
+	value_find = api.context_find;
+
+	for (i = 0; i < sizeof(SUITES) / sizeof(SUITES[0]); ++i) {
+		int failures = test_failures;
+
+		SUITES[i].run();
+		printf("%-24s %s\n", SUITES[i].name, test_failures == failures ? "ok" : "FAILED");
+	}
+
+	return test_failures ? 1 : 0;
+}
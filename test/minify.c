@@ -0,0 +1,41 @@
+#include "test.h"
+
+static void
+check_minify(const char *template, const char *expected)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+	api.minify_html = 1;
+
+	CHECK(test_render(ob, &api, template, "{\"name\": \"N\", \"l\": [1, 2]}") == 0);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+void
+test_minify(void)
+{
+	/* whitespace between tags goes away, runs of it in text become one
+	 * space, and comments are dropped */
+	check_minify(
+		"<html>\n  <body>\n    <p>Hello   {{name}}  <b>x</b> <i>y</i></p>\n"
+		"    <!-- a comment -->\n    <pre>  keep\n   this </pre>\n  </body>\n</html>\n",
+		"<html><body><p>Hello N <b>x</b> <i>y</i></p><pre>  keep\n   this </pre></body></html>");
+
+	/* attributes are left alone inside their quotes, and sections
+	 * don't stop the text around them from being minified */
+	check_minify(
+		"<div   class=\"a   b\"\n  id='{{name}}  x'>\n{{#l}}\n  <li>  i </li>\n{{/l}}\n</div>",
+		"<div class=\"a   b\" id='N  x'><li> i </li><li> i </li></div>");
+
+	/* raw text elements are kept as they are */
+	check_minify(
+		"<script>\n  var a  =  1;\n</script>\n<style> a  { } </STYLE>\n<textarea>  {{name}}  </textarea>",
+		"<script>\n  var a  =  1;\n</script><style> a  { } </STYLE><textarea>  N  </textarea>");
+
+	/* comments with tags in them, and conditional comments, are kept */
+	check_minify("<!-- {{name}}   -->\n<p>", "<!-- N   --><p>");
+	check_minify("<!--[if IE]>  <p>x</p>  <![endif]-->", "<!--[if IE]> <p>x</p> <![endif]-->");
+}
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+
+#include "test.h"
+
+static void
+check_double(double number, const char *expected)
+{
+	struct buf *ob = bufnew(32);
+
+	bufputd(ob, number);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+static void
+check_int(int64_t number, const char *expected)
+{
+	struct buf *ob = bufnew(32);
+
+	bufputi64(ob, number);
+	CHECK_OUTPUT(ob, expected);
+	bufrelease(ob);
+}
+
+/* The shortest digits always read back as the very same double */
+static void
+test_round_trip(void)
+{
+	uint64_t state = 0x9E3779B97F4A7C15ull;
+	struct buf *ob = bufnew(32);
+	int i, mismatches = 0;
+
+	for (i = 0; i < 100000; ++i) {
+		double number, parsed;
+		uint64_t bits;
+
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		bits = state;
+
+		memcpy(&number, &bits, sizeof(number));
+		if (isnan(number) || isinf(number))
+			continue;
+
+		ob->size = 0;
+		bufputd(ob, number);
+		bufputc(ob, '\0');
+
+		parsed = strtod(ob->data, NULL);
+		if (memcmp(&parsed, &number, sizeof(number)) != 0)
+			mismatches++;
+	}
+
+	CHECK(mismatches == 0);
+	bufrelease(ob);
+}
+
+/* How many significant digits a number is printed with */
+static int
+significant_digits(const char *number)
+{
+	int count = 0, zeros = 0, leading = 1;
+
+	for (; *number && *number != 'e'; ++number) {
+		if (*number < '0' || *number > '9')
+			continue;
+
+		if (*number == '0') {
+			if (!leading)
+				zeros++;
+			continue;
+		}
+
+		count += zeros + 1;
+		zeros = 0;
+		leading = 0;
+	}
+
+	return count;
+}
+
+/* Nothing shorter than what we print reads back into the same double */
+static void
+test_shortest(void)
+{
+	uint64_t state = 0x2545F4914F6CDD1Dull;
+	struct buf *ob = bufnew(32);
+	int i, longer = 0;
+
+	for (i = 0; i < 20000; ++i) {
+		double number;
+		char shortest[32];
+		int precision;
+
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		memcpy(&number, &state, sizeof(number));
+		if (isnan(number) || isinf(number) || number == 0)
+			continue;
+
+		for (precision = 1; precision < 17; ++precision) {
+			snprintf(shortest, sizeof(shortest), "%.*g", precision, number);
+			if (strtod(shortest, NULL) == number)
+				break;
+		}
+
+		ob->size = 0;
+		bufputd(ob, number);
+		bufputc(ob, '\0');
+
+		if (significant_digits(ob->data) != precision)
+			longer++;
+	}
+
+	CHECK(longer == 0);
+	bufrelease(ob);
+}
+
+static void
+test_render_numbers(void)
+{
+	struct buf *ob = bufnew(64);
+	crustache_api api;
+
+	crustache_value_api(&api);
+
+	CHECK(test_render(ob, &api, "{{i}}|{{d}}|{{t}}|{{f}}|{{#t}}yes{{/t}}{{^f}}no{{/f}}",
+		"{\"i\": -42, \"d\": 0.25, \"t\": true, \"f\": false}") == 0);
+	CHECK_OUTPUT(ob, "-42|0.25|true||yesno");
+
+	bufrelease(ob);
+}
+
+void
+test_numbers(void)
+{
+	check_int(0, "0");
+	check_int(-1, "-1");
+	check_int(INT64_MAX, "9223372036854775807");
+	check_int(INT64_MIN, "-9223372036854775808");
+
+	check_double(0.1, "0.1");
+	check_double(1.0 / 3, "0.3333333333333333");
+	check_double(123456789.125, "123456789.125");
+	check_double(2.5, "2.5");
+	check_double(100, "100");
+	check_double(-0.0, "-0");
+	check_double(1e-7, "1e-07");
+	check_double(1e21, "1e+21");
+	check_double(5e-324, "5e-324");
+	check_double(DBL_MAX, "1.7976931348623157e+308");
+	check_double(DBL_MIN, "2.2250738585072014e-308");
+	check_double(9007199254740993.0, "9007199254740992");
+	check_double(1e23, "1e+23");
+	check_double(0.3, "0.3");
+	check_double(5e-310, "5e-310");
+	check_double(INFINITY, "inf");
+	check_double(-INFINITY, "-inf");
+
+	test_round_trip();
+	test_shortest();
+	test_render_numbers();
+}
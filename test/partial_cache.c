@@ -0,0 +1,221 @@
+#include <pthread.h>
+
+#include "test.h"
+
+static const char *ITEMS = "{\"items\": [\"a\", \"b\", \"c\"]}";
+
+static const char *TREE =
+	"{\"name\": \"a\", \"kids\": [{\"name\": \"b\", \"kids\": [{\"name\": \"c\", \"kids\": []}]},"
+	" {\"name\": \"d\", \"kids\": []}]}";
+
+static crustache_api partial_api;
+static const char *partial_text;
+static int loads;
+
+static crustache_template *owned[8];
+static size_t owned_count;
+
+static int
+load_partial(crustache_template **partial, const char *name, size_t name_size)
+{
+	const char *text = partial_text;
+	int error;
+
+	loads++;
+
+	if (name_size == 3 && memcmp(name, "bad", 3) == 0)
+		return -1;
+
+	if (name_size == 4 && memcmp(name, "tree", 4) == 0)
+		text = "{{name}}({{#kids}}{{>tree}}{{/kids}})";
+
+	error = crustache_new(partial, &partial_api, text, strlen(text));
+
+	if (!partial_api.free_partials && owned_count < 8)
+		owned[owned_count++] = *partial;
+
+	return error;
+}
+
+/* Render `crt` against `json` and return how many partials it loaded */
+static int
+render_loads(struct buf *ob, crustache_template *crt, const char *json)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_value *value;
+	crustache_var context;
+
+	CHECK(crustache_json_parse(&value, arena, json, strlen(json)) == 0);
+	crustache_value_var(&context, value);
+
+	ob->size = 0;
+	loads = 0;
+	CHECK(crustache_render(ob, crt, &context) == 0);
+
+	crustache_arena_free(arena);
+	return loads;
+}
+
+static void
+test_cache(struct buf *ob)
+{
+	const char *template = "{{#items}}{{>p}}{{/items}}|{{#items}}{{>p}}{{/items}}";
+	crustache_template *crt;
+
+	partial_text = "<{{.}}>";
+	CHECK(crustache_new(&crt, &partial_api, template, strlen(template)) == 0);
+
+	/* loaded once, for every tag with its name and every render */
+	CHECK(render_loads(ob, crt, ITEMS) == 1);
+	CHECK_OUTPUT(ob, "<a><b><c>|<a><b><c>");
+	CHECK(render_loads(ob, crt, ITEMS) == 0);
+
+	/* until it's cleared */
+	partial_text = "[{{.}}]";
+	crustache_clear_partials(crt, "other", 5);
+	CHECK(render_loads(ob, crt, ITEMS) == 0);
+	CHECK_OUTPUT(ob, "<a><b><c>|<a><b><c>");
+
+	crustache_clear_partials(crt, "p", 1);
+	CHECK(render_loads(ob, crt, ITEMS) == 1);
+	CHECK_OUTPUT(ob, "[a][b][c]|[a][b][c]");
+
+	crustache_clear_partials(crt, NULL, 0);
+	CHECK(render_loads(ob, crt, ITEMS) == 1);
+	crustache_free(crt);
+
+	/* a recursive partial is loaded once for the whole tree */
+	CHECK(crustache_new(&crt, &partial_api, "{{>tree}}", 9) == 0);
+	CHECK(render_loads(ob, crt, TREE) == 1);
+	CHECK_OUTPUT(ob, "a(b(c())d())");
+
+	crustache_clear_partials(crt, "tree", 4);
+	CHECK(render_loads(ob, crt, TREE) == 1);
+	crustache_free(crt);
+}
+
+static void
+test_not_cached(struct buf *ob)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_template *crt;
+	crustache_value *value;
+	crustache_var context;
+
+	CHECK(crustache_json_parse(&value, arena, ITEMS, strlen(ITEMS)) == 0);
+	crustache_value_var(&context, value);
+
+	/* failures are asked for again */
+	CHECK(crustache_new(&crt, &partial_api, "{{>bad}}", 8) == 0);
+	loads = 0;
+	CHECK(crustache_render(ob, crt, &context) == CR_ERENDER_BAD_PARTIAL);
+	CHECK(crustache_render(ob, crt, &context) == CR_ERENDER_BAD_PARTIAL);
+	CHECK(loads == 2);
+	crustache_free(crt);
+
+	/* and partials owned by the host are never kept */
+	partial_api.free_partials = 0;
+	partial_text = "<{{.}}>";
+
+	CHECK(crustache_new(&crt, &partial_api, "{{#items}}{{>p}}{{/items}}", 26) == 0);
+	CHECK(render_loads(ob, crt, ITEMS) == 3);
+	CHECK_OUTPUT(ob, "<a><b><c>");
+	crustache_free(crt);
+
+	while (owned_count > 0)
+		crustache_free(owned[--owned_count]);
+
+	partial_api.free_partials = 1;
+	crustache_arena_free(arena);
+}
+
+/* Safe to call from threads: no counting */
+static int
+load_tree(crustache_template **partial, const char *name, size_t name_size)
+{
+	const char *text = "{{name}}({{#kids}}{{>tree}}{{>leaf}}{{/kids}})";
+
+	if (name_size == 4 && memcmp(name, "leaf", 4) == 0)
+		text = "{{^kids}}.{{/kids}}";
+
+	return crustache_new(partial, &partial_api, text, strlen(text));
+}
+
+struct render_thread {
+	crustache_template *template;
+	int bad;
+};
+
+static void *
+render_thread(void *arg)
+{
+	struct render_thread *thread = arg;
+	crustache_arena *arena = crustache_arena_new(1024);
+	struct buf *ob = bufnew(64);
+	crustache_value *value;
+	crustache_var context;
+	int i;
+
+	crustache_json_parse(&value, arena, TREE, strlen(TREE));
+	crustache_json_decode_all(value);
+	crustache_value_var(&context, value);
+
+	for (i = 0; i < 5; ++i) {
+		ob->size = 0;
+
+		if (crustache_render(ob, thread->template, &context) < 0 ||
+			ob->size != 14 || memcmp(ob->data, "a(b(c().)d().)", 14) != 0)
+			thread->bad++;
+	}
+
+	bufrelease(ob);
+	crustache_arena_free(arena);
+	return NULL;
+}
+
+/* Threads rendering a new template all load its partials at once */
+static void
+test_threads(void)
+{
+	struct render_thread threads[4];
+	pthread_t ids[4];
+	crustache_template *crt;
+	int round, i;
+
+	partial_api.partial = &load_tree;
+
+	for (round = 0; round < 50; ++round) {
+		CHECK(crustache_new(&crt, &partial_api, "{{>tree}}", 9) == 0);
+
+		for (i = 0; i < 4; ++i) {
+			threads[i].template = crt;
+			threads[i].bad = 0;
+			pthread_create(&ids[i], NULL, &render_thread, &threads[i]);
+		}
+
+		for (i = 0; i < 4; ++i) {
+			pthread_join(ids[i], NULL);
+			CHECK(threads[i].bad == 0);
+		}
+
+		crustache_free(crt);
+	}
+
+	partial_api.partial = &load_partial;
+}
+
+void
+test_partial_cache(void)
+{
+	struct buf *ob = bufnew(64);
+
+	crustache_value_api(&partial_api);
+	partial_api.partial = &load_partial;
+	partial_api.free_partials = 1;
+
+	test_cache(ob);
+	test_not_cached(ob);
+	test_threads();
+
+	bufrelease(ob);
+}
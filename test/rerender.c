@@ -0,0 +1,164 @@
+#include "test.h"
+
+static const char *TEMPLATE =
+	"<h1>{{title}}</h1><p>{{temp}}</p><ul>{{#items}}<li>{{n}}</li>{{/items}}</ul>";
+
+static const char *CONTEXT =
+	"{\"title\": \"Dash\", \"temp\": \"20C\", \"items\": [{\"n\": \"a\"}, {\"n\": \"b\"}]}";
+
+static void
+check_result(crustache_result *result, const char *expected)
+{
+	size_t size;
+	const char *output = crustache_result_output(result, &size);
+
+	CHECK(size == strlen(expected) && memcmp(output, expected, size) == 0);
+}
+
+static void
+check_change(crustache_result *result, size_t i, size_t old_start, size_t old_size, size_t new_start, size_t new_size)
+{
+	size_t count;
+	const crustache_change *changes = crustache_result_changes(result, &count);
+
+	CHECK(i < count);
+	if (i >= count)
+		return;
+
+	CHECK(changes[i].old_start == old_start && changes[i].old_size == old_size);
+	CHECK(changes[i].new_start == new_start && changes[i].new_size == new_size);
+}
+
+static size_t
+change_count(crustache_result *result)
+{
+	size_t count;
+
+	crustache_result_changes(result, &count);
+	return count;
+}
+
+/* Render `template` against `root` and keep the result around */
+static crustache_result *
+render(crustache_template **crt, crustache_api *api, const char *template, crustache_value *root)
+{
+	crustache_result *result = NULL;
+	crustache_var context;
+
+	crustache_value_var(&context, root);
+	CHECK(crustache_new(crt, api, template, strlen(template)) == 0);
+	CHECK(crustache_render_tracked(&result, *crt, &context) == 0);
+	return result;
+}
+
+static void
+set_str(crustache_arena *arena, crustache_value *map, const char *key, const char *str)
+{
+	crustache_value_set(arena, map, key, strlen(key),
+		crustache_value_new_str(arena, str, strlen(str)));
+}
+
+static void
+test_changes(crustache_api *api, crustache_arena *arena)
+{
+	crustache_key temp = {"temp", 4, 0};
+	crustache_key items[] = {{"items", 5, 0}, {"nothing", 7, 0}};
+	crustache_key both[] = {{"title", 5, 0}, {"temp", 4, 0}};
+	crustache_template *crt;
+	crustache_result *result;
+	crustache_value *root, *list, *item;
+
+	CHECK(crustache_json_parse(&root, arena, CONTEXT, strlen(CONTEXT)) == 0);
+
+	result = render(&crt, api, TEMPLATE, root);
+	check_result(result, "<h1>Dash</h1><p>20C</p><ul><li>a</li><li>b</li></ul>");
+
+	/* only the parts reading `temp` are rendered again */
+	set_str(arena, root, "temp", "21C");
+	test_finds = 0;
+	CHECK(crustache_rerender(result, &temp, 1) == 0);
+	check_result(result, "<h1>Dash</h1><p>21C</p><ul><li>a</li><li>b</li></ul>");
+	CHECK(test_finds == 1);
+	CHECK(change_count(result) == 1);
+	check_change(result, 0, 16, 3, 16, 3);
+
+	/* parts which come out the same are not listed */
+	CHECK(crustache_rerender(result, &temp, 1) == 0);
+	CHECK(change_count(result) == 0);
+
+	/* a section, with a key nobody reads */
+	list = crustache_value_new_array(arena, 1);
+	item = crustache_value_new_map(arena, 1);
+	set_str(arena, item, "n", "zz");
+	crustache_value_push(arena, list, item);
+	crustache_value_set(arena, root, "items", 5, list);
+
+	CHECK(crustache_rerender(result, items, 2) == 0);
+	check_result(result, "<h1>Dash</h1><p>21C</p><ul><li>zz</li></ul>");
+	CHECK(change_count(result) == 1);
+	check_change(result, 0, 27, 20, 27, 11);
+
+	/* ranges which don't touch are listed apart */
+	set_str(arena, root, "title", "T");
+	set_str(arena, root, "temp", "X");
+	CHECK(crustache_rerender(result, both, 2) == 0);
+	check_result(result, "<h1>T</h1><p>X</p><ul><li>zz</li></ul>");
+	CHECK(change_count(result) == 2);
+	check_change(result, 0, 4, 4, 4, 1);
+	check_change(result, 1, 16, 3, 13, 1);
+
+	/* a failed rerender leaves the result as it was */
+	set_str(arena, root, "items", "oops");
+	CHECK(crustache_rerender(result, items, 1) < 0);
+	check_result(result, "<h1>T</h1><p>X</p><ul><li>zz</li></ul>");
+
+	crustache_result_free(result);
+	crustache_free(crt);
+}
+
+static void
+test_merged(crustache_api *api, crustache_arena *arena)
+{
+	const char *json = "{\"a\": \"1\", \"b\": \"2\", \"sep\": \",\", \"items\": [{\"n\": \"x\"}, {\"n\": \"y\"}]}";
+	crustache_key ab[] = {{"a", 1, 0}, {"b", 1, 0}};
+	crustache_key sep = {"sep", 3, 0};
+	crustache_template *crt;
+	crustache_result *result;
+	crustache_value *root;
+
+	CHECK(crustache_json_parse(&root, arena, json, strlen(json)) == 0);
+
+	/* touching ranges are merged */
+	result = render(&crt, api, "<{{a}}{{b}}>", root);
+	set_str(arena, root, "a", "one");
+	set_str(arena, root, "b", "two");
+	CHECK(crustache_rerender(result, ab, 2) == 0);
+	check_result(result, "<onetwo>");
+	CHECK(change_count(result) == 1);
+	check_change(result, 0, 1, 2, 1, 6);
+	crustache_result_free(result);
+	crustache_free(crt);
+
+	/* names inside a section may come from the root */
+	result = render(&crt, api, "{{#items}}{{n}}{{sep}}{{/items}}", root);
+	check_result(result, "x,y,");
+	set_str(arena, root, "sep", ";");
+	CHECK(crustache_rerender(result, &sep, 1) == 0);
+	check_result(result, "x;y;");
+	crustache_result_free(result);
+	crustache_free(crt);
+}
+
+void
+test_rerender(void)
+{
+	crustache_arena *arena = crustache_arena_new(4096);
+	crustache_api api;
+
+	test_counting_api(&api, NULL);
+
+	test_changes(&api, arena);
+	test_merged(&api, arena);
+
+	crustache_arena_free(arena);
+}
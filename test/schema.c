@@ -0,0 +1,136 @@
+#include "test.h"
+
+static const char *PARTIALS[][2] = {
+	{"row", "{{name}}{{>cell}}"},
+	{"cell", "{{#value}}{{amount}}{{/value}}{{>row}}"},
+	{"head", "{{title}}{{^items}}{{empty}}{{/items}}"},
+};
+
+static crustache_api schema_api;
+
+static int
+load_partial(crustache_template **partial, const char *name, size_t name_size)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(PARTIALS) / sizeof(PARTIALS[0]); ++i) {
+		if (strlen(PARTIALS[i][0]) == name_size &&
+			memcmp(PARTIALS[i][0], name, name_size) == 0)
+			return crustache_new(partial, &schema_api, PARTIALS[i][1], strlen(PARTIALS[i][1]));
+	}
+
+	return -1;
+}
+
+/*
+ * Write a scope of the schema as `name:usage`, with the usage as one
+ * letter per flag (Variable, Section, Inverted, Parent) and the
+ * children of each key in braces.
+ */
+static void
+dump_keys(struct buf *ob, const crustache_schema_key *key)
+{
+	for (; key != NULL; key = key->next) {
+		bufput(ob, key->name, key->name_size);
+		bufputc(ob, ':');
+
+		if (key->usage & CRUSTACHE_KEY_VARIABLE)
+			bufputc(ob, 'v');
+		if (key->usage & CRUSTACHE_KEY_SECTION)
+			bufputc(ob, 's');
+		if (key->usage & CRUSTACHE_KEY_INVERTED)
+			bufputc(ob, 'i');
+		if (key->usage & CRUSTACHE_KEY_PARENT)
+			bufputc(ob, 'p');
+
+		if (key->children != NULL) {
+			bufputc(ob, '{');
+			dump_keys(ob, key->children);
+			bufputc(ob, '}');
+		}
+
+		if (key->next != NULL)
+			bufputc(ob, ' ');
+	}
+}
+
+/* Dump the schema of `template` into `ob`, with the partials after a `|` */
+static int
+dump_schema(struct buf *ob, const char *template, int expand_partials)
+{
+	const crustache_schema_partial *partial;
+	crustache_schema *schema;
+	crustache_template *crt;
+	int error;
+
+	ob->size = 0;
+	CHECK(crustache_new(&crt, &schema_api, template, strlen(template)) == 0);
+
+	error = crustache_template_schema(&schema, crt, expand_partials);
+
+	if (error == 0) {
+		dump_keys(ob, schema->keys);
+		bufputc(ob, '|');
+
+		for (partial = schema->partials; partial != NULL; partial = partial->next) {
+			bufput(ob, partial->name, partial->name_size);
+			if (partial->next != NULL)
+				bufputc(ob, ' ');
+		}
+
+		crustache_schema_free(schema);
+	}
+
+	crustache_free(crt);
+	return error;
+}
+
+void
+test_schema(void)
+{
+	struct buf *ob = bufnew(128);
+
+	crustache_value_api(&schema_api);
+	schema_api.partial = &load_partial;
+	schema_api.free_partials = 1;
+
+	/* each section opens a scope of its own */
+	CHECK(dump_schema(ob, "{{title}}{{#items}}{{name}}{{#tags}}{{label}}{{/tags}}{{/items}}{{name}}", 0) == 0);
+	CHECK_OUTPUT(ob, "title:v items:s{name:v tags:s{label:v}} name:v|");
+
+	/* a key used more than once is listed once, with every usage */
+	CHECK(dump_schema(ob, "{{#a}}{{x}}{{/a}}{{^a}}{{y}}{{/a}}{{a}}{{#a}}{{x}}{{z}}{{/a}}", 0) == 0);
+	CHECK_OUTPUT(ob, "a:vsi{x:v z:v} y:v|");
+
+	/* inverted sections don't open a scope: their keys are read from
+	 * the enclosing one */
+	CHECK(dump_schema(ob, "{{#items}}{{^empty}}{{name}}{{/empty}}{{/items}}{{^none}}{{other}}{{/none}}", 0) == 0);
+	CHECK_OUTPUT(ob, "items:s{empty:i name:v} none:i other:v|");
+
+	/* dotted names become a path of parents */
+	CHECK(dump_schema(ob, "{{user.name}}{{user.address.city}}{{#user}}{{name}}{{age}}{{/user}}", 0) == 0);
+	CHECK_OUTPUT(ob, "user:sp{name:v address:p{city:v} age:v}|");
+
+	CHECK(dump_schema(ob, "{{#a.b}}{{c}}{{/a.b}}{{^a.d}}{{e}}{{/a.d}}", 0) == 0);
+	CHECK_OUTPUT(ob, "a:p{b:s{c:v} d:i} e:v|");
+
+	/* implicit iterators and loop variables read no keys */
+	CHECK(dump_schema(ob, "{{#list}}{{.}}{{@index}}{{#@first}}{{x}}{{/@first}}{{#.}}{{y}}{{/.}}{{/list}}", 0) == 0);
+	CHECK_OUTPUT(ob, "list:s{x:v y:v}|");
+
+	/* partials are listed, but only expanded when asked to */
+	CHECK(dump_schema(ob, "{{#items}}{{>row}}{{/items}}{{>head}}", 0) == 0);
+	CHECK_OUTPUT(ob, "items:s|row head");
+
+	/* their keys then go where the partial tag is, and recursive
+	 * partials are expanded once */
+	CHECK(dump_schema(ob, "{{#items}}{{>row}}{{/items}}{{>head}}", 1) == 0);
+	CHECK_OUTPUT(ob, "items:si{name:v value:s{amount:v}} title:v empty:v|row cell head");
+
+	/* partials which fail to load fail the schema */
+	CHECK(dump_schema(ob, "{{x}}{{>missing}}", 0) == 0);
+	CHECK_OUTPUT(ob, "x:v|missing");
+	CHECK(dump_schema(ob, "{{x}}{{>missing}}", 1) < 0);
+
+	bufrelease(ob);
+}
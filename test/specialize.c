@@ -0,0 +1,101 @@
+#include "test.h"
+
+static const char *STATICS =
+	"{\"site\": \"Crust & Co\", \"on\": true, \"off\": false,"
+	" \"nav\": [{\"n\": \"a\"}, {\"n\": \"b\"}], \"cfg\": {\"lang\": \"en\"}}";
+
+static const char *CONTEXT =
+	"{\"user\": \"bob\", \"items\": [\"x\", \"y\"]}";
+
+/*
+ * Specialize `template` on STATICS, free the original, and render the
+ * result against CONTEXT. Returns how many lookups the render took.
+ */
+static int
+check_specialize(crustache_api *api, const char *template, const char *expected)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	crustache_template *crt, *special;
+	crustache_value *statics, *context;
+	crustache_var statics_var, context_var;
+	struct buf *ob = bufnew(64);
+
+	CHECK(crustache_json_parse(&statics, arena, STATICS, strlen(STATICS)) == 0);
+	CHECK(crustache_json_parse(&context, arena, CONTEXT, strlen(CONTEXT)) == 0);
+	crustache_value_var(&statics_var, statics);
+	crustache_value_var(&context_var, context);
+
+	CHECK(crustache_new(&crt, api, template, strlen(template)) == 0);
+	CHECK(crustache_specialize(&special, crt, &statics_var) == 0);
+	crustache_free(crt);
+
+	test_finds = 0;
+	CHECK(crustache_render(ob, special, &context_var) == 0);
+	CHECK_OUTPUT(ob, expected);
+
+	crustache_free(special);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+	return test_finds;
+}
+
+/* Once folded, a value is part of the text */
+static void
+test_folded(crustache_api *api)
+{
+	crustache_arena *arena = crustache_arena_new(1024);
+	const char *template = "{{site}}{{#on}}!{{/on}} {{user}}";
+	crustache_template *crt, *special;
+	crustache_value *statics, *context;
+	crustache_var statics_var, context_var;
+	struct buf *ob = bufnew(64);
+
+	CHECK(crustache_json_parse(&statics, arena, STATICS, strlen(STATICS)) == 0);
+	CHECK(crustache_json_parse(&context, arena, CONTEXT, strlen(CONTEXT)) == 0);
+	crustache_value_var(&statics_var, statics);
+	crustache_value_var(&context_var, context);
+
+	CHECK(crustache_new(&crt, api, template, strlen(template)) == 0);
+	CHECK(crustache_specialize(&special, crt, &statics_var) == 0);
+
+	crustache_value_set(arena, statics, "site", 4, crustache_value_new_str(arena, "Other", 5));
+	crustache_value_set(arena, statics, "on", 2, crustache_value_new_bool(arena, 0));
+
+	CHECK(crustache_render(ob, special, &context_var) == 0);
+	CHECK_OUTPUT(ob, "Crust &amp; Co! bob");
+
+	crustache_free(special);
+	crustache_free(crt);
+	crustache_arena_free(arena);
+	bufrelease(ob);
+}
+
+void
+test_specialize(void)
+{
+	crustache_api api;
+
+	test_counting_api(&api, NULL);
+
+	/* static tags and sections are folded into the text, and only the
+	 * per-render names are looked up */
+	CHECK(check_specialize(&api, "<h1>{{site}}</h1> hi {{user}}",
+		"<h1>Crust &amp; Co</h1> hi bob") == 1);
+	CHECK(check_specialize(&api, "{{#off}}gone{{/off}}{{^off}}here {{user}}{{/off}}",
+		"here bob") == 1);
+	CHECK(check_specialize(&api, "{{#nav}}[{{n}}]{{/nav}}|{{user}}",
+		"[a][b]|bob") == 1);
+	CHECK(check_specialize(&api, "{{#cfg}}{{lang}}{{/cfg}}-{{cfg.lang}}",
+		"en-en") == 0);
+	CHECK(check_specialize(&api, "{{{site}}} {{site | upcase}}",
+		"Crust & Co CRUST &amp; CO") == 0);
+	CHECK(check_specialize(&api, "{{^nav}}none{{/nav}}{{missing}}.",
+		".") == 1);
+
+	/* sections which mix static and per-render names still find the
+	 * statics below the render context */
+	check_specialize(&api, "{{#nav}}[{{n}}{{user}}]{{/nav}}", "[abob][bbob]");
+	check_specialize(&api, "{{#items}}{{.}}{{site}}{{/items}}", "xCrust &amp; CoyCrust &amp; Co");
+
+	test_folded(&api);
+}
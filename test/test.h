@@ -0,0 +1,75 @@
+#ifndef __CRUSTACHE_TEST_H__
+#define __CRUSTACHE_TEST_H__
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/crustache.h"
+
+extern int test_failures;
+
+#define CHECK(cond) \
+	test_check((cond) != 0, __FILE__, __LINE__, #cond)
+
+#define CHECK_OUTPUT(ob, expected) \
+	test_check_output((ob), (expected), __FILE__, __LINE__)
+
+extern void
+test_check(int ok, const char *file, int line, const char *what);
+
+extern void
+test_check_output(struct buf *ob, const char *expected, const char *file, int line);
+
+/*
+ * Render `template` against the JSON document `json` into `ob`. `api`
+ * must have been set up with crustache_value_api, plus whatever options
+ * the test needs. Returns the error from compiling or rendering.
+ */
+extern int
+test_render(struct buf *ob, crustache_api *api, const char *template, const char *json);
+
+/*
+ * Lookups in documents from crustache_value_api, for suites whose own
+ * `context_find` only handles a few names.
+ */
+extern int
+test_value_find(crustache_var *var, void *context, const char *key, size_t key_size);
+
+/*
+ * Set `api` up with crustache_value_api, with every lookup counted in
+ * `test_finds` (which is reset) and then passed to `find`, or to
+ * test_value_find if `find` is NULL. `context_find_many` is unset, so
+ * no lookup goes around the count. The count is shared: don't render
+ * with this API from several threads.
+ */
+extern int test_finds;
+
+extern void
+test_counting_api(crustache_api *api,
+	int (*find)(crustache_var *, void *, const char *, size_t));
+
+/* The suites, one per file */
+extern void test_escape_cache(void);
+extern void test_utf8(void);
+extern void test_numbers(void);
+extern void test_filters(void);
+extern void test_minify(void);
+extern void test_dotted_names(void);
+extern void test_loops(void);
+extern void test_layers(void);
+extern void test_schema(void);
+extern void test_find_many(void);
+extern void test_borrowed(void);
+extern void test_arena(void);
+extern void test_json(void);
+extern void test_blob(void);
+extern void test_lambdas(void);
+extern void test_lambda_section(void);
+extern void test_fragment_cache(void);
+extern void test_rerender(void);
+extern void test_specialize(void);
+extern void test_partial_cache(void);
+extern void test_link_partials(void);
+extern void test_compiled(void);
+
+#endif
@@ -0,0 +1,120 @@
+#include "test.h"
+
+#define REPLACEMENT "\xEF\xBF\xBD"
+
+/* Every name is the same string, which JSON can't carry when it's broken */
+static const char *text;
+
+static int
+find_text(crustache_var *var, void *context, const char *key, size_t key_size)
+{
+	(void)context;
+	(void)key;
+	(void)key_size;
+
+	var->type = CRUSTACHE_VAR_STR;
+	var->data = (void *)text;
+	var->size = strlen(text);
+	var->flags = CRUSTACHE_VAR_BORROWED;
+	return 0;
+}
+
+static int
+render_text(struct buf *ob, crustache_api *api, const char *template, const char *str)
+{
+	crustache_template *crt;
+	crustache_var context;
+	int error;
+
+	text = str;
+	memset(&context, 0x0, sizeof(context));
+	context.type = CRUSTACHE_VAR_CONTEXT;
+
+	ob->size = 0;
+	error = crustache_new(&crt, api, template, strlen(template));
+
+	if (error == 0)
+		error = crustache_render(ob, crt, &context);
+
+	crustache_free(crt);
+	return error;
+}
+
+static void
+test_replace(crustache_api *api)
+{
+	struct buf *ob = bufnew(64);
+
+	api->validate_utf8 = CRUSTACHE_UTF8_REPLACE;
+
+	CHECK(render_text(ob, api, "{{a}}|{{{a}}}|{{&a}}", "bad \xff <x>") == 0);
+	CHECK_OUTPUT(ob, "bad " REPLACEMENT " &lt;x&gt;|bad " REPLACEMENT " <x>|bad " REPLACEMENT " <x>");
+
+	/* overlong forms and surrogates are replaced byte by byte */
+	CHECK(render_text(ob, api, "{{a}}", "\xE0\x80\x80x") == 0);
+	CHECK_OUTPUT(ob, REPLACEMENT REPLACEMENT REPLACEMENT "x");
+
+	CHECK(render_text(ob, api, "{{a}}", "\xED\xA0\x80") == 0);
+	CHECK_OUTPUT(ob, REPLACEMENT REPLACEMENT REPLACEMENT);
+
+	/* a sequence cut short at the end is a single error */
+	CHECK(render_text(ob, api, "{{a}}", "ok\xE2\x82") == 0);
+	CHECK_OUTPUT(ob, "ok" REPLACEMENT);
+
+	/* valid text goes through untouched, past the 16-byte blocks too */
+	CHECK(render_text(ob, api, "{{a}}", "h\xC3\xA9llo \xF0\x9F\x98\x80 0123456789abcdef <&>") == 0);
+	CHECK_OUTPUT(ob, "h\xC3\xA9llo \xF0\x9F\x98\x80 0123456789abcdef &lt;&amp;&gt;");
+
+	bufrelease(ob);
+}
+
+static void
+test_fail(crustache_api *api)
+{
+	struct buf *ob = bufnew(64);
+
+	api->validate_utf8 = CRUSTACHE_UTF8_FAIL;
+
+	CHECK(render_text(ob, api, "x{{a}}", "bad \xff <x>") == CR_ERENDER_BAD_UTF8);
+	CHECK(render_text(ob, api, "x{{{a}}}", "bad \xff <x>") == CR_ERENDER_BAD_UTF8);
+
+	CHECK(render_text(ob, api, "x{{a}}", "g\xC3\xBCt <x>") == 0);
+	CHECK_OUTPUT(ob, "xg\xC3\xBCt &lt;x&gt;");
+
+	bufrelease(ob);
+}
+
+static void
+test_passthrough(crustache_api *api)
+{
+	struct buf *ob = bufnew(64);
+
+	api->validate_utf8 = CRUSTACHE_UTF8_PASSTHROUGH;
+
+	CHECK(render_text(ob, api, "{{a}}", "bad \xff <x>") == 0);
+	CHECK_OUTPUT(ob, "bad \xff &lt;x&gt;");
+
+	bufrelease(ob);
+}
+
+void
+test_utf8(void)
+{
+	crustache_escape_cache *cache = crustache_escape_cache_new(16, 0);
+	crustache_api api;
+
+	memset(&api, 0x0, sizeof(api));
+	api.context_find = &find_text;
+
+	test_replace(&api);
+	test_fail(&api);
+	test_passthrough(&api);
+
+	/* the same, with the escaped strings coming from a cache */
+	api.escape_cache = cache;
+	test_replace(&api);
+	test_fail(&api);
+	test_passthrough(&api);
+
+	crustache_escape_cache_free(cache);
+}
@@ -0,0 +1,101 @@
+/*
+ * bench-escape: throughput of the HTML escaper, with and without UTF-8
+ * validation
+ *
+ *	cd src && cc -O2 -o bench-escape ../tools/bench_escape.c houdini_html.c buffer.c
+ *	bench-escape [size] [rounds]
+ *
+ * Every input is `size` bytes long (4KB by default) and gets escaped
+ * `rounds` times.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/houdini.h"
+
+struct input {
+	const char *name;
+	const char *pattern;
+};
+
+static const struct input INPUTS[] = {
+	{"ascii", "The quick brown fox jumps over the lazy dog, again and again. "},
+	{"latin utf8", "El pingüino Wenceslao hizo kilómetros bajo exhaustiva lluvia y frío, añoraba a su querido cachorro. "},
+	{"cjk utf8", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe6\x96\x87\xe7\xab\xa0\xe3\x81\xa7\xe3\x81\x99\xe3\x80\x82"},
+	{"html-heavy", "<a href=\"/x?a=1&b=2\">it's</a> "},
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *
+fill(const char *pattern, size_t size)
+{
+	size_t len = strlen(pattern), i;
+	char *data = malloc(size);
+
+	for (i = 0; i < size; ++i)
+		data[i] = pattern[i % len];
+
+	/* don't leave a broken sequence at the end */
+	while (size > 0 && (data[size - 1] & 0xC0) == 0x80)
+		data[--size] = ' ';
+
+	if (size > 0 && (data[size - 1] & 0x80))
+		data[size - 1] = ' ';
+
+	return data;
+}
+
+static double
+bench(const char *data, size_t size, int rounds, int validate)
+{
+	struct buf *ob = bufnew(size * 2);
+	double start = now();
+	int i;
+
+	for (i = 0; i < rounds; ++i) {
+		ob->size = 0;
+
+		if (validate)
+			houdini_escape_html_utf8(ob, data, size, 1);
+		else
+			houdini_escape_html(ob, data, size);
+	}
+
+	start = now() - start;
+	bufrelease(ob);
+
+	return (double)size * rounds / start / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t size = argc > 1 ? (size_t)atol(argv[1]) : 4096;
+	int rounds = argc > 2 ? atoi(argv[2]) : 100000;
+	size_t i;
+
+	printf("%-12s %14s %16s\n", "", "escape-only", "escape+validate");
+
+	for (i = 0; i < sizeof(INPUTS) / sizeof(INPUTS[0]); ++i) {
+		char *data = fill(INPUTS[i].pattern, size);
+
+		printf("%-12s %9.0f MB/s %11.0f MB/s\n", INPUTS[i].name,
+			bench(data, size, rounds, 0),
+			bench(data, size, rounds, 1));
+
+		free(data);
+	}
+
+	return 0;
+}
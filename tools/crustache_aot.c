@@ -0,0 +1,212 @@
+/*
+ * crustache-aot: compile Mustache templates into C
+ *
+ *	cd src && cc -o crustache-aot ../tools/crustache_aot.c *.c -lpthread
+ *	crustache-aot [-m] [-f filter]... [-o output.c] [-H header.h] template...
+ *
+ * Every template gets a `<name>_new` function, which creates the template
+ * with the generated code attached, where `<name>` is the file name of
+ * the template without its extension. Pass the partials of a template
+ * too, so they get compiled as well.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../src/crustache.h"
+
+#define MAX_FILTERS 64
+
+static const char *USAGE =
+	"usage: crustache-aot [-m] [-f filter]... [-o output.c] [-H header.h] template...\n"
+	"\n"
+	"  -m         minify the HTML of the templates (see `minify_html`)\n"
+	"  -f NAME    the templates use a filter called NAME\n"
+	"  -o FILE    write the C code to FILE instead of the standard output\n"
+	"  -H FILE    write the declarations of the generated code to FILE\n";
+
+/* Filters registered by the host only need to exist when compiling */
+static int
+filter_stub(
+	crustache_var *out, crustache_var *in,
+	const crustache_var *args, size_t arg_count,
+	struct buf *scratch, const crustache_api *api)
+{
+	(void)out;
+	(void)in;
+	(void)args;
+	(void)arg_count;
+	(void)scratch;
+	(void)api;
+	return -1;
+}
+
+/* Partials are loaded by the host when rendering */
+static int
+partial_stub(crustache_template **partial, const char *partial_name, size_t name_size)
+{
+	(void)partial;
+	(void)partial_name;
+	(void)name_size;
+	return -1;
+}
+
+static int
+read_file(struct buf *ob, const char *path)
+{
+	char chunk[4096];
+	size_t n;
+	FILE *file = fopen(path, "rb");
+
+	if (file == NULL)
+		return -1;
+
+	while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		bufput(ob, chunk, n);
+
+	n = ferror(file);
+	fclose(file);
+	return n ? -1 : 0;
+}
+
+static int
+write_file(struct buf *ib, const char *path)
+{
+	FILE *file = path ? fopen(path, "wb") : stdout;
+	int error;
+
+	if (file == NULL)
+		return -1;
+
+	error = (fwrite(ib->data, 1, ib->size, file) != ib->size);
+
+	if (path != NULL)
+		error |= (fclose(file) != 0);
+
+	return error ? -1 : 0;
+}
+
+/* The file name without its directory or extension, as a C identifier */
+static void
+template_name(char *name, size_t size, const char *path)
+{
+	const char *base = strrchr(path, '/');
+	size_t i = 0;
+
+	base = base ? base + 1 : path;
+
+	if (isdigit((unsigned char)*base) && i + 1 < size)
+		name[i++] = '_';
+
+	for (; *base && *base != '.' && i + 1 < size; ++base)
+		name[i++] = isalnum((unsigned char)*base) ? *base : '_';
+
+	name[i] = '\0';
+}
+
+static int
+compile_template(struct buf *ob, struct buf *header, crustache_api *api, const char *path)
+{
+	crustache_template *template = NULL;
+	struct buf *source = bufnew(4096);
+	char name[128];
+	int error;
+
+	template_name(name, sizeof(name), path);
+
+	if (read_file(source, path) < 0 || name[0] == '\0') {
+		fprintf(stderr, "crustache-aot: cannot read %s\n", path);
+		bufrelease(source);
+		return -1;
+	}
+
+	error = crustache_new(&template, api, source->data, source->size);
+
+	if (error < 0) {
+		size_t line = 0, col = 0, line_len = 0;
+
+		crustache_error_syntaxline(&line, &col, &line_len, template);
+		fprintf(stderr, "%s:%lu:%lu: %s\n", path,
+			(unsigned long)line, (unsigned long)col, crustache_strerror(error));
+	} else {
+		bufprintf(ob, "\n/* %s */\n\n", path);
+		error = crustache_compile_c(ob, template, name);
+	}
+
+	if (error == 0 && header != NULL) {
+		bufprintf(header,
+			"\nextern const crustache_compiled %s_compiled;\n"
+			"extern const char %s_source[];\n"
+			"extern const size_t %s_source_size;\n"
+			"extern int %s_new(crustache_template **template, crustache_api *api);\n",
+			name, name, name, name);
+	}
+
+	crustache_free(template);
+	bufrelease(source);
+	return error;
+}
+
+int
+main(int argc, char **argv)
+{
+	crustache_filter filters[MAX_FILTERS + 1];
+	size_t filter_count = 0;
+	const char *output = NULL, *header_path = NULL;
+	struct buf *ob, *header = NULL;
+	crustache_api api;
+	int i, error = 0;
+
+	memset(&api, 0x0, sizeof(api));
+	memset(filters, 0x0, sizeof(filters));
+
+	for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+		if (strcmp(argv[i], "-m") == 0) {
+			api.minify_html = 1;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc && filter_count < MAX_FILTERS) {
+			filters[filter_count].name = argv[++i];
+			filters[filter_count++].filter = &filter_stub;
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		} else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+			header_path = argv[++i];
+		} else {
+			fputs(USAGE, stderr);
+			return 2;
+		}
+	}
+
+	if (i == argc) {
+		fputs(USAGE, stderr);
+		return 2;
+	}
+
+	api.filters = filters;
+	api.partial = &partial_stub;
+
+	ob = bufnew(4096);
+	BUFPUTSL(ob, "/* Generated by crustache-aot; do not edit */\n#include \"crustache.h\"\n");
+
+	if (header_path != NULL) {
+		header = bufnew(1024);
+		BUFPUTSL(header, "/* Generated by crustache-aot; do not edit */\n#include \"crustache.h\"\n");
+	}
+
+	for (; i < argc && error == 0; ++i)
+		error = compile_template(ob, header, &api, argv[i]);
+
+	if (error == 0 && write_file(ob, output) < 0) {
+		fprintf(stderr, "crustache-aot: cannot write %s\n", output);
+		error = -1;
+	}
+
+	if (error == 0 && header != NULL && write_file(header, header_path) < 0) {
+		fprintf(stderr, "crustache-aot: cannot write %s\n", header_path);
+		error = -1;
+	}
+
+	bufrelease(ob);
+	bufrelease(header);
+	return error < 0 ? 1 : 0;
+}